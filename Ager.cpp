@@ -0,0 +1,400 @@
+/**
+ * The ager. A fresh volume performs nothing like one that has had files
+ * come and go on it for months: free space is scattered, files written
+ * side by side are interleaved, and the directory is full of holes every
+ * lookup has to step over. The ager gets a volume into that state on
+ * purpose, so it can be measured (and the allocator or directory tuned)
+ * as it would be after long use.
+ *
+ * It fills the volume to a target with files of log-normal sizes (most
+ * small, a few big, as on real disks), several written at once a chunk
+ * at a time, then churns: creates, appends, deletes and copies in a
+ * given mix, deleting whenever the volume would go over the target, until
+ * a given share of the volume has been rewritten. Everything comes from
+ * the seed, and deletes wait for the reclaimer to free their clusters, so
+ * the same seed on the same image leaves exactly the same layout.
+ *
+ * @author: Eduardo Rodrigues - emr4378
+ */
+
+using namespace std;
+
+#include "Ager.h"
+
+/**
+ * Constructor
+ *
+ * @param fs the (opened) file system to age
+ */
+Ager::Ager(FileSys *fs) {
+	this->fs = fs;
+	report = NULL;
+	data = NULL;
+	seed = 0;
+	target = 0;
+	stored = 0;
+	next = 0;
+}
+
+/**
+ * Fills in a middle-of-the-road aging: 70% full, the volume rewritten
+ * twice over, files around 16 KB (up to 4 MB), four written at once, and
+ * a churn mix of 4 creates, 2 appends, 3 deletes and 1 copy in 10.
+ *
+ * @param config pointer to the config to fill in
+ */
+void Ager::defaults(AgingConfig *config) {
+	config->seed = 4378;
+	config->fill = 70;
+	config->churn = 200;
+	config->creates = 40;
+	config->appends = 20;
+	config->deletes = 30;
+	config->copies = 10;
+	config->medianSize = 16 * 1024;
+	config->maxSize = 4 * 1024 * 1024;
+	config->writers = 4;
+}
+
+/**
+ * Ages the volume, then measures it. Files already on the volume are
+ * counted towards the fill and can be appended to, copied and deleted
+ * like the ones the ager makes.
+ *
+ * @param config how to age it
+ * @param report pointer to store what was done and what it left in
+ * @return int 0 if aged; -1 if config makes no sense or a write failed
+ *         other than for want of space
+ */
+int Ager::age(AgingConfig *config, AgingReport *report) {
+	int ret = 0;
+	int i;
+	int pick;
+	long long churned;
+	long long start;
+	long long lookups;
+	FileSysStats stats;
+	vector<FileInfo> entries;
+
+	memset(report, 0, sizeof(AgingReport));
+	if (config->fill < 1 || config->fill > 95 || config->churn < 0
+		|| config->creates < 0 || config->appends < 0 || config->deletes < 0
+		|| config->copies < 0
+		|| config->creates + config->appends + config->deletes + config->copies == 0
+		|| config->medianSize < 1 || config->maxSize < config->medianSize
+		|| config->writers < 1 || config->writers > AGE_MAX_WRITERS) {
+		ret = -1;
+	}
+
+	if (ret == 0) {
+		this->config = *config;
+		this->report = report;
+		seed = config->seed;
+		fs->getStats(&stats);
+		target = (long long)stats.size * config->fill / 100;
+		churned = (long long)stats.size * config->churn / 100;
+
+		files.clear();
+		sizes.clear();
+		stored = 0;
+		next = 0;
+		fs->listEntries(&entries);
+		for (i = 0; i < entries.size(); i++) {
+			files.push_back(entries[i].name);
+			sizes[entries[i].name] = entries[i].size;
+			stored += entries[i].size;
+		}
+		for (i = 0; i < AGE_MAX_WRITERS; i++) {
+			writers[i].handle = -1;
+			writers[i].left = 0;
+		}
+		writing.assign(AGE_MAX_WRITERS, "");
+		data = (char*)malloc(AGE_CHUNK);
+		for (i = 0; i < AGE_CHUNK; i++) {
+			data[i] = (char)rand_r(&seed);
+		}
+
+		start = Profiler::now();
+		//fill
+		while (stored < target && report->full == 0 && ret == 0) {
+			ret = startWrite(newName(), pickSize(config->maxSize), false);
+		}
+		ret = (ret == 0) ? writeChunks(true) : ret;
+
+		//churn
+		churned += report->written;
+		while (report->written < churned && ret == 0) {
+			pick = random(config->creates + config->appends + config->deletes
+							+ config->copies);
+			if (stored >= target || (pick >= config->creates + config->appends
+				&& pick < config->creates + config->appends + config->deletes)) {
+				ret = deleteFile();
+			} else if (pick < config->creates) {
+				ret = startWrite(newName(), pickSize(config->maxSize), false);
+			} else if (pick < config->creates + config->appends) {
+				ret = appendFile();
+			} else {
+				ret = copyFile();
+			}
+			ret = (ret == 0) ? writeChunks(false) : ret;
+		}
+		ret = (ret == 0) ? writeChunks(true) : ret;
+		while (fs->getReclaimBacklog(NULL) > 0) {
+			usleep(1000);
+		}
+		report->seconds = (Profiler::now() - start) / 1e9;
+		free(data);
+		data = NULL;
+	}
+
+	if (ret == 0) {
+		fs->getStats(&stats);
+		report->files = stats.directoryFiles;
+		report->usedPercent = 100LL * stats.usedClusters / stats.clusters;
+		report->directoryEntries = stats.directoryEntries;
+		report->directoryHoles = stats.directoryHoles;
+		Defragmenter(fs).measure(&report->fragmentation, NULL);
+
+		lookups = 0;
+		start = Profiler::now();
+		for (i = 0; i < AGE_LOOKUPS && !files.empty(); i++) {
+			fs->getFileSize(files[random(files.size())]);
+			lookups++;
+		}
+		report->lookupMicros = (lookups > 0) ? (Profiler::now() - start) / 1e3 / lookups : 0;
+		report->readMBps = Defragmenter(fs).measureReadThroughput();
+	}
+
+	return ret;
+}
+
+/**
+ * A file size, log-normal around the median (see AGE_SIZE_SPREAD).
+ *
+ * @param most the biggest size to return
+ * @return int the size, in bytes; 1 to most
+ */
+int Ager::pickSize(int most) {
+	double u1 = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+	double u2 = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+	double normal = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+	double size = config.medianSize * exp(AGE_SIZE_SPREAD * normal);
+
+	return (int)max(1.0, min(size, (double)most));
+}
+
+/**
+ * @param range how many numbers to pick from
+ * @return int a number from 0 to range - 1, from the seed
+ */
+int Ager::random(int range) {
+	return rand_r(&seed) % range;
+}
+
+/**
+ * @param name a file's name
+ * @return bool true if a writer is part way through writing to it
+ */
+bool Ager::isWriting(string name) {
+	return find(writing.begin(), writing.end(), name) != writing.end();
+}
+
+/**
+ * Starts writing a file, on the first idle writer; if none is idle, every
+ * busy one writes a chunk in turn until one is.
+ *
+ * @param name the file's name
+ * @param size how many bytes to write to it
+ * @param append true to add to the end of an existing file; false to make it
+ * @return int 0 if started (or, for want of space, not); -1 if a write failed
+ */
+int Ager::startWrite(string name, int size, bool append) {
+	int ret = 0;
+	int writer = -1;
+	int i;
+
+	while (writer == -1 && ret == 0) {
+		for (i = 0; i < config.writers && writer == -1; i++) {
+			if (writers[i].handle == -1) {
+				writer = i;
+			}
+		}
+		if (writer == -1) {
+			ret = writeChunks(false);
+		}
+	}
+
+	if (ret == 0) {
+		writers[writer].handle = fs->openFile(name, FS_WRITE | FS_CREATE
+													| (append ? FS_APPEND : 0));
+		if (writers[writer].handle >= 0) {
+			if (!append) {
+				files.push_back(name);
+				sizes[name] = 0;
+				report->creates++;
+			} else {
+				report->appends++;
+			}
+			writers[writer].left = size;
+			writing[writer] = name;
+			stored += size;
+		} else if (writers[writer].handle == FS_ERR_NO_SPACE) {
+			writers[writer].handle = -1;
+			report->full++;
+		} else {
+			writers[writer].handle = -1;
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Every busy writer writes one chunk, in turn.
+ *
+ * @param all true to carry on until every file being written is finished
+ * @return int 0 if written (or, for want of space, cut short); -1 if a write failed
+ */
+int Ager::writeChunks(bool all) {
+	int ret = 0;
+	int i;
+	int length;
+	int written;
+	bool busy = true;
+	long long start;
+
+	while (busy && ret == 0) {
+		busy = false;
+		for (i = 0; i < config.writers && ret == 0; i++) {
+			if (writers[i].handle >= 0) {
+				length = min(AGE_CHUNK, writers[i].left);
+				start = Profiler::now();
+				written = fs->writeFile(writers[i].handle, data, length);
+				report->writeSeconds += (Profiler::now() - start) / 1e9;
+				if (written == length) {
+					sizes[writing[i]] += length;
+					report->written += length;
+					writers[i].left -= length;
+				} else if (written == FS_ERR_NO_SPACE) {
+					report->full++;
+					stored -= writers[i].left;
+					writers[i].left = 0;
+				} else {
+					ret = -1;
+				}
+				if (writers[i].left == 0 || ret != 0) {
+					fs->closeFile(writers[i].handle);
+					writers[i].handle = -1;
+					writing[i] = "";
+				}
+				busy = busy || writers[i].handle >= 0;
+			}
+		}
+		busy = busy && all;
+	}
+
+	return ret;
+}
+
+/**
+ * Appends to a random file not being written, about a quarter of a new
+ * file's size, never taking it past the biggest size.
+ *
+ * @return int 0 if done (or there was nothing to append to); -1 if a write failed
+ */
+int Ager::appendFile() {
+	int ret = 0;
+	int size;
+	string name;
+
+	if (!files.empty()) {
+		name = files[random(files.size())];
+		size = min(max(pickSize(config.maxSize) / 4, 1), config.maxSize - sizes[name]);
+		if (size > 0 && !isWriting(name)) {
+			ret = startWrite(name, size, true);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Deletes a random file not being written, and waits for the reclaimer to
+ * free its clusters so where the next file goes doesn't depend on how
+ * quick it was.
+ *
+ * @return int 0
+ */
+int Ager::deleteFile() {
+	int i;
+	string name;
+
+	if (!files.empty()) {
+		i = random(files.size());
+		name = files[i];
+		if (!isWriting(name) && fs->removeFile(name) == 0) {
+			stored -= sizes[name];
+			sizes.erase(name);
+			files[i] = files.back();
+			files.pop_back();
+			report->deletes++;
+		}
+		while (fs->getReclaimBacklog(NULL) > 0) {
+			usleep(100);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Copies a random file not being written to a new one, if there's room
+ * under the fill target.
+ *
+ * @return int 0 if done (or, for want of space, not); -1 if the copy failed
+ */
+int Ager::copyFile() {
+	int ret = 0;
+	int result;
+	long long start;
+	string source;
+	string dest;
+
+	if (!files.empty()) {
+		source = files[random(files.size())];
+		if (!isWriting(source) && stored + sizes[source] <= target) {
+			dest = newName();
+			start = Profiler::now();
+			result = fs->copyFile(source, dest, true, true);
+			report->writeSeconds += (Profiler::now() - start) / 1e9;
+			if (result >= 0) {
+				files.push_back(dest);
+				sizes[dest] = sizes[source];
+				stored += sizes[source];
+				report->written += sizes[source];
+				report->copies++;
+			} else if (result == FS_ERR_NO_SPACE) {
+				report->full++;
+			} else {
+				ret = -1;
+			}
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @return string a name no file on the volume has ("aged" and a number)
+ */
+string Ager::newName() {
+	stringstream name;
+
+	do {
+		name.str("");
+		name << "aged" << next++;
+	} while (sizes.count(name.str()) > 0);
+
+	return name.str();
+}
@@ -0,0 +1,88 @@
+#ifndef AGER_H
+#define AGER_H
+
+#include <sys/time.h>
+
+#include "FileSys.h"
+#include "Defragmenter.h"
+
+#define AGE_CHUNK (16 * 1024) //bytes per write; files being written take turns a chunk at a time
+#define AGE_MAX_WRITERS 16 //most files written at once
+#define AGE_SIZE_SPREAD 1.5 //sigma of the log-normal file sizes; 1.5 puts 1 in 10 files 6x past the median
+#define AGE_LOOKUPS 2000 //random lookups timed once aged
+
+/**
+ * How to age a volume; see Ager::age()
+ */
+struct AgingConfig {
+	unsigned int seed; //the same seed on the same image does exactly the same
+	int fill; //percent of the volume kept full of files
+	int churn; //percent of the volume's size written once it's full (100 rewrites it once)
+	int creates; //weight of creating a file, in the churn mix
+	int appends; //weight of appending to a file
+	int deletes; //weight of deleting a file
+	int copies; //weight of copying a file (within the volume)
+	int medianSize; //bytes; file sizes are log-normal around this
+	int maxSize; //bytes; no file is written bigger
+	int writers; //files written at once, a chunk to each in turn
+};
+
+/**
+ * What aging a volume did, and what it left behind
+ */
+struct AgingReport {
+	int creates; //operations done, filling and churning
+	int appends;
+	int deletes;
+	int copies;
+	int full; //writes that ran out of space
+	long long written; //bytes written, copies included
+	double writeSeconds; //time spent writing and copying
+	double seconds; //time spent aging altogether
+	int files; //on the volume once aged
+	int usedPercent; //of the volume's clusters, once aged
+	VolumeFragmentation fragmentation; //once aged (see Defragmenter::measure())
+	int directoryEntries; //slots in the directory table
+	int directoryHoles; //free or deleted slots before the last file
+	double lookupMicros; //average time to look up a random file by name
+	double readMBps; //whole volume read back from the disk (see Defragmenter::measureReadThroughput())
+};
+
+/**
+ * A file being written a chunk at a time
+ */
+struct AgeWriter {
+	int handle; //-1 if this writer is idle
+	int left; //bytes still to write
+};
+
+class Ager {
+	public:
+		Ager(FileSys *fs);
+		int age(AgingConfig *config, AgingReport *report);
+		static void defaults(AgingConfig *config);
+	private:
+		int pickSize(int most);
+		int random(int range);
+		bool isWriting(string name);
+		int startWrite(string name, int size, bool append);
+		int writeChunks(bool all);
+		int appendFile();
+		int deleteFile();
+		int copyFile();
+		string newName();
+
+		FileSys *fs;
+		AgingConfig config;
+		AgingReport *report;
+		unsigned int seed; //rand_r() state
+		long long target; //bytes of files kept on the volume
+		long long stored; //bytes of files on the volume, and still to be written to them
+		int next; //number of the next file made
+		vector<string> files; //every file on the volume
+		map<string, int> sizes; //file -> bytes written to it
+		AgeWriter writers[AGE_MAX_WRITERS];
+		vector<string> writing; //names of the files writers are writing, by writer
+		char *data; //AGE_CHUNK bytes written over and over
+};
+#endif
@@ -0,0 +1,256 @@
+/**
+ * The cluster allocator. Picks which free cluster a file (or anything
+ * else) gets next, by one of several policies chosen per volume:
+ *
+ * first  - the lowest free cluster. Packs everything at the front of the
+ *          volume, but after files come and go new ones are scattered
+ *          through whatever gaps are left.
+ * next   - the first free cluster after the last one handed out, wrapping
+ *          round at the end, so freed gaps are only reused once the cursor
+ *          comes back round to them.
+ * best   - carries on from the file's last cluster if that's free, and
+ *          otherwise starts the smallest run of free clusters that holds
+ *          everything the caller still wants to write (the biggest run if
+ *          none does), leaving big runs for big files.
+ * near   - the free cluster closest to the file's last one, either side;
+ *          a file's first cluster goes where next would put it.
+ *
+ * Every policy only ever hands out clusters FileSys::isFree() agrees are
+ * free. All calls are made holding the file system's metadata lock for
+ * writing, so the allocator needs no lock of its own.
+ *
+ * @author: Eduardo Rodrigues - emr4378
+ */
+
+using namespace std;
+
+#include "Allocator.h"
+
+/**
+ * Constructor
+ *
+ * @param fs the file system to allocate clusters in; its FAT must be loaded
+ * @param policy the ALLOC_* policy to start with
+ */
+Allocator::Allocator(FileSys *fs, int policy) {
+	this->fs = fs;
+	setPolicy(policy);
+	cursor = 1;
+	lowest = 1;
+}
+
+/**
+ * Picks a free cluster. The caller marks it used in the FAT.
+ *
+ * @param near the file's current last cluster, which the new one should
+ *        follow; -1 for a file's first cluster (or anything not in a file)
+ * @param wanted the number of clusters the caller means to take one after
+ *        another, this one included (a hint for best fit)
+ * @return int the cluster; 0xFFFF if none is free
+ */
+int Allocator::allocate(int near, int wanted) {
+	int ret;
+
+	if (policy == ALLOC_NEXT_FIT) {
+		ret = nextFit();
+	} else if (policy == ALLOC_BEST_FIT) {
+		ret = bestFit(near, max(wanted, 1));
+	} else if (policy == ALLOC_NEAR) {
+		ret = (near > 0 && near < fs->numClusters) ? nearest(near) : nextFit();
+	} else {
+		ret = firstFit();
+	}
+
+	if (ret != 0xFFFF) {
+		cursor = (ret + 1 < fs->numClusters) ? ret + 1 : 1;
+		if (ret == lowest) {
+			lowest = ret + 1;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Tells the allocator a cluster has been freed (see FileSys::releaseCluster()).
+ *
+ * @param cluster the cluster
+ */
+void Allocator::freed(int cluster) {
+	if (cluster > 0 && cluster < lowest) {
+		lowest = cluster;
+	}
+}
+
+/**
+ * Forgets what's known about where free clusters are; for when a lot of
+ * the FAT changed at once (a snapshot rolled back or deleted, say).
+ */
+void Allocator::reset() {
+	lowest = 1;
+}
+
+/**
+ * @return int the ALLOC_* policy in use
+ */
+int Allocator::getPolicy() {
+	return policy;
+}
+
+/**
+ * Changes the policy; anything unknown is taken as first fit.
+ *
+ * @param policy the ALLOC_* policy
+ */
+void Allocator::setPolicy(int policy) {
+	this->policy = (policy >= 0 && policy < ALLOC_POLICIES) ? policy : ALLOC_FIRST_FIT;
+}
+
+/**
+ * @param policy an ALLOC_* policy
+ * @return string its name, as the shell and mkfs take it
+ */
+string Allocator::getPolicyName(int policy) {
+	string names[] = {"first", "next", "best", "near"};
+
+	return (policy >= 0 && policy < ALLOC_POLICIES) ? names[policy] : "";
+}
+
+/**
+ * @param name a policy's name (see getPolicyName())
+ * @return int the ALLOC_* policy; -1 if there's none by that name
+ */
+int Allocator::findPolicy(string name) {
+	int ret = -1;
+	int i;
+
+	for (i = 0; i < ALLOC_POLICIES && ret == -1; i++) {
+		if (getPolicyName(i) == name) {
+			ret = i;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * The lowest free cluster. Nothing below lowest is free (unless something
+ * freed a cluster without saying so), so the search starts there and only
+ * wraps round to check the rest if it finds nothing.
+ *
+ * @return int the cluster; 0xFFFF if none is free
+ */
+int Allocator::firstFit() {
+	int i;
+	int ret = 0xFFFF;
+
+	for (i = lowest; i < fs->numClusters && ret == 0xFFFF; i++) {
+		if (fs->isFree(i)) {
+			ret = i;
+		}
+	}
+	for (i = 1; i < lowest && ret == 0xFFFF; i++) {
+		if (fs->isFree(i)) {
+			ret = i;
+		}
+	}
+	lowest = (ret == 0xFFFF) ? fs->numClusters : ret;
+
+	return ret;
+}
+
+/**
+ * The first free cluster from the cursor on, wrapping round at the end.
+ *
+ * @return int the cluster; 0xFFFF if none is free
+ */
+int Allocator::nextFit() {
+	int i;
+	int ret = 0xFFFF;
+
+	for (i = cursor; i < fs->numClusters && ret == 0xFFFF; i++) {
+		if (fs->isFree(i)) {
+			ret = i;
+		}
+	}
+	for (i = 1; i < cursor && ret == 0xFFFF; i++) {
+		if (fs->isFree(i)) {
+			ret = i;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * The cluster right after near if it's free; otherwise the start of the
+ * smallest free run of at least wanted clusters, or of the biggest free
+ * run if none is that long. Ties go to the lowest run. Only a file's
+ * first cluster, or one where its run hit something, costs a walk over
+ * the whole FAT.
+ *
+ * @param near the file's last cluster; -1 if none
+ * @param wanted clusters the caller means to take one after another
+ * @return int the cluster; 0xFFFF if none is free
+ */
+int Allocator::bestFit(int near, int wanted) {
+	int i;
+	int ret = 0xFFFF;
+	int start = 0;
+	int length = 0;
+	int bestLength = 0;
+	bool fits;
+	bool bestFits;
+	bool done = false;
+
+	if (near > 0 && near + 1 < fs->numClusters && fs->isFree(near + 1)) {
+		ret = near + 1;
+		done = true;
+	}
+
+	//one past the end closes the last run
+	for (i = 1; i <= fs->numClusters && !done; i++) {
+		if (i < fs->numClusters && fs->isFree(i)) {
+			if (length == 0) {
+				start = i;
+			}
+			length++;
+		} else if (length > 0) {
+			fits = length >= wanted;
+			bestFits = bestLength >= wanted;
+			if (bestLength == 0 || (fits && (!bestFits || length < bestLength))
+				|| (!fits && !bestFits && length > bestLength)) {
+				ret = start;
+				bestLength = length;
+			}
+			//can't do better than an exact fit
+			done = bestLength == wanted;
+			length = 0;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * The free cluster closest to near, looking one further away each side
+ * in turn (after before before).
+ *
+ * @param near the file's last cluster
+ * @return int the cluster; 0xFFFF if none is free
+ */
+int Allocator::nearest(int near) {
+	int distance;
+	int ret = 0xFFFF;
+
+	for (distance = 1; ret == 0xFFFF
+			&& (near + distance < fs->numClusters || near - distance > 0); distance++) {
+		if (near + distance < fs->numClusters && fs->isFree(near + distance)) {
+			ret = near + distance;
+		} else if (near - distance > 0 && fs->isFree(near - distance)) {
+			ret = near - distance;
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,27 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include "FileSys.h"
+
+class Allocator {
+	public:
+		Allocator(FileSys *fs, int policy);
+		int allocate(int near, int wanted);
+		void freed(int cluster);
+		void reset();
+		int getPolicy();
+		void setPolicy(int policy);
+		static string getPolicyName(int policy);
+		static int findPolicy(string name);
+	private:
+		int firstFit();
+		int nextFit();
+		int bestFit(int near, int wanted);
+		int nearest(int near);
+
+		FileSys *fs;
+		int policy; //ALLOC_* policy
+		int cursor; //where next fit's search starts
+		int lowest; //no cluster below this is free (first fit's search starts here)
+};
+#endif
@@ -0,0 +1,323 @@
+/**
+ * The cluster index. Remembers where the runs of contiguous clusters in
+ * recently used chains are, so finding the cluster that holds a given part
+ * of a file is a binary search over the file's runs instead of a walk down
+ * the FAT from its first cluster.
+ *
+ * Chains are indexed lazily, only as far as they've been looked up, and
+ * never all at once; the least recently used chain is dropped whenever
+ * there are too many chains or runs held. Appending to a chain needs
+ * nothing done; the next lookup past the end carries on walking from the
+ * last indexed cluster. Anything that cuts, frees or moves a chain must
+ * invalidate() it.
+ *
+ * Files on extent volumes aren't chained in the FAT, so they're load()ed
+ * whole from their extent lists instead of walked.
+ *
+ * @author: Eduardo Rodrigues - emr4378
+ */
+
+using namespace std;
+
+#include "ClusterIndex.h"
+
+/**
+ * Constructor
+ *
+ * @param fat the file allocation table to index; must outlive the index
+ * @param numClusters the number of entries in the FAT
+ */
+ClusterIndex::ClusterIndex(int *fat, int numClusters) {
+	int i;
+
+	this->fat = fat;
+	this->numClusters = numClusters;
+	totalRuns = 0;
+	clock = 0;
+	pthread_mutex_init(&lock, NULL);
+	for (i = 0; i < CLUSTER_INDEX_CHAINS; i++) {
+		chains[i].first = -1;
+	}
+}
+
+/**
+ * Finds the cluster holding part of a chain.
+ *
+ * Should NEVER be called without holding the file system's metadata lock
+ * (for reading at least), so the FAT doesn't change underneath it.
+ *
+ * @param first the first cluster of the chain
+ * @param clusterNumber which of the chain's clusters (0 = first)
+ * @return int the cluster; 0xFFFF if the chain isn't that long
+ */
+int ClusterIndex::lookup(int first, int clusterNumber) {
+	int ret;
+	ChainIndex *chain;
+
+	pthread_mutex_lock(&lock);
+	chain = findChain(first);
+	ret = lookupIn(chain, clusterNumber);
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+/**
+ * Finds the cluster holding part of a chain, but only if the chain is
+ * already indexed; never starts a walk from the first cluster. Used for
+ * files whose layout isn't in the FAT (extent volumes), which have to be
+ * load()ed instead.
+ *
+ * Should NEVER be called without holding the file system's metadata lock.
+ *
+ * @param first the first cluster of the chain
+ * @param clusterNumber which of the chain's clusters (0 = first)
+ * @return int the cluster; 0xFFFF if the chain isn't that long, -1 if
+ *         the chain isn't indexed
+ */
+int ClusterIndex::find(int first, int clusterNumber) {
+	int ret = -1;
+	int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < CLUSTER_INDEX_CHAINS && ret == -1; i++) {
+		if (chains[i].first == first) {
+			ret = lookupIn(&chains[i], clusterNumber);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+/**
+ * Indexes a whole chain from runs already known, then finds the cluster
+ * holding part of it.
+ *
+ * Should NEVER be called without holding the file system's metadata lock.
+ *
+ * @param first the first cluster of the chain
+ * @param runs every run in the chain, in file order
+ * @param clusterNumber which of the chain's clusters (0 = first)
+ * @return int the cluster; 0xFFFF if the chain isn't that long
+ */
+int ClusterIndex::load(int first, vector<ClusterRun> *runs, int clusterNumber) {
+	int ret;
+	ChainIndex *chain;
+
+	pthread_mutex_lock(&lock);
+	chain = findChain(first);
+	totalRuns -= chain->runs.size();
+	while (totalRuns + (int)runs->size() > CLUSTER_INDEX_MAX_RUNS
+			&& evictLeastRecent(chain));
+	chain->runs = *runs;
+	chain->walked = runs->back().start + runs->back().length;
+	totalRuns += runs->size();
+	ret = lookupIn(chain, clusterNumber);
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+/**
+ * Finds the cluster holding part of an indexed chain, walking on past
+ * what's indexed if it has to.
+ *
+ * Should NEVER be called without holding the index lock.
+ *
+ * @param chain the chain's index
+ * @param clusterNumber which of the chain's clusters (0 = first)
+ * @return int the cluster; 0xFFFF if the chain isn't that long
+ */
+int ClusterIndex::lookupIn(ChainIndex *chain, int clusterNumber) {
+	int ret;
+	int low;
+	int high;
+	int middle;
+	ClusterRun *run;
+
+	chain->lastUsed = ++clock;
+	if (clusterNumber >= chain->walked) {
+		ret = extend(chain, clusterNumber);
+	} else {
+		//last run starting at or before clusterNumber
+		low = 0;
+		high = chain->runs.size() - 1;
+		while (low < high) {
+			middle = (low + high + 1) / 2;
+			if (chain->runs[middle].start <= clusterNumber) {
+				low = middle;
+			} else {
+				high = middle - 1;
+			}
+		}
+		run = &chain->runs[low];
+		ret = run->cluster + (clusterNumber - run->start);
+	}
+
+	return ret;
+}
+
+/**
+ * Drops what's indexed for a chain. Must be called whenever a chain is
+ * cut short, freed or moved.
+ *
+ * @param first the first cluster of the chain
+ */
+void ClusterIndex::invalidate(int first) {
+	int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < CLUSTER_INDEX_CHAINS; i++) {
+		if (chains[i].first == first) {
+			drop(&chains[i]);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Drops everything indexed; for when chains may have changed anywhere.
+ */
+void ClusterIndex::clear() {
+	int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < CLUSTER_INDEX_CHAINS; i++) {
+		drop(&chains[i]);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Finds a chain's index, starting a new one (in a free slot, or the least
+ * recently used one) if it isn't indexed yet.
+ *
+ * Should NEVER be called without holding the index lock.
+ *
+ * @param first the first cluster of the chain
+ * @return ChainIndex* the chain's index
+ */
+ChainIndex *ClusterIndex::findChain(int first) {
+	int i;
+	ChainIndex *ret = NULL;
+	ChainIndex *oldest = &chains[0];
+	ClusterRun run;
+
+	for (i = 0; i < CLUSTER_INDEX_CHAINS && ret == NULL; i++) {
+		if (chains[i].first == first) {
+			ret = &chains[i];
+		} else if (chains[i].first == -1
+			|| (oldest->first != -1 && chains[i].lastUsed < oldest->lastUsed)) {
+			oldest = &chains[i];
+		}
+	}
+
+	if (ret == NULL) {
+		ret = oldest;
+		drop(ret);
+		run.start = 0;
+		run.cluster = first;
+		run.length = 1;
+		ret->first = first;
+		ret->walked = 1;
+		ret->runs.push_back(run);
+		totalRuns++;
+	}
+
+	return ret;
+}
+
+/**
+ * Walks a chain on from the last cluster indexed until clusterNumber is
+ * reached, adding to the index as it goes. If there's no room left for
+ * more runs (even after dropping other chains), the rest is walked but
+ * not indexed.
+ *
+ * Should NEVER be called without holding the index lock.
+ *
+ * @param chain the chain's index
+ * @param clusterNumber which of the chain's clusters to walk to
+ * @return int the cluster; 0xFFFF if the chain isn't that long
+ */
+int ClusterIndex::extend(ChainIndex *chain, int clusterNumber) {
+	ClusterRun *last = &chain->runs.back();
+	ClusterRun run;
+	int cluster = last->cluster + last->length - 1;
+	int walked = chain->walked;
+	bool indexing = true;
+
+	while (walked <= clusterNumber && cluster != 0xFFFF) {
+		cluster = fat[cluster];
+		if (cluster == 0x0000 || cluster >= numClusters || walked >= numClusters) {
+			//broken chain; fsck's problem, not ours
+			cluster = 0xFFFF;
+		} else if (cluster != 0xFFFF && indexing) {
+			last = &chain->runs.back();
+			if (cluster == last->cluster + last->length) {
+				last->length++;
+				chain->walked++;
+			} else if (totalRuns < CLUSTER_INDEX_MAX_RUNS || evictLeastRecent(chain)) {
+				run.start = walked;
+				run.cluster = cluster;
+				run.length = 1;
+				chain->runs.push_back(run);
+				chain->walked++;
+				totalRuns++;
+			} else {
+				indexing = false;
+			}
+		}
+		walked++;
+	}
+
+	return cluster;
+}
+
+/**
+ * Drops the least recently used chain to make room for more runs.
+ *
+ * Should NEVER be called without holding the index lock.
+ *
+ * @param keep a chain that mustn't be dropped (the one being extended)
+ * @return bool true if a chain was dropped
+ */
+bool ClusterIndex::evictLeastRecent(ChainIndex *keep) {
+	int i;
+	ChainIndex *oldest = NULL;
+
+	for (i = 0; i < CLUSTER_INDEX_CHAINS; i++) {
+		if (&chains[i] != keep && chains[i].first != -1
+			&& (oldest == NULL || chains[i].lastUsed < oldest->lastUsed)) {
+			oldest = &chains[i];
+		}
+	}
+	if (oldest != NULL) {
+		drop(oldest);
+	}
+
+	return oldest != NULL;
+}
+
+/**
+ * Empties a slot and gives its memory back.
+ *
+ * Should NEVER be called without holding the index lock.
+ *
+ * @param chain the slot
+ */
+void ClusterIndex::drop(ChainIndex *chain) {
+	if (chain->first != -1) {
+		totalRuns -= chain->runs.size();
+		vector<ClusterRun>().swap(chain->runs);
+		chain->first = -1;
+		chain->walked = 0;
+	}
+}
+
+/**
+ * Deconstructor
+ */
+ClusterIndex::~ClusterIndex() {
+	pthread_mutex_destroy(&lock);
+}
@@ -0,0 +1,54 @@
+#ifndef CLUSTERINDEX_H
+#define CLUSTERINDEX_H
+
+#include <vector>
+#include <pthread.h>
+
+using namespace std;
+
+#define CLUSTER_INDEX_CHAINS 64 //most chains indexed at once
+#define CLUSTER_INDEX_MAX_RUNS 65536 //most runs held across all chains
+
+/**
+ * A run of clusters that are next to each other on disk
+ */
+struct ClusterRun {
+	int start; //which of the file's clusters the run begins at (0 = first)
+	int cluster; //where the run begins on disk
+	int length; //clusters in the run
+};
+
+/**
+ * The part of one chain indexed so far; a free slot has first == -1
+ */
+struct ChainIndex {
+	int first; //first cluster of the chain; what the index is looked up by
+	int walked; //clusters indexed so far, from the start of the chain
+	unsigned long lastUsed; //when it was last looked up; least recent goes first
+	vector<ClusterRun> runs; //in file order
+};
+
+class ClusterIndex {
+	public:
+		ClusterIndex(int *fat, int numClusters);
+		~ClusterIndex();
+		int lookup(int first, int clusterNumber);
+		int find(int first, int clusterNumber);
+		int load(int first, vector<ClusterRun> *runs, int clusterNumber);
+		void invalidate(int first);
+		void clear();
+	private:
+		ChainIndex *findChain(int first);
+		int lookupIn(ChainIndex *chain, int clusterNumber);
+		int extend(ChainIndex *chain, int clusterNumber);
+		bool evictLeastRecent(ChainIndex *keep);
+		void drop(ChainIndex *chain);
+
+		int *fat;
+		int numClusters;
+		int totalRuns; //runs held across all chains
+		unsigned long clock; //bumped on every lookup
+		pthread_mutex_t lock;
+		ChainIndex chains[CLUSTER_INDEX_CHAINS];
+};
+#endif
@@ -0,0 +1,252 @@
+/**
+ * The defragmenter. Measures how fragmented files are and moves each
+ * fragmented file into a single contiguous run of clusters.
+ *
+ * Files are moved one at a time, so a pass can be stopped between any two
+ * files. Every move is ordered so a crash at any point leaves the file
+ * system consistent: the data is copied into free clusters, then the new
+ * chain is written to the FAT, then the directory entry is pointed at it,
+ * and only then is the old chain freed. The worst a crash can leave behind
+ * is orphaned clusters, which fsck -r reclaims.
+ *
+ * @author: Eduardo Rodrigues - emr4378
+ */
+
+using namespace std;
+
+#include "Defragmenter.h"
+
+/**
+ * Constructor
+ *
+ * @param fs the (opened) file system to defragment
+ */
+Defragmenter::Defragmenter(FileSys *fs) {
+	this->fs = fs;
+}
+
+/**
+ * Measures the fragmentation of every file and of the whole volume.
+ *
+ * @param volume pointer to the volume totals to fill in
+ * @param files pointer to vector for the per-file results; can be NULL
+ * @return int the number of fragmented files
+ */
+int Defragmenter::measure(VolumeFragmentation *volume,
+							vector<FileFragmentation> *files) {
+	int i;
+	FileFragmentation frag;
+
+	memset(volume, 0, sizeof(VolumeFragmentation));
+	if (files != NULL) {
+		files->clear();
+	}
+
+	pthread_rwlock_rdlock(&fs->metaLock);
+	for (i = 0; i < fs->directoryTable.size(); i++) {
+		if (measureFile(i, &frag) == 0) {
+			volume->files++;
+			volume->clusters += frag.clusters;
+			volume->extents += frag.extents;
+			if (frag.extents > 1) {
+				volume->fragmentedFiles++;
+			}
+			if (files != NULL) {
+				files->push_back(frag);
+			}
+		}
+	}
+	pthread_rwlock_unlock(&fs->metaLock);
+
+	if (volume->files > 0) {
+		volume->extentsPerFile = (double)volume->extents / volume->files;
+	}
+	if (volume->extents > 0) {
+		volume->averageRunLength = (double)volume->clusters / volume->extents;
+	}
+
+	return volume->fragmentedFiles;
+}
+
+/**
+ * Counts the clusters and contiguous runs in a single file's chain.
+ *
+ * @param entry index of the file in the directory table
+ * @param frag pointer to the result to fill in
+ * @return int 0 if entry is a file, -1 if the slot is free or deleted
+ *         (including deleted files the reclaimer hasn't got to yet)
+ */
+int Defragmenter::measureFile(int entry, FileFragmentation *frag) {
+	int ret = -1;
+	int i;
+	vector<int> clusters;
+	DirectoryTableEntry *dte = &fs->directoryTable[entry];
+
+	if (dte->name[0] != (char)0x00 && dte->name[0] != (char)0xFF
+		&& dte->name[0] != (char)0xFE
+		&& fs->mapFile(entry, &clusters) == 0 && !clusters.empty()) {
+		frag->entry = entry;
+		frag->name = fs->directoryTable[entry].name;
+		frag->clusters = clusters.size();
+		frag->extents = 1;
+		for (i = 1; i < clusters.size(); i++) {
+			if (clusters[i] != clusters[i - 1] + 1) {
+				frag->extents++;
+			}
+		}
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * Defragments the volume, one file at a time, lowest free run first.
+ *
+ * @param maxFiles the most files to move in this pass; 0 for no limit
+ * @param stop flag checked between files; pass ends once it's set. Can be NULL
+ * @param result pointer to the pass result to fill in
+ * @return int the number of files moved, -2 if out of clusters for all of them
+ */
+int Defragmenter::defragment(int maxFiles, volatile sig_atomic_t *stop,
+								DefragResult *result) {
+	int i;
+	int run;
+	FileFragmentation frag;
+
+	memset(result, 0, sizeof(DefragResult));
+
+	fs->lockAll();
+	//a mounted snapshot can't be changed
+	for (i = 0; i < fs->directoryTable.size() && !fs->readOnly; i++) {
+		if (measureFile(i, &frag) == 0 && frag.extents > 1) {
+			if ((stop != NULL && *stop)
+				|| (maxFiles > 0 && result->moved >= maxFiles)) {
+				result->interrupted = (stop != NULL && *stop);
+				result->remaining++;
+			} else {
+				run = fs->findFreeRun(frag.clusters);
+				if (run != 0xFFFF && relocateFile(i, frag.clusters, run) == 0) {
+					result->moved++;
+				} else {
+					result->skipped++;
+				}
+			}
+		}
+	}
+
+	fs->findUsedClusterCount();
+	fs->unlockAll();
+
+	return (result->moved == 0 && result->skipped > 0) ? -2 : result->moved;
+}
+
+/**
+ * Moves a file's data into the free run given and swaps the directory entry
+ * over to it. Each step is flushed to disk before the next one starts.
+ *
+ * @param entry index of the file in the directory table
+ * @param length the number of clusters in the file's chain
+ * @param run first cluster of a free run at least length clusters long
+ * @return int 0 if moved, -1 if the data couldn't be copied
+ */
+int Defragmenter::relocateFile(int entry, int length, int run) {
+	int ret = 0;
+	int i;
+	int *fat = fs->fileAllocationTable;
+	int clusterSize = fs->boot->clusterSize;
+	void *clusterData = malloc(clusterSize);
+	vector<int> clusters;
+	vector<Extent> extents(1);
+
+	//1. copy the data into the free run
+	fs->mapFile(entry, &clusters);
+	for (i = 0; i < length && ret == 0; i++) {
+		if (fs->readCluster(clusters[i], clusterData, clusterSize) != clusterSize) {
+			//last cluster can be short if it's at the end of the image
+			memset(clusterData, 0, clusterSize);
+		}
+		if (fs->writeCluster(run + i, clusterData, clusterSize) != clusterSize) {
+			ret = -1;
+		}
+	}
+	free(clusterData);
+
+	if (ret == 0) {
+		fs->syncFileSys();
+
+		//2. link up the new chain (or just mark the run used, on an extent
+		//volume); the old one is still in place
+		for (i = 0; i < length - 1; i++) {
+			fat[run + i] = fs->usingExtents ? EXTENT_CLUSTER : run + i + 1;
+		}
+		fat[run + length - 1] = fs->usingExtents ? EXTENT_CLUSTER : 0xFFFF;
+		fs->writeFAT(fat, fs->boot->FAT);
+		fs->syncFileSys();
+
+		//3. point the file at the new chain; a single extent needs no
+		//overflow blocks, so any it had are freed along with the old chain
+		fs->clusterIndex->invalidate(fs->directoryTable[entry].index);
+		fs->directoryTable[entry].index = run;
+		if (fs->usingExtents) {
+			extents[0].start = run;
+			extents[0].length = length;
+			fs->writeExtents(entry, &extents);
+		}
+		fs->writeDirectoryTable(&fs->directoryTable, fs->boot->rootDir);
+		fs->syncFileSys();
+
+		//4. free the old chain
+		for (i = 0; i < clusters.size(); i++) {
+			fs->releaseCluster(clusters[i]);
+		}
+		fs->writeFAT(fat, fs->boot->FAT);
+		fs->syncFileSys();
+	}
+
+	return ret;
+}
+
+/**
+ * Reads every file front to back, the same way cat and cp do, and times it.
+ * The image is dropped from the page cache first so the read actually
+ * goes to the disk and the layout matters.
+ *
+ * @return double read throughput in MB/s; 0 if nothing was read
+ */
+double Defragmenter::measureReadThroughput() {
+	int i;
+	int j;
+	long long bytes = 0;
+	double seconds;
+	struct timeval start;
+	struct timeval end;
+	int clusterSize = fs->boot->clusterSize;
+	void *clusterData = malloc(clusterSize);
+	DirectoryTableEntry *dte;
+	vector<int> clusters;
+
+	pthread_rwlock_rdlock(&fs->metaLock);
+	fs->syncFileSys();
+	for (i = 0; i < fs->memberCount(); i++) {
+		posix_fadvise(fs->memberFd(i), 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < fs->directoryTable.size(); i++) {
+		dte = &fs->directoryTable[i];
+		if (dte->name[0] != (char)0x00 && dte->name[0] != (char)0xFF
+			&& dte->name[0] != (char)0xFE && fs->mapFile(i, &clusters) == 0) {
+			for (j = 0; j < clusters.size(); j++) {
+				bytes += fs->readCluster(clusters[j], clusterData, clusterSize);
+			}
+		}
+	}
+	gettimeofday(&end, NULL);
+	pthread_rwlock_unlock(&fs->metaLock);
+	free(clusterData);
+
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+	return (seconds > 0) ? (bytes / (1024.0 * 1024.0)) / seconds : 0;
+}
@@ -0,0 +1,55 @@
+#ifndef DEFRAGMENTER_H
+#define DEFRAGMENTER_H
+
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "FileSys.h"
+
+/**
+ * How fragmented a single file is
+ */
+struct FileFragmentation {
+	int entry; //index of the file in the directory table
+	string name;
+	int clusters; //length of the file's chain
+	int extents; //number of contiguous runs the chain is made of
+};
+
+/**
+ * How fragmented the whole volume is
+ */
+struct VolumeFragmentation {
+	int files; //files on the volume
+	int fragmentedFiles; //files made of more than one extent
+	int clusters; //clusters in all file chains
+	int extents; //contiguous runs in all file chains
+	double extentsPerFile; //average extents per file
+	double averageRunLength; //average clusters per extent
+};
+
+/**
+ * Result of a defragmentation pass
+ */
+struct DefragResult {
+	int moved; //files relocated into a contiguous run
+	int skipped; //fragmented files with no free run large enough
+	int remaining; //fragmented files left when the pass stopped
+	bool interrupted; //true if the stop flag cut the pass short
+};
+
+class Defragmenter {
+	public:
+		Defragmenter(FileSys *fs);
+		int measure(VolumeFragmentation *volume, vector<FileFragmentation> *files);
+		int defragment(int maxFiles, volatile sig_atomic_t *stop, DefragResult *result);
+		double measureReadThroughput();
+	private:
+		int measureFile(int entry, FileFragmentation *frag);
+		int relocateFile(int entry, int length, int run);
+
+		FileSys *fs;
+};
+#endif
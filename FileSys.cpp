@@ -1,6 +1,10 @@
 /**
  * The main File System class. All the file system magic happens here.
  *
+ * Nothing in here prints: every method hands back what it found (see
+ * FileInfo, FileSysStats and FsError) and leaves showing it to the
+ * shell, or whatever else the library is built into.
+ *
  * @author: Eduardo Rodrigues - emr4378
  */
  
@@ -8,6 +12,65 @@
 using namespace std;
 
 #include "FileSys.h"
+#include "Allocator.h"
+#include "Tracer.h"
+
+/**
+ * Constructor. Nothing is opened until openFileSys() or createFileSys().
+ *
+ * Every public method is safe to call from any number of threads. The FAT
+ * and directory are guarded by a reader-writer lock, and each file by one
+ * of a set of striped reader-writer locks, so any number of threads can
+ * read files at once while writers only block readers of the same file.
+ * File locks are always taken before the metadata lock.
+ */
+FileSys::FileSys() {
+	int i;
+
+	fd = -1;
+	stripeUnit = 0;
+	batchDepth = 0;
+	fatDirty = false;
+	directoryDirty = false;
+	boot = NULL;
+	fileAllocationTable = NULL;
+	fatOnDisk = NULL;
+	clusterIndex = NULL;
+	allocator = NULL;
+	tracer = NULL;
+	usingExtents = false;
+	memset(&header, 0, sizeof(VolumeHeader));
+	pendingFiles = 0;
+	pendingClusters = 0;
+	discarding = false;
+	changeMap = NULL;
+	changeFd = -1;
+	held = NULL;
+	readOnly = false;
+	memset(&changes, 0, sizeof(ChangeHeader));
+	reclaimerRunning = false;
+	reclaimStop = false;
+	reclaimWork = false;
+	numClusters = 0;
+	usedClusters = 0;
+	heldClusters = 0;
+	packHint = 0;
+	entriesPerTable = 0;
+
+	pthread_rwlock_init(&metaLock, NULL);
+	for (i = 0; i < FILE_LOCK_STRIPES; i++) {
+		pthread_rwlock_init(&fileLocks[i], NULL);
+	}
+
+	pthread_mutex_init(&handleLock, NULL);
+	for (i = 0; i < MAX_OPEN_FILES; i++) {
+		handles[i] = NULL;
+	}
+
+	pthread_mutex_init(&reclaimLock, NULL);
+	pthread_cond_init(&reclaimWake, NULL);
+	pthread_mutex_init(&changeLock, NULL);
+}
 
 /**
  * Opens a file system and loads in the Boot Record, FAT and root directory
@@ -20,30 +83,52 @@ using namespace std;
  * @return int 0 if file system loads in right, -1 if not (not file system)
  */
 int FileSys::openFileSys(string name) {
+	PROFILE(&profiler, OP_MOUNT);
 	int ret = -1;
 	int i;
-	file = fopen(name.c_str(), "r+");
-	if (file != NULL) {
+	fd = open(name.c_str(), O_RDWR);
+	if (fd != -1) {
+		sysName = name;
 		boot = new BootRecord();
 		readBootRecord(boot);
+		readVolumeHeader(&header);
+		if (header.magic != VOLUME_MAGIC) {
+			//made before volume headers; a plain chain volume
+			memset(&header, 0, sizeof(VolumeHeader));
+		}
 
 		if ((boot->clusterSize < (MIN_CLUSTER_SIZE * 1024) 
 			|| boot->clusterSize > (MAX_CLUSTER_SIZE * 1024)
 			|| boot->size < (MIN_FILE_SIZE * 1024 * 1024)
 			|| boot->size > (MAX_FILE_SIZE * 1024 * 1024)
-			|| boot->size < boot->clusterSize)) {
+			|| boot->size < boot->clusterSize
+			|| boot->size / boot->clusterSize >= MAX_CLUSTERS
+			|| header.version > VOLUME_VERSION)) {
+			ret = -1;
+		} else if ((header.flags & VOLUME_STRIPED) && openStripes() != 0) {
 			ret = -1;
 		} else {
-			sysName = name;
+			usingExtents = (header.flags & VOLUME_EXTENTS) != 0;
+			discarding = (header.flags & VOLUME_DISCARD) != 0;
 			entriesPerTable = (boot->clusterSize)/DT_ENTRY_SIZE;
 			numClusters = (boot->size)/(boot->clusterSize);
 			fileAllocationTable = new int[numClusters];
+			fatOnDisk = new int[numClusters];
+			clusterIndex = new ClusterIndex(fileAllocationTable, numClusters);
 			directoryTable.resize(entriesPerTable);
 
+			openChangeMap(false);
 			readFAT(fileAllocationTable, boot->FAT);
+			memcpy(fatOnDisk, fileAllocationTable, numClusters * sizeof(int));
+			allocator = new Allocator(this, header.allocator);
 			readDirectoryTable(&directoryTable, boot->rootDir);
+			loadSnapshots();
+			loadPackSlots();
+
+			//picks up files deleted before the last unmount
+			findUsedClusterCount();
+			startReclaimer();
 
-			printInfo();
 			ret = 0; 
 		}
 	}
@@ -53,7 +138,7 @@ int FileSys::openFileSys(string name) {
 
 /**
  * Creates a file system. Saves the inital boot record, FAT and 
- * root directory table to a file named after file system.
+ * root directory table to a file named after file system, sparse.
  *
  * @param name string containing name of file system
  * @param fSize int the total size of the file system
@@ -61,45 +146,214 @@ int FileSys::openFileSys(string name) {
  * @return int 0 if file system is created, -1 otherwise
  */
 int FileSys::createFileSys(string name, int fSize, int cSize) {
+	return createFileSys(name, fSize, cSize, FS_BACKING_SPARSE);
+}
+
+/**
+ * Creates a file system. The image file is sized
+ * to the whole volume before anything is written to it, so it's never
+ * extended cluster by cluster as files are written.
+ *
+ * The FAT starts at cluster 1 and takes as many clusters as it needs
+ * (chained to each other in the FAT itself); the root directory follows.
+ * The volume may have at most MAX_CLUSTERS - 1 clusters.
+ *
+ * @param name string containing name of file system
+ * @param fSize int the total size of the file system, in MB
+ * @param cSize int the size of the clusters in the file system, in KB
+ * @param backing FS_BACKING_SPARSE, FS_BACKING_FALLOCATE or FS_BACKING_ZERO
+ * @return int 0 if file system is created, -1 if the image couldn't be
+ *         created (or the sizes are out of range), -2 if there's no room
+ *         on the host for it
+ */
+int FileSys::createFileSys(string name, int fSize, int cSize, int backing) {
+	return createFileSys(name, fSize, cSize, backing, NULL, 0);
+}
+
+/**
+ * Creates a file system striped over the image and the given member
+ * files: stripe units are dealt out to them in turn (see StripeMember),
+ * so a big I/O is spread over all of them and each does its share at
+ * once. Every member is sized (and backed) alike, to its share of the
+ * volume. Member names are kept in the stripe table as given; relative
+ * ones are taken from the image's directory, so the set can be moved
+ * together.
+ *
+ * @param name string containing name of file system
+ * @param fSize int the total size of the file system, in MB
+ * @param cSize int the size of the clusters in the file system, in KB
+ * @param backing FS_BACKING_SPARSE, FS_BACKING_FALLOCATE or FS_BACKING_ZERO
+ * @param members pointer to the names of the other backing files, at most
+ *        MAX_STRIPE_MEMBERS - 1; NULL (or none) for a plain volume
+ * @param unit the stripe unit, in KB; a multiple of cSize
+ * @return int 0 if file system is created, -1 if the image or a member
+ *         couldn't be created (or the sizes are out of range), -2 if
+ *         there's no room on the host for them
+ */
+int FileSys::createFileSys(string name, int fSize, int cSize, int backing,
+							vector<string> *members, int unit) {
+	PROFILE(&profiler, OP_FORMAT);
 	int ret = -1;
 	int i;
+	int fatClusters;
+	int count = (members != NULL) ? members->size() + 1 : 1;
+	bool named = true;
+	off_t memberSize = (off_t)fSize * 1024 * 1024;
+	char memberName[STRIPE_NAME_SIZE];
+	StripeMember *member;
+
+	for (i = 1; i < count; i++) {
+		named = named && (*members)[i - 1] != "" && (*members)[i - 1].size() < STRIPE_NAME_SIZE;
+	}
+	if (fSize < MIN_FILE_SIZE || fSize > MAX_FILE_SIZE
+		|| cSize < MIN_CLUSTER_SIZE || cSize > MAX_CLUSTER_SIZE
+		|| fSize * 1024 / cSize >= MAX_CLUSTERS || count > MAX_STRIPE_MEMBERS || !named
+		|| (count > 1 && (unit < cSize || unit % cSize != 0 || unit > fSize * 1024))) {
+		fd = -1;
+	} else {
+		sysName = name;
+		fd = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	}
+	if (fd != -1) {
+		if (count > 1) {
+			//each member's share, in whole stripe units
+			memberSize = (memberSize + (off_t)unit * 1024 - 1) / ((off_t)unit * 1024);
+			memberSize = (memberSize + count - 1) / count * unit * 1024;
+		}
+		ret = sizeImage(fd, memberSize, backing);
+		for (i = 0; i < count && ret == 0; i++) {
+			member = new StripeMember();
+			member->name = (i == 0) ? name : (*members)[i - 1];
+			member->fd = (i == 0) ? fd : open(memberPath(member->name).c_str(),
+												O_RDWR | O_CREAT | O_TRUNC, 0644);
+			member->running = false;
+			stripes.push_back(member);
+			if (i > 0) {
+				ret = (member->fd == -1) ? -1 : sizeImage(member->fd, memberSize, backing);
+			}
+		}
+		if (ret != 0) {
+			for (i = 1; i < stripes.size(); i++) {
+				if (stripes[i]->fd != -1) {
+					close(stripes[i]->fd);
+				}
+			}
+			close(fd);
+			fd = -1;
+		}
+		if (ret != 0 || count == 1) {
+			for (i = 0; i < stripes.size(); i++) {
+				delete stripes[i];
+			}
+			stripes.clear();
+		}
+	}
 
-	file = fopen(name.c_str(), "w+");
-	if (file != NULL) {
+	if (ret == 0) {
 		boot = new BootRecord();
 		boot->clusterSize = cSize * 1024;
 		boot->size = fSize * 1024 * 1024;
-		boot->FAT = 1;
-		boot->rootDir = 2;
-		
-		sysName = name;
 		entriesPerTable = (boot->clusterSize)/DT_ENTRY_SIZE;
 		numClusters = (boot->size)/(boot->clusterSize);
+		fatClusters = (numClusters * sizeof(int) + boot->clusterSize - 1) / boot->clusterSize;
+		boot->FAT = 1;
+		boot->rootDir = boot->FAT + fatClusters;
 		fileAllocationTable = new int[numClusters];
+		fatOnDisk = new int[numClusters];
+		clusterIndex = new ClusterIndex(fileAllocationTable, numClusters);
+		//nothing's on disk yet, so the first write covers the whole FAT
+		memset(fatOnDisk, 0xFF, numClusters * sizeof(int));
 
 		fileAllocationTable[0] = 0xFFFF;
-		fileAllocationTable[1] = 0xFFFF;
-		fileAllocationTable[2] = 0xFFFF;
-		for (i = 3; i < numClusters; i++) {
+		for (i = 1; i < numClusters; i++) {
 			fileAllocationTable[i] = 0x0000;
 		}
+		for (i = boot->FAT; i < boot->rootDir - 1; i++) {
+			fileAllocationTable[i] = i + 1;
+		}
+		fileAllocationTable[boot->rootDir - 1] = 0xFFFF;
+		fileAllocationTable[boot->rootDir] = 0xFFFF;
 		directoryTable.resize(entriesPerTable);
 		for (i = 0; i < entriesPerTable; i++) {
 			directoryTable[i].name[0] = 0x00;
 		}
 
+		memset(&header, 0, sizeof(VolumeHeader));
+		header.magic = VOLUME_MAGIC;
+		header.version = VOLUME_VERSION;
+		header.allocator = ALLOC_FIRST_FIT;
+		if (count > 1) {
+			header.flags |= VOLUME_STRIPED;
+			header.stripeUnit = unit * 1024;
+			header.stripeMembers = count;
+			stripeUnit = header.stripeUnit;
+			startStripes();
+		}
+		usingExtents = false;
+		discarding = false;
+		allocator = new Allocator(this, header.allocator);
+
+		openChangeMap(true);
 		writeBootRecord(boot);
+		writeVolumeHeader(&header);
+		for (i = 1; i < count; i++) {
+			memset(memberName, 0, STRIPE_NAME_SIZE);
+			strncpy(memberName, stripes[i]->name.c_str(), STRIPE_NAME_SIZE - 1);
+			writeAt(memberName, STRIPE_NAME_SIZE,
+					STRIPE_TABLE_OFFSET + (off_t)(i - 1) * STRIPE_NAME_SIZE);
+		}
 		writeFAT(fileAllocationTable, boot->FAT);
 		writeDirectoryTable(&directoryTable, boot->rootDir);
+		syncFileSys();
 
 		findUsedClusterCount();
+		startReclaimer();
+	}
+
+	return ret;
+}
 
-		cout << "ls" << endl;
+/**
+ * Sizes an (empty, just opened) image file: the image to the whole
+ * volume, or a striped volume's members to their share of it.
+ *
+ * @param file the image or member
+ * @param size its size, in bytes
+ * @param backing FS_BACKING_SPARSE, FS_BACKING_FALLOCATE or FS_BACKING_ZERO
+ * @return int 0 if sized, -1 if it couldn't be, -2 if there's no room on
+ *         the host
+ */
+int FileSys::sizeImage(int file, off_t size, int backing) {
+	int ret = 0;
+	int err = 0;
+	off_t offset;
+	int length;
+	char *zeros;
 
-		printDirectoryTable(directoryTable);
+	if (backing == FS_BACKING_FALLOCATE) {
+		//glibc falls back to writing a byte per block if the host file
+		//system can't reserve them itself
+		err = posix_fallocate(file, 0, size);
+	} else if (backing == FS_BACKING_ZERO) {
+		zeros = (char*)calloc(ZERO_FILL_CHUNK, 1);
+		for (offset = 0; offset < size && err == 0; offset += ZERO_FILL_CHUNK) {
+			length = (size - offset < ZERO_FILL_CHUNK) ? size - offset : ZERO_FILL_CHUNK;
+			errno = 0;
+			if (pwrite(file, zeros, length, offset) != length) {
+				err = (errno != 0) ? errno : ENOSPC;
+			}
+		}
+		free(zeros);
+	} else if (ftruncate(file, size) != 0) {
+		err = errno;
+	}
 
-		ret = 0;
+	if (err == ENOSPC) {
+		ret = -2;
+	} else if (err != 0) {
+		ret = -1;
 	}
+
 	return ret;
 }
 
@@ -140,24 +394,28 @@ void FileSys::compressDirectoryTable(vector<DirectoryTableEntry> *table, int clu
 
 /**
  * Writes given directory table vector to the file.
+ * Held back until the batch ends if a batch is running (see beginBatch()).
  *
  * @param table pointer to directory table vector
  * @param cluster the cluster in the FAT where the table starts
  */
 void FileSys::writeDirectoryTable(vector<DirectoryTableEntry> *table, int cluster) {
+	PROFILE(&profiler, OP_WRITE_DIRECTORY);
 	int offset;
 	int i = 0;
 	int j = 0;
 	int clusterSize = boot->clusterSize;
 
-	do {
-		offset =  clusterSize * cluster;
-		fseek(file, offset, SEEK_SET);
-
-		fwrite(&((*table)[i * entriesPerTable]), 128, entriesPerTable, file);
-		cluster = fileAllocationTable[cluster];
-		i++;
-	} while(cluster != 0xFFFF);
+	if (batchDepth > 0) {
+		directoryDirty = true;
+	} else {
+		do {
+			offset =  clusterSize * cluster;
+			writeAt(&((*table)[i * entriesPerTable]), 128 * entriesPerTable, offset);
+			cluster = fileAllocationTable[cluster];
+			i++;
+		} while(cluster != 0xFFFF);
+	}
 }
 
 /**
@@ -176,8 +434,7 @@ int FileSys::readDirectoryTable(vector<DirectoryTableEntry> *table, int cluster)
 	do {
 		table->resize((i + 1)*entriesPerTable);
 		offset =  clusterSize * cluster;
-		fseek(file, offset, SEEK_SET);
-		fread(&((*table)[i * entriesPerTable]), 128, entriesPerTable, file);
+		readAt(&((*table)[i * entriesPerTable]), 128 * entriesPerTable, offset);
 		cluster = fileAllocationTable[cluster];
 		i++;
 	} while(cluster  != 0xFFFF);
@@ -185,16 +442,33 @@ int FileSys::readDirectoryTable(vector<DirectoryTableEntry> *table, int cluster)
 }
 
 /**
- * Writes the given FAT to the file.
+ * Writes the given FAT to the file, then punches out whatever clusters
+ * were freed since it was last written (if discarding). Only the FAT's
+ * clusters that changed since then are written, so a big FAT (small
+ * clusters) isn't rewritten whole for every file touched.
+ * Held back until the batch ends if a batch is running (see beginBatch()).
  *
  * @param fat pointer to FAT array
  * @param cluster the cluster in the FAT where the table is located
  */
 void FileSys::writeFAT(int *fat, int cluster) {
+	PROFILE(&profiler, OP_WRITE_FAT);
 	int offset =  boot->clusterSize * cluster;
-	if (offset < boot->size) {
-		fseek(file, offset, SEEK_SET);
-		fwrite(fat, numClusters * sizeof(int), 1, file);
+	int perCluster = boot->clusterSize / sizeof(int);
+	int length;
+	int i;
+
+	if (batchDepth > 0) {
+		fatDirty = true;
+	} else if (offset < boot->size) {
+		for (i = 0; i < numClusters; i += perCluster) {
+			length = min(perCluster, numClusters - i) * sizeof(int);
+			if (memcmp(fat + i, fatOnDisk + i, length) != 0) {
+				writeAt(fat + i, length, offset + i * sizeof(int));
+				memcpy(fatOnDisk + i, fat + i, length);
+			}
+		}
+		flushDiscards();
 	}
 }
 
@@ -207,8 +481,7 @@ void FileSys::writeFAT(int *fat, int cluster) {
 void FileSys::readFAT(int *fat, int cluster) {
 	int offset =  boot->clusterSize * cluster;
 	if (offset < boot->size) {
-		fseek(file, offset, SEEK_SET);
-		fread(fat, numClusters * sizeof(int), 1, file);
+		readAt(fat, numClusters * sizeof(int), offset);
 	}
 }
 
@@ -217,8 +490,7 @@ void FileSys::readFAT(int *fat, int cluster) {
  * @param boot pointer to the Boot Record
  */
 void FileSys::writeBootRecord(BootRecord *boot) {
-	fseek(file, 0, SEEK_SET);
-	fwrite(boot, BOOT_RECORD_SIZE, 1, file); 
+	writeAt(boot, BOOT_RECORD_SIZE, 0);
 }
 
 /**
@@ -226,743 +498,4783 @@ void FileSys::writeBootRecord(BootRecord *boot) {
  * @param boot pointer to the Boot Record
  */
 void FileSys::readBootRecord(BootRecord *boot) {
-	fseek(file, 0, SEEK_SET);
-	fread(boot, BOOT_RECORD_SIZE, 1, file);
+	readAt(boot, BOOT_RECORD_SIZE, 0);
 }
 
 /**
- * Finds the actual number of files/directories in the given directory.
- * Different from the directory size; size is the total amount of entries
- * it can hold before needing a resize.
- *
- * @param table the Directory Table whose files should be counted
- * @return the total number of files
+ * Writes the volume header to the file, right after the boot record.
+ * @param header pointer to the volume header
  */
-int FileSys::getDirectoryFileCount(vector<DirectoryTableEntry> table) {
-	int ret = 0;
+void FileSys::writeVolumeHeader(VolumeHeader *header) {
+	writeAt(header, VOLUME_HEADER_SIZE, BOOT_RECORD_SIZE);
+}
+
+/**
+ * Reads the volume header from the file.
+ * @param header pointer to store the volume header in
+ */
+void FileSys::readVolumeHeader(VolumeHeader *header) {
+	readAt(header, VOLUME_HEADER_SIZE, BOOT_RECORD_SIZE);
+}
+
+/**
+ * Flushes everything written so far out to the disk. Used wherever the
+ * order writes reach the disk in matters (e.g. moving a file's clusters).
+ */
+void FileSys::syncFileSys() {
 	int i;
-	for (i = 0; i < table.size(); i++) {
-		if (table[i].name[0] != (char)0x00 && table[i].name[0] != (char)0xFF) {
-			ret++;
+
+	for (i = 0; i < memberCount(); i++) {
+		PROFILE_SYSCALL(1);
+		fsync(memberFd(i));
+	}
+}
+
+/**
+ * Reads from the file system at the given position. Uses pread() so no
+ * file position is shared and any number of threads can read at once.
+ * On a striped volume a read of STRIPE_PARALLEL_MIN or more is split
+ * over the members at once (see stripeAt()).
+ *
+ * @param buf where to store what's read
+ * @param length the number of bytes to read
+ * @param offset the position in the file system to read from
+ * @return int the number of bytes read; short if the end of the file was hit
+ */
+int FileSys::readAt(void *buf, int length, off_t offset) {
+	int done = 0;
+	int n = 1;
+	int in;
+	off_t at;
+
+	if (stripeUnit != 0 && length >= STRIPE_PARALLEL_MIN) {
+		done = stripeAt((char*)buf, length, offset, false);
+		n = 0;
+	}
+	while (done < length && n > 0) {
+		at = offset + done;
+		n = length - done;
+		in = memberFd(memberAt(&at, &n));
+		n = pread(in, (char*)buf + done, n, at);
+		PROFILE_SYSCALL(1);
+		if (n > 0) {
+			PROFILE_BYTES(n);
+			done += n;
+		} else if (n < 0 && errno == EINTR) {
+			n = 1;
 		}
 	}
 
-	return ret;
+	return done;
 }
 
-
 /**
- * Finds the total number of used clusters in the File allocation Table (FAT).
- * A cluster is deemed used if it's value isn't 0 (0x0000).
+ * Sends part of the file system to a host file descriptor. Spliced
+ * straight from the image into out if it's a pipe, so the data is never
+ * copied through user space; read and written otherwise.
  *
- * @return the number of used clusters
+ * @param out where to send it
+ * @param length the number of bytes to send
+ * @param offset the position in the file system to send from
+ * @param splicing pointer to a flag, true to try splice() first; cleared
+ *        once out turns out not to take it, so the caller's next run
+ *        doesn't try again
+ * @return int the number of bytes sent; short if out couldn't take more
  */
-int FileSys::findUsedClusterCount() {
-	int i;
-	usedClusters = 0;
+int FileSys::sendAt(int out, int length, off_t offset, bool *splicing) {
+	int done = 0;
+	int n = 1;
+	int m;
+	int written;
+	int in;
+	off_t at;
+	loff_t from;
+	char buf[64 * 1024];
 
-	for (i = 0; i < numClusters; i++) {
-		if (fileAllocationTable[i] != 0x0000) {
-			usedClusters++;
+	while (done < length && n > 0 && *splicing) {
+		at = offset + done;
+		m = length - done;
+		in = memberFd(memberAt(&at, &m));
+		from = at;
+		n = splice(in, &from, out, NULL, m, SPLICE_F_MOVE | SPLICE_F_MORE);
+		PROFILE_SYSCALL(1);
+		if (n > 0) {
+			PROFILE_BYTES(n);
+			done += n;
+		} else if (n < 0 && errno == EINTR) {
+			n = 1;
+		} else if (n < 0 && errno == EINVAL && done == 0) {
+			//not a pipe (or an image splice() can't read); copy instead
+			*splicing = false;
+			n = 1;
+		}
+	}
+	while (done < length && n > 0 && !*splicing) {
+		n = readAt(buf, min(length - done, (int)sizeof(buf)), offset + done);
+		for (written = 0, m = 1; written < n && m > 0; ) {
+			m = write(out, buf + written, n - written);
+			PROFILE_SYSCALL(1);
+			if (m > 0) {
+				written += m;
+			} else if (m < 0 && errno == EINTR) {
+				m = 1;
+			}
 		}
+		done += written;
+		n = (written == n) ? n : 0;
 	}
 
-	return usedClusters;
+	return done;
 }
 
 /**
- * Finds the next available cluster in the File Allocation Table (FAT).
- * A cluster is deemed free if it's value is 0 (0x0000).
+ * Copies part of another image into the file system, image to image.
+ * copy_file_range() does it inside the host's kernel, so the data never
+ * comes up to user space (and a host file system that can share blocks
+ * between files may not copy it at all); where it can't be used between
+ * the two images (on different host file systems, with an older kernel)
+ * it's read and written instead. Writes nothing while a snapshot is
+ * mounted.
  *
- * @return an available FAT/cluster index; 0xFFFF if no clusters are free
+ * @param from the other file system
+ * @param fromOffset the position in it to copy from
+ * @param length the number of bytes to copy
+ * @param offset the position in the file system to copy to
+ * @param ranging pointer to a flag, true to try copy_file_range() first;
+ *        cleared once it turns out not to work between the two, so the
+ *        caller's next run doesn't try again
+ * @return int the number of bytes copied; short if there was an error
  */
-int FileSys::findNextFreeCluster() {
-	int i;
-	int ret = 0xFFFF;
+int FileSys::copyAt(FileSys *from, off_t fromOffset, int length, off_t offset, bool *ranging) {
+	int done = 0;
+	int n = 1;
+	int m;
+	int in;
+	int out;
+	off_t at;
+	off_t to;
+	loff_t source;
+	loff_t dest;
+	char buf[64 * 1024];
 
-	for (i = 1; i < numClusters && ret == 0xFFFF; i++) {
-		if (fileAllocationTable[i] == 0x0000) {
-			ret = i;
+	if (readOnly) {
+		//a snapshot is mounted; nothing reaches the image
+		n = 0;
+	} else {
+		markChanged(offset, length);
+	}
+	while (done < length && n > 0 && *ranging) {
+		at = fromOffset + done;
+		to = offset + done;
+		m = length - done;
+		in = from->memberFd(from->memberAt(&at, &m));
+		out = memberFd(memberAt(&to, &m));
+		source = at;
+		dest = to;
+		n = copy_file_range(in, &source, out, &dest, m, 0);
+		PROFILE_SYSCALL(1);
+		if (n > 0) {
+			PROFILE_BYTES(n);
+			done += n;
+		} else if (n < 0 && errno == EINTR) {
+			n = 1;
+		} else if (n < 0 && done == 0 && (errno == EXDEV || errno == EINVAL
+					|| errno == ENOSYS || errno == EOPNOTSUPP)) {
+			//not between these two; copy instead
+			*ranging = false;
+			n = 1;
+		}
+	}
+	while (done < length && n > 0 && !*ranging) {
+		n = from->readAt(buf, min(length - done, (int)sizeof(buf)), fromOffset + done);
+		if (n > 0) {
+			n = writeAt(buf, n, offset + done);
+			done += n;
+		} else if (n < 0 && errno == EINTR) {
+			n = 1;
 		}
 	}
 
-	return ret;
+	return done;
 }
 
 /**
- * Finds the Directory Table index of a file by it's filename.
+ * Writes to the file system at the given position. Uses pwrite() so no
+ * file position is shared between threads. Writes nothing while a
+ * snapshot is mounted. On a striped volume a write of STRIPE_PARALLEL_MIN
+ * or more is split over the members at once (see stripeAt()).
  *
- * @param name string containing name of file
- * @return index of file if it exists; -1 otherwise
+ * @param buf what to write
+ * @param length the number of bytes to write
+ * @param offset the position in the file system to write to
+ * @return int the number of bytes written; short if there was an error
  */
-int FileSys::findIndexForFile(string name) {
-	int i;
-	int index = -1;
-	for (i = 0; i < directoryTable.size() && index == -1; i++) {
-		if (directoryTable[i].name == name) {
-			index = i;
+int FileSys::writeAt(const void *buf, int length, off_t offset) {
+	int done = 0;
+	int n = 1;
+	int out;
+	off_t at;
+
+	if (readOnly) {
+		//a snapshot is mounted; nothing reaches the image
+		n = 0;
+	} else {
+		markChanged(offset, length);
+	}
+	if (n > 0 && stripeUnit != 0 && length >= STRIPE_PARALLEL_MIN) {
+		done = stripeAt((char*)buf, length, offset, true);
+		n = 0;
+	}
+	while (done < length && n > 0) {
+		at = offset + done;
+		n = length - done;
+		out = memberFd(memberAt(&at, &n));
+		n = pwrite(out, (const char*)buf + done, n, at);
+		PROFILE_SYSCALL(1);
+		if (n > 0) {
+			PROFILE_BYTES(n);
+			done += n;
+		} else if (n < 0 && errno == EINTR) {
+			n = 1;
 		}
 	}
-	return index;
+
+	return done;
 }
 
 /**
- * The "touch" functionality of filesystem.
+ * Finds which backing file a position in the volume is in. Only a striped
+ * volume has more than one, and there a stripe unit is the most that's
+ * in one place.
  *
- * Creates a 0 byte file, with timestamp and given name
- * and adds it to the first available spot in the directory
- * table and first available spot in the FAT.
- * Will not create file if file of same name is found.
+ * @param offset pointer to the position in the volume; turned into the
+ *        position in the member's file
+ * @param length pointer to the bytes wanted from there; cut to what's in
+ *        the same stripe unit
+ * @return int the member it's in (see memberFd()); 0 if not striped
+ */
+int FileSys::memberAt(off_t *offset, int *length) {
+	int ret = 0;
+	off_t unit;
+
+	if (stripeUnit != 0) {
+		unit = *offset / stripeUnit;
+		ret = unit % stripes.size();
+		*length = (int)min((off_t)*length, stripeUnit - *offset % stripeUnit);
+		*offset = unit / stripes.size() * stripeUnit + *offset % stripeUnit;
+	}
+
+	return ret;
+}
+
+/**
+ * @param member which backing file, from 0 to memberCount() - 1
+ * @return int its file descriptor; member 0 is the image (fd)
+ */
+int FileSys::memberFd(int member) {
+	return (stripeUnit != 0) ? stripes[member]->fd : fd;
+}
+
+/**
+ * @return int how many backing files the volume has; 1 if not striped
+ */
+int FileSys::memberCount() {
+	return (stripeUnit != 0) ? stripes.size() : 1;
+}
+
+/**
+ * Where a member named in the stripe table is on the host. Names not
+ * starting with '/' are relative to the image's directory.
  *
- * @param name string containing name of the file to be created
- * @return directory index of file if created; -2 if out of clusters, -1 otherwise
+ * @param name the member's name, as kept in the stripe table
+ * @return string the path to open it by
  */
-int FileSys::createFile(string name) {
-	int ret = -2;
+string FileSys::memberPath(string name) {
+	string ret = name;
+	size_t slash = sysName.rfind('/');
+
+	if (name[0] != '/' && slash != string::npos) {
+		ret = sysName.substr(0, slash + 1) + name;
+	}
+
+	return ret;
+}
+
+/**
+ * Opens the members of a striped volume named in its stripe table and
+ * starts their workers. The boot record and volume header have to have
+ * been read (from the image, member 0).
+ *
+ * @return int 0 if every member was opened, -1 if the header doesn't
+ *         describe a stripe set or a member couldn't be opened
+ */
+int FileSys::openStripes() {
+	int ret = 0;
 	int i;
-	int cluster = findNextFreeCluster();
-	int index = -1;
-	bool unique = true;
+	char name[STRIPE_NAME_SIZE];
+	StripeMember *member;
 
-	if (cluster != 0xFFFF) {
+	if (header.stripeMembers < 2 || header.stripeMembers > MAX_STRIPE_MEMBERS
+		|| header.stripeUnit < boot->clusterSize
+		|| header.stripeUnit % boot->clusterSize != 0) {
 		ret = -1;
-		for (i = 0; i < directoryTable.size() && unique; i++) {
-			if (index == -1 &&
-				(directoryTable[i].name[0] == (char)0x00 || 
-				directoryTable[i].name[0] == (char)0xFF)) {
-				index = i;
-			}
-			if (directoryTable[i].name == name) {
-				unique = false;
-			}
+	}
+	for (i = 0; i < header.stripeMembers && ret == 0; i++) {
+		member = new StripeMember();
+		member->name = sysName;
+		member->fd = fd;
+		member->running = false;
+		if (i > 0) {
+			memset(name, 0, STRIPE_NAME_SIZE);
+			readAt(name, STRIPE_NAME_SIZE - 1,
+					STRIPE_TABLE_OFFSET + (off_t)(i - 1) * STRIPE_NAME_SIZE);
+			member->name = name;
+			member->fd = (name[0] != 0) ? open(memberPath(name).c_str(), O_RDWR) : -1;
 		}
-		if (unique) {
-			//new file at cluster; filled here in case directory table must grow
-			fileAllocationTable[cluster] = 0xFFFF;
-			if (index == -1) {
-				//if directory table is filled
-				int dirCluster = boot->rootDir;
-				while (fileAllocationTable[dirCluster] != 0xFFFF) {
-					dirCluster = fileAllocationTable[dirCluster];
-				}
-			
-				fileAllocationTable[dirCluster] = findNextFreeCluster();
-				if (fileAllocationTable[dirCluster] != 0xFFFF) {
-					dirCluster = fileAllocationTable[dirCluster];
-					fileAllocationTable[dirCluster] = 0xFFFF;
-					int dirTableSize = directoryTable.size();
-					directoryTable.resize(dirTableSize+entriesPerTable);
-					for (i = dirTableSize; i < directoryTable.size(); i++) {
-						directoryTable[i].name[0] = 0x00;
-					}
-					index = dirTableSize;
-				} else {
-					ret = -2;
-				}
-			}
+		stripes.push_back(member);
+		ret = (member->fd == -1) ? -1 : 0;
+	}
 
-			if (index != -1 && ret != -2) {
-				strcpy(directoryTable[index].name, name.c_str());
-				directoryTable[index].index = cluster;
-				directoryTable[index].size = 0;
-				directoryTable[index].type = 0x00;
-				directoryTable[index].creation = time(NULL);
+	if (ret == 0) {
+		stripeUnit = header.stripeUnit;
+		startStripes();
+	}
 
-				writeFAT(fileAllocationTable, boot->FAT);
-				writeDirectoryTable(&directoryTable, boot->rootDir);
+	return ret;
+}
 
-				ret = index;
-			} else {
-				readFAT(fileAllocationTable, boot->FAT);
-				readDirectoryTable(&directoryTable, boot->rootDir);
+/**
+ * Does a read or write of a striped volume with every member doing its
+ * share at once: the I/O is cut at stripe unit boundaries, each member's
+ * pieces are handed to its worker, and the caller does the pieces of the
+ * member the I/O starts on itself before waiting for the rest. Members
+ * whose worker isn't running are done by the caller too, one after
+ * another.
+ *
+ * @param buf where to store what's read, or what to write
+ * @param length the number of bytes
+ * @param offset the position in the file system
+ * @param write true to write, false to read
+ * @return int the number of bytes read or written; short if the end of a
+ *         member was hit or there was an error
+ */
+int FileSys::stripeAt(char *buf, int length, off_t offset, bool write) {
+	int ret = 0;
+	int i;
+	int n;
+	int done;
+	int member;
+	int first = 0;
+	StripePiece piece;
+	StripeJob jobs[MAX_STRIPE_MEMBERS];
+
+	for (i = 0; i < stripes.size(); i++) {
+		jobs[i].fd = stripes[i]->fd;
+		jobs[i].write = write;
+		jobs[i].done = 0;
+		jobs[i].syscalls = 0;
+		jobs[i].finished = false;
+	}
+	for (done = 0; done < length; done += n) {
+		piece.offset = offset + done;
+		n = length - done;
+		member = memberAt(&piece.offset, &n);
+		piece.buf = buf + done;
+		piece.length = n;
+		jobs[member].pieces.push_back(piece);
+		first = (done == 0) ? member : first;
+	}
+
+	for (i = 0; i < stripes.size(); i++) {
+		if (i != first && !jobs[i].pieces.empty() && stripes[i]->running) {
+			pthread_mutex_lock(&stripes[i]->lock);
+			stripes[i]->queue.push_back(&jobs[i]);
+			pthread_cond_signal(&stripes[i]->wake);
+			pthread_mutex_unlock(&stripes[i]->lock);
+		}
+	}
+	for (i = 0; i < stripes.size(); i++) {
+		if (i == first || !stripes[i]->running) {
+			runStripeJob(&jobs[i]);
+			jobs[i].finished = true;
+		}
+	}
+	for (i = 0; i < stripes.size(); i++) {
+		if (i != first && !jobs[i].pieces.empty() && stripes[i]->running) {
+			pthread_mutex_lock(&stripes[i]->lock);
+			while (!jobs[i].finished) {
+				pthread_cond_wait(&stripes[i]->finished, &stripes[i]->lock);
 			}
+			pthread_mutex_unlock(&stripes[i]->lock);
 		}
+		PROFILE_SYSCALL(jobs[i].syscalls);
+		PROFILE_BYTES(jobs[i].done);
+		ret += jobs[i].done;
 	}
 
 	return ret;
 }
 
 /**
- * The "cp" functionality of the filesystem.
- * 
- * Copies source param to dest param. At least one should be local
- * (inside this FileSys), otherwise this shouldn't be called
- * 
- * @param source string containing file to be copied
- * @param dest string containing destination of file
- * @param sourceInFileSys boolean indicating if source is local (in FileSys)
- * @param destInFileSys boolean indicating if dest is local (in FileSys)
- * @return int If both files are external, -2. If file can't be found, -1. Otherwise 0
+ * Starts every member's worker (see stripeWorker()).
  */
-int FileSys::copyFile(string source, string dest, 
-						bool sourceInFileSys, bool destInFileSys) {
-	//struct dirent dirp;
-	//DIR *dir;
-	string fileName;
+void FileSys::startStripes() {
 	int i;
-	int ret = -2;
-	if (source == dest) {
-		ret = -3;
+
+	for (i = 0; i < stripes.size(); i++) {
+		stripes[i]->stop = false;
+		pthread_mutex_init(&stripes[i]->lock, NULL);
+		pthread_cond_init(&stripes[i]->wake, NULL);
+		pthread_cond_init(&stripes[i]->finished, NULL);
+		stripes[i]->running = (pthread_create(&stripes[i]->worker, NULL,
+												stripeWorker, stripes[i]) == 0);
+	}
+}
+
+/**
+ * Stops the members' workers once they've finished what they were given.
+ */
+void FileSys::stopStripes() {
+	int i;
+
+	for (i = 0; i < stripes.size(); i++) {
+		if (stripes[i]->running) {
+			pthread_mutex_lock(&stripes[i]->lock);
+			stripes[i]->stop = true;
+			pthread_cond_signal(&stripes[i]->wake);
+			pthread_mutex_unlock(&stripes[i]->lock);
+			pthread_join(stripes[i]->worker, NULL);
+			stripes[i]->running = false;
+		}
+	}
+}
+
+/**
+ * A striped volume member's worker. Does the jobs handed to it in the
+ * order they came, and sleeps while there are none.
+ *
+ * @param arg the StripeMember
+ * @return NULL
+ */
+void *FileSys::stripeWorker(void *arg) {
+	StripeMember *member = (StripeMember*)arg;
+	StripeJob *job;
+
+	pthread_mutex_lock(&member->lock);
+	while (!member->queue.empty() || !member->stop) {
+		if (member->queue.empty()) {
+			pthread_cond_wait(&member->wake, &member->lock);
+		} else {
+			job = member->queue.front();
+			member->queue.erase(member->queue.begin());
+			pthread_mutex_unlock(&member->lock);
+			runStripeJob(job);
+			pthread_mutex_lock(&member->lock);
+			job->finished = true;
+			pthread_cond_broadcast(&member->finished);
+		}
+	}
+	pthread_mutex_unlock(&member->lock);
+
+	return NULL;
+}
+
+/**
+ * Reads or writes a member's pieces of an I/O, stopping at the first
+ * one that comes up short. Counts its syscalls in the job rather than
+ * the profiler, as it may run on a worker.
+ *
+ * @param job the member's share
+ */
+void FileSys::runStripeJob(StripeJob *job) {
+	int i;
+	int n = 1;
+	int done;
+	StripePiece *piece;
+
+	for (i = 0; i < job->pieces.size() && n > 0; i++) {
+		piece = &job->pieces[i];
+		for (done = 0; done < piece->length && n > 0; ) {
+			if (job->write) {
+				n = pwrite(job->fd, piece->buf + done, piece->length - done,
+							piece->offset + done);
+			} else {
+				n = pread(job->fd, piece->buf + done, piece->length - done,
+							piece->offset + done);
+			}
+			job->syscalls++;
+			if (n > 0) {
+				done += n;
+			} else if (n < 0 && errno == EINTR) {
+				n = 1;
+			}
+		}
+		job->done += done;
+	}
+}
+
+/**
+ * Loads the changed-cluster map from <image>.chg, or starts a new one.
+ * If there's no usable map (none yet, a different size, or the volume
+ * wasn't closed cleanly so writes may have been missed) every cluster is
+ * counted as changed in the current generation, so the next delta is a
+ * full copy rather than a wrong one. The map is marked unclean on disk
+ * until the file system is closed.
+ *
+ * @param fresh true if the image was just created; any old map is dropped
+ */
+void FileSys::openChangeMap(bool fresh) {
+	int i;
+	bool loaded = false;
+	string name = sysName + ".chg";
+
+	changeMap = new unsigned int[numClusters];
+	changeFd = open(name.c_str(), O_RDWR | O_CREAT | (fresh ? O_TRUNC : 0), 0644);
+	if (changeFd != -1
+		&& pread(changeFd, &changes, sizeof(ChangeHeader), 0) == sizeof(ChangeHeader)
+		&& changes.magic == CHANGE_MAGIC) {
+		loaded = changes.clean && changes.numClusters == numClusters
+			&& pread(changeFd, changeMap, numClusters * sizeof(int),
+						sizeof(ChangeHeader)) == numClusters * sizeof(int);
 	} else {
-		ret = -1;
-		/*
-			//apparently this doesn't work in Solaris; there is no d_type in the
-			//dirent struct. AWESOME.
+		memset(&changes, 0, sizeof(ChangeHeader));
+		changes.magic = CHANGE_MAGIC;
+		changes.generation = 1;
+	}
 
-			if (source[source.size()-1] == '*') {
-			source.erase(source.end()-1);
-			cout << "Copy all " << endl;
+	if (!loaded) {
+		changes.numClusters = numClusters;
+		for (i = 0; i < numClusters; i++) {
+			changeMap[i] = changes.generation;
+		}
+	}
+	writeChangeMap(false);
+}
 
-			if (!sourceInFileSys) {
-				dir = opendir(source.c_str());
-				if (dir != NULL) {
-					while ((dirp = readdir(dir)) != NULL) {
-						if (dirp->d_type == 8 && dirp->d_name != "") {
-							fileName = source;
-							fileName.append(dirp->d_name);
-							copyFile(fileName, dest, false, destInFileSys);
-						}
-					}
+/**
+ * Saves the changed-cluster map to <image>.chg.
+ *
+ * @param clean true if nothing more will be written to the image (it's
+ *        being closed); the map is only trusted on the next mount if so
+ */
+void FileSys::writeChangeMap(bool clean) {
+	if (changeFd != -1) {
+		pthread_mutex_lock(&changeLock);
+		changes.clean = clean ? 1 : 0;
+		pwrite(changeFd, changeMap, numClusters * sizeof(int), sizeof(ChangeHeader));
+		pwrite(changeFd, &changes, sizeof(ChangeHeader), 0);
+		fsync(changeFd);
+		PROFILE_SYSCALL(3);
+		PROFILE_BYTES(numClusters * sizeof(int) + sizeof(ChangeHeader));
+		pthread_mutex_unlock(&changeLock);
+	}
+}
+
+/**
+ * @return unsigned int the generation clusters written now are stamped
+ *         with; the next delta exported brings a copy up to it
+ */
+unsigned int FileSys::getGeneration() {
+	return changes.generation;
+}
+
+/**
+ * Stamps the clusters a write touches with the current generation.
+ * Every write to the image goes through here (see writeAt()).
+ *
+ * @param offset where the write starts in the image
+ * @param length the number of bytes written
+ */
+void FileSys::markChanged(off_t offset, int length) {
+	int i;
+	int first = offset / boot->clusterSize;
+	int last = (offset + max(length, 1) - 1) / boot->clusterSize;
+
+	if (changeMap != NULL) {
+		pthread_mutex_lock(&changeLock);
+		for (i = first; i <= last && i < numClusters; i++) {
+			changeMap[i] = changes.generation;
+		}
+		pthread_mutex_unlock(&changeLock);
+	}
+}
+
+/**
+ * Reads (the start of) a cluster.
+ *
+ * @param cluster the cluster to read
+ * @param buf where to store what's read
+ * @param length the number of bytes to read; at most the cluster size
+ * @return int the number of bytes read
+ */
+int FileSys::readCluster(int cluster, void *buf, int length) {
+	PROFILE(&profiler, OP_READ_CLUSTER);
+	return readAt(buf, length, (off_t)boot->clusterSize * cluster);
+}
+
+/**
+ * Writes (the start of) a cluster.
+ *
+ * @param cluster the cluster to write
+ * @param buf what to write
+ * @param length the number of bytes to write; at most the cluster size
+ * @return int the number of bytes written
+ */
+int FileSys::writeCluster(int cluster, const void *buf, int length) {
+	PROFILE(&profiler, OP_WRITE_CLUSTER);
+	return writeAt(buf, length, (off_t)boot->clusterSize * cluster);
+}
+
+/**
+ * Copies a file's clusters and size out of the FAT and directory, so its data
+ * can be read without holding the metadata lock.
+ *
+ * The caller should hold the file's lock so the chain can't change
+ * underneath it.
+ *
+ * @param name string containing name of file
+ * @param clusters pointer to vector to store the file's clusters in, in order
+ * @param size pointer to store the file's size in
+ * @param small where to copy a small file's data (PACK_MAX_SIZE bytes);
+ *        clusters is left empty for one
+ * @return int 0 if the file was found, -1 otherwise
+ */
+int FileSys::readFileChain(string name, vector<int> *clusters, unsigned int *size,
+							void *small) {
+	int ret = -1;
+	int index;
+
+	clusters->clear();
+	pthread_rwlock_rdlock(&metaLock);
+	index = findIndexForFile(name);
+	if (index != -1 && isSmall(index)) {
+		*size = readSmall(index, small, PACK_MAX_SIZE, 0);
+		ret = 0;
+	} else if (index != -1) {
+		*size = directoryTable[index].size;
+		ret = mapFile(index, clusters);
+	}
+	pthread_rwlock_unlock(&metaLock);
+
+	return ret;
+}
+
+/**
+ * Takes a free cluster and links it onto the end of a chain. The new
+ * cluster is marked as the end of the chain straight away so no other
+ * thread can take it too.
+ *
+ * @param cluster the current last cluster of the chain
+ * @param wanted how many more clusters the chain is about to grow by,
+ *        this one included
+ * @return int the new cluster; 0xFFFF if no clusters are free
+ */
+int FileSys::allocateAfter(int cluster, int wanted) {
+	int next;
+
+	pthread_rwlock_wrlock(&metaLock);
+	next = findNextFreeCluster(cluster, wanted);
+	fileAllocationTable[cluster] = next;
+	if (next != 0xFFFF) {
+		fileAllocationTable[next] = 0xFFFF;
+	}
+	pthread_rwlock_unlock(&metaLock);
+
+	return next;
+}
+
+/**
+ * Takes a free cluster and adds it to the end of a file. Chain volumes
+ * link it on with allocateAfter(); extent volumes take the cluster right
+ * after the last one if it's free (so the last extent just grows), whatever
+ * the allocator, and add it to the file's extent list.
+ *
+ * Should NEVER be called without holding the file's lock for writing.
+ *
+ * @param name string containing name of the file
+ * @param cluster the current last cluster of the file
+ * @param wanted how many more clusters the file is about to grow by, this
+ *        one included
+ * @return int the new cluster; 0xFFFF if no clusters are free
+ */
+int FileSys::appendCluster(string name, int cluster, int wanted) {
+	int next = 0xFFFF;
+	int index;
+	Extent extent;
+	vector<Extent> extents;
+
+	if (!usingExtents) {
+		next = allocateAfter(cluster, wanted);
+	} else {
+		pthread_rwlock_wrlock(&metaLock);
+		index = findIndexForFile(name);
+		if (index != -1 && readExtents(index, &extents) == 0) {
+			flushDiscards();
+			if (cluster + 1 < numClusters && isFree(cluster + 1)) {
+				next = cluster + 1;
+			} else {
+				next = findNextFreeCluster(cluster, wanted);
+			}
+		}
+		if (next != 0xFFFF) {
+			fileAllocationTable[next] = EXTENT_CLUSTER;
+			if (extents.back().start + extents.back().length == next) {
+				extents.back().length++;
+			} else {
+				extent.start = next;
+				extent.length = 1;
+				extents.push_back(extent);
+			}
+			if (writeExtents(index, &extents) != 0) {
+				//no room for another overflow block
+				releaseCluster(next);
+				next = 0xFFFF;
+			}
+			clusterIndex->invalidate(directoryTable[index].index);
+		}
+		pthread_rwlock_unlock(&metaLock);
+	}
+
+	return next;
+}
+
+/**
+ * Lists every cluster of a file, in order, from its chain or extents.
+ * Small files have none.
+ *
+ * Should NEVER be called without holding the metadata lock.
+ *
+ * @param index the index of the file in the directory table
+ * @param clusters pointer to vector to store the clusters in
+ * @return int 0 if done; -1 if the file's extent list couldn't be read
+ */
+int FileSys::mapFile(int index, vector<int> *clusters) {
+	int ret = 0;
+	int i;
+	int j;
+	int cluster;
+	vector<Extent> extents;
+
+	clusters->clear();
+	if (!isSmall(index) && !usingExtents) {
+		cluster = directoryTable[index].index;
+		while (cluster != 0xFFFF && clusters->size() < numClusters) {
+			clusters->push_back(cluster);
+			cluster = fileAllocationTable[cluster];
+		}
+	} else if (!isSmall(index)) {
+		ret = readExtents(index, &extents);
+		for (i = 0; i < extents.size() && ret == 0; i++) {
+			for (j = 0; j < extents[i].length; j++) {
+				clusters->push_back(extents[i].start + j);
+			}
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Cuts a file down to the given number of clusters and frees the rest.
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @param index the index of the file in the directory table
+ * @param keep the number of clusters to keep; at least 1
+ */
+void FileSys::cutFile(int index, int keep) {
+	int i;
+	int j;
+	int kept = 0;
+	int cluster = directoryTable[index].index;
+	int next;
+	vector<Extent> extents;
+
+	if (!usingExtents) {
+		for (i = 1; i < keep && fileAllocationTable[cluster] != 0xFFFF; i++) {
+			cluster = fileAllocationTable[cluster];
+		}
+		next = fileAllocationTable[cluster];
+		fileAllocationTable[cluster] = 0xFFFF;
+		while (next != 0xFFFF) {
+			cluster = next;
+			next = fileAllocationTable[cluster];
+			releaseCluster(cluster);
+		}
+	} else if (readExtents(index, &extents) == 0) {
+		for (i = 0; i < extents.size(); i++) {
+			for (j = 0; j < extents[i].length; j++) {
+				if (kept >= keep) {
+					releaseCluster(extents[i].start + j);
 				}
+				kept++;
+			}
+			if (kept > keep) {
+				extents[i].length = max(0, (int)extents[i].length - (kept - keep));
+				kept = keep;
+			}
+		}
+		while (extents.back().length == 0) {
+			extents.pop_back();
+		}
+		//only ever shrinks, so there's always room
+		writeExtents(index, &extents);
+	}
+	clusterIndex->invalidate(directoryTable[index].index);
+}
+
+/**
+ * Frees every cluster of a file (and its overflow blocks, if any), or a
+ * packed file's slots.
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @param index the index of the file in the directory table
+ */
+void FileSys::freeFile(int index) {
+	int i;
+	int j;
+	int cluster = directoryTable[index].index;
+	int next;
+	vector<Extent> extents;
+
+	clusterIndex->invalidate(cluster);
+	if (directoryTable[index].type == TYPE_PACKED) {
+		releaseSlots(cluster, getSmallInfo(index)->slot, directoryTable[index].size);
+	} else if (!isSmall(index) && !usingExtents) {
+		do {
+			next = fileAllocationTable[cluster];
+			releaseCluster(cluster);
+			cluster = next;
+		} while (cluster != 0xFFFF);
+	} else if (!isSmall(index)) {
+		readExtents(index, &extents);
+		for (i = 0; i < extents.size(); i++) {
+			for (j = 0; j < extents[i].length; j++) {
+				releaseCluster(extents[i].start + j);
+			}
+		}
+		freeExtentBlocks(getExtentInfo(index)->overflow);
+	}
+}
+
+/**
+ * Finds where an extent volume keeps a file's extents: the end of the
+ * name in its directory entry.
+ *
+ * @param index the index of the file in the directory table
+ * @return ExtentInfo* the file's extent info
+ */
+ExtentInfo *FileSys::getExtentInfo(int index) {
+	return (ExtentInfo*)(directoryTable[index].name + EXTENT_NAME_SIZE);
+}
+
+/**
+ * Reads a file's extent list, from its directory entry and then any
+ * overflow blocks.
+ *
+ * Should NEVER be called without holding the metadata lock.
+ *
+ * @param index the index of the file in the directory table
+ * @param extents pointer to vector to store the extents in, in file order
+ * @return int 0 if read; -1 if the list is damaged (see fsck)
+ */
+int FileSys::readExtents(int index, vector<Extent> *extents) {
+	int ret = 0;
+	int i;
+	int blocks = 0;
+	unsigned int block;
+	ExtentInfo *info = getExtentInfo(index);
+	int perBlock = (boot->clusterSize - sizeof(ExtentBlock)) / sizeof(Extent);
+	char *data;
+	ExtentBlock *blockHeader;
+
+	extents->clear();
+	for (i = 0; i < info->count && i < EXTENTS_INLINE; i++) {
+		extents->push_back(info->extents[i]);
+	}
+
+	block = info->overflow;
+	if (block != 0 && extents->size() < info->count) {
+		data = (char*)malloc(boot->clusterSize);
+		blockHeader = (ExtentBlock*)data;
+		while (block != 0 && ret == 0 && extents->size() < info->count) {
+			if (block >= numClusters || blocks++ >= numClusters
+				|| readCluster(block, data, boot->clusterSize) != boot->clusterSize
+				|| blockHeader->count > perBlock) {
+				ret = -1;
 			} else {
-				int dirTableSize = getDirectoryFileCount(directoryTable);
-				for (i = 0; i < dirTableSize; i++) {
-					fileName = dest;
-					fileName.append(directoryTable[i].name);
-					copyFile(directoryTable[i].name, fileName, true, destInFileSys);
+				for (i = 0; i < blockHeader->count; i++) {
+					extents->push_back(((Extent*)(blockHeader + 1))[i]);
 				}
+				block = blockHeader->next;
 			}
-			//copy all
-		} else {*/
+		}
+		free(data);
+	}
+
+	for (i = 0; i < extents->size() && ret == 0; i++) {
+		if ((*extents)[i].length == 0 || (*extents)[i].start >= numClusters
+			|| (*extents)[i].start + (*extents)[i].length > numClusters) {
+			ret = -1;
+		}
+	}
+	if (extents->size() != info->count || extents->empty()) {
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Stores a file's extent list, in its directory entry and as many overflow
+ * blocks as it needs. Blocks the file already has are reused (unless a
+ * snapshot holds them); new ones are taken from the free clusters and ones
+ * no longer needed are freed. The blocks are written straight away; the FAT and directory are left for
+ * the caller to write.
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @param index the index of the file in the directory table
+ * @param extents pointer to the extents, in file order; at least one
+ * @return int 0 if stored; -2 if out of clusters for overflow blocks
+ */
+int FileSys::writeExtents(int index, vector<Extent> *extents) {
+	int ret = 0;
+	int i;
+	int done;
+	int n;
+	int existing;
+	unsigned int block;
+	vector<int> blocks;
+	vector<int> replaced;
+	ExtentInfo *info = getExtentInfo(index);
+	int perBlock = (boot->clusterSize - sizeof(ExtentBlock)) / sizeof(Extent);
+	int overflow = max(0, (int)extents->size() - EXTENTS_INLINE);
+	int needed = (overflow + perBlock - 1) / perBlock;
+	char *data = (char*)malloc(boot->clusterSize);
+	ExtentBlock *blockHeader = (ExtentBlock*)data;
+
+	findExtentBlocks(info->overflow, &blocks);
+	for (i = 0; i < blocks.size() && replaced.empty(); i++) {
+		if (isHeld(blocks[i])) {
+			//a snapshot still reads these; write the list somewhere new
+			replaced.swap(blocks);
+		}
+	}
+	existing = blocks.size();
+	for (i = existing; i < needed && ret == 0; i++) {
+		block = findNextFreeCluster();
+		if (block == 0xFFFF) {
+			ret = -2;
+		} else {
+			fileAllocationTable[block] = EXTENT_CLUSTER;
+			blocks.push_back(block);
+		}
+	}
+
+	if (ret == -2) {
+		//give back only the blocks just taken
+		for (i = existing; i < blocks.size(); i++) {
+			releaseCluster(blocks[i]);
+		}
+	} else {
+		for (i = 0, done = EXTENTS_INLINE; i < needed; i++, done += n) {
+			memset(data, 0, boot->clusterSize);
+			n = min(perBlock, (int)extents->size() - done);
+			blockHeader->count = n;
+			blockHeader->next = (i + 1 < needed) ? blocks[i + 1] : 0;
+			memcpy(blockHeader + 1, &(*extents)[done], n * sizeof(Extent));
+			writeCluster(blocks[i], data, boot->clusterSize);
+		}
+		for (i = needed; i < blocks.size(); i++) {
+			releaseCluster(blocks[i]);
+		}
+		for (i = 0; i < replaced.size(); i++) {
+			releaseCluster(replaced[i]);
+		}
+
+		memset(info, 0, sizeof(ExtentInfo));
+		info->count = extents->size();
+		info->overflow = (needed > 0) ? blocks[0] : 0;
+		for (i = 0; i < extents->size() && i < EXTENTS_INLINE; i++) {
+			info->extents[i] = (*extents)[i];
+		}
+	}
+	free(data);
+
+	return ret;
+}
+
+/**
+ * Frees a list of overflow blocks.
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @param block the first overflow block; 0 if none
+ */
+void FileSys::freeExtentBlocks(int block) {
+	int i;
+	vector<int> blocks;
+
+	findExtentBlocks(block, &blocks);
+	for (i = 0; i < blocks.size(); i++) {
+		releaseCluster(blocks[i]);
+	}
+}
+
+/**
+ * Follows a list of overflow blocks from the first.
+ *
+ * @param block the first overflow block; 0 if none
+ * @param blocks pointer to vector to store the blocks in, in order
+ * @return int 0 if the list ended properly; -1 if it ran out of range
+ */
+int FileSys::findExtentBlocks(int block, vector<int> *blocks) {
+	int ret = 0;
+	ExtentBlock blockHeader;
+
+	blocks->clear();
+	while (block != 0 && ret == 0) {
+		if (block < 0 || block >= numClusters || blocks->size() >= numClusters) {
+			ret = -1;
+		} else {
+			blocks->push_back(block);
+			readCluster(block, &blockHeader, sizeof(ExtentBlock));
+			block = blockHeader.next;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Turns an extent list into cluster index runs.
+ *
+ * @param extents pointer to the extents, in file order
+ * @param runs pointer to vector to store the runs in
+ */
+void FileSys::indexExtents(vector<Extent> *extents, vector<ClusterRun> *runs) {
+	int i;
+	ClusterRun run;
+
+	run.start = 0;
+	runs->clear();
+	for (i = 0; i < extents->size(); i++) {
+		run.cluster = (*extents)[i].start;
+		run.length = (*extents)[i].length;
+		runs->push_back(run);
+		run.start += run.length;
+	}
+}
+
+/**
+ * Finds the actual number of files/directories in the given directory.
+ * Different from the directory size; size is the total amount of entries
+ * it can hold before needing a resize.
+ *
+ * @param table the Directory Table whose files should be counted
+ * @return the total number of files
+ */
+int FileSys::getDirectoryFileCount(vector<DirectoryTableEntry> table) {
+	int ret = 0;
+	int i;
+	for (i = 0; i < table.size(); i++) {
+		if (table[i].name[0] != (char)0x00 && table[i].name[0] != (char)0xFF
+			&& table[i].name[0] != (char)0xFE) {
+			ret++;
+		}
+	}
+
+	return ret;
+}
+
+
+/**
+ * Finds the total number of used clusters in the File allocation Table (FAT).
+ * A cluster is deemed used if it's value isn't 0 (0x0000); clusters of
+ * deleted files that haven't been reclaimed yet are still used. Also
+ * recounts those files and clusters.
+ *
+ * @return the number of used clusters
+ */
+int FileSys::findUsedClusterCount() {
+	int i;
+	usedClusters = 0;
+	pendingFiles = 0;
+	pendingClusters = 0;
+	heldClusters = 0;
+
+	PROFILE_SCANNED(numClusters);
+	for (i = 0; i < numClusters; i++) {
+		if (fileAllocationTable[i] != 0x0000) {
+			usedClusters++;
+		} else if (isHeld(i)) {
+			heldClusters++;
+		}
+	}
+	for (i = 0; i < directoryTable.size(); i++) {
+		if (directoryTable[i].name[0] == (char)0xFE) {
+			pendingFiles++;
+			pendingClusters += directoryTable[i].size / boot->clusterSize + 1;
+		}
+	}
+
+	return usedClusters;
+}
+
+/**
+ * Finds the next available cluster in the File Allocation Table (FAT), for
+ * anything that isn't part of a file's data (directory clusters, extent
+ * blocks, snapshot tables and so on).
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @return an available FAT/cluster index; 0xFFFF if no clusters are free
+ */
+int FileSys::findNextFreeCluster() {
+	return findNextFreeCluster(-1, 1);
+}
+
+/**
+ * Finds the next available cluster in the File Allocation Table (FAT).
+ * A cluster is deemed free if it's value is 0 (0x0000) and no snapshot
+ * holds it; which free one is picked is up to the volume's allocator. If
+ * none are, but
+ * deleted files are still waiting on the reclaimer, they're reclaimed
+ * there and then rather than running out of room. Clusters still waiting
+ * to be punched out are punched first, so none is punched after it's
+ * been handed out again.
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @param near the file's current last cluster; -1 for its first cluster
+ * @param wanted how many clusters the caller is about to take one after
+ *        another, this one included
+ * @return an available FAT/cluster index; 0xFFFF if no clusters are free
+ */
+int FileSys::findNextFreeCluster(int near, int wanted) {
+	PROFILE(&profiler, OP_ALLOCATE);
+	int ret;
+
+	flushDiscards();
+	ret = allocator->allocate(near, wanted);
+	if (ret == 0xFFFF && pendingFiles > 0 && reclaimPending(numClusters) > 0) {
+		ret = findNextFreeCluster(near, wanted);
+	}
+
+	return ret;
+}
+
+/**
+ * Gives a cluster back to the free clusters. Every cluster a file (or
+ * anything else) gives up goes through here. A cluster a snapshot holds
+ * is only free as far as the live volume is concerned; it isn't handed
+ * out again (or punched out) until the snapshot is deleted.
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @param cluster the cluster to free
+ */
+void FileSys::releaseCluster(int cluster) {
+	fileAllocationTable[cluster] = 0x0000;
+	allocator->freed(cluster);
+	if (discarding && !isHeld(cluster)) {
+		discardQueue.push_back(cluster);
+	}
+}
+
+/**
+ * Whether a cluster can be handed out: nothing uses it now and no
+ * snapshot still needs what's in it.
+ *
+ * @param cluster the cluster
+ * @return bool true if it's free
+ */
+bool FileSys::isFree(int cluster) {
+	PROFILE_SCANNED(1);
+	return fileAllocationTable[cluster] == 0x0000 && !isHeld(cluster);
+}
+
+/**
+ * Whether a snapshot still needs what's in a cluster, so it mustn't be
+ * written over (see writableCluster()) or handed out again once freed.
+ *
+ * @param cluster the cluster
+ * @return bool true if a snapshot holds it
+ */
+bool FileSys::isHeld(int cluster) {
+	return held != NULL && held[cluster];
+}
+
+/**
+ * Finds the lowest run of free clusters that's at least as long as asked.
+ *
+ * @param length the number of clusters needed
+ * @return int first cluster of the run; 0xFFFF if there's no such run
+ */
+int FileSys::findFreeRun(int length) {
+	int i;
+	int start = 0xFFFF;
+	int found = 0;
+
+	for (i = 1; i < numClusters && found < length; i++) {
+		if (isFree(i)) {
+			if (found == 0) {
+				start = i;
+			}
+			found++;
+		} else {
+			found = 0;
+		}
+	}
+
+	return (found >= length) ? start : 0xFFFF;
+}
+
+/**
+ * Punches every cluster freed since the last flush out of the image, so
+ * the host gets the space back. Called once the FAT saying they're free
+ * is written, and before any free cluster is handed out.
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @return int the number of runs punched; -1 if the host can't punch holes
+ */
+int FileSys::flushDiscards() {
+	int ret = 0;
+
+	if (!discardQueue.empty()) {
+		ret = punchRuns(&discardQueue);
+		discardQueue.clear();
+	}
+
+	return ret;
+}
+
+/**
+ * Punches clusters out of the image, sorted and joined into runs first so
+ * it's one call per run of neighbouring clusters rather than per cluster.
+ * The image keeps its size; the punched clusters just read back as zeros.
+ *
+ * @param clusters pointer to the clusters to punch, in any order; sorted
+ * @return int the number of runs punched; -1 if the host can't punch holes
+ */
+int FileSys::punchRuns(vector<int> *clusters) {
+	int ret = 0;
+	int i;
+	int start;
+	int length;
+	int done;
+	int n;
+	int member;
+	off_t offset;
+	off_t at;
+	bool punched;
+	int clusterSize = boot->clusterSize;
+
+	sort(clusters->begin(), clusters->end());
+	for (i = 0; i < clusters->size() && ret != -1; i++) {
+		start = i;
+		while (i + 1 < clusters->size() && (*clusters)[i + 1] <= (*clusters)[i] + 1) {
+			i++;
+		}
+		offset = (off_t)(*clusters)[start] * clusterSize;
+		length = ((*clusters)[i] - (*clusters)[start] + 1) * clusterSize;
+		markChanged(offset, length);
+		//a stripe unit at a time on a striped volume
+		for (done = 0, punched = true; done < length && punched; done += n) {
+			at = offset + done;
+			n = length - done;
+			member = memberFd(memberAt(&at, &n));
+			PROFILE_SYSCALL(1);
+			punched = (fallocate(member, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+									at, n) == 0);
+		}
+		if (punched) {
+			ret++;
+		} else if (errno == EOPNOTSUPP || errno == ENOSYS) {
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Frees clusters of deleted files, up to the given number. Files are cut
+ * down from the end, so a file too big for one pass is left shorter but
+ * still whole, and its entry is only cleared once the last of it is gone.
+ * The directory is written before the FAT, so a crash in between leaves
+ * at worst orphaned clusters for "fsck -r" to reclaim.
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @param maxClusters the most clusters to free
+ * @return int the number of clusters freed
+ */
+int FileSys::reclaimPending(int maxClusters) {
+	PROFILE(&profiler, OP_RECLAIM);
+	int i;
+	int count;
+	int keep;
+	int freed = 0;
+	int clusterSize = boot->clusterSize;
+
+	for (i = 0; i < directoryTable.size() && freed < maxClusters; i++) {
+		if (directoryTable[i].name[0] == (char)0xFE) {
+			count = directoryTable[i].size / clusterSize + 1;
+			if (count > maxClusters - freed) {
+				keep = count - (maxClusters - freed);
+				cutFile(i, keep);
+				directoryTable[i].size = (keep - 1) * clusterSize;
+				freed = maxClusters;
+			} else {
+				freeFile(i);
+				memset(&directoryTable[i], 0, sizeof(DirectoryTableEntry));
+				pendingFiles--;
+				freed += count;
+			}
+		}
+	}
+
+	if (freed > 0) {
+		pendingClusters = max(0, pendingClusters - freed);
+		usedClusters = max(0, usedClusters - freed);
+		writeDirectoryTable(&directoryTable, boot->rootDir);
+		writeFAT(fileAllocationTable, boot->FAT);
+	}
+
+	return freed;
+}
+
+/**
+ * Starts the thread that frees deleted files' clusters in the background.
+ */
+void FileSys::startReclaimer() {
+	reclaimStop = false;
+	reclaimWork = true;
+	reclaimerRunning = (pthread_create(&reclaimer, NULL, reclaimWorker, this) == 0);
+}
+
+/**
+ * Stops the reclaimer once it finishes the pass it's on. Whatever it
+ * hasn't freed yet is picked up again the next time the volume is opened.
+ */
+void FileSys::stopReclaimer() {
+	if (reclaimerRunning) {
+		pthread_mutex_lock(&reclaimLock);
+		reclaimStop = true;
+		pthread_cond_signal(&reclaimWake);
+		pthread_mutex_unlock(&reclaimLock);
+		pthread_join(reclaimer, NULL);
+		reclaimerRunning = false;
+	}
+}
+
+/**
+ * The reclaimer thread. Frees RECLAIM_BATCH clusters at a time, letting
+ * go of the metadata lock in between, and sleeps while there's nothing
+ * left to free.
+ *
+ * @param arg the FileSys
+ * @return NULL
+ */
+void *FileSys::reclaimWorker(void *arg) {
+	FileSys *fs = (FileSys*)arg;
+	int freed;
+	bool stop = false;
+
+	while (!stop) {
+		pthread_rwlock_wrlock(&fs->metaLock);
+		freed = fs->reclaimPending(RECLAIM_BATCH);
+		pthread_rwlock_unlock(&fs->metaLock);
+
+		pthread_mutex_lock(&fs->reclaimLock);
+		while (freed == 0 && !fs->reclaimWork && !fs->reclaimStop) {
+			pthread_cond_wait(&fs->reclaimWake, &fs->reclaimLock);
+		}
+		if (freed == 0) {
+			fs->reclaimWork = false;
+		}
+		stop = fs->reclaimStop;
+		pthread_mutex_unlock(&fs->reclaimLock);
+	}
+
+	return NULL;
+}
+
+/**
+ * How many clusters are in use right now, counted afresh from the FAT.
+ *
+ * @return int the number of clusters in use
+ */
+int FileSys::getUsedClusters() {
+	int ret;
+
+	pthread_rwlock_wrlock(&metaLock);
+	ret = findUsedClusterCount();
+	pthread_rwlock_unlock(&metaLock);
+
+	return ret;
+}
+
+/**
+ * How much the reclaimer still has to free. Those clusters aren't
+ * counted as available until it has.
+ *
+ * @param files pointer to store the number of deleted files in; can be NULL
+ * @return int the number of clusters still held by deleted files
+ */
+int FileSys::getReclaimBacklog(int *files) {
+	int ret;
+
+	pthread_rwlock_rdlock(&metaLock);
+	ret = pendingClusters;
+	if (files != NULL) {
+		*files = pendingFiles;
+	}
+	pthread_rwlock_unlock(&metaLock);
+
+	return ret;
+}
+
+/**
+ * Finds the Directory Table index of a file by it's filename.
+ *
+ * @param name string containing name of file
+ * @return index of file if it exists; -1 otherwise
+ */
+int FileSys::findIndexForFile(string name) {
+	int i;
+	int index = -1;
+	for (i = 0; i < directoryTable.size() && index == -1; i++) {
+		if (directoryTable[i].name == name) {
+			index = i;
+		}
+	}
+	return index;
+}
+
+/**
+ * The "touch" functionality of filesystem.
+ *
+ * Creates a 0 byte file, with timestamp and given name
+ * and adds it to the first available spot in the directory
+ * table and first available spot in the FAT.
+ * Will not create file if file of same name is found.
+ *
+ * @param name string containing name of the file to be created
+ * @return directory index of file if created; -2 if out of clusters, -1 otherwise
+ */
+int FileSys::createFile(string name) {
+	PROFILE(&profiler, OP_TOUCH);
+	TraceCall traced(tracer, OP_TOUCH, 0);
+	int ret;
+
+	lockFile(name, true);
+	pthread_rwlock_wrlock(&metaLock);
+	ret = createFileEntry(name, true, 1);
+	pthread_rwlock_unlock(&metaLock);
+	unlockFile(name);
+
+	traced.done(ret, name, "");
+	return ret;
+}
+
+/**
+ * The background "touch" functionality of the filesystem.
+ *
+ * Should NEVER be called without holding the file's lock and the
+ * metadata lock for writing.
+ *
+ * @param name string containing name of the file to be created
+ * @param small true to start it as an empty small file, with no cluster,
+ *        if its name is short enough (see SmallInfo)
+ * @param wanted how many clusters the file is about to be written to (a hint
+ *        for where its first cluster goes; see Allocator)
+ * @return directory index of file if created; -2 if out of clusters, -1 otherwise
+ *         (including names too long to store)
+ */
+int FileSys::createFileEntry(string name, bool small, int wanted) {
+	int ret = readOnly ? -1 : -2;
+	int i;
+	bool empty = small && name.size() < SMALL_NAME_SIZE;
+	int cluster = (readOnly || empty) ? 0xFFFF : findNextFreeCluster(-1, wanted);
+	int index = -1;
+	int nameLength = usingExtents ? EXTENT_NAME_SIZE : sizeof(directoryTable[0].name);
+	bool unique = name.size() < nameLength;
+	ExtentInfo *info;
+
+	if (cluster != 0xFFFF || (empty && !readOnly)) {
+		ret = -1;
+		for (i = 0; i < directoryTable.size() && unique; i++) {
+			if (index == -1 &&
+				(directoryTable[i].name[0] == (char)0x00 || 
+				directoryTable[i].name[0] == (char)0xFF)) {
+				index = i;
+			}
+			if (directoryTable[i].name == name) {
+				unique = false;
+			}
+		}
+		if (unique) {
+			//new file at cluster; filled here in case directory table must grow
+			if (!empty) {
+				fileAllocationTable[cluster] = usingExtents ? EXTENT_CLUSTER : 0xFFFF;
+			}
+			if (index == -1) {
+				//if directory table is filled
+				int dirCluster = boot->rootDir;
+				while (fileAllocationTable[dirCluster] != 0xFFFF) {
+					dirCluster = fileAllocationTable[dirCluster];
+				}
+			
+				fileAllocationTable[dirCluster] = findNextFreeCluster();
+				if (fileAllocationTable[dirCluster] != 0xFFFF) {
+					dirCluster = fileAllocationTable[dirCluster];
+					fileAllocationTable[dirCluster] = 0xFFFF;
+					int dirTableSize = directoryTable.size();
+					directoryTable.resize(dirTableSize+entriesPerTable);
+					for (i = dirTableSize; i < directoryTable.size(); i++) {
+						directoryTable[i].name[0] = 0x00;
+					}
+					index = dirTableSize;
+				} else {
+					ret = -2;
+				}
+			}
+
+			if (index != -1 && ret != -2) {
+				memset(directoryTable[index].name, 0, sizeof(directoryTable[index].name));
+				strcpy(directoryTable[index].name, name.c_str());
+				directoryTable[index].index = empty ? 0 : cluster;
+				if (usingExtents && !empty) {
+					info = getExtentInfo(index);
+					info->count = 1;
+					info->extents[0].start = cluster;
+					info->extents[0].length = 1;
+				}
+				directoryTable[index].size = 0;
+				directoryTable[index].type = empty ? TYPE_INLINE : 0x00;
+				directoryTable[index].creation = time(NULL);
+
+				writeFAT(fileAllocationTable, boot->FAT);
+				writeDirectoryTable(&directoryTable, boot->rootDir);
+
+				ret = index;
+			} else if (!empty) {
+				//nothing was written; just give the cluster back. Re-reading
+				//the FAT would throw away other threads' allocations
+				releaseCluster(cluster);
+			}
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * The "cp" functionality of the filesystem.
+ * 
+ * Copies source param to dest param. At least one should be local
+ * (inside this FileSys), otherwise this shouldn't be called
+ * 
+ * @param source string containing file to be copied
+ * @param dest string containing destination of file
+ * @param sourceInFileSys boolean indicating if source is local (in FileSys)
+ * @param destInFileSys boolean indicating if dest is local (in FileSys)
+ * @return int If both files are external, -2. If file can't be found, -1. Otherwise 0
+ */
+int FileSys::copyFile(string source, string dest, 
+						bool sourceInFileSys, bool destInFileSys) {
+	PROFILE(&profiler, OP_COPY);
+	TraceCall traced(tracer, OP_COPY, 0);
+	traced.copying(source, sourceInFileSys, destInFileSys);
+	//struct dirent dirp;
+	//DIR *dir;
+	string fileName;
+	int i;
+	int ret = -2;
+	if (source == dest) {
+		ret = -3;
+	} else {
+		ret = -1;
+		/*
+			//apparently this doesn't work in Solaris; there is no d_type in the
+			//dirent struct. AWESOME.
+
+			if (source[source.size()-1] == '*') {
+			source.erase(source.end()-1);
+			cout << "Copy all " << endl;
+
+			if (!sourceInFileSys) {
+				dir = opendir(source.c_str());
+				if (dir != NULL) {
+					while ((dirp = readdir(dir)) != NULL) {
+						if (dirp->d_type == 8 && dirp->d_name != "") {
+							fileName = source;
+							fileName.append(dirp->d_name);
+							copyFile(fileName, dest, false, destInFileSys);
+						}
+					}
+				}
+			} else {
+				int dirTableSize = getDirectoryFileCount(directoryTable);
+				for (i = 0; i < dirTableSize; i++) {
+					fileName = dest;
+					fileName.append(directoryTable[i].name);
+					copyFile(directoryTable[i].name, fileName, true, destInFileSys);
+				}
+			}
+			//copy all
+		} else {*/
+
+		if (source.empty() || source[source.size()-1] == '/') {
+			//directory source
+			source.append(dest.substr(dest.find_last_of('/') + 1));
+		}
+		if (dest.empty() || dest[dest.size()-1] == '/') {
+			//directory destination
+			dest.append(source.substr(source.find_last_of('/') + 1));
+		}
+		if (source == dest && sourceInFileSys == destInFileSys) {
+			//copying a file onto itself would delete it
+			ret = -3;
+		} else if (!destInFileSys && sourceInFileSys) {
+			//internal (fake/the FileSys) to external (real)
+			ret = copyFileInToExt(source, dest);
+		} else if (!sourceInFileSys && destInFileSys) {
+			//external (real) to internal (fake/the FileSys)
+			ret = copyFileExtToIn(source, dest);
+		} else if (sourceInFileSys && destInFileSys) {
+			//internal to internal
+			ret = copyFileInternally(source, dest);
+		}
+	}
+	traced.done(ret, source, dest);
+	return ret;
+}
+
+/**
+ * A sub-component of the "cp" functionality of the filesystem.
+ *
+ * Copies an internal file system to the  external file (real).
+ * Only holds the source file's lock for reading, so any number of these
+ * can run at once.
+ *
+ * Should NEVER be called by anything other than copyFile()
+ *
+ * @param source string containing the name of the source file
+ * @param dest string containing the full path name of the destination file
+ * @return int If error, -1; otherwise 0
+ */
+int FileSys::copyFileInToExt(string source, string dest) {
+	int ret = -1;
+	FILE *outerFile;
+	int i;
+	int leftOver;
+	unsigned int size;
+	vector<int> clusters;
+	int clusterSize = boot->clusterSize;
+	void *clusterData = malloc(max(clusterSize, PACK_MAX_SIZE));
+
+	//internal (fake/the FileSys) to external (real)
+	lockFile(source, false);
+	outerFile = fopen(dest.c_str(), "w+");
+	if (outerFile != NULL) {
+		if (readFileChain(source, &clusters, &size, clusterData) == 0
+			&& clusters.empty()) {
+			//small file; already read
+			fwrite(clusterData, size, 1, outerFile);
+			ret = 0;
+		} else if (!clusters.empty()) {
+			leftOver = size % clusterSize;
+
+			for (i = 0; i < (int)clusters.size() - 1; i++) {
+				readCluster(clusters[i], clusterData, clusterSize);
+				fwrite(clusterData, clusterSize, 1, outerFile);
+			}
+
+			if (leftOver != 0) {
+				readCluster(clusters.back(), clusterData, leftOver);
+				fwrite(clusterData, leftOver, 1, outerFile);
+			}
+
+			ret = 0;
+		}
+		fclose(outerFile);
+	}
+	unlockFile(source);
+
+	free(clusterData);
+
+	return ret;
+}
+
+/**
+ * A sub-component of the "cp" functionality of the filesystem.
+ *
+ * Copies an external file (real) to the internal file system.
+ * Holds the destination file's lock throughout, but only takes the
+ * metadata lock to create the entry, grab each cluster and finish up.
+ * Anything but a regular file is streamed in instead (see importStream()).
+ *
+ * Should NEVER be called by anything other than copyFile()
+ *
+ * @param source string containing the full path name of the source file
+ * @param dest string containing the name of the destination file
+ * @return int -1 if error, -2 if out of clusters, 0 otherwise
+ */
+int FileSys::copyFileExtToIn(string source, string dest) {
+	int ret = -1;
+	FILE *outerFile = NULL;
+	int in;
+	int index;
+	int cluster;
+	int length;
+	int wanted;
+	unsigned int size;
+	bool small;
+	struct stat info;
+	int clusterSize = boot->clusterSize;
+	void *clusterData = malloc(max(clusterSize, PACK_MAX_SIZE));
+	
+	//external (real) to internal (fake/the FileSys)
+	lockFile(dest, true);
+	if (stat(source.c_str(), &info) == 0 && !S_ISREG(info.st_mode)) {
+		//a pipe, socket or device (/dev/stdin, say); it can't be sized up front
+		in = open(source.c_str(), O_RDONLY);
+		if (in != -1) {
+			ret = importStream(in, dest, &size);
+			close(in);
+		}
+	} else {
+		outerFile = fopen(source.c_str(), "r");
+	}
+	if (outerFile != NULL) {
+		fseek(outerFile, 0, SEEK_END);
+		size = ftell(outerFile);
+		fseek(outerFile, 0, SEEK_SET);
+		small = size <= PACK_MAX_SIZE && dest.size() < SMALL_NAME_SIZE;
+		wanted = size / clusterSize + 1;
+		if (small) {
+			//read before taking the metadata lock; it's stored under it
+			size = fread(clusterData, 1, size, outerFile);
+		}
+
+		pthread_rwlock_wrlock(&metaLock);
+		removeFileEntry(dest); //if dest already exists, delete/overwrite
+		index = createFileEntry(dest, small, wanted);
+		if (index >= 0 && small) {
+			ret = storeSmall(index, clusterData, size);
+			if (ret != 0) {
+				removeFile(index);
+			}
+		} else if (index >= 0) {
+			cluster = directoryTable[index].index;
+		}
+		pthread_rwlock_unlock(&metaLock);
+
+		if (index >= 0 && !small) {
+			while (!feof(outerFile) && cluster != 0xFFFF) {
+				length = fread(clusterData, 1, clusterSize, outerFile);
+				writeCluster(cluster, clusterData, length);
+
+				if (!feof(outerFile)) {
+					wanted--;
+					cluster = appendCluster(dest, cluster, wanted);
+				}
+			}
+
+			//the entry may have moved while the metadata lock was let go
+			pthread_rwlock_wrlock(&metaLock);
+			index = findIndexForFile(dest);
+			if (!feof(outerFile)) {
+				//OH SHIT, outta room baby!
+				//undo all the changes
+				removeFile(index);
+				ret = -2;
+			} else {
+				directoryTable[index].size = size;
+				writeFAT(fileAllocationTable, boot->FAT);
+				writeDirectoryTable(&directoryTable, boot->rootDir);
+				ret = 0;
+			}
+			pthread_rwlock_unlock(&metaLock);
+		} else if (index < 0) {
+			ret = index;
+		}
+		fclose(outerFile);
+	}
+	unlockFile(dest);
+
+	free(clusterData);
+
+	return ret;
+}
+
+/**
+ * Imports whatever comes in on a host file descriptor, to its end, as a
+ * file: a pipe, a socket or stdin, anything that can't be sized up front
+ * (see importStream()). Replaces dest if it exists.
+ *
+ * @param in where to read from
+ * @param dest name for the file in the file system
+ * @return int the file's size once imported; -1 if error, -2 if out of
+ *         clusters (in either case nothing is left of the file)
+ */
+int FileSys::importFile(int in, string dest) {
+	PROFILE(&profiler, OP_COPY);
+	TraceCall traced(tracer, OP_COPY, 0);
+	traced.copying("", false, true);
+	int ret;
+	unsigned int size = 0;
+
+	lockFile(dest, true);
+	ret = importStream(in, dest, &size);
+	unlockFile(dest);
+	ret = (ret == 0) ? size : ret;
+
+	traced.set(-1, size, -1, TRACE_DEST_IN);
+	traced.done(ret, "", dest);
+	return ret;
+}
+
+/**
+ * Streams a host file descriptor into a new file, taking clusters as the
+ * data arrives. Reads are double-buffered with write-behind: while a
+ * writer thread writes one IMPORT_BUFFER_SIZE buffer to the volume, the
+ * next is read into the other, so a pipe is drained as fast as the volume
+ * takes it. The size is only set once the end is reached; if the volume
+ * fills up (or a read fails) the file is removed again, its clusters with
+ * it. As for copyFileExtToIn(), a file that turns out to be small is
+ * stored as one.
+ *
+ * Should NEVER be called without holding dest's lock for writing.
+ *
+ * @param in where to read from
+ * @param dest name for the file in the file system
+ * @param size pointer to store the number of bytes read in
+ * @return int 0 if imported; -1 if error, -2 if out of clusters
+ */
+int FileSys::importStream(int in, string dest, unsigned int *size) {
+	int ret = 0;
+	int index;
+	int length;
+	int current;
+	bool ended;
+	bool small = false;
+	bool failed = false;
+	bool writing = false;
+	int clusterSize = boot->clusterSize;
+	int chunk = max(clusterSize, IMPORT_BUFFER_SIZE / clusterSize * clusterSize);
+	ImportStream stream;
+	pthread_t writer;
+
+	stream.fs = this;
+	stream.name = dest;
+	stream.buffers[0] = (char*)malloc(chunk);
+	stream.buffers[1] = NULL; //only wanted if there's more than one buffer's worth
+	stream.pending = -1;
+	stream.done = false;
+	stream.started = false;
+	stream.result = 0;
+	pthread_mutex_init(&stream.lock, NULL);
+	pthread_cond_init(&stream.changed, NULL);
+
+	//a bigger pipe hands over more per read(), with fewer trips between the
+	//writer and here; fails harmlessly if in isn't a pipe
+	fcntl(in, F_SETPIPE_SZ, IMPORT_BUFFER_SIZE);
+
+	//the first buffer's worth says if it's small, and where it should go
+	length = readStream(in, stream.buffers[0], chunk);
+	ended = length < chunk;
+	*size = max(length, 0);
+	if (length < 0) {
+		ret = -1;
+	} else {
+		small = ended && length <= PACK_MAX_SIZE && dest.size() < SMALL_NAME_SIZE;
+		pthread_rwlock_wrlock(&metaLock);
+		removeFileEntry(dest); //if dest already exists, delete/overwrite
+		index = createFileEntry(dest, small, ended ? length / clusterSize + 1
+												: 2 * chunk / clusterSize);
+		if (index >= 0 && small) {
+			ret = storeSmall(index, stream.buffers[0], length);
+			if (ret != 0) {
+				removeFile(index);
+			}
+		} else if (index >= 0) {
+			stream.cluster = directoryTable[index].index;
+		} else {
+			ret = index;
+		}
+		pthread_rwlock_unlock(&metaLock);
+	}
+
+	if (ret == 0 && !small) {
+		stream.lengths[0] = length;
+		if (ended) {
+			//all in the one buffer; nothing to read behind it
+			ret = writeImport(&stream, 0);
+		} else {
+			stream.buffers[1] = (char*)malloc(chunk);
+			stream.pending = 0;
+			writing = pthread_create(&writer, NULL, importWriter, &stream) == 0;
+			ret = writing ? 0 : -1;
+		}
+		for (current = 1; !ended && !failed && ret == 0; current ^= 1) {
+			length = readStream(in, stream.buffers[current], chunk);
+			ended = length < chunk;
+			if (length < 0) {
+				ret = -1;
+			} else {
+				*size += length;
+			}
+			//hand it over as soon as the writer's done with the other one
+			pthread_mutex_lock(&stream.lock);
+			while (stream.pending != -1) {
+				pthread_cond_wait(&stream.changed, &stream.lock);
+			}
+			if (length > 0) {
+				stream.lengths[current] = length;
+				stream.pending = current;
+				pthread_cond_broadcast(&stream.changed);
+			}
+			failed = stream.result != 0;
+			pthread_mutex_unlock(&stream.lock);
+		}
+		if (writing) {
+			pthread_mutex_lock(&stream.lock);
+			while (stream.pending != -1) {
+				pthread_cond_wait(&stream.changed, &stream.lock);
+			}
+			stream.done = true;
+			pthread_cond_broadcast(&stream.changed);
+			pthread_mutex_unlock(&stream.lock);
+			pthread_join(writer, NULL);
+		}
+		ret = (ret == 0) ? stream.result : ret;
+		if (ret == 0 && *size > 0 && *size % clusterSize == 0) {
+			//a file a whole number of clusters long still has one past its
+			//end, as everywhere else (size / clusterSize + 1)
+			stream.cluster = appendCluster(dest, stream.cluster, 1);
+			ret = (stream.cluster == 0xFFFF) ? -2 : 0;
+		}
+
+		//the entry may have moved while the metadata lock was let go
+		pthread_rwlock_wrlock(&metaLock);
+		index = findIndexForFile(dest);
+		if (ret != 0) {
+			//out of room, or the read failed: undo all the changes
+			removeFile(index);
+		} else {
+			directoryTable[index].size = *size;
+			writeFAT(fileAllocationTable, boot->FAT);
+			writeDirectoryTable(&directoryTable, boot->rootDir);
+		}
+		pthread_rwlock_unlock(&metaLock);
+	}
+
+	pthread_cond_destroy(&stream.changed);
+	pthread_mutex_destroy(&stream.lock);
+	free(stream.buffers[0]);
+	free(stream.buffers[1]);
+
+	return ret;
+}
+
+/**
+ * The write-behind half of importStream(): writes each buffer it's handed
+ * to the end of the file as it comes, until told there are no more.
+ *
+ * @param arg the ImportStream
+ * @return NULL
+ */
+void *FileSys::importWriter(void *arg) {
+	ImportStream *stream = (ImportStream*)arg;
+	int buffer;
+	int result;
+
+	pthread_mutex_lock(&stream->lock);
+	while (!stream->done || stream->pending != -1) {
+		if (stream->pending == -1) {
+			pthread_cond_wait(&stream->changed, &stream->lock);
+		} else {
+			buffer = stream->pending;
+			result = stream->result;
+			pthread_mutex_unlock(&stream->lock);
+			if (result == 0) {
+				result = stream->fs->writeImport(stream, buffer);
+			}
+			pthread_mutex_lock(&stream->lock);
+			stream->result = result;
+			stream->pending = -1;
+			pthread_cond_broadcast(&stream->changed);
+		}
+	}
+	pthread_mutex_unlock(&stream->lock);
+
+	return NULL;
+}
+
+/**
+ * Writes one of a streaming import's buffers to the end of the file:
+ * takes the clusters it needs first (asking for a run as long again, as
+ * more is likely to follow), then writes each run of consecutive ones in
+ * one go.
+ *
+ * Should NEVER be called but by importWriter().
+ *
+ * @param stream the import
+ * @param buffer which of its buffers
+ * @return int 0 if written; -2 if out of clusters
+ */
+int FileSys::writeImport(ImportStream *stream, int buffer) {
+	int ret = 0;
+	int i;
+	int run;
+	int clusterSize = boot->clusterSize;
+	int length = stream->lengths[buffer];
+	int count = (length + clusterSize - 1) / clusterSize;
+	vector<int> clusters;
+
+	for (i = 0; i < count && ret == 0; i++) {
+		if (stream->started) {
+			stream->cluster = appendCluster(stream->name, stream->cluster, 2 * count - i);
+		}
+		stream->started = true;
+		if (stream->cluster == 0xFFFF) {
+			ret = -2;
+		} else {
+			clusters.push_back(stream->cluster);
+		}
+	}
+
+	for (i = 0; i < count && ret == 0; i += run) {
+		for (run = 1; i + run < count && clusters[i + run] == clusters[i] + run; run++);
+		writeAt(stream->buffers[buffer] + i * clusterSize,
+				min(run * clusterSize, length - i * clusterSize),
+				(off_t)clusterSize * clusters[i]);
+	}
+
+	return ret;
+}
+
+/**
+ * Reads from a host file descriptor until the buffer's full or the end.
+ *
+ * @param in where to read from
+ * @param buf where to store it
+ * @param length the most bytes to read
+ * @return int the number of bytes read; less than length only at the
+ *         end; -1 if a read failed
+ */
+int FileSys::readStream(int in, char *buf, int length) {
+	int ret = 0;
+	int n = 1;
+
+	while (ret < length && n > 0) {
+		n = read(in, buf + ret, length - ret);
+		if (n > 0) {
+			ret += n;
+		} else if (n < 0 && errno == EINTR) {
+			n = 1;
+		} else if (n < 0) {
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * A sub-component of the "cp" functionality of the filesystem.
+ *
+ * Copies an internal file of the filesystem to the filesystem. Basically
+ * iterates through all the clusters of a file and copies them to the next
+ * available cluster.
+ *
+ * Should NEVER be called by anything other than copyFile()
+ *
+ * @param source string containing the name of the source file
+ * @param dest string containing the name of the destination file
+ * @return int -1 if error, -2 if out of clusters, 0 otherwise
+ */
+int FileSys::copyFileInternally(string source, string dest) {
+	int ret = -1;
+	int i;
+	int destIndex;
+	int destCluster;
+	unsigned int size;
+	bool small;
+	vector<int> sourceClusters;
+	int clusterSize = boot->clusterSize;
+	void *clusterData = malloc(max(clusterSize, PACK_MAX_SIZE));
+
+	lockFiles(source, dest);
+	if (readFileChain(source, &sourceClusters, &size, clusterData) == 0) {
+		//small files stay small, if the new name is short enough
+		small = sourceClusters.empty() && dest.size() < SMALL_NAME_SIZE;
+		pthread_rwlock_wrlock(&metaLock);
+		removeFileEntry(dest); //if dest already exists, delete/overwrite
+		destIndex = createFileEntry(dest, small, max((int)sourceClusters.size(), 1));
+		if (destIndex >= 0 && small) {
+			ret = storeSmall(destIndex, clusterData, size);
+			if (ret != 0) {
+				removeFile(destIndex);
+			}
+		} else if (destIndex >= 0 && sourceClusters.empty()) {
+			//small source, long name: an ordinary one-cluster file
+			writeCluster(directoryTable[destIndex].index, clusterData, size);
+			directoryTable[destIndex].size = size;
+			writeDirectoryTable(&directoryTable, boot->rootDir);
+			ret = 0;
+		} else if (destIndex >= 0) {
+			destCluster = directoryTable[destIndex].index;
+		}
+		pthread_rwlock_unlock(&metaLock);
+
+		if (destIndex >= 0 && !sourceClusters.empty()) {
+			for (i = 0; i < sourceClusters.size() && destCluster != 0xFFFF; i++) {
+				readCluster(sourceClusters[i], clusterData, clusterSize);
+				writeCluster(destCluster, clusterData, clusterSize);
+
+				if (i + 1 < sourceClusters.size()) {
+					destCluster = appendCluster(dest, destCluster, sourceClusters.size() - i - 1);
+				}
+			}
+
+			pthread_rwlock_wrlock(&metaLock);
+			destIndex = findIndexForFile(dest);
+			if (destCluster == 0xFFFF) {
+				//OH SHIT, outta room baby!
+				//undo all the changes
+				removeFile(destIndex);
+				ret = -2;
+			} else {
+				directoryTable[destIndex].size = size;
+				writeFAT(fileAllocationTable, boot->FAT);
+				writeDirectoryTable(&directoryTable, boot->rootDir);
+				ret = 0;
+			}
+			pthread_rwlock_unlock(&metaLock);
+		} else if (destIndex < 0) {
+			ret = destIndex;
+		}
+	}
+	unlockFiles(source, dest);
+
+	free(clusterData);
+	
+	return ret;
+}
+
+/**
+ * Copies a file from another open file system into this one, image to
+ * image, without it passing through the host as a file: clusters are
+ * taken here for the whole file, then each run that's consecutive in both
+ * is copied in one go (see copyAt()). The two can have different cluster
+ * sizes. Small files are read and stored as they would be by copyFile().
+ * Replaces dest if it exists.
+ *
+ * @param from the file system to copy from; can be this one
+ * @param source string containing the name of the file in from
+ * @param dest string containing the name to give it here; "" (or ending
+ *        in '/') for the same name
+ * @return int -1 if error, -2 if out of clusters (nothing is left of
+ *         dest), 0 otherwise
+ */
+int FileSys::copyFileFrom(FileSys *from, string source, string dest) {
+	PROFILE(&profiler, OP_COPY);
+	TraceCall traced(tracer, OP_COPY, 0);
+	traced.copying(source, from == this, true);
+	int ret = -1;
+	unsigned int size = 0;
+
+	if (dest.empty() || dest[dest.size()-1] == '/') {
+		dest.append(source);
+	}
+	if (from == this) {
+		ret = copyFile(source, dest, true, true);
+	} else if (!source.empty()) {
+		//always in the same order, or two copies going opposite ways could
+		//each hold the lock the other wants
+		if (from < this) {
+			from->lockFile(source, false);
+			lockFile(dest, true);
+		} else {
+			lockFile(dest, true);
+			from->lockFile(source, false);
+		}
+		ret = transferFrom(from, source, dest, &size);
+		from->unlockFile(source);
+		unlockFile(dest);
+		traced.set(-1, size, -1, TRACE_DEST_IN);
+	}
+
+	traced.done(ret, source, dest);
+	return ret;
+}
+
+/**
+ * Moves a file from another open file system into this one: copies it
+ * (see copyFileFrom()), then removes it from the other.
+ *
+ * @param from the file system to move from; can be this one
+ * @param source string containing the name of the file in from
+ * @param dest string containing the name to give it here; "" (or ending
+ *        in '/') for the same name
+ * @return int -1 if error, -2 if out of clusters (the source is kept), 0
+ *         otherwise
+ */
+int FileSys::moveFileFrom(FileSys *from, string source, string dest) {
+	PROFILE(&profiler, OP_MOVE);
+	TraceCall traced(tracer, OP_MOVE, 0);
+	traced.copying(source, from == this, true);
+	int ret;
+
+	if (from == this) {
+		ret = moveFile(source, dest, true, true);
+	} else {
+		ret = copyFileFrom(from, source, dest);
+		if (ret >= 0) {
+			ret = from->removeFile(source);
+		}
+	}
+
+	traced.done(ret, source, dest);
+	return ret;
+}
+
+/**
+ * The copying half of copyFileFrom().
+ *
+ * Should NEVER be called by anything other than copyFileFrom(), which
+ * holds both files' locks.
+ *
+ * @param from the file system to copy from; not this one
+ * @param source string containing the name of the file in from
+ * @param dest string containing the name to give it here
+ * @param size pointer to store the file's size in
+ * @return int -1 if error, -2 if out of clusters, 0 otherwise
+ */
+int FileSys::transferFrom(FileSys *from, string source, string dest, unsigned int *size) {
+	int ret = -1;
+	int i;
+	int j;
+	int index;
+	int count;
+	int cluster;
+	int length;
+	int run;
+	int done;
+	bool small;
+	bool ranging = true;
+	int clusterSize = boot->clusterSize;
+	int fromSize = from->boot->clusterSize;
+	vector<int> sourceClusters;
+	vector<int> clusters;
+	void *smallData = malloc(PACK_MAX_SIZE);
+
+	if (from->readFileChain(source, &sourceClusters, size, smallData) == 0) {
+		small = sourceClusters.empty() && dest.size() < SMALL_NAME_SIZE;
+		count = *size / clusterSize + 1;
+		pthread_rwlock_wrlock(&metaLock);
+		removeFileEntry(dest); //if dest already exists, delete/overwrite
+		index = createFileEntry(dest, small, count);
+		if (index >= 0 && small) {
+			ret = storeSmall(index, smallData, *size);
+			if (ret != 0) {
+				removeFile(index);
+			}
+		} else if (index >= 0) {
+			cluster = directoryTable[index].index;
+			ret = 0;
+		} else {
+			ret = index;
+		}
+		pthread_rwlock_unlock(&metaLock);
+
+		if (ret == 0 && !small) {
+			clusters.push_back(cluster);
+			for (i = 1; i < count && cluster != 0xFFFF; i++) {
+				cluster = appendCluster(dest, cluster, count - i);
+				clusters.push_back(cluster);
+			}
+			if (cluster == 0xFFFF) {
+				ret = -2;
+			} else if (sourceClusters.empty()) {
+				//small source, long name: an ordinary one-cluster file
+				writeCluster(clusters[0], smallData, *size);
+			}
+
+			//walk both files' clusters together, a run at a time
+			for (done = 0; done < *size && !sourceClusters.empty() && ret == 0; done += length) {
+				i = done / fromSize;
+				j = done / clusterSize;
+				for (run = 1; i + run < sourceClusters.size()
+						&& sourceClusters[i + run] == sourceClusters[i] + run; run++);
+				length = run * fromSize - done % fromSize;
+				for (run = 1; j + run < clusters.size()
+						&& clusters[j + run] == clusters[j] + run; run++);
+				length = min(length, min(run * clusterSize - done % clusterSize,
+											(int)*size - done));
+				if (copyAt(from, (off_t)fromSize * sourceClusters[i] + done % fromSize,
+							length, (off_t)clusterSize * clusters[j] + done % clusterSize,
+							&ranging) != length) {
+					ret = -1;
+				}
+			}
+
+			//the entry may have moved while the metadata lock was let go
+			pthread_rwlock_wrlock(&metaLock);
+			index = findIndexForFile(dest);
+			if (ret != 0) {
+				//out of room, or the copy failed: undo all the changes
+				removeFile(index);
+			} else {
+				directoryTable[index].size = *size;
+				writeFAT(fileAllocationTable, boot->FAT);
+				writeDirectoryTable(&directoryTable, boot->rootDir);
+			}
+			pthread_rwlock_unlock(&metaLock);
+		}
+	}
+
+	free(smallData);
+
+	return ret;
+}
+
+/**
+ * The "mv" functionality of the filesystem.
+ *
+ * Removes destination if it exists, then passes all parameters onto copyFile() 
+ * then removes the source file
+ *
+ * @param source string containing file to be copied
+ * @param dest string containing destination of file
+ * @param sourceInFileSys boolean indicating if source is local (in FileSys)
+ * @param destInFileSys boolean indicating if dest is local (in FileSys)
+ * @return int -1 if error, -2 if out of clusters, 0 otherwise
+ */ 
+int FileSys::moveFile(string source, string dest, 
+						bool sourceInFileSys, bool destInFileSys) {
+	PROFILE(&profiler, OP_MOVE);
+	TraceCall traced(tracer, OP_MOVE, 0);
+	traced.copying(source, sourceInFileSys, destInFileSys);
+	int ret = -1;
+	if (source != dest) {
+		ret = copyFile(source, dest, sourceInFileSys, destInFileSys);
+		if (ret >= 0) {
+			if (sourceInFileSys) {
+				ret = removeFile(source);
+			} else {
+				ret = remove(source.c_str());
+			}
+		}
+	}
+
+	traced.done(ret, source, dest);
+	return ret;
+}
+
+/**
+ * The "rm" functionality of the filesystem.
+ *
+ * Finds the index inside the directory table of a file
+ * given by it's file name. Can handle wildcard "*" name.
+ *
+ * @param name string containing name of the file to be removed
+ * @return int 0 if (all) removed successfully, -1 otherwise
+ */
+int FileSys::removeFile(string name) {
+	PROFILE(&profiler, OP_REMOVE);
+	TraceCall traced(tracer, OP_REMOVE, 0);
+	int ret;
+
+	if (name == "*") {
+		lockAll();
+		ret = removeFileEntry(name);
+		unlockAll();
+	} else {
+		lockFile(name, true);
+		pthread_rwlock_wrlock(&metaLock);
+		ret = removeFileEntry(name);
+		pthread_rwlock_unlock(&metaLock);
+		unlockFile(name);
+	}
+
+	traced.done(ret, name, "");
+	return ret;
+}
+
+/**
+ * The background "rm" functionality of the filesystem, by name.
+ *
+ * Should NEVER be called without holding the file's lock (every file's
+ * lock for "*") and the metadata lock for writing.
+ *
+ * @param name string containing name of the file to be removed
+ * @return int 0 if (all) removed successfully, -1 otherwise
+ */
+int FileSys::removeFileEntry(string name) {
+	int ret = readOnly ? -1 : 0;
+	int i;
+	int index = -1;
+	for (i = directoryTable.size()-1; i >= 0 && !readOnly && (name == "*" || index == -1); i--) {
+		if (directoryTable[i].name == name ||
+			(name == "*" && (directoryTable[i].name[0] != (char)0x00 
+					&& directoryTable[i].name[0] != (char)0xFF
+					&& directoryTable[i].name[0] != (char)0xFE))) {
+			index = i;
+			if (removeFile(index) == -1) {
+				ret = -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * The background "rm" functionality of the filesystem.
+ *
+ * Removes a file by setting the first byte of the file name to the
+ * pending flag (0xFE). The file is gone from then on, but its clusters
+ * are left for the reclaimer thread to free, so this takes the same time
+ * however big the file is. Small files have no clusters to wait for, so
+ * they're freed there and then.
+ *
+ * Should NEVER be called by anything other than removeFileEntry() or
+ * the copy functions (while holding the metadata lock for writing).
+ *
+ * @param index the index of the entry in the directory table to be removed
+ * @return int 0 if removed successfully, -1 otherwise
+ */
+int FileSys::removeFile(int index) {
+	int ret = -1;
+	if (index != -1 && isSmall(index)) {
+		freeFile(index);
+		memset(&directoryTable[index], 0, sizeof(DirectoryTableEntry));
+		writeFAT(fileAllocationTable, boot->FAT);
+		writeDirectoryTable(&directoryTable, boot->rootDir);
+		ret = 0;
+	} else if (index != -1) {
+		directoryTable[index].name[0] = 0xFE;
+		pendingFiles++;
+		pendingClusters += directoryTable[index].size / boot->clusterSize + 1;
+		writeDirectoryTable(&directoryTable, boot->rootDir);
+
+		pthread_mutex_lock(&reclaimLock);
+		reclaimWork = true;
+		pthread_cond_signal(&reclaimWake);
+		pthread_mutex_unlock(&reclaimLock);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * The "df" functionality of the filesystem.
+ *
+ * Fills in the structure of the filesystem and how much of it is used
+ *
+ * @param stats pointer to the stats to fill in
+ * @return int 0
+ */
+int FileSys::getStats(FileSysStats *stats) {
+	PROFILE(&profiler, OP_DF);
+	TraceCall traced(tracer, OP_DF, 0);
+	int i;
+
+	pthread_rwlock_wrlock(&metaLock);
+	findUsedClusterCount();
+	stats->inlineFiles = 0;
+	stats->packedFiles = 0;
+	stats->directoryFiles = 0;
+	stats->directoryHoles = 0;
+	for (i = 0; i < directoryTable.size(); i++) {
+		if (directoryTable[i].name[0] != (char)0x00 && directoryTable[i].name[0] != (char)0xFF) {
+			stats->inlineFiles += (directoryTable[i].type == TYPE_INLINE) ? 1 : 0;
+			stats->packedFiles += (directoryTable[i].type == TYPE_PACKED) ? 1 : 0;
+		}
+		if (directoryTable[i].name[0] != (char)0x00 && directoryTable[i].name[0] != (char)0xFF
+			&& directoryTable[i].name[0] != (char)0xFE) {
+			//every empty slot seen so far is before this file
+			stats->directoryHoles = i - stats->directoryFiles;
+			stats->directoryFiles++;
+		}
+	}
+	stats->directoryEntries = directoryTable.size();
+	stats->packClusters = packSlots.size();
+	stats->name = sysName;
+	stats->size = boot->size;
+	stats->clusterSize = boot->clusterSize;
+	stats->clusters = numClusters;
+	stats->usedClusters = usedClusters;
+	stats->availableClusters = numClusters - usedClusters - heldClusters;
+	stats->extents = usingExtents;
+	stats->allocator = allocator->getPolicy();
+	stats->fatClusters = boot->rootDir - boot->FAT;
+	stats->fatMemory = numClusters * sizeof(int);
+	stats->pendingClusters = pendingClusters;
+	stats->pendingFiles = pendingFiles;
+	stats->discarding = discarding;
+	stats->heldClusters = heldClusters;
+	stats->snapshots = snapshots.size();
+	stats->readOnly = readOnly;
+	stats->stripeMembers = memberCount();
+	stats->stripeUnit = stripeUnit;
+	pthread_rwlock_unlock(&metaLock);
+	stats->hostAllocated = getHostAllocated();
+
+	traced.done(0, "", "");
+	return 0;
+}
+
+/**
+ * Copies the File Allocation Table (FAT) as it is now.
+ *
+ * A cluster's value is 0 if it's free, 0xFFFF if it ends a chain, one of
+ * the markers from PACK_CLUSTER up if it's used some other way, and
+ * otherwise the next cluster in its chain.
+ *
+ * @param fat pointer to vector to store the FAT in, one value per cluster
+ * @return int the number of clusters
+ */
+int FileSys::getFAT(vector<int> *fat) {
+	PROFILE(&profiler, OP_LIST);
+	TraceCall traced(tracer, OP_LIST, TRACE_LIST_FAT);
+	pthread_rwlock_rdlock(&metaLock);
+	fat->assign(fileAllocationTable, fileAllocationTable + numClusters);
+	pthread_rwlock_unlock(&metaLock);
+
+	traced.done(fat->size(), "", "");
+	return fat->size();
+}
+
+/**
+ * The "ls" functionality of the filesystem.
+ *
+ * Lists every file that's neither free nor deleted, in directory order.
+ *
+ * @param entries pointer to vector to store the files in
+ * @return int the number of files
+ */
+int FileSys::listEntries(vector<FileInfo> *entries) {
+	PROFILE(&profiler, OP_LIST);
+	TraceCall traced(tracer, OP_LIST, TRACE_LIST_ENTRIES);
+	int i;
+	FileInfo info;
+
+	entries->clear();
+	pthread_rwlock_rdlock(&metaLock);
+	for (i = 0; i < directoryTable.size(); i++) {
+		if (directoryTable[i].name[0] != (char)0x00 && directoryTable[i].name[0] != (char)0xFF
+			&& directoryTable[i].name[0] != (char)0xFE) {
+			info.name = directoryTable[i].name;
+			info.entry = i;
+			info.index = directoryTable[i].index;
+			info.size = directoryTable[i].size;
+			info.type = directoryTable[i].type;
+			info.created = directoryTable[i].creation;
+			entries->push_back(info);
+		}
+	}
+	pthread_rwlock_unlock(&metaLock);
+
+	traced.done(entries->size(), "", "");
+	return entries->size();
+}
+
+/**
+ * Copies the operation counters (see Profiler): calls, system calls,
+ * bytes and clusters scanned, and latency histograms for every public
+ * operation and the hot paths under them.
+ *
+ * @param stats pointer to vector to store them in, indexed by OP_*
+ * @return int the number of operations; all zeros if built with FS_NO_STATS
+ */
+int FileSys::getOpStats(vector<OpStats> *stats) {
+	return profiler.getStats(stats);
+}
+
+/**
+ * The operation counters, ready to show (see Profiler::format()).
+ *
+ * @param json true for JSON, false for a table
+ * @return string the counters of every operation called since the last reset
+ */
+string FileSys::formatOpStats(bool json) {
+	return profiler.format(json);
+}
+
+/**
+ * Zeroes the operation counters.
+ */
+void FileSys::resetOpStats() {
+	profiler.reset();
+}
+
+/**
+ * Starts recording every call made to the file system (see Tracer) to a
+ * trace file, for Tracer::replay() to make again later. Only calls from
+ * outside are recorded, not the ones they make themselves. Should be
+ * started and stopped between calls, not while other threads are making
+ * them.
+ *
+ * @param path the trace file; overwritten
+ * @return int 0 if tracing; -1 if already tracing or path couldn't be written
+ */
+int FileSys::startTrace(string path) {
+	int ret = -1;
+	TraceHeader traceHeader;
+
+	if (tracer == NULL && boot != NULL) {
+		memset(&traceHeader, 0, sizeof(TraceHeader));
+		pthread_rwlock_rdlock(&metaLock);
+		traceHeader.size = boot->size;
+		traceHeader.clusterSize = boot->clusterSize;
+		traceHeader.flags = header.flags;
+		traceHeader.allocator = allocator->getPolicy();
+		pthread_rwlock_unlock(&metaLock);
+
+		tracer = new Tracer();
+		ret = tracer->start(path, &traceHeader);
+		if (ret != 0) {
+			delete tracer;
+			tracer = NULL;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Stops tracing, writing out the rest of the trace.
+ *
+ * @return long long the number of calls recorded; -1 if not tracing, or
+ *         if some of the trace couldn't be written
+ */
+long long FileSys::stopTrace() {
+	long long ret = -1;
+
+	if (tracer != NULL) {
+		ret = tracer->getRecords();
+		if (tracer->stop() != 0) {
+			ret = -1;
+		}
+		delete tracer;
+		tracer = NULL;
+	}
+
+	return ret;
+}
+
+/**
+ * @return bool true if every call is being recorded (see startTrace())
+ */
+bool FileSys::isTracing() {
+	return tracer != NULL;
+}
+
+/**
+ * Opens a file and hands back a handle to it, for reading and writing
+ * any part of the file with readFile()/writeFile() and friends.
+ *
+ * A handle should only be used by one thread at a time; any number of
+ * handles (on the same file or not) can be used at once.
+ *
+ * @param name string containing name of the file
+ * @param flags FS_READ, FS_WRITE, FS_CREATE, FS_TRUNCATE and/or FS_APPEND
+ * @return int the handle; -1 if the file doesn't exist or too many are open,
+ *         -2 if it had to be created and there was no room
+ */
+int FileSys::openFile(string name, int flags) {
+	PROFILE(&profiler, OP_OPEN);
+	TraceCall traced(tracer, OP_OPEN, 0);
+	traced.set(-1, 0, -1, flags);
+	int ret = -1;
+	int i;
+	int index;
+	FileHandle *h;
+
+	lockFile(name, (flags & FS_CREATE) != 0);
+	if (flags & FS_CREATE) {
+		pthread_rwlock_wrlock(&metaLock);
+	} else {
+		pthread_rwlock_rdlock(&metaLock);
+	}
+	index = findIndexForFile(name);
+	if (readOnly && (flags & (FS_WRITE | FS_CREATE | FS_TRUNCATE))) {
+		//a mounted snapshot can only be read
+		index = -1;
+	} else if (index == -1 && (flags & FS_CREATE)) {
+		index = createFileEntry(name, true, 1);
+		ret = (index == -2) ? -2 : -1;
+	}
+	pthread_rwlock_unlock(&metaLock);
+	unlockFile(name);
+
+	if (index >= 0) {
+		h = new FileHandle();
+		h->name = name;
+		h->flags = flags;
+		h->entry = index;
+		h->offset = 0;
+
+		pthread_mutex_lock(&handleLock);
+		for (i = 0; i < MAX_OPEN_FILES && ret < 0; i++) {
+			if (handles[i] == NULL) {
+				handles[i] = h;
+				ret = i;
+			}
+		}
+		pthread_mutex_unlock(&handleLock);
+
+		if (ret < 0) {
+			delete h;
+		} else if ((flags & FS_TRUNCATE) && (flags & FS_WRITE)) {
+			truncateFile(ret, 0);
+		}
+	}
+
+	traced.done(ret, name, "");
+	return ret;
+}
+
+/**
+ * Reads from the handle's current position and moves it past what was read.
+ *
+ * @param handle the handle, from openFile()
+ * @param buf where to store what's read
+ * @param length the most bytes to read
+ * @return int the number of bytes read (0 at the end of the file); -1 if error
+ */
+int FileSys::readFile(int handle, void *buf, int length) {
+	TraceCall traced(tracer, OP_READ, TRACE_AT_POSITION);
+	traced.set(handle, length, -1, 0);
+	int ret = -1;
+	FileHandle *h = getHandle(handle);
+
+	if (h != NULL) {
+		ret = readFileAt(handle, buf, length, h->offset);
+		if (ret > 0) {
+			h->offset += ret;
+		}
+	}
+
+	traced.done(ret, "", "");
+	return ret;
+}
+
+/**
+ * Reads from anywhere in a file. Doesn't move the handle's position.
+ *
+ * @param handle the handle, from openFile()
+ * @param buf where to store what's read
+ * @param length the most bytes to read
+ * @param offset where in the file to start reading
+ * @return int the number of bytes read (0 at the end of the file); -1 if error
+ */
+int FileSys::readFileAt(int handle, void *buf, int length, int offset) {
+	PROFILE(&profiler, OP_READ);
+	TraceCall traced(tracer, OP_READ, TRACE_AT_OFFSET);
+	traced.set(handle, length, offset, 0);
+	int ret = -1;
+	FileHandle *h = getHandle(handle);
+
+	if (h != NULL && (h->flags & FS_READ) && offset >= 0 && length >= 0) {
+		lockFile(h->name, false);
+		ret = readHandle(h, buf, length, offset);
+		unlockFile(h->name);
+	}
+
+	traced.done(ret, "", "");
+	return ret;
+}
+
+/**
+ * Sends a file from the handle's current position to a host file
+ * descriptor (a pipe into another program, say), and moves the position
+ * past what was sent. Into a pipe the data is spliced from the image
+ * without passing through user space (see sendAt()). The file's lock is
+ * let go every PIPE_CHUNK_SIZE bytes, so a slow reader on the other end
+ * doesn't hold up writers to the file for long.
+ *
+ * @param handle the handle, from openFile()
+ * @param out where to send it; the caller should ignore SIGPIPE, as the
+ *        other end going away is just an error here
+ * @param length the most bytes to send
+ * @return int the number of bytes sent (0 at the end of the file); -1 if
+ *         error before anything could be sent
+ */
+int FileSys::sendFile(int handle, int out, int length) {
+	PROFILE(&profiler, OP_READ);
+	TraceCall traced(tracer, OP_READ, TRACE_FD);
+	traced.set(handle, length, -1, 0);
+	int ret = -1;
+	int n = 1;
+	FileHandle *h = getHandle(handle);
+
+	if (h != NULL && (h->flags & FS_READ) && length >= 0) {
+		ret = 0;
+		while (ret < length && n > 0) {
+			lockFile(h->name, false);
+			n = sendHandle(h, out, min(length - ret, PIPE_CHUNK_SIZE), h->offset);
+			unlockFile(h->name);
+			if (n > 0) {
+				h->offset += n;
+				ret += n;
+			} else if (n < 0 && ret == 0) {
+				ret = -1;
+			}
+		}
+	}
+
+	traced.set(handle, max(ret, 0), -1, 0);
+	traced.done(ret, "", "");
+	return ret;
+}
+
+/**
+ * Writes at the handle's current position (or the end of the file, for
+ * FS_APPEND handles) and moves it past what was written.
+ *
+ * @param handle the handle, from openFile()
+ * @param buf what to write
+ * @param length the number of bytes to write
+ * @return int the number of bytes written; -1 if error, -2 if out of clusters
+ */
+int FileSys::writeFile(int handle, const void *buf, int length) {
+	PROFILE(&profiler, OP_WRITE);
+	TraceCall traced(tracer, OP_WRITE, TRACE_AT_POSITION);
+	traced.set(handle, length, -1, 0);
+	int ret = -1;
+	FileHandle *h = getHandle(handle);
+
+	if (h != NULL && (h->flags & FS_WRITE) && length >= 0) {
+		lockFile(h->name, true);
+		if (h->flags & FS_APPEND) {
+			ret = writeHandle(h, buf, length, -1);
+			if (ret >= 0) {
+				h->offset = getFileSize(h->name);
+			}
+		} else {
+			ret = writeHandle(h, buf, length, h->offset);
+			if (ret >= 0) {
+				h->offset += ret;
+			}
+		}
+		unlockFile(h->name);
+	}
+
+	traced.done(ret, "", "");
+	return ret;
+}
+
+/**
+ * Writes anywhere in a file, growing it if the write goes past the end.
+ * Any gap between the old end and offset reads back as zeros. Doesn't move
+ * the handle's position.
+ *
+ * @param handle the handle, from openFile()
+ * @param buf what to write
+ * @param length the number of bytes to write
+ * @param offset where in the file to start writing
+ * @return int the number of bytes written; -1 if error, -2 if out of clusters
+ */
+int FileSys::writeFileAt(int handle, const void *buf, int length, int offset) {
+	PROFILE(&profiler, OP_WRITE);
+	TraceCall traced(tracer, OP_WRITE, TRACE_AT_OFFSET);
+	traced.set(handle, length, offset, 0);
+	int ret = -1;
+	FileHandle *h = getHandle(handle);
+
+	if (h != NULL && (h->flags & FS_WRITE) && offset >= 0 && length >= 0) {
+		lockFile(h->name, true);
+		ret = writeHandle(h, buf, length, offset);
+		unlockFile(h->name);
+	}
+
+	traced.done(ret, "", "");
+	return ret;
+}
+
+/**
+ * Writes what comes in on a host file descriptor (a pipe out of another
+ * program, say) at the handle's position, until it ends or length bytes
+ * have come, and moves the position past it. Written PIPE_CHUNK_SIZE
+ * bytes at a time with writeFile(), so it grows the file and copes with
+ * snapshots just as writing it directly would.
+ *
+ * @param handle the handle, from openFile()
+ * @param in where to read from
+ * @param length the most bytes to take
+ * @return int the number of bytes written; -1 if error, -2 if out of
+ *         clusters. What was written before an error stays written.
+ */
+int FileSys::receiveFile(int handle, int in, int length) {
+	TraceCall traced(tracer, OP_WRITE, TRACE_FD);
+	traced.set(handle, length, -1, 0);
+	int ret = -1;
+	int n = 1;
+	int filled;
+	int written = 1;
+	FileHandle *h = getHandle(handle);
+	char *buf;
+
+	if (h != NULL && (h->flags & FS_WRITE) && length >= 0) {
+		ret = 0;
+		buf = (char*)malloc(PIPE_CHUNK_SIZE);
+		while (ret < length && n > 0 && written > 0) {
+			//fill the whole buffer; a pipe hands over a page or so per read()
+			filled = 0;
+			while (filled < min(length - ret, PIPE_CHUNK_SIZE) && n > 0) {
+				n = read(in, buf + filled, min(length - ret, PIPE_CHUNK_SIZE) - filled);
+				if (n > 0) {
+					filled += n;
+				} else if (n < 0 && errno == EINTR) {
+					n = 1;
+				}
+			}
+			written = (filled > 0) ? writeFile(handle, buf, filled) : 0;
+			if (written > 0) {
+				ret += written;
+			} else if (written < 0) {
+				ret = written;
+			}
+			if (n < 0) {
+				ret = -1;
+			}
+		}
+		free(buf);
+	}
+
+	traced.set(handle, max(ret, 0), -1, 0);
+	traced.done(ret, "", "");
+	return ret;
+}
+
+/**
+ * Moves the handle's position.
+ *
+ * @param handle the handle, from openFile()
+ * @param offset where to move to, relative to whence
+ * @param whence SEEK_SET (start of file), SEEK_CUR (current position) or
+ *        SEEK_END (end of file)
+ * @return int the new position; -1 if error
+ */
+int FileSys::seekFile(int handle, int offset, int whence) {
+	PROFILE(&profiler, OP_SEEK);
+	TraceCall traced(tracer, OP_SEEK, 0);
+	traced.set(handle, 0, offset, whence);
+	int ret = -1;
+	int base = 0;
+	FileHandle *h = getHandle(handle);
+
+	if (h != NULL) {
+		if (whence == SEEK_CUR) {
+			base = h->offset;
+		} else if (whence == SEEK_END) {
+			base = getFileSize(h->name);
+		}
+		if (base >= 0 && base + offset >= 0) {
+			h->offset = base + offset;
+			ret = h->offset;
+		}
+	}
+
+	traced.done(ret, "", "");
+	return ret;
+}
+
+/**
+ * Cuts a file down, or grows it with zeros, to the given length.
+ *
+ * @param handle the handle, from openFile(); must have been opened FS_WRITE
+ * @param length the new size of the file, in bytes
+ * @return int 0 if done; -1 if error, -2 if out of clusters
+ */
+int FileSys::truncateFile(int handle, int length) {
+	PROFILE(&profiler, OP_TRUNCATE);
+	TraceCall traced(tracer, OP_TRUNCATE, 0);
+	traced.set(handle, length, -1, 0);
+	int ret = -1;
+	int entry;
+	unsigned int size;
+	int clusterSize;
+	FileHandle *h = getHandle(handle);
+
+	if (h != NULL && (h->flags & FS_WRITE) && length >= 0) {
+		clusterSize = boot->clusterSize;
+		lockFile(h->name, true);
+		pthread_rwlock_wrlock(&metaLock);
+		entry = findHandleEntry(h);
+		size = length;
+		if (entry != -1 && isSmall(entry) && length <= PACK_MAX_SIZE) {
+			ret = updateSmall(entry, NULL, 0, 0, length);
+			entry = -1;
+		} else if (entry != -1 && isSmall(entry) && unpackFile(entry) != 0) {
+			ret = -2;
+			entry = -1;
+		}
+		if (entry != -1) {
+			size = directoryTable[entry].size;
+			if (length < size) {
+				cutFile(entry, length / clusterSize + 1);
+				directoryTable[entry].size = length;
+				writeFAT(fileAllocationTable, boot->FAT);
+				writeDirectoryTable(&directoryTable, boot->rootDir);
+			}
+			ret = 0;
+		}
+		pthread_rwlock_unlock(&metaLock);
+
+		if (ret == 0 && length > size) {
+			//writing nothing at length zero-fills up to it
+			ret = writeHandle(h, NULL, 0, length);
+			ret = (ret < 0) ? ret : 0;
+		}
+		unlockFile(h->name);
+	}
+
+	traced.done(ret, "", "");
+	return ret;
+}
+
+/**
+ * Closes a handle opened with openFile().
+ *
+ * @param handle the handle
+ * @return int 0 if closed; -1 if it wasn't open
+ */
+int FileSys::closeFile(int handle) {
+	PROFILE(&profiler, OP_CLOSE);
+	TraceCall traced(tracer, OP_CLOSE, 0);
+	traced.set(handle, 0, -1, 0);
+	int ret = -1;
+
+	pthread_mutex_lock(&handleLock);
+	if (handle >= 0 && handle < MAX_OPEN_FILES && handles[handle] != NULL) {
+		delete handles[handle];
+		handles[handle] = NULL;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&handleLock);
+
+	traced.done(ret, "", "");
+	return ret;
+}
+
+/**
+ * Looks up an open handle.
+ *
+ * @param handle the handle, from openFile()
+ * @return FileHandle* the handle; NULL if it isn't open
+ */
+FileHandle *FileSys::getHandle(int handle) {
+	FileHandle *h = NULL;
+
+	pthread_mutex_lock(&handleLock);
+	if (handle >= 0 && handle < MAX_OPEN_FILES) {
+		h = handles[handle];
+	}
+	pthread_mutex_unlock(&handleLock);
+
+	return h;
+}
+
+/**
+ * Finds where a handle's file is in the directory. Entries move when files
+ * before them are removed, so the last known spot is checked first and the
+ * file is searched for by name only if it's gone.
+ *
+ * Should NEVER be called without holding the metadata lock.
+ *
+ * @param h the handle
+ * @return int index of the file in the directory table; -1 if it was removed
+ */
+int FileSys::findHandleEntry(FileHandle *h) {
+	if (h->entry < 0 || h->entry >= directoryTable.size() 
+		|| h->name != directoryTable[h->entry].name) {
+		h->entry = findIndexForFile(h->name);
+	}
+
+	return h->entry;
+}
+
+/**
+ * Finds the cluster holding the given part of a file, using the
+ * cluster index rather than walking the FAT from the start. On extent
+ * volumes the file's whole extent list is loaded into the index the
+ * first time it's needed.
+ *
+ * Should NEVER be called without holding the file's lock.
+ *
+ * @param name string containing name of the file
+ * @param first the file's first cluster
+ * @param clusterNumber which of the file's clusters (0 = first)
+ * @return int the cluster; 0xFFFF if the file isn't that long
+ */
+int FileSys::lookupCluster(string name, int first, int clusterNumber) {
+	int cluster;
+	int index;
+	vector<Extent> extents;
+	vector<ClusterRun> runs;
+
+	pthread_rwlock_rdlock(&metaLock);
+	if (!usingExtents) {
+		cluster = clusterIndex->lookup(first, clusterNumber);
+	} else {
+		cluster = clusterIndex->find(first, clusterNumber);
+		if (cluster == -1) {
+			index = findIndexForFile(name);
+			if (index != -1 && readExtents(index, &extents) == 0) {
+				indexExtents(&extents, &runs);
+				cluster = clusterIndex->load(first, &runs, clusterNumber);
+			} else {
+				cluster = 0xFFFF;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&metaLock);
+
+	return cluster;
+}
+
+/**
+ * Finds the cluster holding part of a file, to write to. A cluster a
+ * snapshot holds is never written over: the file is given a new cluster
+ * in its place (see redirectCluster()), and that's written to instead.
+ *
+ * Should NEVER be called without holding the file's lock for writing.
+ *
+ * @param h the handle
+ * @param first pointer to the file's first cluster; updated if it's replaced
+ * @param clusterNumber which of the file's clusters (0 = first)
+ * @param whole true if all of the cluster is about to be written
+ * @param moved pointer to a flag that's set if a cluster was replaced, so
+ *        the FAT and directory need writing
+ * @return int the cluster; 0xFFFF if the file isn't that long, or there
+ *         was no room for a new one
+ */
+int FileSys::writableCluster(FileHandle *h, int *first, int clusterNumber,
+								bool whole, bool *moved) {
+	int cluster = lookupCluster(h->name, *first, clusterNumber);
+	int entry;
+
+	//snapshots only come and go under every file's lock, so held can't
+	//change while this file's is held
+	if (cluster != 0xFFFF && isHeld(cluster)) {
+		pthread_rwlock_wrlock(&metaLock);
+		entry = findHandleEntry(h);
+		if (entry != -1) {
+			cluster = redirectCluster(entry, clusterNumber, cluster, whole);
+			*first = directoryTable[entry].index;
+		} else {
+			cluster = 0xFFFF;
+		}
+		if (cluster != 0xFFFF) {
+			*moved = true;
+		}
+		pthread_rwlock_unlock(&metaLock);
+	}
+
+	return cluster;
+}
+
+/**
+ * Swaps one of a file's clusters for a new one, copying what's in it
+ * across, and leaves the old one to the snapshots holding it. On chain
+ * volumes the new cluster is linked in where the old one was; on extent
+ * volumes the extent it was in is split around it.
+ *
+ * Should NEVER be called without holding the file's lock and the
+ * metadata lock, both for writing.
+ *
+ * @param entry index of the file in the directory table
+ * @param clusterNumber which of the file's clusters (0 = first)
+ * @param old the cluster being replaced
+ * @param whole true if all of the cluster is about to be written, so
+ *        there's no need to copy it
+ * @return int the new cluster; 0xFFFF if there was no room
+ */
+int FileSys::redirectCluster(int entry, int clusterNumber, int old, bool whole) {
+	int i;
+	int clusterSize = boot->clusterSize;
+	int first = directoryTable[entry].index;
+	int ret = findNextFreeCluster(old, 1);
+	char *data;
+	Extent extent;
+	vector<Extent> extents;
+	vector<Extent> split;
+
+	if (ret != 0xFFFF && !whole) {
+		data = (char*)malloc(clusterSize);
+		readCluster(old, data, clusterSize);
+		writeCluster(ret, data, clusterSize);
+		free(data);
+	}
+
+	if (ret != 0xFFFF && !usingExtents) {
+		fileAllocationTable[ret] = fileAllocationTable[old];
+		if (clusterNumber == 0) {
+			directoryTable[entry].index = ret;
+		} else {
+			fileAllocationTable[clusterIndex->lookup(first, clusterNumber - 1)] = ret;
+		}
+		releaseCluster(old);
+	} else if (ret != 0xFFFF && readExtents(entry, &extents) == 0) {
+		fileAllocationTable[ret] = EXTENT_CLUSTER;
+		for (i = 0; i < extents.size(); i++) {
+			extent = extents[i];
+			if (old >= extent.start && old < extent.start + extent.length) {
+				if (old > extent.start) {
+					extent.length = old - extents[i].start;
+					split.push_back(extent);
+				}
+				extent.start = ret;
+				extent.length = 1;
+				split.push_back(extent);
+				if (old + 1 < extents[i].start + extents[i].length) {
+					extent.start = old + 1;
+					extent.length = extents[i].start + extents[i].length - old - 1;
+					split.push_back(extent);
+				}
+			} else {
+				split.push_back(extent);
+			}
+		}
+		if (writeExtents(entry, &split) == 0) {
+			if (clusterNumber == 0) {
+				directoryTable[entry].index = ret;
+			}
+			releaseCluster(old);
+		} else {
+			releaseCluster(ret);
+			ret = 0xFFFF;
+		}
+	} else if (ret != 0xFFFF) {
+		//the extent list couldn't be read; give the new cluster back
+		releaseCluster(ret);
+		ret = 0xFFFF;
+	}
+	clusterIndex->invalidate(first);
+
+	return ret;
+}
+
+/**
+ * Whether a file is small: kept in its directory entry or in a pack
+ * cluster, with no chain or extents of its own.
+ *
+ * @param index the index of the file in the directory table
+ * @return bool true for a TYPE_INLINE or TYPE_PACKED file
+ */
+bool FileSys::isSmall(int index) {
+	return directoryTable[index].type == TYPE_INLINE
+			|| directoryTable[index].type == TYPE_PACKED;
+}
+
+/**
+ * Finds where a small file keeps its data (or its slot): the end of the
+ * name in its directory entry.
+ *
+ * @param index the index of the file in the directory table
+ * @return SmallInfo* the file's small info
+ */
+SmallInfo *FileSys::getSmallInfo(int index) {
+	return (SmallInfo*)(directoryTable[index].name + SMALL_NAME_SIZE);
+}
+
+/**
+ * Reads part of a small file, from its entry or its pack cluster.
+ *
+ * Should NEVER be called without holding the metadata lock.
+ *
+ * @param index the index of the file in the directory table
+ * @param buf where to store what's read
+ * @param length the most bytes to read
+ * @param offset where in the file to start reading
+ * @return int the number of bytes read
+ */
+int FileSys::readSmall(int index, void *buf, int length, int offset) {
+	int ret = 0;
+	unsigned int size = directoryTable[index].size;
+
+	if (offset < size) {
+		ret = min(length, (int)(size - offset));
+		if (directoryTable[index].type == TYPE_INLINE) {
+			memcpy(buf, getSmallInfo(index)->data + offset, ret);
+		} else {
+			readAt(buf, ret, (off_t)directoryTable[index].index * boot->clusterSize
+								+ getSmallInfo(index)->slot * PACK_SLOT_SIZE + offset);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Makes a file small, holding the given data: in its directory entry if
+ * it fits, otherwise in a fresh run of slots. Slots are never written
+ * over, so the old copy stays whole until the new one is in place (and a
+ * snapshot's copy stays whole for good). The file's old slots, if it was
+ * packed, are let go afterwards; a file that had clusters must have them
+ * freed by the caller, who will have kept its list of them.
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @param index the index of the file in the directory table
+ * @param buf the file's data
+ * @param size bytes of data; at most PACK_MAX_SIZE
+ * @return int 0 if stored; -2 if out of clusters for a pack cluster
+ */
+int FileSys::storeSmall(int index, const void *buf, int size) {
+	int ret = 0;
+	int cluster = 0;
+	unsigned int slot = 0;
+	int packClusters = packSlots.size();
+	bool wasPacked = directoryTable[index].type == TYPE_PACKED;
+	int oldCluster = directoryTable[index].index;
+	unsigned int oldSlot = getSmallInfo(index)->slot;
+	unsigned int oldSize = directoryTable[index].size;
+	bool fatChanged;
+
+	if (size > INLINE_DATA_SIZE) {
+		cluster = findSlots((size + PACK_SLOT_SIZE - 1) / PACK_SLOT_SIZE, &slot);
+		if (cluster == 0xFFFF) {
+			ret = -2;
+		} else {
+			writeAt(buf, size, (off_t)cluster * boot->clusterSize + slot * PACK_SLOT_SIZE);
+		}
+	}
+
+	if (ret == 0) {
+		memset(getSmallInfo(index), 0, sizeof(SmallInfo));
+		if (size > INLINE_DATA_SIZE) {
+			directoryTable[index].type = TYPE_PACKED;
+			getSmallInfo(index)->slot = slot;
+		} else {
+			directoryTable[index].type = TYPE_INLINE;
+			memcpy(getSmallInfo(index)->data, buf, size);
+		}
+		directoryTable[index].index = cluster;
+		directoryTable[index].size = size;
+
+		fatChanged = packSlots.size() != packClusters;
+		if (wasPacked && releaseSlots(oldCluster, oldSlot, oldSize)) {
+			fatChanged = true;
+		}
+		if (fatChanged) {
+			writeFAT(fileAllocationTable, boot->FAT);
+		}
+		writeDirectoryTable(&directoryTable, boot->rootDir);
+	}
+
+	return ret;
+}
+
+/**
+ * Changes part of a small file and gives it a new size; any gap is zeros.
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @param index the index of the file in the directory table
+ * @param buf what to write; can be NULL if length is 0
+ * @param length the number of bytes to write
+ * @param offset where in the file to write them
+ * @param end the file's new size; at most PACK_MAX_SIZE
+ * @return int 0 if done; -2 if out of clusters for a pack cluster
+ */
+int FileSys::updateSmall(int index, const void *buf, int length, int offset,
+							unsigned int end) {
+	int ret;
+	char *data = (char*)calloc(PACK_MAX_SIZE, 1);
+
+	readSmall(index, data, end, 0);
+	if (length > 0) {
+		memcpy(data + offset, buf, length);
+	}
+	ret = storeSmall(index, data, end);
+	free(data);
+
+	return ret;
+}
+
+/**
+ * Does the writing for writeHandle() while a file is small. A write that
+ * would take it past PACK_MAX_SIZE gives it a cluster instead (see
+ * unpackFile()) and is left for writeHandle() to do the usual way.
+ *
+ * Should NEVER be called without holding the file's lock for writing.
+ *
+ * @param h the handle
+ * @param buf what to write; can be NULL if length is 0
+ * @param length the number of bytes to write
+ * @param offset where in the file to start writing; -1 for the end
+ * @return int the number of bytes written; -1 if error, -2 if out of
+ *         clusters, -3 if the file isn't small (any more)
+ */
+int FileSys::writeSmall(FileHandle *h, const void *buf, int length, int offset) {
+	int ret = -1;
+	int entry;
+	unsigned int size;
+	unsigned int end;
+
+	pthread_rwlock_wrlock(&metaLock);
+	entry = findHandleEntry(h);
+	if (entry != -1 && !isSmall(entry)) {
+		ret = -3;
+	} else if (entry != -1) {
+		size = directoryTable[entry].size;
+		if (offset == -1) {
+			offset = size;
+		}
+		end = max(size, (unsigned int)(offset + length));
+		if (end <= PACK_MAX_SIZE) {
+			ret = updateSmall(entry, buf, length, offset, end);
+			ret = (ret == 0) ? length : ret;
+		} else {
+			ret = (unpackFile(entry) == 0) ? -3 : -2;
+		}
+	}
+	pthread_rwlock_unlock(&metaLock);
+
+	return ret;
+}
+
+/**
+ * Turns a small file into an ordinary one of one cluster, for a write
+ * that takes it past PACK_MAX_SIZE.
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @param index the index of the file in the directory table
+ * @return int 0 if done; -2 if out of clusters
+ */
+int FileSys::unpackFile(int index) {
+	int ret = -2;
+	int cluster = findNextFreeCluster();
+	char *data;
+	ExtentInfo *info;
+
+	if (cluster != 0xFFFF) {
+		data = (char*)malloc(PACK_MAX_SIZE);
+		writeCluster(cluster, data, readSmall(index, data, PACK_MAX_SIZE, 0));
+		free(data);
+
+		if (directoryTable[index].type == TYPE_PACKED) {
+			releaseSlots(directoryTable[index].index, getSmallInfo(index)->slot,
+							directoryTable[index].size);
+		}
+		memset(getSmallInfo(index), 0, sizeof(SmallInfo));
+		fileAllocationTable[cluster] = usingExtents ? EXTENT_CLUSTER : 0xFFFF;
+		directoryTable[index].index = cluster;
+		directoryTable[index].type = 0x00;
+		if (usingExtents) {
+			info = getExtentInfo(index);
+			info->count = 1;
+			info->extents[0].start = cluster;
+			info->extents[0].length = 1;
+		}
+		writeFAT(fileAllocationTable, boot->FAT);
+		writeDirectoryTable(&directoryTable, boot->rootDir);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * Finds a run of free slots in a pack cluster, starting from the one the
+ * last run was found in, or starts a new pack cluster. Pack clusters a
+ * snapshot holds are never written to, even where their slots are free.
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @param count the number of slots needed
+ * @param slot pointer to store the first slot of the run in
+ * @return int the pack cluster; 0xFFFF if out of clusters
+ */
+int FileSys::findSlots(int count, unsigned int *slot) {
+	int ret = 0xFFFF;
+	int i;
+	int j;
+	int found;
+	int perCluster = boot->clusterSize / PACK_SLOT_SIZE;
+	map<int, vector<char> >::iterator it = packSlots.lower_bound(packHint);
+
+	for (i = 0; i < packSlots.size() && ret == 0xFFFF; i++, it++) {
+		if (it == packSlots.end()) {
+			it = packSlots.begin();
+		}
+		found = 0;
+		for (j = 0; j < perCluster && found < count && !isHeld(it->first); j++) {
+			found = it->second[j] ? 0 : found + 1;
+		}
+		if (found == count) {
+			ret = it->first;
+			*slot = j - count;
+		}
+	}
+
+	if (ret == 0xFFFF) {
+		ret = findNextFreeCluster();
+		if (ret != 0xFFFF) {
+			fileAllocationTable[ret] = PACK_CLUSTER;
+			packSlots[ret].assign(perCluster, 0);
+			*slot = 0;
+		}
+	}
 
-		if (source[dest.size()-1] == '/' || source.empty()) {
-			//directory source
-			source.append(dest.substr(dest.find_last_of('/') + 1));
+	if (ret != 0xFFFF) {
+		for (i = 0; i < count; i++) {
+			packSlots[ret][*slot + i] = 1;
 		}
-		if (dest[source.size()-1] == '/' || dest.empty()) {
-			//directory destination
-			dest.append(source.substr(source.find_last_of('/') + 1));
+		packHint = ret;
+	}
+
+	return ret;
+}
+
+/**
+ * Lets go of a packed file's slots, and frees its pack cluster once no
+ * file is left in it.
+ *
+ * Should NEVER be called without holding the metadata lock for writing.
+ *
+ * @param cluster the pack cluster the file is in
+ * @param slot the file's first slot
+ * @param size the file's size, in bytes
+ * @return bool true if the pack cluster was freed (the FAT changed)
+ */
+bool FileSys::releaseSlots(int cluster, unsigned int slot, unsigned int size) {
+	bool ret = false;
+	int i;
+	int count = (size + PACK_SLOT_SIZE - 1) / PACK_SLOT_SIZE;
+	vector<char> *slots;
+
+	if (packSlots.count(cluster) > 0) {
+		slots = &packSlots[cluster];
+		for (i = slot; i < slots->size() && count > 0; i++, count--) {
+			(*slots)[i] = 0;
 		}
-		if (!destInFileSys && sourceInFileSys) {
-			//internal (fake/the FileSys) to external (real)
-			ret = copyFileInToExt(source, dest);
-		} else if (!sourceInFileSys && destInFileSys) {
-			//external (real) to internal (fake/the FileSys)
-			ret = copyFileExtToIn(source, dest);
-		} else if (sourceInFileSys && destInFileSys) {
-			//internal to internal
-			ret = copyFileInternally(source, dest);
+		if (find(slots->begin(), slots->end(), 1) == slots->end()) {
+			packSlots.erase(cluster);
+			releaseCluster(cluster);
+			ret = true;
 		}
 	}
+
 	return ret;
 }
 
 /**
- * A sub-component of the "cp" functionality of the filesystem.
- *
- * Copies an internal file system to the  external file (real).
+ * Works out which slots of which pack clusters are in use, from the
+ * directory. Nothing about slots is kept on disk but the entries.
+ */
+void FileSys::loadPackSlots() {
+	int i;
+	int j;
+	int cluster;
+	int count;
+	int perCluster = boot->clusterSize / PACK_SLOT_SIZE;
+
+	packSlots.clear();
+	for (i = 0; i < directoryTable.size(); i++) {
+		cluster = directoryTable[i].index;
+		if (directoryTable[i].name[0] != (char)0x00 && directoryTable[i].name[0] != (char)0xFF
+			&& directoryTable[i].type == TYPE_PACKED && cluster < numClusters) {
+			if (packSlots.count(cluster) == 0) {
+				packSlots[cluster].assign(perCluster, 0);
+			}
+			count = (directoryTable[i].size + PACK_SLOT_SIZE - 1) / PACK_SLOT_SIZE;
+			for (j = getSmallInfo(i)->slot; j < perCluster && count > 0; j++, count--) {
+				packSlots[cluster][j] = 1;
+			}
+		}
+	}
+}
+
+/**
+ * Does the reading for readFileAt(): a run of clusters that follow on
+ * from each other in the image at a time, so a contiguous file is read
+ * in as few calls as there are chunks (and on a striped volume, with
+ * every member reading its share at once).
  *
- * Should NEVER be called by anything other than copyFile()
+ * Should NEVER be called without holding the file's lock.
  *
- * @param source string containing the name of the source file
- * @param dest string containing the full path name of the destination file
- * @return int If error, -1; otherwise 0
+ * @param h the handle
+ * @param buf where to store what's read
+ * @param length the most bytes to read
+ * @param offset where in the file to start reading
+ * @return int the number of bytes read; -1 if the file was removed
  */
-int FileSys::copyFileInToExt(string source, string dest) {
+int FileSys::readHandle(FileHandle *h, void *buf, int length, int offset) {
 	int ret = -1;
-	string fileName;
-	FILE *outerFile;
-	int index;
-	int offset;
-	int j;
+	int entry;
+	int first;
 	int cluster;
-	int sourceIndex;
-	int destIndex;
-	int sourceCluster;
-	int destCluster;
-	int leftOver;
-	int i = 0;
+	int clusters;
+	int n;
+	int position;
+	unsigned int size;
 	int clusterSize = boot->clusterSize;
-	void *clusterData = malloc(clusterSize);
 
-	//internal (fake/the FileSys) to external (real)
-	outerFile = fopen(dest.c_str(), "w+");
-	if (outerFile != NULL) {
-		index = findIndexForFile(source);	
-		if (index != -1) {
-			cluster = directoryTable[index].index;
-			leftOver = directoryTable[index].size % clusterSize;
+	pthread_rwlock_rdlock(&metaLock);
+	entry = findHandleEntry(h);
+	if (entry != -1 && isSmall(entry)) {
+		ret = readSmall(entry, buf, length, offset);
+		entry = -1;
+	} else if (entry != -1) {
+		size = directoryTable[entry].size;
+		first = directoryTable[entry].index;
+	}
+	pthread_rwlock_unlock(&metaLock);
 
-			while (fileAllocationTable[cluster] != 0xFFFF) {
-				offset = clusterSize * cluster;
-				fseek(outerFile, (clusterSize * i), SEEK_SET);
-				fseek(file, offset, SEEK_SET);
-				fread(clusterData, clusterSize, 1, file);
-				fwrite(clusterData, clusterSize, 1, outerFile);
-				
-				cluster = fileAllocationTable[cluster];
-				i++;
+	if (entry != -1) {
+		ret = 0;
+		if (offset < size) {
+			length = min(length, (int)(size - offset));
+			while (ret < length) {
+				position = offset + ret;
+				cluster = lookupCluster(h->name, first, position / clusterSize);
+				for (clusters = 1; clusters * clusterSize - position % clusterSize < length - ret
+						&& lookupCluster(h->name, first, position / clusterSize + clusters)
+							== cluster + clusters; clusters++);
+				n = min(clusters * clusterSize - position % clusterSize, length - ret);
+				readAt((char*)buf + ret, n,
+						(off_t)clusterSize * cluster + position % clusterSize);
+				ret += n;
 			}
+		}
+	}
 
-			if (leftOver != 0) {
-				clusterData = realloc(clusterData, leftOver);
-				offset = clusterSize * cluster;
-				fseek(outerFile, (clusterSize * i), SEEK_SET);
-				fseek(file, offset, SEEK_SET);
-				fread(clusterData, leftOver, 1, file);
-				fwrite(clusterData, leftOver, 1, outerFile);
-			}
+	return ret;
+}
 
-			ret = 0;
-		}
-		fclose(outerFile);
+/**
+ * Does the sending for sendFile(): a run of clusters that follow on from
+ * each other in the image at a time, so a contiguous file goes out in as
+ * few splice() calls as there are chunks. Small files are read and written.
+ *
+ * Should NEVER be called without holding the file's lock.
+ *
+ * @param h the handle
+ * @param out where to send it
+ * @param length the most bytes to send
+ * @param offset where in the file to start sending
+ * @return int the number of bytes sent; -1 if the file was removed or out
+ *         took nothing
+ */
+int FileSys::sendHandle(FileHandle *h, int out, int length, int offset) {
+	int ret = -1;
+	int entry;
+	int first;
+	int cluster;
+	int clusters;
+	int n = 1;
+	int sent;
+	int position;
+	unsigned int size;
+	bool splicing = true;
+	int clusterSize = boot->clusterSize;
+	char small[PACK_MAX_SIZE];
+
+	pthread_rwlock_rdlock(&metaLock);
+	entry = findHandleEntry(h);
+	if (entry != -1 && isSmall(entry)) {
+		n = readSmall(entry, small, min(length, PACK_MAX_SIZE), offset);
+		entry = -1;
+		ret = 0;
+	} else if (entry != -1) {
+		size = directoryTable[entry].size;
+		first = directoryTable[entry].index;
 	}
+	pthread_rwlock_unlock(&metaLock);
 
-	free(clusterData);
+	if (ret == 0) {
+		while (ret < n && (sent = write(out, small + ret, n - ret)) > 0) {
+			ret += sent;
+		}
+		ret = (ret == 0 && n > 0) ? -1 : ret;
+	} else if (entry != -1) {
+		ret = 0;
+		if (offset < size) {
+			length = min(length, (int)(size - offset));
+			while (ret < length && n > 0) {
+				position = offset + ret;
+				cluster = lookupCluster(h->name, first, position / clusterSize);
+				for (clusters = 1; clusters * clusterSize - position % clusterSize < length - ret
+						&& lookupCluster(h->name, first, position / clusterSize + clusters)
+							== cluster + clusters; clusters++);
+				n = min(clusters * clusterSize - position % clusterSize, length - ret);
+				sent = sendAt(out, n, (off_t)clusterSize * cluster + position % clusterSize,
+								&splicing);
+				ret += sent;
+				n = (sent == n) ? n : 0;
+			}
+			ret = (ret == 0) ? -1 : ret;
+		}
+	}
 
 	return ret;
 }
 
 /**
- * A sub-component of the "cp" functionality of the filesystem.
- *
- * Copies an external file (real) to the internal file system.
+ * Does the writing for writeFileAt(). Grows the chain first (so running
+ * out of room leaves the file as it was), zero-fills any gap past the old
+ * end, then writes the data and the new size. Clusters a snapshot holds
+ * are replaced rather than written over (see writableCluster()). Small
+ * files are rewritten whole by writeSmall() until they outgrow
+ * PACK_MAX_SIZE.
  *
- * Should NEVER be called by anything other than copyFile()
+ * Should NEVER be called without holding the file's lock for writing.
  *
- * @param source string containing the full path name of the source file
- * @param dest string containing the name of the destination file
- * @return int -1 if error, -2 if out of clusters, 0 otherwise
+ * @param h the handle
+ * @param buf what to write; can be NULL if length is 0
+ * @param length the number of bytes to write
+ * @param offset where in the file to start writing; -1 for the end
+ * @return int the number of bytes written; -1 if error, -2 if out of clusters
  */
-int FileSys::copyFileExtToIn(string source, string dest) {
+int FileSys::writeHandle(FileHandle *h, const void *buf, int length, int offset) {
 	int ret = -1;
-	string fileName;
-	FILE *outerFile;
-	int index;
-	int offset;
-	int j;
+	int entry;
+	int first;
 	int cluster;
-	int sourceIndex;
-	int destIndex;
-	int sourceCluster;
-	int destCluster;
-	int i = 0;
+	int n;
+	int position;
+	int done;
+	int count;
+	int needed;
+	int start;
+	int run;
+	off_t at;
+	off_t next;
+	unsigned int size;
+	unsigned int end;
+	bool moved = false;
 	int clusterSize = boot->clusterSize;
-	void *clusterData = malloc(clusterSize);
-	
-	//external (real) to internal (fake/the FileSys)
-	outerFile = fopen(source.c_str(), "r");
-	if (outerFile != NULL) {
-		removeFile(dest); //if dest already exists, delete/overwrite
-		index = createFile(dest);
-		if (index >= 0) {
-			cluster = directoryTable[index].index;
+	char *zeros;
 
-			fseek(outerFile, 0, SEEK_END);
-			directoryTable[index].size = ftell(outerFile);
-			fseek(outerFile, 0, SEEK_SET);
+	pthread_rwlock_rdlock(&metaLock);
+	entry = findHandleEntry(h);
+	if (entry != -1 && isSmall(entry)) {
+		entry = -1;
+		ret = -3;
+	} else if (entry != -1) {
+		size = directoryTable[entry].size;
+		first = directoryTable[entry].index;
+	}
+	pthread_rwlock_unlock(&metaLock);
 
-			while (!feof(outerFile) && cluster != 0xFFFF) {
-				offset = clusterSize * cluster;
-				fseek(outerFile, (clusterSize * i), SEEK_SET);
-				fseek(file, offset, SEEK_SET);
-				fread(clusterData, clusterSize, 1, outerFile);
-				fwrite(clusterData, clusterSize, 1, file);
+	if (ret == -3) {
+		//-3 again if it outgrew being small; then it's written as usual
+		ret = writeSmall(h, buf, length, offset);
+		if (ret == -3) {
+			ret = -1;
+			pthread_rwlock_rdlock(&metaLock);
+			entry = findHandleEntry(h);
+			if (entry != -1) {
+				size = directoryTable[entry].size;
+				first = directoryTable[entry].index;
+			}
+			pthread_rwlock_unlock(&metaLock);
+		}
+	}
 
-				fileAllocationTable[cluster] = 0xFFFF;
-				if (!feof(outerFile)) {
-					fileAllocationTable[cluster] = findNextFreeCluster();
-					cluster = fileAllocationTable[cluster];
+	if (entry != -1) {
+		ret = 0;
+		if (offset == -1) {
+			offset = size;
+		}
+		end = max(size, (unsigned int)(offset + length));
+		count = size / clusterSize + 1;
+		needed = end / clusterSize + 1;
+
+		//1. grow the chain; only ever appends, existing data isn't touched
+		cluster = lookupCluster(h->name, first, count - 1);
+		while (count < needed && cluster != 0xFFFF) {
+			cluster = appendCluster(h->name, cluster, needed - count);
+			if (cluster != 0xFFFF) {
+				count++;
+			}
+		}
+		if (count < needed) {
+			pthread_rwlock_wrlock(&metaLock);
+			entry = findHandleEntry(h);
+			if (entry != -1) {
+				cutFile(entry, size / clusterSize + 1);
+			}
+			pthread_rwlock_unlock(&metaLock);
+			ret = -2;
+		}
+
+		//2. zeros between the old end and where the write starts
+		if (ret == 0 && offset > size) {
+			zeros = (char*)calloc(clusterSize, 1);
+			for (position = size; ret == 0 && position < offset; position += n) {
+				n = min(clusterSize - position % clusterSize, (int)(offset - position));
+				cluster = writableCluster(h, &first, position / clusterSize,
+											n == clusterSize, &moved);
+				if (cluster == 0xFFFF) {
+					ret = -2;
+				} else {
+					writeAt(zeros, n, (off_t)clusterSize * cluster + position % clusterSize);
 				}
-				i++;
 			}
+			free(zeros);
+		}
 
-			if (!feof(outerFile)) {
-				//OH SHIT, outta room baby!
-				//undo all the changes
-				readFAT(fileAllocationTable, boot->FAT);
-				readDirectoryTable(&directoryTable, boot->rootDir);
-				removeFile(index);
+		//3. the data itself, a run of clusters that follow on from each
+		//other in the image at a time
+		for (done = 0, run = 0; ret == 0 && done < length; done += n) {
+			position = offset + done;
+			n = min(clusterSize - position % clusterSize, length - done);
+			cluster = writableCluster(h, &first, position / clusterSize,
+										n == clusterSize, &moved);
+			if (cluster == 0xFFFF) {
 				ret = -2;
 			} else {
-				writeFAT(fileAllocationTable, boot->FAT);
+				next = (off_t)clusterSize * cluster + position % clusterSize;
+				if (run > 0 && at + run != next) {
+					writeAt((const char*)buf + start, run, at);
+					run = 0;
+				}
+				if (run == 0) {
+					start = done;
+					at = next;
+				}
+				run += n;
+			}
+		}
+		if (run > 0) {
+			writeAt((const char*)buf + start, run, at);
+		}
+
+		//4. the new size and chain
+		pthread_rwlock_wrlock(&metaLock);
+		entry = findHandleEntry(h);
+		if (entry != -1) {
+			if (ret == 0 && end > size) {
+				directoryTable[entry].size = end;
+			} else if (ret != 0 && count == needed && needed > size / clusterSize + 1) {
+				//no room to replace a held cluster; drop what step 1 added
+				cutFile(entry, size / clusterSize + 1);
+			}
+			if (moved || (ret == 0 && end > size)) {
+				if (moved || needed > size / clusterSize + 1) {
+					writeFAT(fileAllocationTable, boot->FAT);
+				}
 				writeDirectoryTable(&directoryTable, boot->rootDir);
-				ret = 0;
 			}
-		} else {
-			ret = index;
 		}
-		fclose(outerFile);
+		pthread_rwlock_unlock(&metaLock);
+		ret = (ret == 0) ? length : ret;
+	}
+
+	return ret;
+}
+
+/**
+ * Converts a chain volume to an extent volume, in place. Every file's
+ * chain becomes a list of extents and the FAT is left as just a map of
+ * which clusters are used.
+ *
+ * Done in an order that leaves a working volume if it's cut short: the
+ * extent lists (which chain volumes ignore) and any overflow blocks are
+ * written first, then the volume header is flipped over to extents, and
+ * only then are the chain links cleared. Cut short before the header
+ * is written, the volume is still a chain volume with at most some
+ * orphaned overflow blocks for "fsck -r" to reclaim.
+ *
+ * @return int the number of files converted (0 if it already was an extent
+ *         volume); -2 if out of clusters for overflow blocks, -3 if a
+ *         name is too long to keep, -4 if there are snapshots (their saved
+ *         FATs are chains)
+ */
+int FileSys::convertToExtents() {
+	PROFILE(&profiler, OP_CONVERT);
+	TraceCall traced(tracer, OP_CONVERT, 0);
+	int ret = 0;
+	int i;
+	int j;
+	Extent extent;
+	vector<int> clusters;
+	vector<vector<Extent> > fileExtents;
+	int perBlock = (boot->clusterSize - sizeof(ExtentBlock)) / sizeof(Extent);
+	int blocksNeeded = 0;
+
+	lockAll();
+	if (!usingExtents && !snapshots.empty()) {
+		ret = -4;
+	}
+	fileExtents.resize(directoryTable.size());
+	for (i = 0; i < directoryTable.size() && ret == 0 && !usingExtents; i++) {
+		if (directoryTable[i].name[0] != (char)0x00
+			&& directoryTable[i].name[0] != (char)0xFF) {
+			if (strlen(directoryTable[i].name) >= EXTENT_NAME_SIZE) {
+				ret = -3;
+			} else {
+				mapFile(i, &clusters);
+				for (j = 0; j < clusters.size(); j++) {
+					if (j > 0 && clusters[j] == clusters[j - 1] + 1) {
+						fileExtents[i].back().length++;
+					} else {
+						extent.start = clusters[j];
+						extent.length = 1;
+						fileExtents[i].push_back(extent);
+					}
+				}
+				blocksNeeded += (max(0, (int)fileExtents[i].size() - EXTENTS_INLINE)
+									+ perBlock - 1) / perBlock;
+			}
+		}
+	}
+	if (ret == 0 && blocksNeeded > numClusters - findUsedClusterCount()) {
+		ret = -2;
+	}
+
+	if (ret == 0 && !usingExtents) {
+		//1. extent lists into the name slack, overflow blocks into free clusters
+		for (i = 0; i < directoryTable.size(); i++) {
+			if (!fileExtents[i].empty()) {
+				memset(getExtentInfo(i), 0, sizeof(ExtentInfo));
+				writeExtents(i, &fileExtents[i]);
+				ret++;
+			}
+		}
+		writeDirectoryTable(&directoryTable, boot->rootDir);
+		writeFAT(fileAllocationTable, boot->FAT);
+		syncFileSys();
+
+		//2. from here on it's an extent volume
+		header.magic = VOLUME_MAGIC;
+		header.version = VOLUME_VERSION;
+		header.flags |= VOLUME_EXTENTS;
+		writeVolumeHeader(&header);
+		syncFileSys();
+		usingExtents = true;
+
+		//3. the FAT is only an allocation map now
+		for (i = 0; i < fileExtents.size(); i++) {
+			for (j = 0; j < fileExtents[i].size(); j++) {
+				for (extent = fileExtents[i][j]; extent.length > 0; extent.length--) {
+					fileAllocationTable[extent.start + extent.length - 1] = EXTENT_CLUSTER;
+				}
+			}
+		}
+		writeFAT(fileAllocationTable, boot->FAT);
+		syncFileSys();
+
+		clusterIndex->clear();
+		findUsedClusterCount();
+	}
+	unlockAll();
+
+	traced.done(ret, "", "");
+	return ret;
+}
+
+/**
+ * Whether files on this volume are lists of extents rather than FAT chains.
+ *
+ * @return bool true for an extent volume
+ */
+bool FileSys::isExtentVolume() {
+	return usingExtents;
+}
+
+/**
+ * Turns discard on or off. While it's on, clusters are punched out of the
+ * image as they're freed, so the image only takes up host space for what's
+ * in use. Turning it on trims the volume first (see trimFileSys()), which
+ * also checks the host can punch holes at all. Saved in the volume header,
+ * so it stays on across mounts.
+ *
+ * @param on true to turn discard on
+ * @return int 0 if set, -1 if the host can't punch holes or a snapshot
+ *         is mounted
+ */
+int FileSys::setDiscard(bool on) {
+	int ret = 0;
+
+	if (readOnly || (on && trimFileSys(NULL, NULL) < 0)) {
+		ret = -1;
+	} else {
+		lockAll();
+		discarding = on;
+		discardQueue.clear();
+		header.magic = VOLUME_MAGIC;
+		header.version = VOLUME_VERSION;
+		if (on) {
+			header.flags |= VOLUME_DISCARD;
+		} else {
+			header.flags &= ~VOLUME_DISCARD;
+		}
+		writeVolumeHeader(&header);
+		syncFileSys();
+		unlockAll();
+	}
+
+	return ret;
+}
+
+/**
+ * @return bool true if freed clusters are punched out of the image
+ */
+bool FileSys::isDiscarding() {
+	return discarding;
+}
+
+/**
+ * Changes how free clusters are picked from now on (see Allocator).
+ * Saved in the volume header, so it stays in effect across mounts; what's
+ * already allocated doesn't move.
+ *
+ * @param policy ALLOC_FIRST_FIT, ALLOC_NEXT_FIT, ALLOC_BEST_FIT or ALLOC_NEAR
+ * @return int 0 if set, -1 if there's no such policy or a snapshot is mounted
+ */
+int FileSys::setAllocator(int policy) {
+	int ret = 0;
+
+	if (readOnly || policy < 0 || policy >= ALLOC_POLICIES) {
+		ret = -1;
+	} else {
+		pthread_rwlock_wrlock(&metaLock);
+		allocator->setPolicy(policy);
+		header.magic = VOLUME_MAGIC;
+		header.version = VOLUME_VERSION;
+		header.allocator = policy;
+		writeVolumeHeader(&header);
+		syncFileSys();
+		pthread_rwlock_unlock(&metaLock);
+	}
+
+	return ret;
+}
+
+/**
+ * @return int the ALLOC_* policy free clusters are picked by
+ */
+int FileSys::getAllocator() {
+	return allocator->getPolicy();
+}
+
+/**
+ * Punches every run of free clusters out of the image, discard or not, so
+ * the host gets back the space of everything ever freed. Clusters of
+ * deleted files the reclaimer hasn't freed yet aren't free, so stay.
+ *
+ * @param before pointer to store the host space taken before, in bytes; can be NULL
+ * @param after pointer to store the host space taken after, in bytes; can be NULL
+ * @return int the number of runs punched; -1 if the host can't punch holes
+ */
+int FileSys::trimFileSys(long long *before, long long *after) {
+	PROFILE(&profiler, OP_TRIM);
+	TraceCall traced(tracer, OP_TRIM, 0);
+	int ret;
+	int i;
+	vector<int> clusters;
+
+	lockAll();
+	if (before != NULL) {
+		*before = getHostAllocated();
+	}
+	discardQueue.clear();
+	for (i = 1; i < numClusters && !readOnly; i++) {
+		if (isFree(i)) {
+			clusters.push_back(i);
+		}
+	}
+	ret = punchRuns(&clusters);
+	if (after != NULL) {
+		*after = getHostAllocated();
+	}
+	unlockAll();
+
+	traced.done(ret, "", "");
+	return ret;
+}
+
+/**
+ * @return long long how much space the image (and any members it's
+ *         striped over) takes up on the host, in bytes; less than its
+ *         size if it's sparse or has been punched
+ */
+long long FileSys::getHostAllocated() {
+	long long ret = 0;
+	int i;
+	struct stat info;
+
+	for (i = 0; i < memberCount(); i++) {
+		if (fstat(memberFd(i), &info) == 0) {
+			ret += (long long)info.st_blocks * 512;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Takes a snapshot: the FAT and directory as they are now, saved to a run
+ * of free clusters. No file data is copied; from then on the clusters the
+ * snapshot's files use are held, so writes to them go to new clusters
+ * instead (see writableCluster()) and freeing them doesn't let them be
+ * handed out again. Takes time in proportion to the metadata, however
+ * much data there is.
+ *
+ * Written so a crash part way leaves at worst orphaned clusters for
+ * "fsck -r": the saved tables first, then the FAT marking their clusters
+ * used, and only then the volume header that points at them.
+ *
+ * @param name string containing the snapshot's name
+ * @return int 0 if taken; -1 if the name is taken, too long or there are
+ *         too many snapshots, -2 if out of clusters
+ */
+int FileSys::createSnapshot(string name) {
+	PROFILE(&profiler, OP_SNAPSHOT);
+	TraceCall traced(tracer, OP_SNAPSHOT, TRACE_SNAPSHOT_CREATE);
+	int ret = 0;
+	int i;
+	int run = 0xFFFF;
+	int table = header.snapshots;
+	int clusterSize = boot->clusterSize;
+	SnapshotEntry snapshot;
+
+	flushBatch();
+	lockAll();
+	if (readOnly || name.empty() || name.size() >= SNAPSHOT_NAME_SIZE
+		|| findSnapshot(name) != -1 || snapshots.size() >= MAX_SNAPSHOTS) {
+		ret = -1;
+	}
+
+	if (ret == 0 && table == 0) {
+		table = findNextFreeCluster();
+		if (table == 0xFFFF) {
+			ret = -2;
+		} else {
+			fileAllocationTable[table] = SNAPSHOT_CLUSTER;
+		}
+	}
+
+	if (ret == 0) {
+		memset(&snapshot, 0, sizeof(SnapshotEntry));
+		strcpy(snapshot.name, name.c_str());
+		snapshot.created = time(NULL);
+		snapshot.fatClusters = (numClusters * sizeof(int) + clusterSize - 1) / clusterSize;
+		snapshot.dirClusters = directoryTable.size() / entriesPerTable;
+		snapshot.flags = header.flags;
+		flushDiscards();
+		run = findFreeRun(snapshot.fatClusters + snapshot.dirClusters);
+		if (run == 0xFFFF) {
+			if (header.snapshots == 0) {
+				fileAllocationTable[table] = 0x0000;
+			}
+			ret = -2;
+		}
 	}
 
-	free(clusterData);
+	if (ret == 0) {
+		snapshot.fat = run;
+		snapshot.dir = run + snapshot.fatClusters;
+		for (i = run; i < snapshot.dir + snapshot.dirClusters; i++) {
+			fileAllocationTable[i] = SNAPSHOT_CLUSTER;
+		}
+
+		//1. the saved tables and the snapshot table
+		writeAt(fileAllocationTable, numClusters * sizeof(int), (off_t)snapshot.fat * clusterSize);
+		writeAt(&directoryTable[0], directoryTable.size() * sizeof(DirectoryTableEntry),
+				(off_t)snapshot.dir * clusterSize);
+		snapshots.push_back(snapshot);
+		header.snapshots = table;
+		writeSnapshotTable();
+		syncFileSys();
+
+		//2. their clusters marked used
+		writeFAT(fileAllocationTable, boot->FAT);
+		syncFileSys();
+
+		//3. the volume pointed at them
+		header.magic = VOLUME_MAGIC;
+		header.version = VOLUME_VERSION;
+		writeVolumeHeader(&header);
+		syncFileSys();
+
+		if (held == NULL) {
+			held = new char[numClusters];
+			memset(held, 0, numClusters);
+		}
+		for (i = 0; i < numClusters; i++) {
+			if (fileAllocationTable[i] != 0x0000 && fileAllocationTable[i] != SNAPSHOT_CLUSTER) {
+				held[i] = 1;
+			}
+		}
+		findUsedClusterCount();
+	}
+	unlockAll();
 
+	traced.done(ret, name, "");
 	return ret;
 }
 
 /**
- * A sub-component of the "cp" functionality of the filesystem.
- *
- * Copies an internal file of the filesystem to the filesystem. Basically
- * iterates through all the clusters of a file and copies them to the next
- * available cluster.
- *
- * Should NEVER be called by anything other than copyFile()
+ * Deletes a snapshot. Its saved tables are freed, and so is every cluster
+ * only it was holding that the live volume has since let go of.
  *
- * @param source string containing the name of the source file
- * @param dest string containing the name of the destination file
- * @return int -1 if error, -2 if out of clusters, 0 otherwise
+ * @param name string containing the snapshot's name
+ * @return int 0 if deleted; -1 if there's no such snapshot
  */
-int FileSys::copyFileInternally(string source, string dest) {
-	int ret;
+int FileSys::deleteSnapshot(string name) {
+	PROFILE(&profiler, OP_SNAPSHOT);
+	TraceCall traced(tracer, OP_SNAPSHOT, TRACE_SNAPSHOT_DELETE);
+	int ret = -1;
 	int i;
-	int sourceIndex;
-	int destIndex;
-	int sourceCluster;
-	int destCluster;
-	int clusterSize = boot->clusterSize;
-	void *clusterData = malloc(clusterSize);
+	int snapshot;
+	char *wasHeld;
 
-	sourceIndex = findIndexForFile(source);
-	if (sourceIndex != -1) {
-		removeFile(dest); //if dest already exists, delete/overwrite
-		destIndex = findIndexForFile(dest);
-		if (destIndex == -1) {
-			destIndex = createFile(dest);
+	lockAll();
+	snapshot = findSnapshot(name);
+	if (!readOnly && snapshot != -1) {
+		for (i = snapshots[snapshot].fat;
+				i < snapshots[snapshot].dir + snapshots[snapshot].dirClusters; i++) {
+			releaseCluster(i);
 		}
-		if (destIndex >= 0) {
-			destCluster = directoryTable[destIndex].index;
-			sourceCluster = directoryTable[sourceIndex].index;
-			directoryTable[destIndex].size = directoryTable[sourceIndex].size;
-
-			while(sourceCluster != 0xFFFF && destCluster != 0xFFFF) {
-				fseek(file, (clusterSize * sourceCluster), SEEK_SET);
-				fread(clusterData, clusterSize, 1,  file);
-				fseek(file, (clusterSize * destCluster), SEEK_SET);
-				fwrite(clusterData, clusterSize, 1,  file);
-
-				sourceCluster = fileAllocationTable[sourceCluster];
-			
-				fileAllocationTable[destCluster] = 0xFFFF;
-				if (sourceCluster != 0xFFFF) {
-					fileAllocationTable[destCluster] = findNextFreeCluster();
-					destCluster = fileAllocationTable[destCluster];
-				}
-			}
+		snapshots.erase(snapshots.begin() + snapshot);
+		if (snapshots.empty()) {
+			releaseCluster(header.snapshots);
+			header.snapshots = 0;
+		} else {
+			writeSnapshotTable();
+		}
+		writeVolumeHeader(&header);
+		syncFileSys();
 
-			if (sourceCluster != 0xFFFF) {
-				//OH SHIT, outta room baby!
-				//undo all the changes
-				readFAT(fileAllocationTable, boot->FAT);
-				readDirectoryTable(&directoryTable, boot->rootDir);
-				removeFile(destIndex);
-				ret = -2;
-			} else {
-				writeFAT(fileAllocationTable, boot->FAT);
-				writeDirectoryTable(&directoryTable, boot->rootDir);
-				ret = 0;
+		wasHeld = held;
+		held = NULL;
+		buildHeldMap();
+		for (i = 0; i < numClusters && discarding && wasHeld != NULL; i++) {
+			if (wasHeld[i] && isFree(i)) {
+				discardQueue.push_back(i);
 			}
-		} else {
-			ret = destIndex;
 		}
+		delete[] wasHeld;
+
+		writeFAT(fileAllocationTable, boot->FAT);
+		findUsedClusterCount();
+		ret = 0;
 	}
+	unlockAll();
 
-	free(clusterData);
-	
+	traced.done(ret, name, "");
 	return ret;
 }
 
 /**
- * The "mv" functionality of the filesystem.
- *
- * Removes destination if it exists, then passes all parameters onto copyFile() 
- * then removes the source file
+ * Rolls the live volume back to a snapshot: its FAT and directory replace
+ * the live ones, so every file is as it was when the snapshot was taken.
+ * The snapshot (and any others) are kept. Clusters used since then are
+ * freed.
  *
- * @param source string containing file to be copied
- * @param dest string containing destination of file
- * @param sourceInFileSys boolean indicating if source is local (in FileSys)
- * @param destInFileSys boolean indicating if dest is local (in FileSys)
- * @return int -1 if error, -2 if out of clusters, 0 otherwise
- */ 
-int FileSys::moveFile(string source, string dest, 
-						bool sourceInFileSys, bool destInFileSys) {
+ * @param name string containing the snapshot's name
+ * @return int 0 if rolled back; -1 if there's no such snapshot
+ */
+int FileSys::rollbackSnapshot(string name) {
+	PROFILE(&profiler, OP_SNAPSHOT);
+	TraceCall traced(tracer, OP_SNAPSHOT, TRACE_SNAPSHOT_ROLLBACK);
 	int ret = -1;
-	if (source != dest) {
-		ret = copyFile(source, dest, sourceInFileSys, destInFileSys);
-		if (ret >= 0) {
-			if (sourceInFileSys) {
-				ret = removeFile(source);
-			} else {
-				ret = remove(source.c_str());
+	int i;
+	int j;
+	int snapshot;
+	int *fat = new int[numClusters];
+	vector<DirectoryTableEntry> table;
+
+	lockAll();
+	snapshot = findSnapshot(name);
+	if (!readOnly && snapshot != -1 && readSnapshot(snapshot, fat, &table) == 0) {
+		for (i = 0; i < numClusters; i++) {
+			//saved tables belong to whichever snapshots exist now, not then
+			if (fat[i] == SNAPSHOT_CLUSTER) {
+				fat[i] = 0x0000;
+			}
+			if (discarding && fileAllocationTable[i] != 0x0000
+				&& fat[i] == 0x0000 && !isHeld(i)) {
+				discardQueue.push_back(i);
 			}
 		}
+		fat[header.snapshots] = SNAPSHOT_CLUSTER;
+		for (i = 0; i < snapshots.size(); i++) {
+			for (j = snapshots[i].fat; j < snapshots[i].dir + snapshots[i].dirClusters; j++) {
+				fat[j] = SNAPSHOT_CLUSTER;
+			}
+		}
+		memcpy(fileAllocationTable, fat, numClusters * sizeof(int));
+		directoryTable = table;
+
+		writeDirectoryTable(&directoryTable, boot->rootDir);
+		writeFAT(fileAllocationTable, boot->FAT);
+		syncFileSys();
+		clusterIndex->clear();
+		allocator->reset();
+		loadPackSlots();
+		findUsedClusterCount();
+
+		//deleted files that were still waiting when it was taken
+		pthread_mutex_lock(&reclaimLock);
+		reclaimWork = true;
+		pthread_cond_signal(&reclaimWake);
+		pthread_mutex_unlock(&reclaimLock);
+		ret = 0;
 	}
+	unlockAll();
+	delete[] fat;
 
+	traced.done(ret, name, "");
 	return ret;
 }
 
 /**
- * The "rm" functionality of the filesystem.
+ * Mounts a snapshot read-only: its FAT and directory are loaded in place
+ * of the live ones, and nothing can be written until the file system is
+ * closed. Nothing is ever written to the image while it's mounted.
  *
- * Finds the index inside the directory table of a file
- * given by it's file name. Can handle wildcard "*" name.
+ * @param name string containing the snapshot's name
+ * @return int 0 if mounted; -1 if there's no such snapshot
+ */
+int FileSys::mountSnapshot(string name) {
+	PROFILE(&profiler, OP_SNAPSHOT);
+	TraceCall traced(tracer, OP_SNAPSHOT, TRACE_SNAPSHOT_MOUNT);
+	int ret = -1;
+	int snapshot;
+	int *fat = new int[numClusters];
+	vector<DirectoryTableEntry> table;
+
+	//the reclaimer writes; it takes the metadata lock, so stop it first
+	stopReclaimer();
+	lockAll();
+	snapshot = findSnapshot(name);
+	if (snapshot != -1 && readSnapshot(snapshot, fat, &table) == 0) {
+		readOnly = true;
+		usingExtents = (snapshots[snapshot].flags & VOLUME_EXTENTS) != 0;
+		discarding = false;
+		discardQueue.clear();
+		memcpy(fileAllocationTable, fat, numClusters * sizeof(int));
+		directoryTable = table;
+		clusterIndex->clear();
+		loadPackSlots();
+		findUsedClusterCount();
+		ret = 0;
+	}
+	unlockAll();
+	if (ret != 0) {
+		startReclaimer();
+	}
+	delete[] fat;
+
+	traced.done(ret, name, "");
+	return ret;
+}
+
+/**
+ * Lists the snapshots, oldest first.
  *
- * @param name string containing name of the file to be removed
- * @return int 0 if (all) removed successfully, -1 otherwise
+ * @param list pointer to vector to store them in
+ * @return int the number of snapshots
  */
-int FileSys::removeFile(string name) {
-	int ret = 0;
+int FileSys::listSnapshots(vector<SnapshotEntry> *list) {
+	pthread_rwlock_rdlock(&metaLock);
+	*list = snapshots;
+	pthread_rwlock_unlock(&metaLock);
+
+	return list->size();
+}
+
+/**
+ * @return bool true if a snapshot is mounted, so nothing can be changed
+ */
+bool FileSys::isReadOnly() {
+	return readOnly;
+}
+
+/**
+ * Reads the snapshot table the volume header points at, and works out
+ * which clusters the snapshots hold.
+ */
+void FileSys::loadSnapshots() {
 	int i;
-	int cluster;
-	int oldCluster;
-	int index = -1;
-	for (i = directoryTable.size()-1; i >= 0 && (name == "*" || index == -1); i--) {
-		if (directoryTable[i].name == name ||
-			(name == "*" && (directoryTable[i].name[0] != (char)0x00 
-					&& directoryTable[i].name[0] != (char)0xFF))) {
-			index = i;
-			if (removeFile(index) == -1) {
-				ret = -1;
+	int perTable = boot->clusterSize / sizeof(SnapshotEntry);
+	SnapshotEntry *table;
+
+	snapshots.clear();
+	if (header.snapshots > 0 && header.snapshots < numClusters) {
+		table = (SnapshotEntry*)malloc(boot->clusterSize);
+		readCluster(header.snapshots, table, boot->clusterSize);
+		for (i = 0; i < perTable && i < MAX_SNAPSHOTS; i++) {
+			if (table[i].name[0] != 0x00) {
+				table[i].name[SNAPSHOT_NAME_SIZE - 1] = 0x00;
+				snapshots.push_back(table[i]);
 			}
 		}
+		free(table);
 	}
+	buildHeldMap();
+}
 
-	return 0;
+/**
+ * Works out which clusters the snapshots hold: every cluster that's used
+ * in any snapshot's saved FAT, other than saved tables themselves.
+ */
+void FileSys::buildHeldMap() {
+	int i;
+	int j;
+	int *fat;
+
+	delete[] held;
+	held = NULL;
+	if (!snapshots.empty()) {
+		held = new char[numClusters];
+		memset(held, 0, numClusters);
+		fat = new int[numClusters];
+		for (i = 0; i < snapshots.size(); i++) {
+			readAt(fat, numClusters * sizeof(int), (off_t)snapshots[i].fat * boot->clusterSize);
+			for (j = 0; j < numClusters; j++) {
+				if (fat[j] != 0x0000 && fat[j] != SNAPSHOT_CLUSTER) {
+					held[j] = 1;
+				}
+			}
+		}
+		delete[] fat;
+	}
+	//clusters no snapshot holds any more are free again
+	if (allocator != NULL) {
+		allocator->reset();
+	}
 }
 
 /**
- * The background "rm" functionality of the filesystem.
- *
- * Removes a file from by setting the first bit of the file
- * name to the deleted flag (0xFF). Removes all of the file's
- * clusters from the FAT.
+ * Finds a snapshot by name.
  *
- * Should NEVER be called by anything other than removeFile(string).
- *
- * @param index the index of the entry in the directory table to be removed
- * @return int 0 if removed successfully, -1 otherwise
+ * @param name string containing the snapshot's name
+ * @return int its index in snapshots; -1 if there's no such snapshot
  */
-int FileSys::removeFile(int index) {
+int FileSys::findSnapshot(string name) {
+	int i;
 	int ret = -1;
-	int cluster;
-	int oldCluster;
-	if (index != -1) {
-		directoryTable[index].name[0] = 0xFF;
 
-		cluster = directoryTable[index].index;
-		do {
-			oldCluster = cluster;
-			cluster = fileAllocationTable[oldCluster];
-			fileAllocationTable[oldCluster] = 0x0000;
-		} while(cluster != 0xFFFF);
+	for (i = 0; i < snapshots.size() && ret == -1; i++) {
+		if (name == snapshots[i].name) {
+			ret = i;
+		}
+	}
 
-		directoryTable.erase(directoryTable.begin() + index);
-		writeFAT(fileAllocationTable, boot->FAT);
-		writeDirectoryTable(&directoryTable, boot->rootDir);
-		ret = 0;
+	return ret;
+}
+
+/**
+ * Writes the snapshot table to the cluster the volume header points at.
+ */
+void FileSys::writeSnapshotTable() {
+	char *data = (char*)calloc(boot->clusterSize, 1);
+
+	memcpy(data, &snapshots[0], snapshots.size() * sizeof(SnapshotEntry));
+	writeCluster(header.snapshots, data, boot->clusterSize);
+	free(data);
+}
+
+/**
+ * Reads a snapshot's saved FAT and directory.
+ *
+ * @param snapshot index of the snapshot in snapshots
+ * @param fat pointer to store the FAT in; numClusters entries
+ * @param table pointer to vector to store the directory in
+ * @return int 0 if read; -1 if the saved tables are cut short
+ */
+int FileSys::readSnapshot(int snapshot, int *fat, vector<DirectoryTableEntry> *table) {
+	int ret = 0;
+	int clusterSize = boot->clusterSize;
+	int bytes = snapshots[snapshot].dirClusters * clusterSize;
+
+	table->resize(snapshots[snapshot].dirClusters * entriesPerTable);
+	if (table->empty()
+		|| readAt(fat, numClusters * sizeof(int),
+					(off_t)snapshots[snapshot].fat * clusterSize) != numClusters * sizeof(int)
+		|| readAt(&(*table)[0], bytes, (off_t)snapshots[snapshot].dir * clusterSize) != bytes) {
+		ret = -1;
 	}
 
 	return ret;
 }
 
 /**
- * The "cat" functionality of the filesystem.
+ * Finds every file whose name matches a shell wildcard pattern.
  *
- * Prints the contents of a file to standard output (terminal)
+ * @param pattern string containing the pattern (*, ? and [...] allowed)
+ * @param names pointer to vector to store the matching names in
+ * @return int the number of matching files
+ */
+int FileSys::listFiles(string pattern, vector<string> *names) {
+	PROFILE(&profiler, OP_LIST);
+	TraceCall traced(tracer, OP_LIST, TRACE_LIST_FILES);
+	int i;
+
+	names->clear();
+	pthread_rwlock_rdlock(&metaLock);
+	for (i = 0; i < directoryTable.size(); i++) {
+		if (directoryTable[i].name[0] != (char)0x00 
+			&& directoryTable[i].name[0] != (char)0xFF
+			&& directoryTable[i].name[0] != (char)0xFE
+			&& fnmatch(pattern.c_str(), directoryTable[i].name, 0) == 0) {
+			names->push_back(directoryTable[i].name);
+		}
+	}
+	pthread_rwlock_unlock(&metaLock);
+
+	traced.done(names->size(), pattern, "");
+	return names->size();
+}
+
+/**
+ * Finds the size of a file.
  *
- * @param name string containing name of the file to be printed
- * @return int -1 if error (file not found), otherwise 0
+ * @param name string containing name of file
+ * @return int size of the file in bytes; -1 if it doesn't exist
  */
-int FileSys::printFile(string name) {
+int FileSys::getFileSize(string name) {
+	PROFILE(&profiler, OP_LOOKUP);
+	TraceCall traced(tracer, OP_LOOKUP, 0);
 	int ret = -1;
 	int index;
-	int cluster;
-	int leftOver;
-	int offset;
-	int clusterSize = boot->clusterSize;
-	void *clusterData;
 
+	pthread_rwlock_rdlock(&metaLock);
 	index = findIndexForFile(name);
 	if (index != -1) {
-		clusterData = malloc(clusterSize);
-		cluster = directoryTable[index].index;
-		leftOver = directoryTable[index].size % clusterSize;
-
-		while (fileAllocationTable[cluster] != 0xFFFF) {
-			offset = clusterSize * cluster;
-			fseek(file, offset, SEEK_SET);
-			fread(clusterData, clusterSize, 1, file);
-			cout << (char*)clusterData;
-			cluster = fileAllocationTable[cluster];
-		}
-		offset = clusterSize * cluster;
-		fseek(file, offset, SEEK_SET);
-		while (leftOver > 0) {
-			cout << (char)fgetc(file);
-			leftOver--;
-		}
-
-		free(clusterData);
-		ret = 0;
+		ret = directoryTable[index].size;
 	}
+	pthread_rwlock_unlock(&metaLock);
 
+	traced.done(ret, name, "");
 	return ret;
 }
 
 /**
- * The "df" functionality of the filesystem.
+ * Starts a batch. Until the matching endBatch(), changes to the FAT and
+ * directory are only made in memory and are written out by flushBatch()
+ * or endBatch(), instead of after every single file. Batches nest.
  *
- * Shows the structure of the filesystem
+ * A crash in the middle of a batch loses every change since the last
+ * flush (the file system on disk is left as it was then).
  */
-void FileSys::showStructure() {
-	findUsedClusterCount();
+void FileSys::beginBatch() {
+	TraceCall traced(tracer, OP_BATCH, TRACE_BATCH_BEGIN);
+	pthread_rwlock_wrlock(&metaLock);
+	batchDepth++;
+	pthread_rwlock_unlock(&metaLock);
+	traced.done(0, "", "");
+}
 
-	cout << left << setw(15) << "Filesystem";
-	cout << " ";
-	cout << right << setw(10) << "Size";
-	cout << " ";
-	cout << right << setw(5) << ((boot->clusterSize)/1024) << "K-clusters";
-	cout << " ";
-	cout << right << setw(8) << "Used" ;
-	cout << " ";
-	cout << right << setw(9) << "Available";
-	cout << " ";
-	cout << right << setw(3) << "Use%" ;
-	cout << endl;
+/**
+ * Writes out whatever the running batch has held back so far.
+ */
+void FileSys::flushBatch() {
+	PROFILE(&profiler, OP_BATCH);
+	TraceCall traced(tracer, OP_BATCH, TRACE_BATCH_FLUSH);
+	int depth;
 
-	cout << left << setw(15) << sysName;
-	cout << " ";
-	cout << right << setw(10) << boot->size;
-	cout << " ";
-	cout << right << setw(15) << numClusters;
-	cout << " ";
-	cout << right << setw(8) << usedClusters;
-	cout << " ";
-	cout << right << setw(9) << (numClusters-usedClusters);
-	cout << " ";
-	cout << right << setw(3) << (int)(((double)usedClusters/(double)numClusters)*100) << "%" ;
-	cout << endl << endl;
+	pthread_rwlock_wrlock(&metaLock);
+	depth = batchDepth;
+	batchDepth = 0;
+	if (fatDirty) {
+		writeFAT(fileAllocationTable, boot->FAT);
+	}
+	if (directoryDirty) {
+		writeDirectoryTable(&directoryTable, boot->rootDir);
+	}
+	fatDirty = false;
+	directoryDirty = false;
+	batchDepth = depth;
+	pthread_rwlock_unlock(&metaLock);
+	traced.done(0, "", "");
 }
 
 /**
- * A function for my benefit.
- * Just prints out the FAT table and current directory table
+ * Ends a batch started with beginBatch(), writing everything held back
+ * once the outermost batch ends.
  */
-void FileSys::printInfo() {
-	printInfo(6, &directoryTable);
+void FileSys::endBatch() {
+	TraceCall traced(tracer, OP_BATCH, TRACE_BATCH_END);
+	bool last;
+
+	pthread_rwlock_wrlock(&metaLock);
+	if (batchDepth > 0) {
+		batchDepth--;
+	}
+	last = (batchDepth == 0);
+	pthread_rwlock_unlock(&metaLock);
+
+	if (last) {
+		flushBatch();
+	}
+	traced.done(0, "", "");
 }
 
 /**
- * The "df" functionality of the file system.
- * Prints out the FAT table, the filesystem structure data, and a directory
+ * Picks which of the striped file locks guards a file.
  *
- * @param width int how many columns the FAT table should be; 6 is awesome
- * @param table pointer to directory table vector to be printed; can be NULL
+ * @param name string containing name of file
+ * @return int index into fileLocks
  */
-void FileSys::printInfo(int width, vector<DirectoryTableEntry> *table) {
-	printFAT(width);
-	showStructure();
-	if (table != NULL) {
-		printDirectoryTable(*table);
+int FileSys::fileLockFor(string name) {
+	unsigned int hash = 5381;
+	int i;
+
+	for (i = 0; i < name.size(); i++) {
+		hash = hash * 33 + (unsigned char)name[i];
 	}
+
+	return hash % FILE_LOCK_STRIPES;
 }
 
 /**
- * Prints the File Allocation Table (FAT) to standard output (terminal).
- * 
- * The entries are printed in the format <cluster #>:<cluster value>
+ * Locks a file, for reading (shared) or writing (exclusive).
  *
- * If the cluster is free, its value is 0 and green
- * If the cluster is reserved, its value is OxFE(65534) and red
- * If the cluster is the last cluster in a chain, its value is 0xFF(65535) and red
- * If the cluster points to another cluster, its value is blue
- * 
- * @param width the number of FAT entries to print per line
+ * @param name string containing name of file
+ * @param write true to lock for writing, false for reading
  */
-void FileSys::printFAT(int width) {
-	int i;
-	string titleRow;
-	string rowDivide;
-	string title = "File Allocation Table";
-	for (i = 0; i < width; i++) {
-		rowDivide += "-----------";
+void FileSys::lockFile(string name, bool write) {
+	if (write) {
+		pthread_rwlock_wrlock(&fileLocks[fileLockFor(name)]);
+	} else {
+		pthread_rwlock_rdlock(&fileLocks[fileLockFor(name)]);
 	}
-	titleRow = rowDivide;
-	
-	cout << titleRow.replace(titleRow.length()/2-title.length()/2, 
-							title.length(), title);
-	for (i = 0; i < numClusters; i++) {
-		if (i % width == 0) {
-			cout << endl;
-		}
-		cout << "\033[1;1m" << setw(4) << i << ":";
-		if (fileAllocationTable[i] == 0x0000) {
-			cout << "\033[0;32m";
-		} else if (fileAllocationTable[i] >= 0xFFFE) {
-			cout << "\033[0;31m";
-		} else {
-			cout << "\033[0;34m";
-		}
-		cout << setw(5) << fileAllocationTable[i];
-		cout << "\033[0m" << "|";
+}
 
-	}
-	cout << endl << endl;
+/**
+ * Unlocks a file locked with lockFile().
+ *
+ * @param name string containing name of file
+ */
+void FileSys::unlockFile(string name) {
+	pthread_rwlock_unlock(&fileLocks[fileLockFor(name)]);
 }
 
 /**
- * The "ls" functionality of the filesystem.
+ * Locks one file for reading and another for writing, lowest stripe
+ * first so two copies going opposite ways can't deadlock.
  *
- * Prints out all non-empty and non-deleted entries
- * in the given DirectoryTable array
- * 
- * @param table the DirectoryTableEntry to print (aka the directory)
+ * @param readName string containing name of the file being read
+ * @param writeName string containing name of the file being written
  */
-void FileSys::printDirectoryTable(vector<DirectoryTableEntry> table) {
-	int i;
-	time_t time;
+void FileSys::lockFiles(string readName, string writeName) {
+	int readLock = fileLockFor(readName);
+	int writeLock = fileLockFor(writeName);
 
-	cout << setw(5) << "" << left << setw(17) << "Filename";
-	cout << left << setw(11) << "Index";
-	cout << left << setw(10) << "Size";
-	cout << left << setw(10) << "Type";
-	cout << left << setw(25) << "Created";
+	if (readLock == writeLock) {
+		pthread_rwlock_wrlock(&fileLocks[writeLock]);
+	} else if (readLock < writeLock) {
+		pthread_rwlock_rdlock(&fileLocks[readLock]);
+		pthread_rwlock_wrlock(&fileLocks[writeLock]);
+	} else {
+		pthread_rwlock_wrlock(&fileLocks[writeLock]);
+		pthread_rwlock_rdlock(&fileLocks[readLock]);
+	}
+}
 
-	cout << endl;
-	cout << setfill('-') << setw(75) << "";
-	cout << setfill(' ');
+/**
+ * Unlocks two files locked with lockFiles().
+ *
+ * @param readName string containing name of the file being read
+ * @param writeName string containing name of the file being written
+ */
+void FileSys::unlockFiles(string readName, string writeName) {
+	int readLock = fileLockFor(readName);
+	int writeLock = fileLockFor(writeName);
 
-	for (i = 0; i < table.size(); i++) {
-		if (table[i].name[0] != (char)0x00 && table[i].name[0] != (char)0xFF) {
-			cout << endl;
-			cout << left << setw(5) << i << left << setw(17) << table[i].name;
-			cout << right << setw(5) << table[i].index;
-			cout << right << setw(10) << table[i].size;
-			cout << right << setw(10) << table[i].type;
+	pthread_rwlock_unlock(&fileLocks[writeLock]);
+	if (readLock != writeLock) {
+		pthread_rwlock_unlock(&fileLocks[readLock]);
+	}
+}
 
-			time = table[i].creation;
-			cout << " ";
-			cout << right << setw(30) << ctime(&time);
+/**
+ * Takes every file lock and the metadata lock for writing, for operations
+ * that touch every file at once (rm *, fsck, defrag).
+ */
+void FileSys::lockAll() {
+	int i;
 
-		
-		}
+	for (i = 0; i < FILE_LOCK_STRIPES; i++) {
+		pthread_rwlock_wrlock(&fileLocks[i]);
 	}
-	cout << setfill('-') << setw(75) << "";
-	cout << setfill(' ') << endl;;
+	pthread_rwlock_wrlock(&metaLock);
 }
 
 /**
- * Prints the current directory table.
+ * Releases everything taken by lockAll().
  */
-void FileSys::printDirectoryTable() {
-	printDirectoryTable(directoryTable);
+void FileSys::unlockAll() {
+	int i;
+
+	pthread_rwlock_unlock(&metaLock);
+	for (i = FILE_LOCK_STRIPES - 1; i >= 0; i--) {
+		pthread_rwlock_unlock(&fileLocks[i]);
+	}
 }
 
 /**
  * Deconstructor
  */
 FileSys::~FileSys() {
+	int i;
+
+	stopTrace();
+	stopReclaimer();
+	pthread_mutex_destroy(&reclaimLock);
+	pthread_cond_destroy(&reclaimWake);
+
+	if (changeFd != -1) {
+		if (fd != -1) {
+			syncFileSys();
+		}
+		writeChangeMap(true);
+		close(changeFd);
+	}
+	delete[] changeMap;
+	pthread_mutex_destroy(&changeLock);
+
+	delete clusterIndex;
+	delete allocator;
 	delete[] fileAllocationTable;
+	delete[] fatOnDisk;
+	delete[] held;
 	delete boot;
-	fclose(file);
+	if (fd != -1) {
+		close(fd);
+	}
+	stopStripes();
+	for (i = 0; i < stripes.size(); i++) {
+		if (i > 0 && stripes[i]->fd != -1) {
+			close(stripes[i]->fd);
+		}
+		if (stripeUnit != 0) {
+			pthread_mutex_destroy(&stripes[i]->lock);
+			pthread_cond_destroy(&stripes[i]->wake);
+			pthread_cond_destroy(&stripes[i]->finished);
+		}
+		delete stripes[i];
+	}
+
+	pthread_rwlock_destroy(&metaLock);
+	for (i = 0; i < FILE_LOCK_STRIPES; i++) {
+		pthread_rwlock_destroy(&fileLocks[i]);
+	}
+
+	for (i = 0; i < MAX_OPEN_FILES; i++) {
+		delete handles[i];
+	}
+	pthread_mutex_destroy(&handleLock);
 }
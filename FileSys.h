@@ -5,6 +5,7 @@
 #include <iomanip>
 #include <algorithm>
 #include <vector>
+#include <map>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <string.h>
@@ -13,13 +14,147 @@
 #include <string>
 #include <time.h>
 #include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fnmatch.h>
 
-#define MAX_FILE_SIZE 50 //MB
+#include "ClusterIndex.h"
+#include "Profiler.h"
+
+class Allocator;
+class Tracer;
+class FileSys;
+
+#define MAX_FILE_SIZE 2047 //MB; keeps every offset in the image below 2 GB
 #define MIN_FILE_SIZE 5 //MB
-#define MIN_CLUSTER_SIZE 8 //KB
-#define MAX_CLUSTER_SIZE 16 //KB
+#define MIN_CLUSTER_SIZE 4 //KB
+#define MAX_CLUSTER_SIZE 1024 //KB
+#define MAX_CLUSTERS 0xFFFC //clusters in a volume; FAT values from here up are markers
 #define DT_ENTRY_SIZE 128 //Bytes
 #define BOOT_RECORD_SIZE 16 //Bytes
+#define FILE_LOCK_STRIPES 64 //per-file locks are hashed into this many
+#define MAX_OPEN_FILES 256 //most file handles open at once
+#define VOLUME_HEADER_SIZE 32 //Bytes; follows the boot record
+#define VOLUME_MAGIC 0x58544146 //"FATX"; marks a volume header as present
+#define VOLUME_VERSION 4 //2 added snapshots, 3 small files, 4 striping
+#define EXTENT_NAME_SIZE 72 //Bytes of the name kept on extent volumes
+#define EXTENTS_INLINE 4 //extents kept in the directory entry itself
+#define EXTENT_CLUSTER 0xFFFE //FAT value of a cluster used by an extent
+#define SNAPSHOT_CLUSTER 0xFFFD //FAT value of a cluster holding snapshot metadata
+#define SNAPSHOT_NAME_SIZE 32 //Bytes; names are at most 31 characters
+#define MAX_SNAPSHOTS 16 //most snapshots kept at once
+#define SMALL_NAME_SIZE 48 //Bytes of the name kept by small files
+#define INLINE_DATA_SIZE 64 //Bytes; files this size or smaller live in their entry
+#define PACK_SLOT_SIZE 256 //Bytes; pack clusters are shared out in slots this size
+#define PACK_MAX_SIZE 2048 //Bytes; files this size or smaller are packed
+#define PACK_CLUSTER 0xFFFC //FAT value of a cluster holding packed files
+#define RECLAIM_BATCH 1024 //most clusters the reclaimer frees per pass
+#define CHANGE_MAGIC 0x47484346 //"FCHG"; marks a changed-cluster map
+#define ZERO_FILL_CHUNK (1024 * 1024) //bytes written at a time by a zero-fill format
+#define PIPE_CHUNK_SIZE (256 * 1024) //bytes sendFile()/receiveFile() move per hold of the file's lock
+#define IMPORT_BUFFER_SIZE (1024 * 1024) //bytes a streaming import reads at a time; it has two
+#define MAX_STRIPE_MEMBERS 8 //most backing files a volume is striped over, the image included
+#define STRIPE_NAME_SIZE 256 //Bytes of each member's name in the stripe table
+#define STRIPE_TABLE_OFFSET 48 //where the stripe table starts; after the volume header, in cluster 0
+#define STRIPE_PARALLEL_MIN (128 * 1024) //bytes an I/O has to span before members do their parts at once
+
+//DirectoryTableEntry types, besides File (0x00) and Directory (0xFF)
+#define TYPE_INLINE 0x01 //small file kept in its directory entry
+#define TYPE_PACKED 0x02 //small file kept in a run of slots of a pack cluster
+
+//VolumeHeader flags
+#define VOLUME_EXTENTS 0x01 //files are lists of extents, not FAT chains
+#define VOLUME_DISCARD 0x02 //freed clusters are punched out of the image
+#define VOLUME_STRIPED 0x04 //spread over several backing files (see StripeMember)
+
+//VolumeHeader allocators; which free cluster is handed out next (see Allocator)
+#define ALLOC_FIRST_FIT 0 //the lowest free cluster
+#define ALLOC_NEXT_FIT 1 //the first free one after the last handed out
+#define ALLOC_BEST_FIT 2 //the smallest free run that fits what's being written
+#define ALLOC_NEAR 3 //the free one closest to the file's last cluster
+#define ALLOC_POLICIES 4
+
+//openFile() flags
+#define FS_READ 0x01 //handle can be read from
+#define FS_WRITE 0x02 //handle can be written to
+#define FS_CREATE 0x04 //create the file if it doesn't exist
+#define FS_TRUNCATE 0x08 //cut the file to 0 bytes when opened (needs FS_WRITE)
+#define FS_APPEND 0x10 //every write goes to the end of the file
+
+//createFileSys() backings; how the image file is sized when formatted
+#define FS_BACKING_SPARSE 0 //ftruncate to full size; blocks allocated as written
+#define FS_BACKING_FALLOCATE 1 //every block reserved up front, without writing it
+#define FS_BACKING_ZERO 2 //every block written with zeros up front
+
+/**
+ * What FileSys methods return when they fail; anything 0 or over is
+ * success (a count, an index or a handle). A few methods have failures
+ * of their own, below FS_ERR_NO_SPACE, listed where they're declared.
+ */
+enum FsError {
+	FS_OK = 0,
+	FS_ERR_FAILED = -1, //no such file, bad argument, or the image couldn't be read or written
+	FS_ERR_NO_SPACE = -2 //out of clusters (or of room for the image on the host)
+};
+
+/**
+ * A file in the directory, as listed by FileSys::listEntries()
+ */
+struct FileInfo {
+	string name;
+	int entry; //where it is in the directory table
+	unsigned int index; //first cluster (the pack cluster for packed files)
+	unsigned int size; //in bytes
+	unsigned int type; //File(0x00), Directory(0xFF) or a small file (TYPE_*)
+	time_t created;
+};
+
+/**
+ * Everything "df" shows, as filled in by FileSys::getStats()
+ */
+struct FileSysStats {
+	string name; //the image's name
+	unsigned int size; //of the volume, in bytes
+	int clusterSize; //in bytes
+	int clusters; //in the volume, system clusters included
+	int usedClusters; //deleted files' clusters included until they're freed
+	int availableClusters; //free and not held by a snapshot; what can be handed out
+	bool extents; //files are stored as extents rather than FAT chains
+	int allocator; //ALLOC_* policy
+	int fatClusters; //clusters the FAT takes on disk
+	int fatMemory; //bytes the FAT takes in memory
+	int pendingClusters; //held by deleted files the reclaimer hasn't freed yet
+	int pendingFiles; //those deleted files
+	long long hostAllocated; //bytes the image takes on the host
+	bool discarding; //freed clusters are punched out of the image
+	int heldClusters; //free but kept by snapshots
+	int snapshots;
+	bool readOnly; //a snapshot is mounted
+	int stripeMembers; //backing files the volume is spread over; 1 if not striped
+	int stripeUnit; //bytes dealt to each in turn; 0 if not striped
+	int inlineFiles; //small files kept in their directory entry
+	int packedFiles; //small files packed into shared clusters
+	int packClusters; //clusters those are packed into
+	int directoryEntries; //slots in the directory table, used or not
+	int directoryFiles; //slots holding a file
+	int directoryHoles; //free or deleted slots before the last file; every lookup scans them
+};
+
+/**
+ * Starts the changed-cluster map, kept beside the image in <image>.chg.
+ * The map itself follows: for every cluster, the generation it was last
+ * written in.
+ */
+struct ChangeHeader {
+	unsigned int magic; //CHANGE_MAGIC
+	unsigned int generation; //what clusters written now are stamped with
+	unsigned int applied; //generation of the last delta applied to the image
+	unsigned int clean; //0 while mounted; the map can't be trusted after a crash
+	unsigned int numClusters; //entries in the map
+	unsigned int reserved;
+};
 
 /**
  * Should reside at address 0 in FileSys 
@@ -29,39 +164,229 @@ struct BootRecord {
 	unsigned int clusterSize; //the size of the cluster, in bytes
 	unsigned int size; //the total size of the disk, in bytes
 	unsigned int rootDir; //index to the cluster storing the root directory
-	unsigned int FAT; //index to the cluster storing the FAT table
+	unsigned int FAT; //index to the first cluster storing the FAT table; the
+					//FAT takes as many clusters as it needs, one after another
+};
+
+/**
+ * Should reside right after the boot record; 32 bytes (VOLUME_HEADER_SIZE).
+ * Volumes made before it existed have zeros here and are chain volumes;
+ * volumes made before the allocator was kept have zeros from allocator on,
+ * and allocate first fit.
+ *
+ * A striped volume's header is followed by its stripe table: the names of
+ * its other members (stripeMembers - 1 of them, STRIPE_NAME_SIZE bytes
+ * each), relative to the image's directory unless they start with '/'.
+ */
+struct VolumeHeader {
+	unsigned int magic; //VOLUME_MAGIC
+	unsigned int version; //VOLUME_VERSION
+	unsigned int flags; //VOLUME_* flags
+	unsigned int snapshots; //cluster holding the snapshot table; 0 if none
+	unsigned int allocator; //ALLOC_* policy
+	unsigned int stripeUnit; //bytes; a multiple of the cluster size (VOLUME_STRIPED)
+	unsigned int stripeMembers; //backing files, the image included (VOLUME_STRIPED)
+	unsigned int reserved;
+};
+
+/**
+ * A snapshot, as kept in the snapshot table (one cluster; a free slot has
+ * an empty name). The FAT and directory as they were when it was taken
+ * are saved in one run of clusters: the FAT, then the directory.
+ */
+struct SnapshotEntry {
+	char name[SNAPSHOT_NAME_SIZE];
+	unsigned int created; //when it was taken (unix epoch format)
+	unsigned int fat; //first cluster of the saved FAT
+	unsigned int fatClusters; //clusters the saved FAT takes
+	unsigned int dir; //first cluster of the saved directory
+	unsigned int dirClusters; //clusters the saved directory takes
+	unsigned int flags; //VOLUME_* flags the volume had when it was taken
+	unsigned int reserved[2];
+};
+
+/**
+ * A run of clusters next to each other on disk
+ */
+struct Extent {
+	unsigned int start; //first cluster of the run
+	unsigned int length; //clusters in the run
+};
+
+/**
+ * Where an extent volume keeps a file's layout: the end of the directory
+ * entry's name (names are cut to EXTENT_NAME_SIZE - 1 characters). Extents
+ * past the first EXTENTS_INLINE go in overflow blocks.
+ */
+struct ExtentInfo {
+	unsigned int count; //extents in the file, inline and overflow
+	unsigned int overflow; //first overflow block; 0 if none
+	Extent extents[EXTENTS_INLINE];
+};
+
+/**
+ * Start of an overflow block; a cluster holding this and then as many
+ * extents as fit
+ */
+struct ExtentBlock {
+	unsigned int count; //extents in this block
+	unsigned int next; //next overflow block; 0 if this is the last
+};
+
+/**
+ * Where a small file (PACK_MAX_SIZE bytes or less, with a name shorter than
+ * SMALL_NAME_SIZE) keeps its data: the end of the directory entry's name.
+ * Small files have no chain or extents, and their entry's index is the
+ * pack cluster they're in (0 if inline).
+ */
+union SmallInfo {
+	char data[INLINE_DATA_SIZE]; //TYPE_INLINE: the whole file
+	unsigned int slot; //TYPE_PACKED: first of the file's slots in the pack cluster
 };
 
 /**
  * Should be 128 bytes (DT_ENTRY_SIZE)
  */
 struct DirectoryTableEntry {
-	char name[112]; //Filname; first byte signifies free(0x00) or deleted(0xFF)
+	char name[112]; //Filname; first byte signifies free(0x00), deleted(0xFF)
+					//or deleted but clusters not yet freed(0xFE)
 	unsigned int index; //index of first cluster
 	unsigned int size; //size of file, in bytes (0 for directories)
-	unsigned int type; //File(0x00) or Directory(0xFF)
+	unsigned int type; //File(0x00), Directory(0xFF) or a small file (TYPE_*)
 	unsigned int creation; //create date of file (unix epoch format)
 };
 
+/**
+ * A streaming import under way (see FileSys::importStream()): one buffer
+ * is read into while the writer thread writes the other behind it
+ */
+struct ImportStream {
+	FileSys *fs;
+	string name; //the file being imported
+	char *buffers[2];
+	int lengths[2]; //bytes read into each
+	int pending; //the buffer handed to the writer; -1 once it's written
+	bool done; //no more buffers are coming
+	bool started; //the file's first cluster (from its entry) has been written
+	int cluster; //the file's last cluster so far
+	int result; //0; -2 once out of clusters (the rest is then dropped)
+	pthread_mutex_t lock; //guards pending, done and result
+	pthread_cond_t changed; //signalled when pending or done changes
+};
+
+/**
+ * Part of an I/O that falls in one stripe unit, so on one member
+ */
+struct StripePiece {
+	char *buf; //where in the caller's buffer
+	int length;
+	off_t offset; //in the member's file
+};
+
+/**
+ * One member's share of an I/O on a striped volume. Done by the member's
+ * worker (see FileSys::stripeWorker()) while the caller does another's.
+ */
+struct StripeJob {
+	int fd; //the member's file
+	bool write;
+	vector<StripePiece> pieces;
+	int done; //bytes read or written
+	int syscalls; //counted to the caller's operation once it's finished
+	bool finished;
+};
+
+/**
+ * A backing file of a striped volume. The volume is cut into stripe units
+ * dealt out to the members in turn: unit k is the (k / members)th unit of
+ * member k % members. Member 0 is the image itself.
+ */
+struct StripeMember {
+	string name; //as kept in the stripe table
+	int fd;
+	pthread_t worker; //does the member's share of I/Os big enough to split
+	bool running;
+	bool stop; //tells the worker to finish up
+	vector<StripeJob*> queue; //jobs handed to the worker, oldest first
+	pthread_mutex_t lock; //guards queue, stop and every queued job's finished
+	pthread_cond_t wake; //signalled when a job is queued or stop is set
+	pthread_cond_t finished; //signalled when a job is finished
+};
+
+/**
+ * An open file, as handed out by FileSys::openFile()
+ */
+struct FileHandle {
+	string name;
+	int flags; //FS_* flags it was opened with
+	int entry; //where the file was in the directory; checked before use
+	int offset; //current position, in bytes
+};
+
 class FileSys {
+	friend class FileSysCheck;
+	friend class Defragmenter;
+	friend class Replicator;
+	friend class Allocator;
+
 	public:
+		FileSys();
 		~FileSys();
 		int openFileSys(string name);
 		int createFileSys(string name, int fSize, int cSize);
-		
-		void printFAT(int width);
-		void printDirectoryTable();
-		void printDirectoryTable(vector<DirectoryTableEntry> table);
+		int createFileSys(string name, int fSize, int cSize, int backing);
+		int createFileSys(string name, int fSize, int cSize, int backing,
+							vector<string> *members, int stripeUnit);
 		int createFile(string name);
 		int copyFile(string source, string dest, 
 						bool sourceInFileSys, bool destInFileSys);
 		int moveFile(string source, string dest, 
 						bool sourceInFileSys, bool destInFileSys);
+		int copyFileFrom(FileSys *from, string source, string dest);
+		int moveFileFrom(FileSys *from, string source, string dest);
 		int removeFile(string name);
-		void showStructure();
-		int printFile(string name);
-		void printInfo(int width, vector<DirectoryTableEntry> *table);
-		void printInfo();
+		int getStats(FileSysStats *stats);
+		int getFAT(vector<int> *fat);
+		int listEntries(vector<FileInfo> *entries);
+		int listFiles(string pattern, vector<string> *names);
+		int getFileSize(string name);
+		void beginBatch();
+		void flushBatch();
+		void endBatch();
+		int openFile(string name, int flags);
+		int readFile(int handle, void *buf, int length);
+		int readFileAt(int handle, void *buf, int length, int offset);
+		int writeFile(int handle, const void *buf, int length);
+		int writeFileAt(int handle, const void *buf, int length, int offset);
+		int sendFile(int handle, int out, int length);
+		int receiveFile(int handle, int in, int length);
+		int importFile(int in, string dest);
+		int seekFile(int handle, int offset, int whence);
+		int truncateFile(int handle, int length);
+		int closeFile(int handle);
+		int convertToExtents();
+		bool isExtentVolume();
+		int getUsedClusters();
+		int getReclaimBacklog(int *files);
+		int setDiscard(bool on);
+		bool isDiscarding();
+		int trimFileSys(long long *before, long long *after);
+		long long getHostAllocated();
+		unsigned int getGeneration();
+		int createSnapshot(string name);
+		int deleteSnapshot(string name);
+		int rollbackSnapshot(string name);
+		int mountSnapshot(string name);
+		int listSnapshots(vector<SnapshotEntry> *list);
+		bool isReadOnly();
+		int setAllocator(int policy);
+		int getAllocator();
+		int getOpStats(vector<OpStats> *stats);
+		string formatOpStats(bool json);
+		void resetOpStats();
+		int startTrace(string path);
+		long long stopTrace();
+		bool isTracing();
 
 	private:
 		void writeDirectoryTable(vector<DirectoryTableEntry> *table, int cluster);
@@ -70,24 +395,146 @@ class FileSys {
 		void readFAT(int *fat, int cluster);
 		void writeBootRecord(BootRecord *boot);
 		void readBootRecord(BootRecord *boot);
+		void writeVolumeHeader(VolumeHeader *header);
+		void readVolumeHeader(VolumeHeader *header);
+		int sizeImage(int file, off_t size, int backing);
+		void syncFileSys();
+		int readAt(void *buf, int length, off_t offset);
+		int writeAt(const void *buf, int length, off_t offset);
+		int sendAt(int out, int length, off_t offset, bool *splicing);
+		int copyAt(FileSys *from, off_t fromOffset, int length, off_t offset, bool *ranging);
+		int memberAt(off_t *offset, int *length);
+		int memberFd(int member);
+		int memberCount();
+		string memberPath(string name);
+		int openStripes();
+		int stripeAt(char *buf, int length, off_t offset, bool write);
+		void startStripes();
+		void stopStripes();
+		static void *stripeWorker(void *arg);
+		static void runStripeJob(StripeJob *job);
+		int readCluster(int cluster, void *buf, int length);
+		int writeCluster(int cluster, const void *buf, int length);
+		int readFileChain(string name, vector<int> *clusters, unsigned int *size,
+							void *small);
+		int allocateAfter(int cluster, int wanted);
+		int appendCluster(string name, int cluster, int wanted);
+		int mapFile(int index, vector<int> *clusters);
+		void cutFile(int index, int keep);
+		void freeFile(int index);
+		ExtentInfo *getExtentInfo(int index);
+		int readExtents(int index, vector<Extent> *extents);
+		int writeExtents(int index, vector<Extent> *extents);
+		void freeExtentBlocks(int block);
+		int findExtentBlocks(int block, vector<int> *blocks);
+		void indexExtents(vector<Extent> *extents, vector<ClusterRun> *runs);
 		int findNextFreeCluster();
+		int findNextFreeCluster(int near, int wanted);
+		void releaseCluster(int cluster);
+		int flushDiscards();
+		bool isFree(int cluster);
+		bool isHeld(int cluster);
+		int findFreeRun(int length);
+		void loadSnapshots();
+		void buildHeldMap();
+		int findSnapshot(string name);
+		void writeSnapshotTable();
+		int readSnapshot(int snapshot, int *fat, vector<DirectoryTableEntry> *table);
+		int writableCluster(FileHandle *h, int *first, int clusterNumber,
+							bool whole, bool *moved);
+		int redirectCluster(int entry, int clusterNumber, int old, bool whole);
+		bool isSmall(int index);
+		SmallInfo *getSmallInfo(int index);
+		int readSmall(int index, void *buf, int length, int offset);
+		int storeSmall(int index, const void *buf, int size);
+		int updateSmall(int index, const void *buf, int length, int offset,
+						unsigned int end);
+		int writeSmall(FileHandle *h, const void *buf, int length, int offset);
+		int unpackFile(int index);
+		int findSlots(int count, unsigned int *slot);
+		bool releaseSlots(int cluster, unsigned int slot, unsigned int size);
+		void loadPackSlots();
+		void openChangeMap(bool fresh);
+		void writeChangeMap(bool clean);
+		void markChanged(off_t offset, int length);
+		int punchRuns(vector<int> *clusters);
+		int reclaimPending(int maxClusters);
+		void startReclaimer();
+		void stopReclaimer();
+		static void *reclaimWorker(void *arg);
 		int findUsedClusterCount();
 		int findIndexForFile(string name);
+		int createFileEntry(string name, bool small, int wanted);
+		int removeFileEntry(string name);
 		int removeFile(int index);
 		int copyFileInternally(string source, string dest);
 		int copyFileInToExt(string source, string dest);
 		int copyFileExtToIn(string source, string dest);
+		int transferFrom(FileSys *from, string source, string dest, unsigned int *size);
+		int importStream(int in, string dest, unsigned int *size);
+		int writeImport(ImportStream *stream, int buffer);
+		static void *importWriter(void *arg);
+		static int readStream(int in, char *buf, int length);
 		int getDirectoryFileCount(vector<DirectoryTableEntry> table);
 		void compressDirectoryTable(vector<DirectoryTableEntry> *table, int cluster);
+		int fileLockFor(string name);
+		void lockFile(string name, bool write);
+		void unlockFile(string name);
+		void lockFiles(string readName, string writeName);
+		void unlockFiles(string readName, string writeName);
+		void lockAll();
+		void unlockAll();
+		FileHandle *getHandle(int handle);
+		int findHandleEntry(FileHandle *h);
+		int lookupCluster(string name, int first, int clusterNumber);
+		int readHandle(FileHandle *h, void *buf, int length, int offset);
+		int sendHandle(FileHandle *h, int out, int length, int offset);
+		int writeHandle(FileHandle *h, const void *buf, int length, int offset);
 	
 		
 		string sysName;
-		FILE *file;
+		int fd; //opened with positional I/O only; there's no shared offset
+		vector<StripeMember*> stripes; //every backing file, fd first; empty if not striped
+		off_t stripeUnit; //bytes; 0 if not striped
+		int batchDepth; //> 0 while FAT/directory writes are being held back
+		bool fatDirty; //FAT changed since it was last written (batch mode)
+		bool directoryDirty; //directory changed since last written (batch mode)
+		pthread_rwlock_t metaLock; //guards the FAT, directory and usedClusters
+		pthread_rwlock_t fileLocks[FILE_LOCK_STRIPES]; //taken before metaLock
+		pthread_mutex_t handleLock; //guards the handles table itself
+		FileHandle *handles[MAX_OPEN_FILES]; //NULL where no file is open
+		ClusterIndex *clusterIndex; //runs of recently used chains
+		Allocator *allocator; //picks free clusters, by header.allocator
 		int usedClusters;
+		int heldClusters; //free in the FAT but kept by snapshots
 		int entriesPerTable;
 		int numClusters;
 		int *fileAllocationTable;
+		int *fatOnDisk; //the FAT as last written; only what differs is rewritten
 		vector<DirectoryTableEntry> directoryTable;
 		BootRecord *boot;
+		VolumeHeader header;
+		bool usingExtents; //header.flags has VOLUME_EXTENTS
+		int pendingFiles; //deleted files whose clusters aren't freed yet
+		int pendingClusters; //clusters those files still hold
+		pthread_t reclaimer; //frees deleted files' clusters in the background
+		bool reclaimerRunning;
+		bool reclaimStop; //tells the reclaimer to finish up
+		bool reclaimWork; //set when a file is deleted
+		pthread_mutex_t reclaimLock; //guards the three flags above
+		pthread_cond_t reclaimWake; //signalled when any of them change
+		bool discarding; //header.flags has VOLUME_DISCARD
+		vector<int> discardQueue; //freed clusters not yet punched out
+		ChangeHeader changes;
+		unsigned int *changeMap; //generation each cluster was last written in
+		int changeFd; //the <image>.chg file; -1 if it couldn't be opened
+		pthread_mutex_t changeLock; //guards changeMap
+		vector<SnapshotEntry> snapshots; //as in the snapshot table
+		char *held; //1 for every cluster a snapshot holds; NULL if no snapshots
+		bool readOnly; //a snapshot is mounted; nothing may be written
+		map<int, vector<char> > packSlots; //pack cluster -> which of its slots are used
+		int packHint; //pack cluster the last slots were found in
+		Profiler profiler; //counts and times every operation
+		Tracer *tracer; //records every call while tracing; NULL if not
 };
 #endif
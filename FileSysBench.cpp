@@ -0,0 +1,1687 @@
+/**
+ * Benchmark driver for the FileSys. Builds scratch file systems and times
+ * operations against them. Built with "make bench"; run as
+ *
+ * ./fsbench [-json] [scratch-image]
+ *
+ * The scratch image goes in /dev/shm when there is one, so the numbers
+ * are the file system's own rather than the host disk's, and the random
+ * data and sizes are the same every run. With -json the tables aren't
+ * printed; every result goes to standard output as one JSON document
+ * instead, for keeping and comparing between versions.
+ *
+ * @author: Eduardo Rodrigues - emr4378
+ */
+
+#include <iostream>
+#include <fstream>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/wait.h>
+using namespace std;
+
+#include "FileSys.h"
+#include "Defragmenter.h"
+#include "Allocator.h"
+
+#define BENCH_VOLUME_SIZE 50 //MB; scratch file system size, unless a run says otherwise
+#define BENCH_CLUSTER_SIZE 16 //KB; scratch file system cluster size, likewise
+#define BENCH_FILES 32 //files imported for the read benchmark
+#define BENCH_FILE_SIZE (1024 * 1024) //size of each file, in bytes
+#define BENCH_READ_ROUNDS 4 //times every file is read per thread count
+#define BENCH_RANDOM_READS 20000 //random reads per file size
+#define BENCH_RANDOM_READ_SIZE 512 //bytes per random read
+#define BENCH_RANDOM_CHUNK (64 * 1024) //contiguous bytes between fragments
+#define BENCH_BACKING_SIZE (32 * 1024 * 1024) //bytes written per backing
+#define BENCH_BACKING_CHUNK (64 * 1024) //bytes per write
+#define BENCH_SNAPSHOT_SIZE (8 * 1024 * 1024) //bytes overwritten per pass
+#define BENCH_SMALL_FILES 1000 //tiny files written per layout
+#define BENCH_SMALL_MAX 2000 //largest tiny file, in bytes
+#define BENCH_SWEEP_DATA (64 * 1024 * 1024) //bytes of files written per run
+#define BENCH_SWEEP_MAX (16 * 1024 * 1024) //largest file in any mix
+#define BENCH_AGING_VOLUME 64 //MB; volume each allocator is aged on (4 KB clusters)
+#define BENCH_AGING_FULL 70 //% of the volume kept full of files
+#define BENCH_AGING_ROUNDS 20 //times a quarter of the files are replaced
+#define BENCH_AGING_MAX (1024 * 1024) //largest file written
+#define BENCH_AGING_CHUNK (16 * 1024) //bytes per write
+#define BENCH_AGING_WRITERS 4 //files written at once, a chunk each in turn
+#define BENCH_MOUNTS 20 //times each volume is mounted
+#define BENCH_MOUNT_FILES 200 //files on each volume mounted
+#define BENCH_LOOKUPS 10000 //random lookups per directory size
+#define BENCH_TRANSFER_DATA (16 * 1024 * 1024) //bytes imported per file size
+#define BENCH_TRANSFER_FILES 512 //most files imported per file size
+#define BENCH_STRIPE_DATA (64 * 1024 * 1024) //bytes written and read per stripe set
+#define BENCH_STRIPE_CHUNK (1024 * 1024) //bytes per write and read
+#define BENCH_STRIPE_UNIT 64 //KB dealt to each member in turn
+#define BENCH_STRIPE_ROUNDS 4 //times the file is read per stripe set
+#define BENCH_SEED 4378 //seeds rand(), so every run writes the same data
+
+/**
+ * One number measured by one benchmark, for -json
+ */
+struct BenchResult {
+	string bench; //which benchmark
+	string params; //what it was measured with, as "name=value,name=value"
+	string metric; //what was measured, unit included
+	double value;
+};
+
+static vector<BenchResult> results; //everything measured so far
+
+/**
+ * What each reader thread is given
+ */
+struct ReaderArgs {
+	FileSys *fs;
+	int first; //first file this thread reads
+	int stride; //number of threads; read every stride'th file
+	long long bytes; //bytes read, filled in by the thread
+};
+
+/**
+ * What a feeder thread writes down a pipe, for streaming imports
+ */
+struct PipeFeeder {
+	int fd; //the pipe's write end; closed once it's all written
+	char *data;
+	int length;
+};
+
+/**
+ * Current time in seconds.
+ */
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Keeps a result for the JSON report.
+ *
+ * @param bench which benchmark
+ * @param params what it was measured with, as "name=value,name=value"
+ * @param metric what was measured, unit included
+ * @param value the measurement
+ */
+static void record(string bench, string params, string metric, double value) {
+	BenchResult result;
+
+	result.bench = bench;
+	result.params = params;
+	result.metric = metric;
+	result.value = value;
+	results.push_back(result);
+}
+
+/**
+ * A value as JSON: as it is if it's a number, quoted otherwise.
+ */
+static string jsonValue(string value) {
+	char *end;
+
+	strtod(value.c_str(), &end);
+	return (!value.empty() && *end == '\0') ? value : "\"" + value + "\"";
+}
+
+/**
+ * Writes every result kept by record() as one JSON document.
+ *
+ * @param image the scratch image the benchmarks ran on
+ */
+static void printJSON(string image) {
+	int i;
+	size_t start;
+	size_t comma;
+	size_t equals;
+	string param;
+
+	cout << "{" << endl;
+	cout << "  \"volume_version\": " << VOLUME_VERSION << "," << endl;
+	cout << "  \"timestamp\": " << time(NULL) << "," << endl;
+	cout << "  \"image\": \"" << image << "\"," << endl;
+	cout << "  \"seed\": " << BENCH_SEED << "," << endl;
+	cout << "  \"results\": [" << endl;
+	cout << setprecision(6);
+	cout.unsetf(ios::fixed);
+	for (i = 0; i < results.size(); i++) {
+		cout << "    {\"bench\": \"" << results[i].bench << "\", \"params\": {";
+		for (start = 0; start < results[i].params.size(); start = comma + 1) {
+			comma = results[i].params.find(',', start);
+			comma = (comma == string::npos) ? results[i].params.size() : comma;
+			param = results[i].params.substr(start, comma - start);
+			equals = param.find('=');
+			cout << ((start > 0) ? ", " : "") << "\"" << param.substr(0, equals) << "\": ";
+			cout << jsonValue(param.substr(equals + 1));
+		}
+		cout << "}, \"metric\": \"" << results[i].metric << "\", \"value\": ";
+		cout << results[i].value << "}" << ((i + 1 < results.size()) ? "," : "") << endl;
+	}
+	cout << "  ]" << endl;
+	cout << "}" << endl;
+}
+
+/**
+ * Name of the i'th benchmark file in the file system.
+ */
+static string benchFileName(int i) {
+	stringstream name;
+	name << "bench" << i;
+	return name.str();
+}
+
+/**
+ * Reader thread; exports its share of the files to /dev/null.
+ */
+static void *readFiles(void *arg) {
+	ReaderArgs *args = (ReaderArgs*)arg;
+	int i;
+
+	args->bytes = 0;
+	for (i = args->first; i < BENCH_FILES * BENCH_READ_ROUNDS; i += args->stride) {
+		if (args->fs->copyFile(benchFileName(i % BENCH_FILES), "/dev/null",
+								true, false) == 0) {
+			args->bytes += BENCH_FILE_SIZE;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Read throughput at 1 to 32 threads, each exporting whole files.
+ *
+ * @param fs the file system, already holding the benchmark files
+ */
+static void benchReadScaling(FileSys *fs) {
+	int threads;
+	int i;
+	long long bytes;
+	double start;
+	double seconds;
+	pthread_t workers[32];
+	ReaderArgs args[32];
+	stringstream name;
+
+	cout << "read scaling (" << BENCH_FILES << " x ";
+	cout << BENCH_FILE_SIZE / 1024 << " KB files, " << BENCH_READ_ROUNDS;
+	cout << " rounds)" << endl;
+	cout << right << setw(8) << "threads" << setw(12) << "MB/s" << endl;
+
+	for (threads = 1; threads <= 32; threads *= 2) {
+		start = now();
+		for (i = 0; i < threads; i++) {
+			args[i].fs = fs;
+			args[i].first = i;
+			args[i].stride = threads;
+			pthread_create(&workers[i], NULL, readFiles, &args[i]);
+		}
+		bytes = 0;
+		for (i = 0; i < threads; i++) {
+			pthread_join(workers[i], NULL);
+			bytes += args[i].bytes;
+		}
+		seconds = now() - start;
+
+		cout << setw(8) << threads;
+		cout << setw(12) << fixed << setprecision(1);
+		cout << (bytes / (1024.0 * 1024.0)) / seconds << endl;
+		name.str("");
+		name << "threads=" << threads;
+		record("read_scaling", name.str(), "mb_per_s", (bytes / (1024.0 * 1024.0)) / seconds);
+	}
+}
+
+/**
+ * Random read latency against file size. Each file is written in chunks
+ * with a cluster of another file in between, so its chain is fragmented
+ * and a lookup deep into it would be a long FAT walk without the index.
+ *
+ * @param image name of the scratch image to build the files in
+ * @return int 0 if it ran; -1 if the files couldn't be set up
+ */
+static int benchRandomReads(string image) {
+	int sizes[] = {64 * 1024, 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024};
+	int ret = 0;
+	int i;
+	int j;
+	int file;
+	int filler;
+	int handle;
+	double start;
+	double first;
+	double seconds;
+	char *chunk = (char*)calloc(BENCH_RANDOM_CHUNK, 1);
+	FileSys *fs = new FileSys();
+	stringstream name;
+
+	if (fs->createFileSys(image, BENCH_VOLUME_SIZE, BENCH_CLUSTER_SIZE) != 0) {
+		ret = -1;
+	}
+
+	filler = fs->openFile("filler", FS_WRITE | FS_CREATE | FS_APPEND);
+	cout << "random reads (" << BENCH_RANDOM_READS << " x ";
+	cout << BENCH_RANDOM_READ_SIZE << " bytes, a fragment every ";
+	cout << BENCH_RANDOM_CHUNK / 1024 << " KB)" << endl;
+	cout << right << setw(10) << "file KB" << setw(14) << "first us";
+	cout << setw(14) << "random us" << endl;
+
+	for (i = 0; i < 4 && ret == 0; i++) {
+		name.str("");
+		name << "random" << i;
+		file = fs->openFile(name.str(), FS_READ | FS_WRITE | FS_CREATE);
+		for (j = 0; j < sizes[i] && ret == 0; j += BENCH_RANDOM_CHUNK) {
+			if (fs->writeFile(file, chunk, BENCH_RANDOM_CHUNK) < 0
+				|| fs->writeFile(filler, chunk, BENCH_CLUSTER_SIZE * 1024) < 0) {
+				ret = -1;
+			}
+		}
+		fs->closeFile(file);
+
+		//a fresh handle on the file; the first read past the end indexes it
+		handle = fs->openFile(name.str(), FS_READ);
+		start = now();
+		fs->readFileAt(handle, chunk, BENCH_RANDOM_READ_SIZE,
+						sizes[i] - BENCH_RANDOM_READ_SIZE);
+		first = now() - start;
+
+		start = now();
+		for (j = 0; j < BENCH_RANDOM_READS; j++) {
+			fs->readFileAt(handle, chunk, BENCH_RANDOM_READ_SIZE,
+							rand() % (sizes[i] - BENCH_RANDOM_READ_SIZE));
+		}
+		seconds = now() - start;
+		fs->closeFile(handle);
+
+		cout << setw(10) << sizes[i] / 1024;
+		cout << setw(14) << fixed << setprecision(2) << first * 1e6;
+		cout << setw(14) << seconds * 1e6 / BENCH_RANDOM_READS << endl;
+		name.str("");
+		name << "file_kb=" << sizes[i] / 1024;
+		record("random_reads", name.str(), "first_us", first * 1e6);
+		record("random_reads", name.str(), "random_us", seconds * 1e6 / BENCH_RANDOM_READS);
+	}
+	fs->closeFile(filler);
+
+	delete fs;
+	free(chunk);
+	remove(image.c_str());
+	remove((image + ".chg").c_str());
+
+	return ret;
+}
+
+/**
+ * Format time and write throughput for each way of backing the image:
+ * sparse, fallocate and zero-filled. Writes are flushed to the host disk
+ * before the clock stops, since that's where the backings differ.
+ *
+ * @param image name of the scratch image to format
+ * @return int 0 if it ran; -1 if an image couldn't be formatted
+ */
+static int benchBacking(string image) {
+	string names[] = {"sparse", "fallocate", "zero"};
+	int ret = 0;
+	int backing;
+	int i;
+	int handle;
+	int fd;
+	double start;
+	double format;
+	double seconds;
+	char *chunk = (char*)malloc(BENCH_BACKING_CHUNK);
+	FileSys *fs;
+
+	for (i = 0; i < BENCH_BACKING_CHUNK; i++) {
+		chunk[i] = (char)rand();
+	}
+
+	cout << "backing (" << BENCH_BACKING_SIZE / (1024 * 1024) << " MB written in ";
+	cout << BENCH_BACKING_CHUNK / 1024 << " KB writes, then fsync)" << endl;
+	cout << right << setw(10) << "backing" << setw(12) << "format ms";
+	cout << setw(12) << "MB/s" << endl;
+
+	for (backing = 0; backing < 3 && ret == 0; backing++) {
+		fs = new FileSys();
+		start = now();
+		if (fs->createFileSys(image, BENCH_VOLUME_SIZE, BENCH_CLUSTER_SIZE, backing) != 0) {
+			ret = -1;
+		}
+		format = now() - start;
+
+		if (ret == 0) {
+			fd = open(image.c_str(), O_RDONLY);
+			//start from a clean page cache so earlier runs don't count
+			fsync(fd);
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+			start = now();
+			handle = fs->openFile("backing", FS_WRITE | FS_CREATE);
+			for (i = 0; i < BENCH_BACKING_SIZE; i += BENCH_BACKING_CHUNK) {
+				fs->writeFile(handle, chunk, BENCH_BACKING_CHUNK);
+			}
+			fs->closeFile(handle);
+			fsync(fd);
+			seconds = now() - start;
+			close(fd);
+
+			cout << setw(10) << names[backing];
+			cout << setw(12) << fixed << setprecision(2) << format * 1e3;
+			cout << setw(12) << setprecision(1);
+			cout << (BENCH_BACKING_SIZE / (1024.0 * 1024.0)) / seconds << endl;
+			record("backing", "backing=" + names[backing], "format_ms", format * 1e3);
+			record("backing", "backing=" + names[backing], "write_mb_per_s",
+					(BENCH_BACKING_SIZE / (1024.0 * 1024.0)) / seconds);
+		}
+		delete fs;
+		remove(image.c_str());
+		remove((image + ".chg").c_str());
+	}
+	free(chunk);
+
+	return ret;
+}
+
+/**
+ * Flushes a volume's backing files and drops them from the page cache, so
+ * what's timed next starts from the disk.
+ *
+ * @param files the image and every member
+ */
+static void syncMembers(vector<string> *files) {
+	int i;
+	int fd;
+
+	for (i = 0; i < files->size(); i++) {
+		fd = open((*files)[i].c_str(), O_RDONLY);
+		if (fd != -1) {
+			fsync(fd);
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+	}
+}
+
+/**
+ * Sequential throughput against the number of backing files a volume is
+ * striped over (1, 2 and 4): one BENCH_STRIPE_DATA file written in
+ * BENCH_STRIPE_CHUNK writes and flushed, then read back the same way.
+ * Each write or read of a run of clusters is split at stripe units and
+ * every member does its share at once, so the gain depends on the members
+ * being on devices (and CPUs) that can work in parallel; all of them are
+ * beside the scratch image here.
+ *
+ * @param image name of the scratch image; members are beside it
+ * @return int 0 if it ran; -1 if a volume couldn't be set up
+ */
+static int benchStriping(string image) {
+	int counts[] = {1, 2, 4};
+	int ret = 0;
+	int i;
+	int j;
+	int round;
+	int handle;
+	double seconds;
+	double megabytes = (double)BENCH_STRIPE_DATA / (1024 * 1024);
+	double write;
+	double read;
+	char *chunk = (char*)malloc(BENCH_STRIPE_CHUNK);
+	vector<string> members;
+	vector<string> files;
+	stringstream name;
+	FileSys *fs;
+
+	for (i = 0; i < BENCH_STRIPE_CHUNK; i++) {
+		chunk[i] = (char)rand();
+	}
+
+	cout << "striping (" << BENCH_STRIPE_DATA / (1024 * 1024) << " MB file, ";
+	cout << BENCH_STRIPE_CHUNK / 1024 << " KB writes and reads, ";
+	cout << BENCH_STRIPE_UNIT << " KB stripe unit)" << endl;
+	cout << right << setw(10) << "members" << setw(12) << "write MB/s";
+	cout << setw(12) << "read MB/s" << endl;
+
+	for (i = 0; i < 3 && ret == 0; i++) {
+		members.clear();
+		files.clear();
+		files.push_back(image);
+		for (j = 1; j < counts[i]; j++) {
+			name.str("");
+			name << image << ".m" << j;
+			members.push_back(name.str());
+			files.push_back(name.str());
+		}
+		fs = new FileSys();
+		if (fs->createFileSys(image, BENCH_STRIPE_DATA / (1024 * 1024) + BENCH_VOLUME_SIZE,
+								BENCH_CLUSTER_SIZE, FS_BACKING_SPARSE, &members,
+								BENCH_STRIPE_UNIT) != 0) {
+			ret = -1;
+		}
+
+		if (ret == 0) {
+			write = now();
+			handle = fs->openFile("striped", FS_WRITE | FS_CREATE);
+			for (j = 0; j < BENCH_STRIPE_DATA; j += BENCH_STRIPE_CHUNK) {
+				fs->writeFile(handle, chunk, BENCH_STRIPE_CHUNK);
+			}
+			fs->closeFile(handle);
+			syncMembers(&files);
+			write = now() - write;
+
+			read = 0;
+			for (round = 0; round < BENCH_STRIPE_ROUNDS; round++) {
+				syncMembers(&files);
+				seconds = now();
+				handle = fs->openFile("striped", FS_READ);
+				while (fs->readFile(handle, chunk, BENCH_STRIPE_CHUNK) > 0);
+				fs->closeFile(handle);
+				read += now() - seconds;
+			}
+			read /= BENCH_STRIPE_ROUNDS;
+
+			cout << setw(10) << counts[i] << fixed << setprecision(1);
+			cout << setw(12) << megabytes / write << setw(12) << megabytes / read << endl;
+			name.str("");
+			name << "members=" << counts[i];
+			record("striping", name.str(), "write_mb_per_s", megabytes / write);
+			record("striping", name.str(), "read_mb_per_s", megabytes / read);
+		}
+		delete fs;
+		for (j = 0; j < files.size(); j++) {
+			remove(files[j].c_str());
+		}
+		remove((image + ".chg").c_str());
+	}
+	free(chunk);
+
+	return ret;
+}
+
+/**
+ * Overwrites a whole file in place, in writes of the given size.
+ *
+ * @return double MB/s
+ */
+static double overwrite(FileSys *fs, int handle, char *chunk, int writeSize) {
+	int i;
+	double start = now();
+
+	for (i = 0; i < BENCH_SNAPSHOT_SIZE; i += writeSize) {
+		fs->writeFileAt(handle, chunk, writeSize, i);
+	}
+
+	return (BENCH_SNAPSHOT_SIZE / (1024.0 * 1024.0)) / (now() - start);
+}
+
+/**
+ * What snapshots cost: how long taking one takes, and in-place overwrite
+ * throughput with none, on the first pass after one (every cluster is
+ * copied on write) and on the pass after that (nothing held any more).
+ *
+ * @param image name of the scratch image to build the file in
+ * @return int 0 if it ran; -1 if the file couldn't be set up
+ */
+static int benchSnapshot(string image) {
+	int sizes[] = {4 * 1024, 64 * 1024};
+	int ret = 0;
+	int i;
+	int handle;
+	double start;
+	double none;
+	double first;
+	double second;
+	char *chunk = (char*)malloc(BENCH_SNAPSHOT_SIZE);
+	FileSys *fs;
+	stringstream name;
+
+	for (i = 0; i < BENCH_SNAPSHOT_SIZE; i++) {
+		chunk[i] = (char)rand();
+	}
+
+	cout << "snapshots (" << BENCH_SNAPSHOT_SIZE / (1024 * 1024);
+	cout << " MB file overwritten in place, MB/s)" << endl;
+	cout << right << setw(10) << "write KB" << setw(12) << "snap ms";
+	cout << setw(12) << "none" << setw(12) << "first" << setw(12) << "second" << endl;
+
+	for (i = 0; i < 2 && ret == 0; i++) {
+		fs = new FileSys();
+		if (fs->createFileSys(image, BENCH_VOLUME_SIZE, BENCH_CLUSTER_SIZE) != 0) {
+			ret = -1;
+		}
+
+		if (ret == 0) {
+			handle = fs->openFile("snapshot", FS_READ | FS_WRITE | FS_CREATE);
+			if (fs->writeFile(handle, chunk, BENCH_SNAPSHOT_SIZE) != BENCH_SNAPSHOT_SIZE) {
+				ret = -1;
+			}
+		}
+
+		if (ret == 0) {
+			none = overwrite(fs, handle, chunk, sizes[i]);
+			start = now();
+			fs->createSnapshot("bench");
+			start = now() - start;
+			first = overwrite(fs, handle, chunk, sizes[i]);
+			second = overwrite(fs, handle, chunk, sizes[i]);
+			fs->closeFile(handle);
+
+			cout << right << setw(10) << sizes[i] / 1024;
+			cout << setw(12) << fixed << setprecision(2) << start * 1e3;
+			cout << setw(12) << setprecision(1) << none << setw(12) << first;
+			cout << setw(12) << second << endl;
+			name.str("");
+			name << "write_kb=" << sizes[i] / 1024;
+			record("snapshot", name.str(), "snapshot_ms", start * 1e3);
+			record("snapshot", name.str(), "no_snapshot_mb_per_s", none);
+			record("snapshot", name.str(), "first_pass_mb_per_s", first);
+			record("snapshot", name.str(), "second_pass_mb_per_s", second);
+		}
+		delete fs;
+		remove(image.c_str());
+		remove((image + ".chg").c_str());
+	}
+	free(chunk);
+
+	return ret;
+}
+
+/**
+ * What keeping small files in their entries or packed together saves:
+ * the same set of tiny files (10 to BENCH_SMALL_MAX bytes) is written once
+ * with short names, so they're kept small, and once with names too long
+ * for that, so every one takes a cluster of its own. Reports the clusters
+ * they take, the space the image takes on the host and how fast every
+ * file is opened and read back.
+ *
+ * @param image name of the scratch image to build the files in
+ * @return int 0 if it ran; -1 if the files couldn't be set up
+ */
+static int benchSmallFiles(string image) {
+	int ret = 0;
+	int i;
+	int layout;
+	int handle;
+	int sizes[BENCH_SMALL_FILES];
+	char data[BENCH_SMALL_MAX];
+	string names[] = {"packed", "one cluster"};
+	double start;
+	int clusters;
+	long long empty;
+	FileSys *fs;
+	stringstream name;
+
+	for (i = 0; i < BENCH_SMALL_FILES; i++) {
+		sizes[i] = 10 + rand() % (BENCH_SMALL_MAX - 10);
+	}
+	for (i = 0; i < BENCH_SMALL_MAX; i++) {
+		data[i] = (char)rand();
+	}
+
+	cout << "small files (" << BENCH_SMALL_FILES << " files of 10 to ";
+	cout << BENCH_SMALL_MAX << " bytes, 8 KB clusters)" << endl;
+	cout << right << setw(12) << "layout" << setw(12) << "clusters";
+	cout << setw(12) << "host KB" << setw(12) << "files/s" << endl;
+
+	for (layout = 0; layout < 2 && ret == 0; layout++) {
+		fs = new FileSys();
+		if (fs->createFileSys(image, 20, 8) != 0) {
+			ret = -1;
+		}
+		empty = fs->getHostAllocated();
+		clusters = fs->getUsedClusters();
+
+		for (i = 0; i < BENCH_SMALL_FILES && ret == 0; i++) {
+			name.str("");
+			name << "small" << i;
+			if (layout == 1) {
+				name << string(SMALL_NAME_SIZE, 'x');
+			}
+			handle = fs->openFile(name.str(), FS_READ | FS_WRITE | FS_CREATE);
+			if (handle < 0 || fs->writeFile(handle, data, sizes[i]) != sizes[i]) {
+				ret = -1;
+			}
+			fs->closeFile(handle);
+		}
+
+		if (ret == 0) {
+			start = now();
+			for (i = 0; i < BENCH_SMALL_FILES; i++) {
+				name.str("");
+				name << "small" << i;
+				if (layout == 1) {
+					name << string(SMALL_NAME_SIZE, 'x');
+				}
+				handle = fs->openFile(name.str(), FS_READ);
+				fs->readFileAt(handle, data, sizes[i], 0);
+				fs->closeFile(handle);
+			}
+			start = now() - start;
+
+			cout << right << setw(12) << names[layout];
+			cout << setw(12) << fs->getUsedClusters() - clusters;
+			cout << setw(12) << (fs->getHostAllocated() - empty) / 1024;
+			cout << setw(12) << fixed << setprecision(0);
+			cout << BENCH_SMALL_FILES / start << endl;
+			record("small_files", "layout=" + names[layout], "clusters",
+					fs->getUsedClusters() - clusters);
+			record("small_files", "layout=" + names[layout], "host_kb",
+					(fs->getHostAllocated() - empty) / 1024);
+			record("small_files", "layout=" + names[layout], "files_per_s",
+					BENCH_SMALL_FILES / start);
+		}
+		delete fs;
+		remove(image.c_str());
+		remove((image + ".chg").c_str());
+	}
+
+	return ret;
+}
+
+/**
+ * Picks the sizes of a mix of files, until they add up to
+ * BENCH_SWEEP_DATA: "small" is 4 to 64 KB, "mixed" anything from 4 KB to
+ * 4 MB (as many of each order of magnitude) and "media" 4 to 16 MB.
+ *
+ * @param mix 0 for small, 1 for mixed, 2 for media
+ * @param sizes vector to store the file sizes in
+ */
+static void pickSizes(int mix, vector<int> *sizes) {
+	long long total = 0;
+	int size;
+
+	sizes->clear();
+	while (total < BENCH_SWEEP_DATA) {
+		if (mix == 0) {
+			size = 4096 + rand() % (60 * 1024);
+		} else if (mix == 1) {
+			size = (int)(4096 * pow(1024.0, rand() / (double)RAND_MAX));
+		} else {
+			size = 4 * 1024 * 1024 + rand() % (12 * 1024 * 1024);
+		}
+		sizes->push_back(size);
+		total += size;
+	}
+}
+
+/**
+ * Cluster size against file size, to pick a cluster size for a volume by
+ * what it'll hold. For each mix of files (see pickSizes()) and each
+ * cluster size from 4 KB to 1 MB, the same files are written to a fresh
+ * volume (as big as that cluster size allows, so every file fits) and
+ * read back, reporting write and read throughput (reads come
+ * from the host's cache, so they show the file system's own cost), the
+ * memory the FAT takes and how much of the clusters used is slack past
+ * the end of each file (internal fragmentation).
+ *
+ * @param image name of the scratch image to build the files in
+ * @return int 0 if it ran; -1 if the files couldn't be set up
+ */
+static int benchClusterSizes(string image) {
+	int clusterSizes[] = {4, 16, 64, 256, 1024};
+	string mixes[] = {"small", "mixed", "media"};
+	int ret = 0;
+	int mix;
+	int i;
+	int j;
+	int handle;
+	int clusters;
+	int volume;
+	long long bytes;
+	double start;
+	double written;
+	double read;
+	char *data = (char*)malloc(BENCH_SWEEP_MAX);
+	vector<int> sizes;
+	FileSys *fs;
+	stringstream name;
+
+	for (i = 0; i < BENCH_SWEEP_MAX; i++) {
+		data[i] = (char)rand();
+	}
+
+	cout << "cluster sizes (" << BENCH_SWEEP_DATA / (1024 * 1024) << " MB of files)" << endl;
+	cout << right << setw(8) << "mix" << setw(12) << "cluster KB" << setw(11) << "volume MB";
+	cout << setw(8) << "files";
+	cout << setw(12) << "write MB/s" << setw(12) << "read MB/s";
+	cout << setw(10) << "FAT KB" << setw(10) << "slack %" << endl;
+
+	for (mix = 0; mix < 3 && ret == 0; mix++) {
+		pickSizes(mix, &sizes);
+		for (i = 0; i < 5 && ret == 0; i++) {
+			volume = min(MAX_FILE_SIZE, (MAX_CLUSTERS - 1) * clusterSizes[i] / 1024);
+			fs = new FileSys();
+			if (fs->createFileSys(image, volume, clusterSizes[i]) != 0) {
+				ret = -1;
+			}
+			clusters = fs->getUsedClusters();
+			bytes = 0;
+
+			start = now();
+			for (j = 0; j < sizes.size() && ret == 0; j++) {
+				name.str("");
+				name << "sweep" << j;
+				handle = fs->openFile(name.str(), FS_WRITE | FS_CREATE);
+				if (handle < 0 || fs->writeFile(handle, data, sizes[j]) != sizes[j]) {
+					ret = -1;
+				}
+				fs->closeFile(handle);
+				bytes += sizes[j];
+			}
+			written = now() - start;
+			clusters = fs->getUsedClusters() - clusters;
+
+			start = now();
+			for (j = 0; j < sizes.size() && ret == 0; j++) {
+				name.str("");
+				name << "sweep" << j;
+				handle = fs->openFile(name.str(), FS_READ);
+				fs->readFileAt(handle, data, sizes[j], 0);
+				fs->closeFile(handle);
+			}
+			read = now() - start;
+
+			if (ret == 0) {
+				cout << right << setw(8) << mixes[mix] << setw(12) << clusterSizes[i];
+				cout << setw(11) << volume << setw(8) << sizes.size() << fixed << setprecision(1);
+				cout << setw(12) << bytes / (1024.0 * 1024.0) / written;
+				cout << setw(12) << bytes / (1024.0 * 1024.0) / read;
+				cout << setw(10) << volume * 1024 / clusterSizes[i] * sizeof(int) / 1024;
+				cout << setw(10) << 100.0 * (1.0 - bytes / ((double)clusters * clusterSizes[i] * 1024));
+				cout << endl;
+				name.str("");
+				name << "mix=" << mixes[mix] << ",cluster_kb=" << clusterSizes[i];
+				record("cluster_sizes", name.str(), "write_mb_per_s",
+						bytes / (1024.0 * 1024.0) / written);
+				record("cluster_sizes", name.str(), "read_mb_per_s",
+						bytes / (1024.0 * 1024.0) / read);
+				record("cluster_sizes", name.str(), "fat_kb",
+						volume * 1024 / clusterSizes[i] * sizeof(int) / 1024);
+				record("cluster_sizes", name.str(), "slack_pct",
+						100.0 * (1.0 - bytes / ((double)clusters * clusterSizes[i] * 1024)));
+			}
+			delete fs;
+			remove(image.c_str());
+			remove((image + ".chg").c_str());
+		}
+	}
+	free(data);
+
+	return ret;
+}
+
+/**
+ * Directory operations against directory size: for each size, that many
+ * empty files are touched into a fresh volume, then BENCH_LOOKUPS random
+ * names are looked up (FileSys::getFileSize(), which is a directory
+ * search and nothing else), then every file is removed.
+ *
+ * @param image name of the scratch image to build the directory in
+ * @return int 0 if it ran; -1 if the files couldn't be set up
+ */
+static int benchDirectory(string image) {
+	int sizes[] = {100, 1000, 4000};
+	int ret = 0;
+	int i;
+	int j;
+	double touched;
+	double looked;
+	double removed;
+	FileSys *fs;
+	stringstream name;
+
+	cout << "directory (empty files; " << BENCH_LOOKUPS << " random lookups)" << endl;
+	cout << right << setw(8) << "files" << setw(12) << "touch/s";
+	cout << setw(12) << "lookup us" << setw(12) << "rm us" << endl;
+
+	for (i = 0; i < 3 && ret == 0; i++) {
+		fs = new FileSys();
+		if (fs->createFileSys(image, BENCH_VOLUME_SIZE, BENCH_CLUSTER_SIZE) != 0) {
+			ret = -1;
+		}
+
+		touched = now();
+		for (j = 0; j < sizes[i] && ret == 0; j++) {
+			if (fs->createFile(benchFileName(j)) < 0) {
+				ret = -1;
+			}
+		}
+		touched = now() - touched;
+
+		looked = now();
+		for (j = 0; j < BENCH_LOOKUPS && ret == 0; j++) {
+			if (fs->getFileSize(benchFileName(rand() % sizes[i])) < 0) {
+				ret = -1;
+			}
+		}
+		looked = now() - looked;
+
+		removed = now();
+		for (j = 0; j < sizes[i] && ret == 0; j++) {
+			if (fs->removeFile(benchFileName(j)) != 0) {
+				ret = -1;
+			}
+		}
+		removed = now() - removed;
+
+		if (ret == 0) {
+			cout << right << setw(8) << sizes[i] << fixed << setprecision(0);
+			cout << setw(12) << sizes[i] / touched << setprecision(2);
+			cout << setw(12) << looked * 1e6 / BENCH_LOOKUPS;
+			cout << setw(12) << removed * 1e6 / sizes[i] << endl;
+			name.str("");
+			name << "files=" << sizes[i];
+			record("directory", name.str(), "touch_per_s", sizes[i] / touched);
+			record("directory", name.str(), "lookup_us", looked * 1e6 / BENCH_LOOKUPS);
+			record("directory", name.str(), "rm_us", removed * 1e6 / sizes[i]);
+		}
+		delete fs;
+		remove(image.c_str());
+		remove((image + ".chg").c_str());
+	}
+
+	return ret;
+}
+
+/**
+ * Writes a PipeFeeder's data down its pipe and closes it.
+ *
+ * @param arg the PipeFeeder
+ * @return NULL
+ */
+static void *feedPipe(void *arg) {
+	PipeFeeder *feeder = (PipeFeeder*)arg;
+	int done = 0;
+	int n = 1;
+
+	while (done < feeder->length && n > 0) {
+		n = write(feeder->fd, feeder->data + done, feeder->length - done);
+		done += max(n, 0);
+	}
+	close(feeder->fd);
+
+	return NULL;
+}
+
+/**
+ * Import, export and internal copy throughput (cp in, cp out, cp inside)
+ * against file size, then rm latency. For each size, enough files to
+ * make BENCH_TRANSFER_DATA (at most BENCH_TRANSFER_FILES of them) are
+ * imported from one host file, each exported to the same host file, and
+ * each copied inside the volume; then every file is removed, and the
+ * time the reclaimer takes to free them all is reported as well, since
+ * rm itself only marks the entry. Last, the same files are streamed in
+ * from a pipe a thread writes them down (FileSys::importFile()), which
+ * should keep up with importing them from the host file, and the first
+ * is exported again and checked against what went in; every size but
+ * 4 KB is a whole number of clusters, which streams have to get right.
+ *
+ * @param image name of the scratch image to copy to and from
+ * @return int 0 if it ran; -1 if the files couldn't be set up
+ */
+static int benchTransfer(string image) {
+	int sizes[] = {4 * 1024, 16 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+	int ret = 0;
+	int i;
+	int j;
+	int count;
+	double megabytes;
+	double imported;
+	double exported;
+	double copied;
+	double removed;
+	double reclaimed;
+	double streamed;
+	int fds[2];
+	PipeFeeder feeder;
+	pthread_t thread;
+	char *data = (char*)malloc(sizes[4]);
+	char *back = (char*)malloc(sizes[4]);
+	string source = image + ".in";
+	string dest = image + ".out";
+	FILE *sourceFile;
+	FileSys *fs;
+	stringstream name;
+
+	for (i = 0; i < sizes[4]; i++) {
+		data[i] = (char)rand();
+	}
+
+	cout << "transfer (" << BENCH_TRANSFER_DATA / (1024 * 1024);
+	cout << " MB per file size, MB/s)" << endl;
+	cout << right << setw(10) << "file KB" << setw(8) << "files" << setw(10) << "import";
+	cout << setw(10) << "export" << setw(10) << "copy";
+	cout << setw(10) << "rm us" << setw(14) << "reclaim ms" << setw(10) << "stream" << endl;
+
+	for (i = 0; i < 5 && ret == 0; i++) {
+		count = max(1, min(BENCH_TRANSFER_FILES, BENCH_TRANSFER_DATA / sizes[i]));
+		megabytes = (double)count * sizes[i] / (1024 * 1024);
+		sourceFile = fopen(source.c_str(), "w");
+		fwrite(data, sizes[i], 1, sourceFile);
+		fclose(sourceFile);
+		fs = new FileSys();
+		if (fs->createFileSys(image, BENCH_VOLUME_SIZE, BENCH_CLUSTER_SIZE) != 0) {
+			ret = -1;
+		}
+
+		imported = now();
+		for (j = 0; j < count && ret == 0; j++) {
+			ret = (fs->copyFile(source, benchFileName(j), false, true) == 0) ? 0 : -1;
+		}
+		imported = now() - imported;
+
+		exported = now();
+		for (j = 0; j < count && ret == 0; j++) {
+			ret = (fs->copyFile(benchFileName(j), dest, true, false) == 0) ? 0 : -1;
+		}
+		exported = now() - exported;
+
+		copied = now();
+		for (j = 0; j < count && ret == 0; j++) {
+			ret = (fs->copyFile(benchFileName(j), benchFileName(count + j), true, true) == 0)
+				? 0 : -1;
+		}
+		copied = now() - copied;
+
+		removed = now();
+		for (j = 0; j < count * 2 && ret == 0; j++) {
+			ret = (fs->removeFile(benchFileName(j)) == 0) ? 0 : -1;
+		}
+		removed = now() - removed;
+		reclaimed = now();
+		while (fs->getReclaimBacklog(NULL) > 0) {
+			usleep(100);
+		}
+		reclaimed = now() - reclaimed;
+
+		streamed = now();
+		for (j = 0; j < count && ret == 0; j++) {
+			pipe(fds);
+			feeder.fd = fds[1];
+			feeder.data = data;
+			feeder.length = sizes[i];
+			pthread_create(&thread, NULL, feedPipe, &feeder);
+			ret = (fs->importFile(fds[0], benchFileName(j)) == sizes[i]) ? 0 : -1;
+			pthread_join(thread, NULL);
+			close(fds[0]);
+		}
+		streamed = now() - streamed;
+		if (ret == 0 && fs->copyFile(benchFileName(0), dest, true, false) == 0) {
+			sourceFile = fopen(dest.c_str(), "r");
+			ret = (fread(back, 1, sizes[4], sourceFile) == sizes[i]
+					&& memcmp(back, data, sizes[i]) == 0) ? 0 : -1;
+			fclose(sourceFile);
+		} else {
+			ret = -1;
+		}
+		if (ret != 0) {
+			cerr << "fsbench: a " << sizes[i] << " byte stream didn't come back whole" << endl;
+		}
+
+		if (ret == 0) {
+			cout << right << setw(10) << sizes[i] / 1024 << setw(8) << count;
+			cout << fixed << setprecision(1);
+			cout << setw(10) << megabytes / imported << setw(10) << megabytes / exported;
+			cout << setw(10) << megabytes / copied << setprecision(2);
+			cout << setw(10) << removed * 1e6 / (count * 2);
+			cout << setw(14) << reclaimed * 1e3 << setprecision(1);
+			cout << setw(10) << megabytes / streamed << endl;
+			name.str("");
+			name << "file_kb=" << sizes[i] / 1024;
+			record("transfer", name.str(), "import_mb_per_s", megabytes / imported);
+			record("transfer", name.str(), "export_mb_per_s", megabytes / exported);
+			record("transfer", name.str(), "copy_mb_per_s", megabytes / copied);
+			record("transfer", name.str(), "rm_us", removed * 1e6 / (count * 2));
+			record("transfer", name.str(), "reclaim_ms", reclaimed * 1e3);
+			record("transfer", name.str(), "stream_mb_per_s", megabytes / streamed);
+		}
+		delete fs;
+		remove(image.c_str());
+		remove((image + ".chg").c_str());
+	}
+	remove(source.c_str());
+	remove(dest.c_str());
+	free(data);
+	free(back);
+
+	return ret;
+}
+
+/**
+ * Starts a host command with its stdin and stdout where they're asked to
+ * be (-1 leaves them as they are), the way the shell runs them.
+ *
+ * @param command the command's arguments, NULL-terminated
+ * @param in what it reads
+ * @param out what it writes
+ * @return pid_t the process, to wait for
+ */
+static pid_t startCommand(const char **command, int in, int out) {
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		if (in != -1) {
+			dup2(in, 0);
+		}
+		if (out != -1) {
+			dup2(out, 1);
+		}
+		execvp(command[0], (char**)command);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+/**
+ * Piping a file through a host command (the shell's |, < and >) against
+ * copying it out to the host, running the command on the copy and, for
+ * output, copying the command's result back in. Out of the volume the
+ * command is wc -c, reading from a pipe the file is spliced into (see
+ * FileSys::sendFile()) or from the copied-out file; into it the command is
+ * cat, writing to a pipe taken in with FileSys::receiveFile() or to a host
+ * file that's then imported. Throughput counts the file's bytes over the
+ * whole job, command and copies included.
+ *
+ * @param image name of the scratch image to pipe to and from
+ * @return int 0 if it ran; -1 if the volume couldn't be set up
+ */
+static int benchPipes(string image) {
+	int sizes[] = {64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+	int ret = 0;
+	int i;
+	int round;
+	int rounds;
+	int handle;
+	int status;
+	int fds[2];
+	int out;
+	pid_t pid;
+	double megabytes;
+	double copyOut;
+	double pipeOut;
+	double copyIn;
+	double pipeIn;
+	char *data = (char*)malloc(sizes[2]);
+	string host = image + ".host";
+	string result = image + ".result";
+	const char *count[] = {"wc", "-c", NULL};
+	const char *catHost[] = {"cat", host.c_str(), NULL};
+	FILE *hostFile;
+	FileSys *fs = new FileSys();
+	stringstream name;
+	void (*oldPipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < sizes[2]; i++) {
+		data[i] = (char)rand();
+	}
+	if (fs->createFileSys(image, BENCH_VOLUME_SIZE, BENCH_CLUSTER_SIZE) != 0) {
+		ret = -1;
+	}
+
+	cout << "pipes (host command on a volume file, MB/s)" << endl;
+	cout << right << setw(10) << "file KB" << setw(8) << "rounds";
+	cout << setw(12) << "copy out" << setw(10) << "pipe out";
+	cout << setw(12) << "copy in" << setw(10) << "pipe in" << endl;
+
+	for (i = 0; i < 3 && ret == 0; i++) {
+		rounds = max(4, 64 * 1024 * 1024 / sizes[i] / 4);
+		megabytes = (double)rounds * sizes[i] / (1024 * 1024);
+		hostFile = fopen(host.c_str(), "w");
+		fwrite(data, sizes[i], 1, hostFile);
+		fclose(hostFile);
+		ret = (fs->copyFile(host, "piped", false, true) == 0) ? 0 : -1;
+		out = open("/dev/null", O_WRONLY);
+
+		//out: cp to the host, then the command on the copy
+		copyOut = now();
+		for (round = 0; round < rounds && ret == 0; round++) {
+			ret = (fs->copyFile("piped", result, true, false) == 0) ? 0 : -1;
+			fds[0] = open(result.c_str(), O_RDONLY);
+			waitpid(startCommand(count, fds[0], out), &status, 0);
+			close(fds[0]);
+			remove(result.c_str());
+		}
+		copyOut = now() - copyOut;
+
+		//out: spliced down a pipe into the command
+		pipeOut = now();
+		for (round = 0; round < rounds && ret == 0; round++) {
+			pipe(fds);
+			fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+			handle = fs->openFile("piped", FS_READ);
+			pid = startCommand(count, fds[0], out);
+			close(fds[0]);
+			ret = (fs->sendFile(handle, fds[1], sizes[i]) == sizes[i]) ? 0 : -1;
+			close(fds[1]);
+			fs->closeFile(handle);
+			waitpid(pid, &status, 0);
+		}
+		pipeOut = now() - pipeOut;
+
+		//in: the command's output to a host file, then cp in
+		copyIn = now();
+		for (round = 0; round < rounds && ret == 0; round++) {
+			fds[1] = open(result.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			waitpid(startCommand(catHost, -1, fds[1]), &status, 0);
+			close(fds[1]);
+			ret = (fs->copyFile(result, "landed", false, true) == 0) ? 0 : -1;
+			remove(result.c_str());
+		}
+		copyIn = now() - copyIn;
+
+		//in: taken from a pipe out of the command
+		pipeIn = now();
+		for (round = 0; round < rounds && ret == 0; round++) {
+			pipe(fds);
+			fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+			handle = fs->openFile("landed", FS_WRITE | FS_CREATE | FS_TRUNCATE);
+			pid = startCommand(catHost, -1, fds[1]);
+			close(fds[1]);
+			ret = (fs->receiveFile(handle, fds[0], INT_MAX) == sizes[i]) ? 0 : -1;
+			close(fds[0]);
+			fs->closeFile(handle);
+			waitpid(pid, &status, 0);
+		}
+		pipeIn = now() - pipeIn;
+		close(out);
+		fs->removeFile("piped");
+		fs->removeFile("landed");
+		while (fs->getReclaimBacklog(NULL) > 0) {
+			usleep(100);
+		}
+
+		if (ret == 0) {
+			cout << right << setw(10) << sizes[i] / 1024 << setw(8) << rounds;
+			cout << fixed << setprecision(1);
+			cout << setw(12) << megabytes / copyOut << setw(10) << megabytes / pipeOut;
+			cout << setw(12) << megabytes / copyIn << setw(10) << megabytes / pipeIn << endl;
+			name.str("");
+			name << "file_kb=" << sizes[i] / 1024;
+			record("pipes", name.str(), "copy_out_mb_per_s", megabytes / copyOut);
+			record("pipes", name.str(), "pipe_out_mb_per_s", megabytes / pipeOut);
+			record("pipes", name.str(), "copy_in_mb_per_s", megabytes / copyIn);
+			record("pipes", name.str(), "pipe_in_mb_per_s", megabytes / pipeIn);
+		}
+	}
+	signal(SIGPIPE, oldPipe);
+	delete fs;
+	remove(image.c_str());
+	remove((image + ".chg").c_str());
+	remove(host.c_str());
+	free(data);
+
+	return ret;
+}
+
+/**
+ * Copying a file from one volume to another, two volumes mounted at once
+ * (the shell's cp between mounts): through the host, copied out to a host
+ * file and that imported, against straight from one image to the other
+ * (FileSys::copyFileFrom(), with copy_file_range() where the host allows).
+ * The volumes have different cluster sizes, as they well might. Throughput
+ * counts the file's bytes over the whole copy. The last direct copy is
+ * exported and checked against what went in; every size is a whole number
+ * of clusters on both volumes, which the copy has to get right.
+ *
+ * @param image name of the scratch image to copy from; the one copied to
+ *        is beside it
+ * @return int 0 if it ran; -1 if the volumes couldn't be set up
+ */
+static int benchVolumes(string image) {
+	int sizes[] = {64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+	int ret = 0;
+	int i;
+	int round;
+	int rounds;
+	double megabytes;
+	double viaHost;
+	double direct;
+	char *data = (char*)malloc(sizes[2]);
+	char *back = (char*)malloc(sizes[2]);
+	string other = image + ".2";
+	string host = image + ".host";
+	FILE *hostFile;
+	FileSys *from = new FileSys();
+	FileSys *to = new FileSys();
+	stringstream name;
+
+	for (i = 0; i < sizes[2]; i++) {
+		data[i] = (char)rand();
+	}
+	if (from->createFileSys(image, BENCH_VOLUME_SIZE, BENCH_CLUSTER_SIZE) != 0
+		|| to->createFileSys(other, BENCH_VOLUME_SIZE, BENCH_CLUSTER_SIZE / 2) != 0) {
+		ret = -1;
+	}
+
+	cout << "volume to volume (" << BENCH_CLUSTER_SIZE << " KB clusters to ";
+	cout << BENCH_CLUSTER_SIZE / 2 << " KB, MB/s)" << endl;
+	cout << right << setw(10) << "file KB" << setw(8) << "rounds";
+	cout << setw(12) << "via host" << setw(10) << "direct" << endl;
+
+	for (i = 0; i < 3 && ret == 0; i++) {
+		rounds = max(4, 64 * 1024 * 1024 / sizes[i] / 4);
+		megabytes = (double)rounds * sizes[i] / (1024 * 1024);
+		hostFile = fopen(host.c_str(), "w");
+		fwrite(data, sizes[i], 1, hostFile);
+		fclose(hostFile);
+		ret = (from->copyFile(host, "moving", false, true) == 0) ? 0 : -1;
+		remove(host.c_str());
+
+		//out to a host file, then in again
+		viaHost = now();
+		for (round = 0; round < rounds && ret == 0; round++) {
+			ret = (from->copyFile("moving", host, true, false) == 0
+					&& to->copyFile(host, "landed", false, true) == 0) ? 0 : -1;
+			remove(host.c_str());
+		}
+		viaHost = now() - viaHost;
+
+		//image to image
+		direct = now();
+		for (round = 0; round < rounds && ret == 0; round++) {
+			ret = (to->copyFileFrom(from, "moving", "landed") == 0) ? 0 : -1;
+		}
+		direct = now() - direct;
+		if (ret == 0 && to->copyFile("landed", host, true, false) == 0) {
+			hostFile = fopen(host.c_str(), "r");
+			ret = (fread(back, 1, sizes[2], hostFile) == sizes[i]
+					&& memcmp(back, data, sizes[i]) == 0) ? 0 : -1;
+			fclose(hostFile);
+			remove(host.c_str());
+		} else {
+			ret = -1;
+		}
+		if (ret != 0) {
+			cerr << "fsbench: a " << sizes[i] << " byte file didn't copy across whole" << endl;
+		}
+
+		from->removeFile("moving");
+		to->removeFile("landed");
+		while (from->getReclaimBacklog(NULL) > 0 || to->getReclaimBacklog(NULL) > 0) {
+			usleep(100);
+		}
+
+		if (ret == 0) {
+			cout << right << setw(10) << sizes[i] / 1024 << setw(8) << rounds;
+			cout << fixed << setprecision(1);
+			cout << setw(12) << megabytes / viaHost << setw(10) << megabytes / direct << endl;
+			name.str("");
+			name << "file_kb=" << sizes[i] / 1024;
+			record("volumes", name.str(), "via_host_mb_per_s", megabytes / viaHost);
+			record("volumes", name.str(), "direct_mb_per_s", megabytes / direct);
+		}
+	}
+	delete from;
+	delete to;
+	remove(image.c_str());
+	remove((image + ".chg").c_str());
+	remove(other.c_str());
+	remove((other + ".chg").c_str());
+	free(data);
+	free(back);
+
+	return ret;
+}
+
+/**
+ * Mount latency against volume size: a volume with BENCH_MOUNT_FILES
+ * files is mounted and unmounted BENCH_MOUNTS times, at sizes up to the
+ * most clusters a volume can have. Mounting reads the FAT and directory
+ * and nothing more; the file system prints nothing, so this is the whole
+ * cost an embedding program pays. Also times df (FileSys::getStats()),
+ * which recounts the used clusters every time.
+ *
+ * @param image name of the scratch image to mount
+ * @return int 0 if it ran; -1 if the volume couldn't be set up
+ */
+static int benchMount(string image) {
+	int sizes[] = {10, 64, 255};
+	int ret = 0;
+	int i;
+	int j;
+	int handle;
+	double start;
+	double mounted;
+	double unmounted;
+	double df;
+	FileSysStats stats;
+	FileSys *fs;
+	stringstream name;
+
+	cout << "mount latency (4 KB clusters, " << BENCH_MOUNT_FILES << " files)" << endl;
+	cout << right << setw(11) << "volume MB" << setw(10) << "clusters";
+	cout << setw(12) << "mount ms" << setw(12) << "unmount ms" << setw(10) << "df us" << endl;
+
+	for (i = 0; i < 3 && ret == 0; i++) {
+		fs = new FileSys();
+		if (fs->createFileSys(image, sizes[i], 4) != 0) {
+			ret = -1;
+		}
+		for (j = 0; j < BENCH_MOUNT_FILES && ret == 0; j++) {
+			name.str("");
+			name << "mounted" << j;
+			handle = fs->openFile(name.str(), FS_WRITE | FS_CREATE);
+			if (handle < 0 || fs->writeFile(handle, &j, sizeof(int)) != sizeof(int)) {
+				ret = -1;
+			}
+			fs->closeFile(handle);
+		}
+		delete fs;
+
+		mounted = 0;
+		unmounted = 0;
+		df = 0;
+		for (j = 0; j < BENCH_MOUNTS && ret == 0; j++) {
+			fs = new FileSys();
+			start = now();
+			if (fs->openFileSys(image) != 0) {
+				ret = -1;
+			}
+			mounted += now() - start;
+			start = now();
+			fs->getStats(&stats);
+			df += now() - start;
+			start = now();
+			delete fs;
+			unmounted += now() - start;
+		}
+
+		if (ret == 0) {
+			cout << right << setw(11) << sizes[i] << setw(10) << sizes[i] * 256;
+			cout << fixed << setprecision(2);
+			cout << setw(12) << mounted * 1000 / BENCH_MOUNTS;
+			cout << setw(12) << unmounted * 1000 / BENCH_MOUNTS;
+			cout << setw(10) << df * 1e6 / BENCH_MOUNTS << endl;
+			name.str("");
+			name << "volume_mb=" << sizes[i];
+			record("mount", name.str(), "mount_ms", mounted * 1000 / BENCH_MOUNTS);
+			record("mount", name.str(), "unmount_ms", unmounted * 1000 / BENCH_MOUNTS);
+			record("mount", name.str(), "df_us", df * 1e6 / BENCH_MOUNTS);
+		}
+		remove(image.c_str());
+		remove((image + ".chg").c_str());
+	}
+
+	return ret;
+}
+
+/**
+ * Writes a batch of files BENCH_AGING_WRITERS at a time, a chunk to each
+ * in turn, the way several programs saving at once would, until the
+ * volume is BENCH_AGING_FULL percent full.
+ *
+ * @param fs the file system
+ * @param next number to name the next file by; moved on past the ones made
+ * @param files vector the new files' names are added to
+ * @param data BENCH_AGING_MAX bytes to write from
+ * @param bytes pointer to add the bytes written to
+ * @return int 0 if every file was written; -1 otherwise
+ */
+static int ageWrite(FileSys *fs, int *next, vector<string> *files, char *data,
+	long long *bytes) {
+	int ret = 0;
+	int i;
+	int length;
+	int handles[BENCH_AGING_WRITERS];
+	int sizes[BENCH_AGING_WRITERS];
+	int done[BENCH_AGING_WRITERS];
+	int open = 0;
+	long long target = BENCH_AGING_VOLUME * 256LL * BENCH_AGING_FULL / 100;
+	long long pending = 0;
+	stringstream name;
+
+	for (i = 0; i < BENCH_AGING_WRITERS; i++) {
+		handles[i] = -1;
+	}
+	do {
+		for (i = 0; i < BENCH_AGING_WRITERS && ret == 0; i++) {
+			if (handles[i] == -1
+				&& fs->getUsedClusters() + pending / (4 * 1024) < target) {
+				name.str("");
+				name << "aged" << (*next)++;
+				handles[i] = fs->openFile(name.str(), FS_WRITE | FS_CREATE);
+				sizes[i] = 4096 + rand() % (BENCH_AGING_MAX - 4096);
+				done[i] = 0;
+				pending += sizes[i];
+				files->push_back(name.str());
+				ret = (handles[i] < 0) ? -1 : 0;
+				open += (handles[i] < 0) ? 0 : 1;
+			}
+			if (handles[i] >= 0 && ret == 0) {
+				length = min(BENCH_AGING_CHUNK, sizes[i] - done[i]);
+				if (fs->writeFile(handles[i], data + done[i], length) != length) {
+					ret = -1;
+				}
+				done[i] += length;
+				pending -= length;
+				*bytes += length;
+				if (done[i] == sizes[i]) {
+					fs->closeFile(handles[i]);
+					handles[i] = -1;
+					open--;
+				}
+			}
+		}
+	} while (open > 0 && ret == 0);
+
+	for (i = 0; i < BENCH_AGING_WRITERS; i++) {
+		if (handles[i] >= 0) {
+			fs->closeFile(handles[i]);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Ages a volume under each allocation policy (see Allocator) and
+ * compares them. Each volume is filled BENCH_AGING_FULL percent with
+ * files of 4 KB to 1 MB, written several at once, then for
+ * BENCH_AGING_ROUNDS rounds a quarter of the files are deleted and new
+ * ones written in their place. Every policy sees exactly the same files
+ * and deletions. Reports how fast the aging writes went, how fragmented
+ * the files end up, and how fast the whole volume then reads back from
+ * the disk (see Defragmenter::measureReadThroughput()).
+ *
+ * @param image name of the scratch image to age
+ * @return int 0 if it ran; -1 if the files couldn't be set up
+ */
+static int benchAllocators(string image) {
+	int ret = 0;
+	int policy;
+	int round;
+	int next;
+	int i;
+	int j;
+	int seed = rand();
+	long long bytes;
+	double start;
+	double written;
+	double read;
+	char *data = (char*)malloc(BENCH_AGING_MAX);
+	string name;
+	vector<string> files;
+	VolumeFragmentation volume;
+	FileSys *fs;
+
+	for (i = 0; i < BENCH_AGING_MAX; i++) {
+		data[i] = (char)rand();
+	}
+
+	cout << "allocators (" << BENCH_AGING_VOLUME << " MB volume, 4 KB clusters, ";
+	cout << BENCH_AGING_FULL << "% full, " << BENCH_AGING_ROUNDS << " rounds of churn)" << endl;
+	cout << right << setw(8) << "policy" << setw(8) << "files" << setw(12) << "write MB/s";
+	cout << setw(14) << "extents/file" << setw(12) << "avg run" << setw(13) << "fragmented";
+	cout << setw(12) << "read MB/s" << endl;
+
+	for (policy = 0; policy < ALLOC_POLICIES && ret == 0; policy++) {
+		fs = new FileSys();
+		if (fs->createFileSys(image, BENCH_AGING_VOLUME, 4) != 0
+			|| fs->setAllocator(policy) != 0) {
+			ret = -1;
+		}
+		srand(seed);
+		files.clear();
+		next = 0;
+		bytes = 0;
+		written = 0;
+
+		start = now();
+		ret = (ret == 0) ? ageWrite(fs, &next, &files, data, &bytes) : ret;
+		written += now() - start;
+		for (round = 0; round < BENCH_AGING_ROUNDS && ret == 0; round++) {
+			for (i = files.size() / 4; i > 0; i--) {
+				j = rand() % files.size();
+				fs->removeFile(files[j]);
+				files.erase(files.begin() + j);
+			}
+			//let the reclaimer hand the clusters back before writing again
+			while (fs->getReclaimBacklog(NULL) > 0) {
+				usleep(1000);
+			}
+			start = now();
+			ret = ageWrite(fs, &next, &files, data, &bytes);
+			written += now() - start;
+		}
+
+		if (ret == 0) {
+			Defragmenter(fs).measure(&volume, NULL);
+			read = Defragmenter(fs).measureReadThroughput();
+			cout << right << setw(8) << Allocator::getPolicyName(policy);
+			cout << setw(8) << volume.files << fixed << setprecision(1);
+			cout << setw(12) << bytes / (1024.0 * 1024.0) / written;
+			cout << setw(14) << volume.extentsPerFile;
+			cout << setw(12) << volume.averageRunLength;
+			cout << setw(12) << 100.0 * volume.fragmentedFiles / max(volume.files, 1) << "%";
+			cout << setw(12) << read << endl;
+			name = "policy=" + Allocator::getPolicyName(policy);
+			record("allocators", name, "write_mb_per_s", bytes / (1024.0 * 1024.0) / written);
+			record("allocators", name, "extents_per_file", volume.extentsPerFile);
+			record("allocators", name, "average_run", volume.averageRunLength);
+			record("allocators", name, "fragmented_pct",
+					100.0 * volume.fragmentedFiles / max(volume.files, 1));
+			record("allocators", name, "read_mb_per_s", read);
+		}
+		delete fs;
+		remove(image.c_str());
+		remove((image + ".chg").c_str());
+	}
+	free(data);
+
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	struct stat shm;
+	bool json = argc > 1 && string(argv[1]) == "-json";
+	string image = (stat("/dev/shm", &shm) == 0 && S_ISDIR(shm.st_mode))
+					? "/dev/shm/fsbench.img" : "/tmp/fsbench.img";
+	string source;
+	FileSys *fs = new FileSys();
+	FILE *sourceFile;
+	ofstream devNull("/dev/null");
+	streambuf *out = cout.rdbuf();
+	char *data;
+	int i;
+	int ret = 0;
+
+	if (argc > (json ? 2 : 1)) {
+		image = argv[json ? 2 : 1];
+	}
+	source = image + ".src";
+	srand(BENCH_SEED);
+	if (json) {
+		//the tables go nowhere; only the JSON is printed
+		cout.rdbuf(devNull.rdbuf());
+	}
+
+	//one host file to import over and over
+	data = (char*)malloc(BENCH_FILE_SIZE);
+	for (i = 0; i < BENCH_FILE_SIZE; i++) {
+		data[i] = (char)rand();
+	}
+	sourceFile = fopen(source.c_str(), "w");
+	fwrite(data, BENCH_FILE_SIZE, 1, sourceFile);
+	fclose(sourceFile);
+	free(data);
+
+	if (fs->createFileSys(image, BENCH_VOLUME_SIZE, BENCH_CLUSTER_SIZE) == 0) {
+		for (i = 0; i < BENCH_FILES && ret == 0; i++) {
+			ret = fs->copyFile(source, benchFileName(i), false, true);
+		}
+	} else {
+		ret = -1;
+	}
+
+	if (ret == 0) {
+		benchReadScaling(fs);
+		cout << endl;
+		if (benchDirectory(image + ".directory") != 0) {
+			cerr << "fsbench: couldn't set up " << image << ".directory" << endl;
+		}
+		cout << endl;
+		if (benchTransfer(image + ".transfer") != 0) {
+			cerr << "fsbench: couldn't set up " << image << ".transfer" << endl;
+		}
+		cout << endl;
+		if (benchPipes(image + ".pipes") != 0) {
+			cerr << "fsbench: couldn't set up " << image << ".pipes" << endl;
+		}
+		cout << endl;
+		if (benchVolumes(image + ".volumes") != 0) {
+			cerr << "fsbench: couldn't set up " << image << ".volumes" << endl;
+		}
+		cout << endl;
+		if (benchRandomReads(image + ".random") != 0) {
+			cerr << "fsbench: couldn't set up " << image << ".random" << endl;
+		}
+		cout << endl;
+		if (benchBacking(image + ".backing") != 0) {
+			cerr << "fsbench: couldn't set up " << image << ".backing" << endl;
+		}
+		cout << endl;
+		if (benchStriping(image + ".striping") != 0) {
+			cerr << "fsbench: couldn't set up " << image << ".striping" << endl;
+		}
+		cout << endl;
+		if (benchSnapshot(image + ".snapshot") != 0) {
+			cerr << "fsbench: couldn't set up " << image << ".snapshot" << endl;
+		}
+		cout << endl;
+		if (benchSmallFiles(image + ".small") != 0) {
+			cerr << "fsbench: couldn't set up " << image << ".small" << endl;
+		}
+		cout << endl;
+		if (benchClusterSizes(image + ".sweep") != 0) {
+			cerr << "fsbench: couldn't set up " << image << ".sweep" << endl;
+		}
+		cout << endl;
+		if (benchAllocators(image + ".aging") != 0) {
+			cerr << "fsbench: couldn't set up " << image << ".aging" << endl;
+		}
+		cout << endl;
+		if (benchMount(image + ".mount") != 0) {
+			cerr << "fsbench: couldn't set up " << image << ".mount" << endl;
+		}
+	} else {
+		cerr << "fsbench: couldn't set up " << image << endl;
+	}
+
+	cout.rdbuf(out);
+	if (json && ret == 0) {
+		printJSON(image);
+	}
+
+	delete fs;
+	remove(source.c_str());
+	remove(image.c_str());
+	remove((image + ".chg").c_str());
+
+	return (ret == 0) ? 0 : 1;
+}
@@ -0,0 +1,552 @@
+/**
+ * The file system checker. Walks every file's cluster chain looking for
+ * cross-linked chains, cycles, bad links, orphaned clusters and sizes that
+ * don't match their chains. Can optionally repair what it finds.
+ *
+ * Every file's first cluster is claimed for it before anything is walked.
+ * Chains are then walked in parallel; every worker claims clusters in a
+ * shared visited map with an atomic compare-and-swap, so a cluster reached
+ * twice is caught no matter which thread got there first. Which chain ends
+ * up keeping it mustn't depend on that, so the chains that ran into each
+ * other are walked again one at a time, lowest index first.
+ *
+ * @author: Eduardo Rodrigues - emr4378
+ */
+
+using namespace std;
+
+#include "FileSysCheck.h"
+#include "Allocator.h"
+
+/**
+ * Constructor
+ *
+ * @param fs the (opened) file system to check
+ */
+FileSysCheck::FileSysCheck(FileSys *fs) {
+	this->fs = fs;
+	owner = NULL;
+	nextEntry = 0;
+	settling = false;
+}
+
+/**
+ * Checks the file system, and repairs it if asked to.
+ *
+ * Problems are fixed by cutting broken chains at the last good cluster,
+ * dropping entries that don't own their first cluster, trimming chains
+ * (or sizes) so they agree, and freeing orphaned clusters.
+ *
+ * @param repair true to fix problems and write the FAT/directory back
+ * @param threads number of threads to walk chains with; < 1 for one per CPU
+ * @param report pointer to the report to fill in
+ * @return int the number of problems found; 0 if the file system is clean
+ */
+int FileSysCheck::check(bool repair, int threads, FsckReport *report) {
+	int i;
+	int j;
+	int numClusters = fs->numClusters;
+	pthread_t workers[FSCK_MAX_THREADS];
+
+	memset(report, 0, sizeof(FsckReport));
+	fs->lockAll();
+	//a mounted snapshot can be checked, never written
+	repair = repair && !fs->readOnly;
+	if (threads < 1) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	threads = max(1, min(threads, FSCK_MAX_THREADS));
+	report->threads = threads;
+
+	owner = new int[numClusters];
+	memset(owner, 0, numClusters * sizeof(int));
+	chains.assign(fs->directoryTable.size(), FsckChain());
+	nextEntry = 0;
+	settling = false;
+
+	claimSystemChain(0);
+	claimSystemChain(fs->boot->FAT);
+	claimSystemChain(fs->boot->rootDir);
+	//snapshot table and every snapshot's saved FAT and directory
+	if (fs->header.snapshots > 0 && fs->header.snapshots < numClusters) {
+		owner[fs->header.snapshots] = FSCK_OWNER_SYSTEM;
+	}
+	for (i = 0; i < fs->snapshots.size(); i++) {
+		for (j = fs->snapshots[i].fat;
+				j < fs->snapshots[i].dir + fs->snapshots[i].dirClusters && j < numClusters; j++) {
+			owner[j] = FSCK_OWNER_SYSTEM;
+		}
+	}
+	for (i = 0; i < chains.size(); i++) {
+		claimStart(i);
+	}
+
+	//the calling thread is worker 0
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&workers[i], NULL, walkWorker, this) != 0) {
+			threads = i;
+		}
+	}
+	walkWorker(this);
+	for (i = 1; i < threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	settleContested();
+	//an entry with nothing of its own is dropped, so what it did claim
+	//(overflow blocks, say) is orphaned
+	for (i = 0; i < numClusters; i++) {
+		if (owner[i] > 0 && chains[owner[i] - 1].problem != FSCK_OK
+			&& chains[owner[i] - 1].last == -1) {
+			owner[i] = 0;
+		}
+	}
+
+	for (i = 0; i < chains.size(); i++) {
+		if (chains[i].problem != FSCK_OK || chains[i].length > 0
+			|| (fs->directoryTable[i].name[0] != (char)0x00
+				&& fs->directoryTable[i].name[0] != (char)0xFF && fs->isSmall(i))) {
+			report->filesChecked++;
+		}
+		report->clustersChecked += chains[i].length;
+		if (chains[i].problem == FSCK_BAD_ENTRY) {
+			report->badEntries++;
+		} else if (chains[i].problem == FSCK_CROSS_LINK) {
+			report->crossLinked++;
+		} else if (chains[i].problem == FSCK_CYCLE) {
+			report->cycles++;
+		} else if (chains[i].problem == FSCK_BAD_LINK) {
+			report->badLinks++;
+		} else if (chains[i].length > 0 && chains[i].length !=
+				fs->directoryTable[i].size / fs->boot->clusterSize + 1) {
+			report->sizeMismatches++;
+		}
+	}
+
+	if (repair) {
+		report->repaired += repairChains();
+	}
+	for (i = 0; i < numClusters; i++) {
+		if (owner[i] == 0 && fs->fileAllocationTable[i] != 0x0000) {
+			report->orphaned++;
+		}
+	}
+	if (repair) {
+		report->repaired += repairOrphans();
+		if (report->repaired > 0) {
+			fs->clusterIndex->clear();
+			fs->allocator->reset();
+			fs->loadPackSlots();
+			fs->writeFAT(fs->fileAllocationTable, fs->boot->FAT);
+			fs->writeDirectoryTable(&fs->directoryTable, fs->boot->rootDir);
+			fs->findUsedClusterCount();
+		}
+	}
+
+	delete[] owner;
+	owner = NULL;
+	fs->unlockAll();
+
+	return report->badEntries + report->crossLinked + report->cycles
+			+ report->badLinks + report->sizeMismatches + report->orphaned;
+}
+
+/**
+ * Thread entry point. Keeps grabbing the next unwalked directory entry
+ * until there are none left.
+ *
+ * @param arg the FileSysCheck doing the checking
+ * @return NULL
+ */
+void *FileSysCheck::walkWorker(void *arg) {
+	FileSysCheck *self = (FileSysCheck*)arg;
+	int entry;
+
+	while ((entry = __sync_fetch_and_add(&self->nextEntry, 1))
+			< (int)self->chains.size()) {
+		self->walkChain(entry);
+	}
+
+	return NULL;
+}
+
+/**
+ * Walks a single file's chain, claiming every cluster in the visited map.
+ * Stops at the end of the chain or at the first problem; running into a
+ * cluster another chain claimed marks both for settleContested(). Deleted files
+ * still waiting on the reclaimer are walked too; they own their clusters
+ * until it frees them.
+ *
+ * @param entry index of the file in the directory table
+ */
+void FileSysCheck::walkChain(int entry) {
+	DirectoryTableEntry *dte = &fs->directoryTable[entry];
+	FsckChain *chain = &chains[entry];
+	int *fat = fs->fileAllocationTable;
+	int numClusters = fs->numClusters;
+	int cluster;
+	int next;
+	int claimed;
+
+	chain->length = 0;
+	chain->last = -1;
+	chain->problem = FSCK_OK;
+
+	if (dte->name[0] == (char)0x00 || dte->name[0] == (char)0xFF) {
+		return;
+	}
+	if (fs->isSmall(entry)) {
+		walkSmall(entry);
+		return;
+	}
+	if (fs->usingExtents) {
+		walkExtents(entry);
+		return;
+	}
+
+	cluster = dte->index;
+	if (startOf(entry) == -1) {
+		chain->problem = FSCK_BAD_ENTRY;
+	} else if (owner[cluster] != entry + 1) {
+		//another entry starts here too and, with the lower index, kept it
+		chain->problem = FSCK_CROSS_LINK;
+	}
+
+	while (chain->problem == FSCK_OK && cluster != 0xFFFF) {
+		//the first cluster was claimed up front
+		claimed = (chain->last == -1) ? 0
+				: __sync_val_compare_and_swap(&owner[cluster], 0, entry + 1);
+		if (claimed == entry + 1) {
+			chain->problem = FSCK_CYCLE;
+		} else if (claimed != 0) {
+			chain->problem = FSCK_CROSS_LINK;
+			contest(entry, claimed);
+		} else {
+			chain->length++;
+			chain->last = cluster;
+
+			next = fat[cluster];
+			if (next != 0xFFFF &&
+				(next < 1 || next >= numClusters || fat[next] == 0x0000)) {
+				chain->problem = FSCK_BAD_LINK;
+			}
+			cluster = next;
+		}
+	}
+}
+
+/**
+ * Checks a small file: one kept in its entry must fit there, and a packed
+ * one's slots must lie inside a pack cluster, which it shares with the
+ * other packed files rather than owning. Small files claim no clusters of
+ * their own, so their chain length stays 0.
+ *
+ * @param entry index of the file in the directory table
+ */
+void FileSysCheck::walkSmall(int entry) {
+	DirectoryTableEntry *dte = &fs->directoryTable[entry];
+	FsckChain *chain = &chains[entry];
+	int cluster = dte->index;
+	unsigned int slots = (dte->size + PACK_SLOT_SIZE - 1) / PACK_SLOT_SIZE;
+
+	if (dte->type == TYPE_INLINE) {
+		if (dte->size > INLINE_DATA_SIZE) {
+			chain->problem = FSCK_BAD_ENTRY;
+		}
+	} else if (cluster < 1 || cluster >= fs->numClusters
+		|| fs->fileAllocationTable[cluster] != PACK_CLUSTER || dte->size > PACK_MAX_SIZE
+		|| fs->getSmallInfo(entry)->slot + slots > fs->boot->clusterSize / PACK_SLOT_SIZE) {
+		chain->problem = FSCK_BAD_ENTRY;
+	} else if (owner[cluster] != FSCK_OWNER_PACKED) {
+		//claimStart() found it taken by the system
+		chain->problem = FSCK_BAD_ENTRY;
+	}
+}
+
+/**
+ * Walks a single file's extent list (extent volumes), claiming its
+ * overflow blocks and then every cluster in every extent. An extent list
+ * that can't be read at all, or whose overflow blocks aren't its own, is a
+ * bad entry. Extents aren't a chain, so while walking in parallel a clash
+ * doesn't stop the walk: the rest is still claimed, so every chain it runs
+ * into is found, and the whole file is settled serially afterwards. When
+ * settling, the walk stops at the first problem.
+ *
+ * @param entry index of the file in the directory table
+ */
+void FileSysCheck::walkExtents(int entry) {
+	FsckChain *chain = &chains[entry];
+	int *fat = fs->fileAllocationTable;
+	int i;
+	int j;
+	int cluster;
+	int claimed;
+	bool stop = false;
+	vector<int> blocks;
+	vector<Extent> extents;
+
+	if (startOf(entry) == -1
+		|| fs->findExtentBlocks(fs->getExtentInfo(entry)->overflow, &blocks) != 0
+		|| fs->readExtents(entry, &extents) != 0) {
+		chain->problem = FSCK_BAD_ENTRY;
+	} else if (owner[extents[0].start] != entry + 1) {
+		//another entry starts here too and, with the lower index, kept it
+		chain->problem = FSCK_CROSS_LINK;
+	}
+	stop = chain->problem == FSCK_BAD_ENTRY || (settling && chain->problem != FSCK_OK);
+	for (i = 0; i < blocks.size() && !stop; i++) {
+		claimed = (fat[blocks[i]] == 0x0000) ? FSCK_OWNER_SYSTEM
+				: __sync_val_compare_and_swap(&owner[blocks[i]], 0, entry + 1);
+		if (claimed != 0) {
+			chain->problem = FSCK_BAD_ENTRY;
+			stop = settling || fat[blocks[i]] == 0x0000;
+			if (claimed != entry + 1) {
+				contest(entry, claimed);
+			}
+		}
+	}
+
+	for (i = 0; i < extents.size() && !stop; i++) {
+		for (j = 0; j < extents[i].length && !stop; j++) {
+			cluster = extents[i].start + j;
+			//the first cluster was claimed up front
+			claimed = (fat[cluster] == 0x0000 || (i == 0 && j == 0)) ? 0
+					: __sync_val_compare_and_swap(&owner[cluster], 0, entry + 1);
+			if (fat[cluster] == 0x0000) {
+				if (chain->problem == FSCK_OK) {
+					chain->problem = FSCK_BAD_LINK;
+				}
+				stop = true;
+			} else if (claimed == entry + 1) {
+				//extents overlapping each other (or the overflow blocks)
+				if (chain->problem == FSCK_OK) {
+					chain->problem = FSCK_CYCLE;
+				}
+				stop = settling;
+			} else if (claimed != 0) {
+				if (chain->problem == FSCK_OK) {
+					chain->problem = FSCK_CROSS_LINK;
+				}
+				stop = settling;
+				contest(entry, claimed);
+			} else if (chain->problem == FSCK_OK) {
+				chain->length++;
+				chain->last = cluster;
+			}
+		}
+	}
+
+	//whatever it claimed past a problem has to be given back and claimed
+	//again one chain at a time
+	if (chain->problem != FSCK_OK && chain->problem != FSCK_BAD_LINK) {
+		contest(entry, 0);
+	}
+}
+
+/**
+ * Returns a file's first cluster, if it's one a chain can start at.
+ *
+ * @param entry index of the file in the directory table
+ * @return int the first cluster; -1 if the entry isn't a file with a
+ * chain, or its first cluster is out of range, free or not a data cluster
+ */
+int FileSysCheck::startOf(int entry) {
+	DirectoryTableEntry *dte = &fs->directoryTable[entry];
+	ExtentInfo *info;
+	int cluster = -1;
+	int value;
+
+	if (dte->name[0] != (char)0x00 && dte->name[0] != (char)0xFF && !fs->isSmall(entry)) {
+		if (fs->usingExtents) {
+			info = fs->getExtentInfo(entry);
+			cluster = (info->count > 0) ? info->extents[0].start : -1;
+		} else {
+			cluster = dte->index;
+		}
+		if (cluster < 1 || cluster >= fs->numClusters) {
+			cluster = -1;
+		} else {
+			value = fs->fileAllocationTable[cluster];
+			if (value == 0x0000 || value == PACK_CLUSTER || value == SNAPSHOT_CLUSTER) {
+				cluster = -1;
+			}
+		}
+	}
+
+	return cluster;
+}
+
+/**
+ * Claims a file's first cluster before any chain is walked, so a broken
+ * chain running into it can't take it. Where two entries start at the same
+ * cluster the lower index keeps it. A packed file claims its pack cluster
+ * for every packed file instead.
+ *
+ * @param entry index of the file in the directory table
+ */
+void FileSysCheck::claimStart(int entry) {
+	DirectoryTableEntry *dte = &fs->directoryTable[entry];
+	int cluster = startOf(entry);
+
+	if (cluster != -1 && owner[cluster] == 0) {
+		owner[cluster] = entry + 1;
+	} else if (dte->name[0] != (char)0x00 && dte->name[0] != (char)0xFF
+		&& fs->isSmall(entry) && dte->type != TYPE_INLINE
+		&& dte->index >= 1 && dte->index < fs->numClusters
+		&& fs->fileAllocationTable[dte->index] == PACK_CLUSTER && owner[dte->index] == 0) {
+		owner[dte->index] = FSCK_OWNER_PACKED;
+	}
+}
+
+/**
+ * Marks a chain, and the chain whose cluster it ran into, to be walked
+ * again by settleContested(). Does nothing while settling.
+ *
+ * @param entry index of the chain that ran into the cluster
+ * @param claimed the cluster's owner; not a chain unless > 0
+ */
+void FileSysCheck::contest(int entry, int claimed) {
+	if (!settling) {
+		__sync_fetch_and_or(&chains[entry].contested, 1);
+		if (claimed > 0) {
+			__sync_fetch_and_or(&chains[claimed - 1].contested, 1);
+		}
+	}
+}
+
+/**
+ * Settles the clusters contested during the parallel walk. The contested
+ * chains give back everything but their first cluster and are walked
+ * again one at a time, lowest index first, so each contested cluster goes
+ * to the same chain however the threads raced.
+ */
+void FileSysCheck::settleContested() {
+	int i;
+	int entry;
+
+	for (i = 0; i < fs->numClusters; i++) {
+		entry = owner[i] - 1;
+		if (entry >= 0 && chains[entry].contested && i != startOf(entry)) {
+			owner[i] = 0;
+		}
+	}
+
+	settling = true;
+	for (i = 0; i < chains.size(); i++) {
+		if (chains[i].contested) {
+			walkChain(i);
+		}
+	}
+}
+
+/**
+ * Marks a chain of system clusters (boot record, FAT, root directory)
+ * as visited before any file chains are walked.
+ *
+ * @param cluster first cluster of the chain
+ */
+void FileSysCheck::claimSystemChain(int cluster) {
+	int *fat = fs->fileAllocationTable;
+
+	while (cluster >= 0 && cluster < fs->numClusters && owner[cluster] == 0) {
+		owner[cluster] = FSCK_OWNER_SYSTEM;
+		cluster = fat[cluster];
+	}
+}
+
+/**
+ * Repairs the chains walked by check(). Entries are visited from the end
+ * so dropping one doesn't shift the ones still to be repaired.
+ *
+ * @return int the number of problems fixed
+ */
+int FileSysCheck::repairChains() {
+	int i;
+	int *fat = fs->fileAllocationTable;
+	int clusterSize = fs->boot->clusterSize;
+	int fixed = 0;
+	DirectoryTableEntry *dte;
+	DirectoryTableEntry empty;
+
+	memset(&empty, 0, sizeof(DirectoryTableEntry));
+
+	for (i = chains.size() - 1; i >= 0; i--) {
+		dte = &fs->directoryTable[i];
+		if (chains[i].problem == FSCK_BAD_ENTRY || (chains[i].problem != FSCK_OK
+				&& chains[i].last == -1)) {
+			//nothing of its own to keep
+			fs->directoryTable.erase(fs->directoryTable.begin() + i);
+			fs->directoryTable.push_back(empty);
+			fixed++;
+		} else if (chains[i].problem != FSCK_OK) {
+			//cut the chain at the last cluster that was really ours; the
+			//rest belongs to someone else or is left for repairOrphans()
+			if (fs->usingExtents) {
+				keepExtents(i, chains[i].length);
+			} else {
+				fat[chains[i].last] = 0xFFFF;
+			}
+			if (dte->size > chains[i].length * clusterSize - 1) {
+				dte->size = chains[i].length * clusterSize - 1;
+			}
+			fixed++;
+		} else if (chains[i].length > dte->size / clusterSize + 1) {
+			//chain is longer than the file; free the extra clusters
+			fs->cutFile(i, dte->size / clusterSize + 1);
+			fixed++;
+		} else if (chains[i].length > 0 &&
+				chains[i].length < dte->size / clusterSize + 1) {
+			//chain is shorter than the file; keep what the chain can hold
+			dte->size = chains[i].length * clusterSize - 1;
+			fixed++;
+		}
+	}
+
+	return fixed;
+}
+
+/**
+ * Cuts an extent list down to its first clusters without freeing the
+ * rest, which may not be the file's to free.
+ *
+ * @param entry index of the file in the directory table
+ * @param keep the number of clusters to keep; at least 1
+ */
+void FileSysCheck::keepExtents(int entry, int keep) {
+	int i;
+	vector<Extent> extents;
+	vector<Extent> kept;
+
+	fs->readExtents(entry, &extents);
+	for (i = 0; i < extents.size() && keep > 0; i++) {
+		kept.push_back(extents[i]);
+		kept.back().length = min((int)extents[i].length, keep);
+		keep -= kept.back().length;
+	}
+	fs->writeExtents(entry, &kept);
+}
+
+/**
+ * Frees every used cluster that no chain reached.
+ *
+ * @return int the number of clusters freed
+ */
+int FileSysCheck::repairOrphans() {
+	int i;
+	int fixed = 0;
+
+	for (i = 0; i < fs->numClusters; i++) {
+		if (owner[i] == 0 && fs->fileAllocationTable[i] != 0x0000) {
+			fs->releaseCluster(i);
+			fixed++;
+		}
+	}
+
+	return fixed;
+}
+
+/**
+ * Deconstructor
+ */
+FileSysCheck::~FileSysCheck() {
+	delete[] owner;
+}
@@ -0,0 +1,70 @@
+#ifndef FILESYSCHECK_H
+#define FILESYSCHECK_H
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "FileSys.h"
+
+#define FSCK_MAX_THREADS 16
+#define FSCK_OWNER_SYSTEM -1 //owner of boot record, FAT and root directory
+#define FSCK_OWNER_PACKED -2 //owner of pack clusters, shared by small files
+
+/**
+ * Counts of everything the checker found (and fixed, if repairing)
+ */
+struct FsckReport {
+	int threads; //number of threads used to walk the chains
+	int filesChecked; //directory entries walked
+	int clustersChecked; //clusters reached from any chain
+	int badEntries; //entries whose first cluster (or extent list) is invalid
+	int crossLinked; //chains running into a cluster owned by another chain
+	int cycles; //chains running back into themselves
+	int badLinks; //links pointing out of range or at a free cluster
+	int sizeMismatches; //entry size doesn't match its chain length
+	int orphaned; //used clusters not reachable from anything
+	int repaired; //problems fixed (repair mode only)
+};
+
+/**
+ * Per-entry result of a chain walk; filled in by the worker threads
+ */
+struct FsckChain {
+	int length; //clusters claimed by this chain
+	int last; //last good cluster of the chain; -1 if none
+	int problem; //one of the FSCK_* problem codes below
+	int contested; //another chain reached one of its clusters; walked again serially
+};
+
+#define FSCK_OK 0
+#define FSCK_BAD_ENTRY 1
+#define FSCK_CROSS_LINK 2
+#define FSCK_CYCLE 3
+#define FSCK_BAD_LINK 4
+
+class FileSysCheck {
+	public:
+		FileSysCheck(FileSys *fs);
+		~FileSysCheck();
+		int check(bool repair, int threads, FsckReport *report);
+	private:
+		static void *walkWorker(void *arg);
+		void walkChain(int entry);
+		void walkExtents(int entry);
+		void walkSmall(int entry);
+		void claimSystemChain(int cluster);
+		void claimStart(int entry);
+		int startOf(int entry);
+		void contest(int entry, int claimed);
+		void settleContested();
+		int repairChains();
+		int repairOrphans();
+		void keepExtents(int entry, int keep);
+
+		FileSys *fs;
+		int *owner; //shared visited map; entry + 1 that claimed each cluster
+		int nextEntry; //next directory entry to hand out to a worker
+		bool settling; //walking contested chains again, one at a time
+		vector<FsckChain> chains;
+};
+#endif
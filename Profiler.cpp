@@ -0,0 +1,218 @@
+/**
+ * Counts and times what the FileSys does: for every public operation and
+ * the hot paths under them, how often it's called, the system calls and
+ * bytes of image I/O it causes, the clusters it scans, and a histogram
+ * of how long calls take (log-bucketed, so p50/p99/p999 come out to
+ * within a factor of two).
+ *
+ * Counting is lock-free: each call adds to its operation's totals with
+ * atomic adds, and the syscall, byte and scan counts are kept per thread
+ * and charged to every operation open on that thread when it ends.
+ * Building with -DFS_NO_STATS leaves all of it out (see PROFILE).
+ *
+ * @author: Eduardo Rodrigues - emr4378
+ */
+
+using namespace std;
+
+#include "Profiler.h"
+
+__thread ProfCounters profCounters = {0, 0, 0};
+
+/**
+ * Constructor
+ */
+Profiler::Profiler() {
+	reset();
+}
+
+/**
+ * Adds one finished call to an operation's totals.
+ *
+ * @param op the OP_* operation
+ * @param ns how long the call took, in nanoseconds
+ * @param used system calls, bytes and clusters scanned during the call
+ */
+void Profiler::record(int op, long long ns, ProfCounters *used) {
+	OpStats *stats = &ops[op];
+	long long longest = stats->maxNs;
+	int bucket = 0;
+
+	while (bucket < PROF_BUCKETS - 1 && (ns >> (bucket + 1)) > 0) {
+		bucket++;
+	}
+
+	__sync_fetch_and_add(&stats->calls, 1);
+	__sync_fetch_and_add(&stats->syscalls, used->syscalls);
+	__sync_fetch_and_add(&stats->bytes, used->bytes);
+	__sync_fetch_and_add(&stats->scanned, used->scanned);
+	__sync_fetch_and_add(&stats->totalNs, ns);
+	__sync_fetch_and_add(&stats->buckets[bucket], 1);
+	while (ns > longest && !__sync_bool_compare_and_swap(&stats->maxNs, longest, ns)) {
+		longest = stats->maxNs;
+	}
+}
+
+/**
+ * Zeroes every count. Calls in progress are counted when they end.
+ */
+void Profiler::reset() {
+	memset(ops, 0, sizeof(ops));
+}
+
+/**
+ * Copies every operation's totals, in OP_* order.
+ *
+ * @param stats pointer to vector to store them in
+ * @return int the number of operations (PROF_OPS)
+ */
+int Profiler::getStats(vector<OpStats> *stats) {
+	stats->assign(ops, ops + PROF_OPS);
+
+	return stats->size();
+}
+
+/**
+ * The totals of every operation called at least once, as a table or as
+ * JSON (one object with an "ops" list, latencies in microseconds and
+ * the histogram's counts up to its last non-empty bucket).
+ *
+ * @param json true for JSON, false for a table
+ * @return string the totals
+ */
+string Profiler::format(bool json) {
+	int i;
+	int j;
+	int last;
+	bool first = true;
+	OpStats stats;
+	stringstream out;
+
+	out << fixed << setprecision(2);
+	if (json) {
+		out << "{\"enabled\": " << (isEnabled() ? "true" : "false") << ", \"ops\": [";
+	} else {
+		out << left << setw(16) << "op" << right << setw(10) << "calls";
+		out << setw(10) << "syscalls" << setw(14) << "bytes" << setw(10) << "scanned";
+		out << setw(10) << "mean us" << setw(10) << "p50 us" << setw(10) << "p99 us";
+		out << setw(10) << "p999 us" << setw(10) << "max us" << endl;
+	}
+
+	for (i = 0; i < PROF_OPS; i++) {
+		stats = ops[i];
+		if (stats.calls > 0 && json) {
+			out << (first ? "" : ",") << endl << "  {\"op\": \"" << getOpName(i) << "\"";
+			out << ", \"calls\": " << stats.calls << ", \"syscalls\": " << stats.syscalls;
+			out << ", \"bytes\": " << stats.bytes << ", \"scanned\": " << stats.scanned;
+			out << ", \"mean_us\": " << stats.totalNs / 1e3 / stats.calls;
+			out << ", \"p50_us\": " << percentile(&stats, 0.5);
+			out << ", \"p99_us\": " << percentile(&stats, 0.99);
+			out << ", \"p999_us\": " << percentile(&stats, 0.999);
+			out << ", \"max_us\": " << stats.maxNs / 1e3 << ", \"histogram\": [";
+			for (last = PROF_BUCKETS - 1; last > 0 && stats.buckets[last] == 0; last--);
+			for (j = 0; j <= last; j++) {
+				out << ((j > 0) ? ", " : "") << stats.buckets[j];
+			}
+			out << "]}";
+			first = false;
+		} else if (stats.calls > 0) {
+			out << left << setw(16) << getOpName(i) << right << setw(10) << stats.calls;
+			out << setw(10) << stats.syscalls << setw(14) << stats.bytes;
+			out << setw(10) << stats.scanned;
+			out << setw(10) << stats.totalNs / 1e3 / stats.calls;
+			out << setw(10) << percentile(&stats, 0.5);
+			out << setw(10) << percentile(&stats, 0.99);
+			out << setw(10) << percentile(&stats, 0.999);
+			out << setw(10) << stats.maxNs / 1e3 << endl;
+		}
+	}
+	if (json) {
+		out << endl << "]}" << endl;
+	}
+
+	return out.str();
+}
+
+/**
+ * @return bool false if built with -DFS_NO_STATS, so nothing is counted
+ */
+bool Profiler::isEnabled() {
+#ifdef FS_NO_STATS
+	return false;
+#else
+	return true;
+#endif
+}
+
+/**
+ * @param op an OP_* operation
+ * @return string its name, as stats shows it
+ */
+string Profiler::getOpName(int op) {
+	string names[] = {"mount", "format", "touch", "cp", "mv", "rm", "ls", "lookup",
+		"df", "open", "read", "write", "seek", "truncate", "close", "batch", "convert",
+		"trim", "snapshot", "allocate", "writeFAT", "writeDirectory", "readCluster",
+		"writeCluster", "reclaim"};
+
+	return (op >= 0 && op < PROF_OPS) ? names[op] : "";
+}
+
+/**
+ * A latency percentile, from the histogram: the top of the bucket the
+ * call at that fraction of the way through falls in (but never more than
+ * the longest call).
+ *
+ * @param stats pointer to an operation's totals
+ * @param fraction which percentile, 0 to 1 (0.99 for p99)
+ * @return double the latency in microseconds; 0 if never called
+ */
+double Profiler::percentile(OpStats *stats, double fraction) {
+	int i;
+	long long seen = 0;
+	long long wanted = (long long)(stats->calls * fraction);
+	double ret = 0;
+
+	for (i = 0; i < PROF_BUCKETS && stats->calls > 0 && ret == 0; i++) {
+		seen += stats->buckets[i];
+		if (seen > wanted || i == PROF_BUCKETS - 1) {
+			ret = min((double)(2LL << i), (double)stats->maxNs) / 1e3;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @return long long the time on the monotonic clock, in nanoseconds
+ */
+long long Profiler::now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Starts timing a call; see PROFILE.
+ *
+ * @param profiler the profiler to count the call in
+ * @param op the OP_* operation
+ */
+ProfScope::ProfScope(Profiler *profiler, int op) {
+	this->profiler = profiler;
+	this->op = op;
+	start = profCounters;
+	startNs = Profiler::now();
+}
+
+/**
+ * Counts the call, with whatever the thread did since it started.
+ */
+ProfScope::~ProfScope() {
+	ProfCounters used;
+
+	used.syscalls = profCounters.syscalls - start.syscalls;
+	used.bytes = profCounters.bytes - start.bytes;
+	used.scanned = profCounters.scanned - start.scanned;
+	profiler->record(op, Profiler::now() - startNs, &used);
+}
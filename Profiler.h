@@ -0,0 +1,111 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <string.h>
+#include <time.h>
+
+#define PROF_BUCKETS 40 //latency histogram buckets; bucket i is 2^i to 2^(i+1) ns
+
+//what's counted; everything FileSys does from outside, then its hot paths
+#define OP_MOUNT 0 //openFileSys()
+#define OP_FORMAT 1 //createFileSys()
+#define OP_TOUCH 2 //createFile()
+#define OP_COPY 3 //copyFile(), copyFileFrom(), importFile()
+#define OP_MOVE 4 //moveFile(), moveFileFrom()
+#define OP_REMOVE 5 //removeFile()
+#define OP_LIST 6 //listFiles(), listEntries(), getFAT()
+#define OP_LOOKUP 7 //getFileSize()
+#define OP_DF 8 //getStats()
+#define OP_OPEN 9 //openFile()
+#define OP_READ 10 //readFile(), readFileAt(), sendFile()
+#define OP_WRITE 11 //writeFile(), writeFileAt(), and receiveFile() by its writes
+#define OP_SEEK 12 //seekFile()
+#define OP_TRUNCATE 13 //truncateFile()
+#define OP_CLOSE 14 //closeFile()
+#define OP_BATCH 15 //flushBatch(), endBatch()
+#define OP_CONVERT 16 //convertToExtents()
+#define OP_TRIM 17 //trimFileSys()
+#define OP_SNAPSHOT 18 //createSnapshot(), deleteSnapshot(), rollbackSnapshot(), mountSnapshot()
+#define OP_ALLOCATE 19 //findNextFreeCluster()
+#define OP_WRITE_FAT 20 //writeFAT()
+#define OP_WRITE_DIRECTORY 21 //writeDirectoryTable()
+#define OP_READ_CLUSTER 22 //readCluster()
+#define OP_WRITE_CLUSTER 23 //writeCluster()
+#define OP_RECLAIM 24 //reclaimPending()
+#define PROF_OPS 25
+
+/**
+ * Everything counted for one operation. syscalls, bytes and scanned
+ * include whatever the operation called, so a write's count includes
+ * the cluster writes and allocations it did.
+ */
+struct OpStats {
+	long long calls;
+	long long syscalls; //system calls on the image (pread, pwrite, fsync, ...)
+	long long bytes; //bytes read from and written to the image
+	long long scanned; //clusters looked at for being free, or counted
+	long long totalNs; //time spent in all calls
+	long long maxNs; //longest call
+	long long buckets[PROF_BUCKETS]; //calls by how long they took
+};
+
+/**
+ * What the running thread has done so far; scopes take the difference
+ * from when they started
+ */
+struct ProfCounters {
+	long long syscalls;
+	long long bytes;
+	long long scanned;
+};
+
+extern __thread ProfCounters profCounters;
+
+class Profiler {
+	public:
+		Profiler();
+		void record(int op, long long ns, ProfCounters *used);
+		void reset();
+		int getStats(vector<OpStats> *stats);
+		string format(bool json);
+		static bool isEnabled();
+		static string getOpName(int op);
+		static double percentile(OpStats *stats, double fraction);
+		static long long now();
+	private:
+		OpStats ops[PROF_OPS];
+};
+
+/**
+ * Times one call to an operation, from where it's declared to the end of
+ * the block it's in (see PROFILE)
+ */
+class ProfScope {
+	public:
+		ProfScope(Profiler *profiler, int op);
+		~ProfScope();
+	private:
+		Profiler *profiler;
+		int op;
+		ProfCounters start;
+		long long startNs;
+};
+
+//built with -DFS_NO_STATS, none of the counting is compiled in
+#ifdef FS_NO_STATS
+#define PROFILE(profiler, op)
+#define PROFILE_SYSCALL(n)
+#define PROFILE_BYTES(n)
+#define PROFILE_SCANNED(n)
+#else
+#define PROFILE(profiler, op) ProfScope profScope(profiler, op)
+#define PROFILE_SYSCALL(n) (profCounters.syscalls += (n))
+#define PROFILE_BYTES(n) (profCounters.bytes += (n))
+#define PROFILE_SCANNED(n) (profCounters.scanned += (n))
+#endif
+
+#endif
@@ -0,0 +1,228 @@
+/**
+ * The replicator. Ships a volume image between hosts as deltas: only the
+ * clusters (FAT, directory and data alike) written since the generation
+ * the other copy is at, instead of the whole image every time.
+ *
+ * Which clusters changed when comes from the FileSys's changed-cluster
+ * map (<image>.chg), which stamps every cluster written with the current
+ * generation. Exporting a delta closes the current generation, so the next
+ * delta picks up from there. Applying one writes the clusters straight
+ * into an unmounted image; once every delta has been applied in order the
+ * copy is byte-for-byte the same as the source was when the last one was
+ * exported.
+ *
+ * @author: Eduardo Rodrigues - emr4378
+ */
+
+using namespace std;
+
+#include "Replicator.h"
+
+/**
+ * Constructor
+ *
+ * @param fs the (opened) file system to export deltas from
+ */
+Replicator::Replicator(FileSys *fs) {
+	this->fs = fs;
+}
+
+/**
+ * Writes a delta of every cluster changed since the given generation and
+ * starts a new generation. The whole file system is locked while it's
+ * written, so the delta is a consistent picture of the volume.
+ *
+ * @param since the generation the copy being updated is at; 0 for a full copy
+ * @param out where to write the delta
+ * @param delta pointer to store the delta's header in
+ * @return int the number of clusters in the delta; -1 if it couldn't be
+ *         written, -3 if since is a generation that hasn't happened yet,
+ *         -4 if the volume is striped (a delta is applied to one image file)
+ */
+int Replicator::exportDelta(unsigned int since, int out, DeltaHeader *delta) {
+	int ret = 0;
+	int i;
+	unsigned int cluster;
+	int clusterSize = fs->boot->clusterSize;
+	char *data = (char*)malloc(clusterSize);
+	vector<unsigned int> changed;
+	struct stat info;
+
+	fs->flushBatch();
+	fs->lockAll();
+
+	memset(delta, 0, sizeof(DeltaHeader));
+	if (since >= fs->changes.generation) {
+		ret = -3;
+	} else if (fs->header.flags & VOLUME_STRIPED) {
+		ret = -4;
+	} else {
+		for (i = 0; i < fs->numClusters; i++) {
+			if (fs->changeMap[i] > since) {
+				changed.push_back(i);
+			}
+		}
+
+		fstat(fs->fd, &info);
+		delta->magic = DELTA_MAGIC;
+		delta->from = since;
+		delta->to = fs->changes.generation;
+		delta->clusterSize = clusterSize;
+		delta->clusters = changed.size();
+		delta->imageSize = info.st_size;
+		if (!writeFully(out, delta, sizeof(DeltaHeader))) {
+			ret = -1;
+		}
+	}
+
+	for (i = 0; i < changed.size() && ret == 0; i++) {
+		cluster = changed[i];
+		memset(data, 0, clusterSize);
+		fs->readAt(data, clusterSize, (off_t)cluster * clusterSize);
+		if (!writeFully(out, &cluster, sizeof(int))
+			|| !writeFully(out, data, clusterSize)) {
+			ret = -1;
+		}
+	}
+
+	if (ret == 0) {
+		//later writes belong to the next delta
+		fs->changes.generation++;
+		fs->writeChangeMap(false);
+		ret = changed.size();
+	}
+
+	fs->unlockAll();
+	free(data);
+
+	return ret;
+}
+
+/**
+ * Applies a delta to an image that isn't mounted, creating the image if
+ * it doesn't exist yet (a full delta, from generation 0, fills it in).
+ * Deltas have to be applied in the order they were exported and the image
+ * mustn't be changed in between; the generation the image is at is kept
+ * in its <image>.chg, and a delta that doesn't follow on is refused.
+ *
+ * If it fails part way the image is left part updated, but still at its
+ * old generation, so the same delta can just be applied again.
+ *
+ * @param image name of the image file to update
+ * @param in where to read the delta from
+ * @param delta pointer to store the delta's header in
+ * @return int the number of clusters applied; -1 if the delta or image
+ *         couldn't be read or written, -3 if the delta doesn't follow on
+ *         from the generation the image is at
+ */
+int Replicator::applyDelta(string image, int in, DeltaHeader *delta) {
+	int ret = 0;
+	unsigned int i;
+	unsigned int cluster;
+	int imageFd = -1;
+	int changeFd = -1;
+	char *data = NULL;
+	ChangeHeader changes;
+	string changeName = image + ".chg";
+
+	if (!readFully(in, delta, sizeof(DeltaHeader)) || delta->magic != DELTA_MAGIC
+		|| delta->clusterSize == 0) {
+		ret = -1;
+	} else {
+		imageFd = open(image.c_str(), O_RDWR | O_CREAT, 0644);
+		changeFd = open(changeName.c_str(), O_RDWR | O_CREAT, 0644);
+		if (imageFd == -1 || changeFd == -1) {
+			ret = -1;
+		} else if (pread(changeFd, &changes, sizeof(ChangeHeader), 0) != sizeof(ChangeHeader)
+			|| changes.magic != CHANGE_MAGIC) {
+			memset(&changes, 0, sizeof(ChangeHeader));
+			changes.magic = CHANGE_MAGIC;
+			changes.generation = 1;
+		}
+	}
+
+	if (ret == 0 && delta->from != 0 && delta->from != changes.applied) {
+		ret = -3;
+	}
+
+	if (ret == 0) {
+		data = (char*)malloc(delta->clusterSize);
+		for (i = 0; i < delta->clusters && ret == 0; i++) {
+			if (!readFully(in, &cluster, sizeof(int))
+				|| !readFully(in, data, delta->clusterSize)
+				|| pwrite(imageFd, data, delta->clusterSize,
+							(off_t)cluster * delta->clusterSize) != delta->clusterSize) {
+				ret = -1;
+			}
+		}
+		free(data);
+	}
+
+	if (ret == 0 && (ftruncate(imageFd, delta->imageSize) != 0 || fsync(imageFd) != 0)) {
+		ret = -1;
+	}
+
+	if (ret == 0) {
+		//the image changed behind any map's back, so it's rebuilt (every
+		//cluster counted as changed) the next time the image is mounted
+		changes.applied = delta->to;
+		changes.clean = 0;
+		changes.numClusters = 0;
+		ftruncate(changeFd, 0);
+		pwrite(changeFd, &changes, sizeof(ChangeHeader), 0);
+		fsync(changeFd);
+		ret = delta->clusters;
+	}
+
+	if (imageFd != -1) {
+		close(imageFd);
+	}
+	if (changeFd != -1) {
+		close(changeFd);
+	}
+
+	return ret;
+}
+
+/**
+ * Reads exactly length bytes, however many reads it takes (pipes hand
+ * data over in pieces).
+ *
+ * @return bool true if all of it was read
+ */
+bool Replicator::readFully(int fd, void *buf, int length) {
+	int done = 0;
+	int n = 1;
+
+	while (done < length && n > 0) {
+		n = read(fd, (char*)buf + done, length - done);
+		if (n > 0) {
+			done += n;
+		} else if (n < 0 && errno == EINTR) {
+			n = 1;
+		}
+	}
+
+	return done == length;
+}
+
+/**
+ * Writes exactly length bytes, however many writes it takes.
+ *
+ * @return bool true if all of it was written
+ */
+bool Replicator::writeFully(int fd, const void *buf, int length) {
+	int done = 0;
+	int n = 1;
+
+	while (done < length && n > 0) {
+		n = write(fd, (const char*)buf + done, length - done);
+		if (n > 0) {
+			done += n;
+		} else if (n < 0 && errno == EINTR) {
+			n = 1;
+		}
+	}
+
+	return done == length;
+}
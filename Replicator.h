@@ -0,0 +1,37 @@
+#ifndef REPLICATOR_H
+#define REPLICATOR_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "FileSys.h"
+
+#define DELTA_MAGIC 0x544C4446 //"FDLT"; starts every delta stream
+
+/**
+ * Starts a delta stream. Followed by one record per changed cluster: the
+ * cluster number (an unsigned int) and then the whole cluster.
+ */
+struct DeltaHeader {
+	unsigned int magic; //DELTA_MAGIC
+	unsigned int from; //generation the image must be at to apply it; 0 for any
+	unsigned int to; //generation the image is at once it's applied
+	unsigned int clusterSize; //bytes in every cluster record
+	unsigned int clusters; //cluster records that follow
+	unsigned int reserved;
+	long long imageSize; //size of the source image file, in bytes
+};
+
+class Replicator {
+	public:
+		Replicator(FileSys *fs);
+		int exportDelta(unsigned int since, int out, DeltaHeader *delta);
+		static int applyDelta(string image, int in, DeltaHeader *delta);
+	private:
+		static bool readFully(int fd, void *buf, int length);
+		static bool writeFully(int fd, const void *buf, int length);
+
+		FileSys *fs;
+};
+#endif
@@ -1,6 +1,7 @@
 /**
  * The Shell class. Contains all the shell command magic.
- * Handles all the user input and contact to the FileSys.
+ * Handles all the user input and contact to the FileSys, and everything
+ * printed about it; the FileSys itself prints nothing.
  *
  * @author: Eduardo Rodrigues - emr4378
  */
@@ -9,40 +10,221 @@ using namespace std;
 
 #include "Shell.h"
 
+//set by Ctrl+C while a defrag is running so it stops after the current file
+static volatile sig_atomic_t defragStop = 0;
+
+static void stopDefrag(int sig) {
+	defragStop = 1;
+}
+
 /**
  * Constructor
+ *
+ * @param count how many file systems to mount
+ * @param names the file systems to open (each created if it doesn't
+ *        exist), or image@snapshot to mount one of an image's snapshots
+ *        read-only; each is mounted at "/" and its name as given, and the
+ *        shell starts in the first that opens
+ * @param batch true to run a script (see runBatch()): nothing is printed
+ *        but what commands print, and a missing file system isn't created
  */
-Shell::Shell(char *name) {
+Shell::Shell(int count, char **names, bool batch) {
 	char *dir = (char*)malloc(sizeof(char)*FILENAME_MAX);
-	int fileSysUse = -1;
-	string tempName;
+	int i;
 
 	getcwd(dir, sizeof(char)*FILENAME_MAX);
 	filePath = new string(dir);
 	oldFilePath = new string(dir);
 	fakeFilePath = new string();
 	free(dir);
+	this->batch = batch;
+	fileSystem = NULL;
 
-	fileSystem = new FileSys();
-
-	if (name != NULL) {
-		tempName = name;
-		getAbsoluteFromRelativePath(tempName, &tempName);
-		if (checkIfExists(tempName)) {
-			fileSysUse = fileSystem->openFileSys(name);
-		} else {
-			fileSysUse = createFileSystem(name);
-		}
+	for (i = 0; i < count; i++) {
+		mountFileSystem(names[i], "");
 	}
 	
-	if (fileSysUse == 0) {
+	if (!mounts.empty()) {
 		chdir("/");
-		*fakeFilePath = "/";
-		*fakeFilePath += name;
+		selectMount(mounts[0].path);
 		*filePath = *fakeFilePath;
 	}
 
-	cout << "Shell Created" << endl;
+	if (!batch) {
+		cout << "Shell Created" << endl;
+	}
+}
+
+/**
+ * Opens a file system and mounts it alongside any already mounted.
+ *
+ * @param name the image to open (created if it doesn't exist, unless
+ *        running a script), or image@snapshot to mount one of its
+ *        snapshots read-only
+ * @param path where to mount it; "" for "/" and name as given
+ * @return int 0 if mounted; -1 if it couldn't be opened, is mounted
+ *         already, or path is taken
+ */
+int Shell::mountFileSystem(string name, string path) {
+	int ret = -1;
+	int i;
+	bool clash;
+	string imageName = name;
+	string snapshot;
+	size_t at;
+	struct stat info;
+	Mount mount;
+	FileSys *current = fileSystem;
+	string currentPath = *fakeFilePath;
+
+	at = imageName.rfind('@');
+	if (!checkIfExists(imageName) && at != string::npos && at > 0) {
+		snapshot = imageName.substr(at + 1);
+		imageName = imageName.substr(0, at);
+	}
+	if (path.empty()) {
+		path = "/" + name;
+	}
+
+	//no mount can be inside another, or it'd be unclear which a path is in
+	clash = path.size() < 2 || path[0] != '/' || path[path.size()-1] == '/'
+			|| findMount(path) != -1;
+	for (i = 0; i < mounts.size() && !clash; i++) {
+		clash = mounts[i].path.find(path + "/") == 0;
+	}
+	if (clash) {
+		cout << "mount: " << path << " is taken, or inside another mount" << endl;
+	}
+	//two FileSys on one image would each write over the other's changes
+	for (i = 0; i < mounts.size() && !clash && stat(imageName.c_str(), &info) == 0; i++) {
+		if (mounts[i].device == info.st_dev && mounts[i].inode == info.st_ino) {
+			cout << "mount: " << imageName << " is already mounted at ";
+			cout << mounts[i].path << endl;
+			clash = true;
+		}
+	}
+
+	if (!clash) {
+		fileSystem = new FileSys();
+		*fakeFilePath = path;
+		if (checkIfExists(imageName)) {
+			ret = fileSystem->openFileSys(imageName);
+			if (ret == 0 && !snapshot.empty()
+				&& fileSystem->mountSnapshot(snapshot) != 0) {
+				cout << imageName << " has no snapshot " << snapshot << endl;
+				ret = -1;
+			} else if (ret == 0 && !batch) {
+				printInfo(6, true);
+				if (!snapshot.empty()) {
+					cout << "snapshot " << snapshot << " mounted read-only" << endl;
+				}
+			}
+		} else if (snapshot.empty() && !batch) {
+			ret = createFileSystem(imageName);
+		} else {
+			cout << imageName << " doesn't exist" << endl;
+		}
+	}
+
+	if (ret == 0) {
+		stat(imageName.c_str(), &info);
+		mount.path = path;
+		mount.image = name;
+		mount.fileSystem = fileSystem;
+		mount.device = info.st_dev;
+		mount.inode = info.st_ino;
+		mounts.push_back(mount);
+	} else if (fileSystem != current) {
+		delete fileSystem;
+	}
+	fileSystem = current;
+	*fakeFilePath = currentPath;
+
+	return ret;
+}
+
+/**
+ * Mounts another file system, or lists those mounted:
+ * mount [image[@snapshot] [/prefix]]
+ *
+ * The image is a path on the host; it's mounted at prefix, or at "/" and
+ * the image's file name if none is given. Files can then be copied and
+ * moved straight from one file system to another (see copyFiles()).
+ *
+ * @param tokens string array containing tokenized version of command
+ * @returns 0 if mounted (or listed); -1 otherwise
+ */
+int Shell::mountCommand(string tokens[]) {
+	int ret = 0;
+	int i;
+	string image;
+	string path = tokens[2];
+	FileSysStats stats;
+
+	if (tokens[1].empty()) {
+		for (i = 0; i < mounts.size(); i++) {
+			mounts[i].fileSystem->getStats(&stats);
+			cout << left << setw(20) << mounts[i].path << " " << setw(30) << mounts[i].image;
+			cout << right << setw(6) << stats.size / (1024 * 1024) << " MB";
+			cout << setw(4);
+			cout << (int)(((double)(stats.clusters - stats.availableClusters) / stats.clusters) * 100);
+			cout << "%";
+			cout << (stats.readOnly ? " (snapshot, read-only)" : "") << endl;
+		}
+		cout << mounts.size() << " mounted" << endl;
+	} else {
+		getAbsoluteFromRelativePath(tokens[1], &image);
+		if (path.empty()) {
+			path = "/" + image.substr(image.find_last_of('/') + 1);
+		}
+		ret = mountFileSystem(image, path);
+		if (ret == 0 && !batch) {
+			cout << "mount: " << image << " on " << path << endl;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Unmounts a file system: umount /prefix
+ *
+ * If the shell is in it, it moves to "/".
+ *
+ * @param tokens string array containing tokenized version of command
+ * @returns 0 if unmounted; -1 if nothing is mounted there
+ */
+int Shell::unmountCommand(string tokens[]) {
+	int ret = -1;
+	int i;
+	string path;
+	string name;
+
+	if (!tokens[1].empty()) {
+		getAbsoluteFromRelativePath(tokens[1], &path);
+		for (i = 0; i < mounts.size() && ret != 0; i++) {
+			if (mounts[i].path == path) {
+				if (findMount(*filePath) == i) {
+					*filePath = "/";
+					*oldFilePath = "/";
+					chdir("/");
+				}
+				delete mounts[i].fileSystem;
+				mounts.erase(mounts.begin() + i);
+				ret = 0;
+			}
+		}
+	}
+	if (ret != 0) {
+		cout << "umount: " << path << " isn't mounted" << endl;
+	}
+	fileSystem = NULL;
+	fakeFilePath->clear();
+	if (!mounts.empty()) {
+		selectMount(mounts[0].path);
+	}
+
+	return ret;
 }
 
 /**
@@ -101,11 +283,20 @@ int Shell::createFileSystem(string name) {
 					cout << " and " << MAX_CLUSTER_SIZE << endl;
 				}
 			}
+			if (condMet && fileSize * 1024 / num >= MAX_CLUSTERS) {
+				condMet = false;
+				cout << "A " << fileSize << " MB file system needs clusters of at least ";
+				cout << fileSize * 1024 / MAX_CLUSTERS + 1 << " KB" << endl;
+			}
 		} while (!condMet && !cin.eof());
 
 		clusterSize = num;
 
 		ret = fileSystem->createFileSys(name, fileSize, clusterSize);
+		if (ret == 0) {
+			cout << "ls" << endl;
+			printDirectory();
+		}
 	}
 
 	return ret;
@@ -116,16 +307,91 @@ int Shell::createFileSystem(string name) {
  * until Ctrl+D or Ctrl+C is pressed
  */
 void Shell::prompt() {
-	char input[256];
-	do {
-		cout << "os1shell->";
-		cin.getline(input, 256);
+	string input;
+
+	cout << "os1shell->";
+	while (getline(cin, input)) {
 		runCommand(input);
-		
-	} while (!cin.eof());
+		cout << "os1shell->";
+	}
 	cout << endl;
 }
 
+/**
+ * Runs a script of commands, one per line, back to back: no prompts, no
+ * echoes, and lines can be any length. Blank lines and lines starting with
+ * # are skipped. The FAT and directory are written once at the end instead
+ * of after every command (see FileSys::beginBatch()), except that they're
+ * written out before host commands and fsck, defrag, convert, trim and
+ * snapshot (see isCommandBatched()), which then run as they would from the
+ * prompt. How many commands ran, how many failed and how fast goes to
+ * stderr, so stdout holds nothing but what the commands printed.
+ *
+ * @param in the script
+ * @return int 0 if every command ran fine; -1 if any failed or no file
+ *         system is open
+ */
+int Shell::runBatch(istream *in) {
+	int ret = 0;
+	long long commands = 0;
+	long long failed = 0;
+	size_t first;
+	double seconds;
+	string line;
+	struct timeval start;
+	struct timeval end;
+
+	if (mounts.empty()) {
+		cerr << "batch: no file system open" << endl;
+		ret = -1;
+	} else {
+		gettimeofday(&start, NULL);
+		beginBatches();
+		while (getline(*in, line)) {
+			first = line.find_first_not_of(" \t\r");
+			if (first != string::npos && line[first] != '#') {
+				commands++;
+				if (runCommand(line) < 0) {
+					failed++;
+				}
+			}
+		}
+		endBatches();
+		gettimeofday(&end, NULL);
+		cout.flush();
+
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+		cerr << "batch: " << commands << " commands (" << failed << " failed) in ";
+		cerr << fixed << setprecision(3) << seconds << " s, ";
+		cerr << setprecision(0) << commands / max(seconds, 1e-6) << " ops/s" << endl;
+		ret = (failed == 0) ? 0 : -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Starts a batch on every file system mounted (see FileSys::beginBatch()).
+ */
+void Shell::beginBatches() {
+	int i;
+
+	for (i = 0; i < mounts.size(); i++) {
+		mounts[i].fileSystem->beginBatch();
+	}
+}
+
+/**
+ * Ends a batch on every file system mounted (see FileSys::endBatch()).
+ */
+void Shell::endBatches() {
+	int i;
+
+	for (i = 0; i < mounts.size(); i++) {
+		mounts[i].fileSystem->endBatch();
+	}
+}
+
 /**
  * Tokenizes the user command and runs it
  *
@@ -134,75 +400,127 @@ void Shell::prompt() {
  * to exec
  *
  * The cd command is a special exception; it isn't passed anywhere. It is handled
- * locally to provide the same functionality as a normal cd command.
+ * locally to provide the same functionality as a normal cd command. So are
+ * mount and umount, which take host paths and mount points.
  * 
  * @param cmdline string for of entire command
  */
 int Shell::runCommand(string cmdline) {
 	int ret = 0;
-	string tokens[256];
-	int i;
-	int j;
+	vector<string> tokens;
 	bool usingFake = false;
-	getTokens(cmdline, " \n", tokens);
-	bool leastOnePath = false;
+	bool unbatched;
+	getTokens(cmdline, " \t\r\n", &tokens);
+	tokens.push_back(""); //room for the current directory, if no path is given
 	if (!tokens[0].empty()) {
 		if (tokens[0] == "cd") {
-			changeDirectory(tokens);
+			changeDirectory(&tokens[0]);
+		} else if (tokens[0] == "mount" || tokens[0] == "umount") {
+			if (batch) {
+				endBatches();
+			}
+			ret = (tokens[0] == "mount") ? mountCommand(&tokens[0])
+										: unmountCommand(&tokens[0]);
+			if (batch) {
+				beginBatches();
+			}
+		} else if (cmdline.find_first_of("|<>") != string::npos) {
+			ret = runPipeline(cmdline);
 		} else {
-
 			if (isCommandSupported(tokens[0])) {
-				i = 1;
-				while (!tokens[i].empty()) {
-					if ((tokens[i][0] == '/' 
-								|| (tokens[i].size() >= 1 
-									&& tokens[i][0] != '-'))) {
-						string newArg;
-						getAbsoluteFromRelativePath(tokens[i], &newArg);
-						tokens[i] = newArg;
-						leastOnePath = true;
-					}
-
-					if (fakeFilePath->empty() == false && 
-						(tokens[i].substr(0, 
-							fakeFilePath->size()) == *fakeFilePath)) {
-						usingFake = true;
-					}
-					i++;
-				}
-				if (!leastOnePath) {
-					tokens[1] = *filePath;
-					tokens[2].clear();
-
-					if (fakeFilePath->empty() == false && 
-						!tokens[1].empty() &&
-						tokens[1].substr(0, 
-							fakeFilePath->size()) == * fakeFilePath) {
-						usingFake = true;
-					}
-				} 
+				usingFake = resolvePaths(&tokens);
 			}
 
+			unbatched = batch && !(usingFake && isCommandBatched(tokens[0]));
+			if (unbatched) {
+				endBatches();
+			}
 			if (usingFake) {
-				ret = runFakeCommand(tokens);
-				if (ret == -2) {
+				ret = runFakeCommand(&tokens[0]);
+				if (ret == FS_ERR_NO_SPACE) {
 					cout << "ERROR: Not enough space in filesystem" << endl;
 				} else if (ret < 0) {
 					cout << tokens[0] << ": error with command" << endl;
 				}
 			} else {
-				ret = runRealCommand(tokens);
+				ret = runRealCommand(&tokens[0]);
+			}
+			if (unbatched) {
+				beginBatches();
 			}
 		}
 	}
 	return ret;
 }
 
+/**
+ * Makes the paths a supported command was given absolute; if it was given
+ * none, the current directory is added after any options. The command
+ * runs on the file system the first path in one is in (see selectMount()).
+ *
+ * @param tokens pointer to the tokenized command, with a spare empty token
+ *        after the one marking the end
+ * @return bool true if any of the paths is in a fake file system
+ */
+bool Shell::resolvePaths(vector<string> *tokens) {
+	int i;
+	bool usingFake = false;
+	bool leastOnePath = false;
+
+	i = 1;
+	while (!(*tokens)[i].empty()) {
+		if (((*tokens)[i][0] == '/' 
+					|| ((*tokens)[i].size() >= 1 
+						&& (*tokens)[i][0] != '-'))) {
+			string newArg;
+			getAbsoluteFromRelativePath((*tokens)[i], &newArg);
+			(*tokens)[i] = newArg;
+			leastOnePath = true;
+		}
+
+		usingFake = usingFake || selectMount((*tokens)[i]);
+		i++;
+	}
+	if (!leastOnePath) {
+		//no path given; use the current directory after any options
+		(*tokens)[i] = *filePath;
+		(*tokens)[i + 1].clear();
+
+		usingFake = selectMount((*tokens)[i]);
+	}
+
+	return usingFake;
+}
+
 bool Shell::isCommandSupported(string cmd) {
-	string cmds[] = {"ls", "touch", "cp", "mv", "rm", "df", "cat"};
+	string cmds[] = {"ls", "touch", "cp", "mv", "rm", "df", "cat", "fsck",
+						"defrag", "convert", "trim", "discard", "snapshot", "alloc", "stats",
+						"trace"};
+	int i;
+	bool ret = false;
+	for (i = 0; i < 16 && ret == false; i++) {
+		if (cmd == cmds[i]) {
+			ret = true;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Whether a fake command can run inside a script's batch (see runBatch()),
+ * its FAT and directory changes held back with everyone else's. The rest
+ * work on the whole volume and want it written out as they found it.
+ *
+ * @param cmd the command
+ * @return bool true if it can run batched
+ */
+bool Shell::isCommandBatched(string cmd) {
+	string cmds[] = {"ls", "touch", "cp", "mv", "rm", "df", "cat", "discard",
+						"alloc", "stats", "trace"};
 	int i;
 	bool ret = false;
-	for (i = 0; i < 7 && ret == false; i++) {
+	for (i = 0; i < 11 && ret == false; i++) {
 		if (cmd == cmds[i]) {
 			ret = true;
 		}
@@ -215,29 +533,39 @@ bool Shell::isCommandSupported(string cmd) {
  * Runs a real command; call fork() on exec() on it
  *
  * @param tokens string array containing tokenized version of command
- * @returns 0 if command runs fine; -1 if there's an error
+ * @returns 0 if command runs fine; -1 if there's an error or it exits
+ *          with anything but 0
  */
 int Shell::runRealCommand(string tokens[]) {
 	int ret = -1;
 	int i;
-	char* args[256];
-	cout << "Command: ";
+	vector<char*> args;
+	if (!batch) {
+		cout << "Command: ";
+	}
 	i = 0;
 	while (!tokens[i].empty()) {
-		args[i] = (char*)malloc(sizeof(char)*tokens[i].length());
-		strcpy(args[i], tokens[i].c_str());
-		cout << args[i] << " ";
+		args.push_back(strdup(tokens[i].c_str()));
+		if (!batch) {
+			cout << args[i] << " ";
+		}
 		i++;
 	}
-	args[i] = NULL;
-	cout << endl;
+	args.push_back(NULL);
+	if (!batch) {
+		cout << endl;
+	}
+	//or the child would print whatever's still buffered a second time
+	cout.flush();
 
 	pid_t pID = fork();
 	if (pID == 0) {
 		//success,  Child stuffs
-		execvp(*args, args);
+		execvp(args[0], &args[0]);
 		cout << "Not a valid command" << endl;
-		exit(0);
+		//not exit(), which would wind the shell's stdin back to where the
+		//child's copy of it was buffered up to
+		_exit(127);
 	} else if (pID < 0) {
 		//failure :(
 		exit(-1);
@@ -249,121 +577,1039 @@ int Shell::runRealCommand(string tokens[]) {
 			tpid = wait(&status);
 		} while (tpid != pID);
 
-		while (i>0) {
+		for (i = 0; i < args.size(); i++) {
 			free(args[i]);
-			i--;
 		}
 
-		ret = 0;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			ret = 0;
+		}
 	}
 
 	return ret;
 }
 
 /**
- * Runs a fake command; calls the appropriate methods in the FileSys
- * One runs supported commands: ls, touch, cp, mv, rm, df, cat
+ * Runs a pipeline: commands joined by |, the first of which can read a
+ * file with < and the last of which can write one with > (or add to the
+ * end of one with >>). Files in the fake file system can be used either
+ * way, and the first command can be a fake one, whose output goes down
+ * the pipe:
  *
- * @param tokens string array containing tokenized version of command
- * @returns 0 if command runs fine; -1 if there's an error
+ *   cat /fs/file | grep x
+ *   wc -l < /fs/file
+ *   sort /etc/passwd > /fs/sorted
+ *
+ * Nothing is copied out to the host first. Fake files are streamed in by
+ * a thread of the shell's, spliced from the image straight into the pipe
+ * (see FileSys::sendFile()), and what comes out for > is written to the
+ * fake file system as it arrives (see FileSys::importFile(); for >>,
+ * FileSys::receiveFile()). If > runs out of space, nothing is left of the
+ * file.
+ *
+ * @param cmdline the whole command line
+ * @returns 0 if it all ran and the last command exited with 0; -2 if the
+ *          fake file system ran out of space; -1 otherwise
  */
-int Shell::runFakeCommand(string tokens[]) {
-	int ret = -1;
+int Shell::runPipeline(string cmdline) {
+	int ret = 0;
 	int i;
-	string cmd = tokens[0];
-	if (cmd == "ls") {
-		fileSystem->printDirectoryTable();
-		ret = 0;
-	} else if (cmd == "touch") {
-		if (tokens[1].size() > fakeFilePath->size() + 1) {
-			ret = fileSystem->createFile(tokens[1].substr(fakeFilePath->size() + 1));
-		}
-	} else if (cmd == "cp" || cmd == "mv") {
-		string sourceFile;
-		string destFile;
-
-		i = 1;
-		while (!tokens[i].empty() && destFile.empty()) {
-			if (tokens[i][0] != '-') {
-				if (sourceFile.empty()) {
-					sourceFile = tokens[i];
+	int j;
+	int first;
+	int last;
+	int status;
+	int fds[2];
+	int input = -1; //what the next command reads; -1 for the shell's stdin
+	int output = -1; //what the last command writes; -1 for the shell's stdout
+	int out;
+	int next;
+	int sinkHandle = -1;
+	int sinkIn = -1;
+	int written = 0;
+	char op;
+	size_t start = 0;
+	size_t bar;
+	bool append = false;
+	bool feeding = false;
+	bool fed = false;
+	string inPath;
+	string outPath;
+	string name;
+	string sinkName;
+	FileSys *fs;
+	FileSys *sink = NULL; //the fake file system > or >> writes to
+	vector<string> tokens;
+	vector<PipeStage> stages;
+	vector<char*> args;
+	PipeStage stage;
+	PipeFeed feed;
+	pthread_t feeder;
+	ostringstream printed;
+	streambuf *saved;
+	void (*oldPipe)(int);
+
+	//split into commands, and take < and > out of them
+	do {
+		bar = cmdline.find('|', start);
+		tokens.clear();
+		getTokens(cmdline.substr(start, (bar == string::npos) ? bar : bar - start),
+					" \t\r\n", &tokens);
+		stage.tokens.clear();
+		stage.fake = false;
+		stage.pid = -1;
+		for (i = 0; !tokens[i].empty() && ret == 0; i++) {
+			op = tokens[i][0];
+			if (op == '<' || op == '>') {
+				j = (tokens[i].substr(0, 2) == ">>") ? 2 : 1;
+				name = tokens[i].substr(j);
+				if (name.empty() && !tokens[i + 1].empty()) {
+					i++;
+					name = tokens[i];
+				}
+				if (name.empty() || (op == '<' && !stages.empty())
+					|| (op == '>' && bar != string::npos)) {
+					ret = -1;
+				} else if (op == '<') {
+					getAbsoluteFromRelativePath(name, &inPath);
 				} else {
-					destFile = tokens[i];
+					getAbsoluteFromRelativePath(name, &outPath);
+					append = (j == 2);
 				}
+			} else {
+				stage.tokens.push_back(tokens[i]);
 			}
-			i++;
 		}
-		if (destFile.empty()) {
+		stage.tokens.push_back("");
+		stage.tokens.push_back("");
+		if (stage.tokens[0].empty()) {
+			ret = -1;
+		}
+		stages.push_back(stage);
+		start = bar + 1;
+	} while (bar != string::npos && ret == 0);
+	if (ret != 0) {
+		cout << "pipeline: every command needs a name, < a file and the first ";
+		cout << "command, and > a file and the last" << endl;
+	}
+
+	for (i = 0; i < stages.size() && ret == 0; i++) {
+		if (isCommandSupported(stages[i].tokens[0])) {
+			stages[i].fake = resolvePaths(&stages[i].tokens);
+		}
+		if (stages[i].fake && (i > 0 || !inPath.empty())) {
+			cout << stages[i].tokens[0] << ": only the first command of a ";
+			cout << "pipeline, with no <, can be on the fake file system" << endl;
+			ret = -1;
+		}
+	}
+
+	//what the fake file system feeds in
+	feed.fileSystem = fileSystem;
+	feed.out = -1;
+	feed.result = 0;
+	if (ret == 0 && stages[0].fake && stages[0].tokens[0] == "cat") {
+		for (i = 1; !stages[0].tokens[i].empty() && ret == 0; i++) {
+			fs = getFakeName(stages[0].tokens[i], &name);
+			if (fs != NULL && fs == fileSystem) {
+				feed.names.push_back(name);
+			} else {
+				cout << "cat: can't mix host files, or other file systems' files, ";
+				cout << "with the fake file system's" << endl;
+				ret = -1;
+			}
+		}
+		feeding = true;
+	} else if (ret == 0 && stages[0].fake) {
+		saved = cout.rdbuf(printed.rdbuf());
+		ret = runFakeCommand(&stages[0].tokens[0]);
+		cout.rdbuf(saved);
+		feed.text = printed.str();
+		if (ret < 0) {
+			cout << stages[0].tokens[0] << ": error with command" << endl;
+		}
+		feeding = true;
+	} else if (ret == 0 && !inPath.empty()
+				&& (feed.fileSystem = getFakeName(inPath, &name)) != NULL) {
+		feed.names.push_back(name);
+		feeding = true;
+	} else if (ret == 0 && !inPath.empty()
+				&& (input = open(inPath.c_str(), O_RDONLY | O_CLOEXEC)) == -1) {
+		cout << inPath << ": couldn't open" << endl;
+		ret = -1;
+	}
+
+	//where the last command's output goes
+	if (ret == 0 && !outPath.empty() && (sink = getFakeName(outPath, &sinkName)) != NULL) {
+		if (append) {
+			sinkHandle = sink->openFile(sinkName, FS_WRITE | FS_CREATE | FS_APPEND);
+		}
+		if (append && sinkHandle < 0) {
+			cout << outPath << ": couldn't open" << endl;
 			ret = -1;
 		} else {
-			bool sourceInFake = false;
-			bool destInFake = false;
-			if (tokens[1].find(*fakeFilePath) == 0) {
-				if (tokens[1].size() > fakeFilePath->size() + 1) {
-					sourceFile = sourceFile.substr(fakeFilePath->size() + 1);
-				} else {
-					sourceFile = "";
-				}
-				sourceInFake = true;
+			pipe2(fds, O_CLOEXEC);
+			sinkIn = fds[0];
+			output = fds[1];
+		}
+	} else if (ret == 0 && !outPath.empty()) {
+		output = open(outPath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC
+						| (append ? O_APPEND : O_TRUNC), 0644);
+		if (output == -1) {
+			cout << outPath << ": couldn't open" << endl;
+			ret = -1;
+		}
+	}
+	if (ret != 0 && input != -1) {
+		close(input);
+	}
+
+	first = stages[0].fake ? 1 : 0;
+	last = stages.size() - 1;
+	if (ret == 0 && feeding && first > last) {
+		//nothing to run on the host; straight to wherever it's going
+		feed.out = (output == -1) ? dup(1) : output;
+		output = -1;
+	} else if (ret == 0 && feeding) {
+		pipe2(fds, O_CLOEXEC);
+		feed.out = fds[1];
+		input = fds[0];
+	}
+
+	if (ret == 0) {
+		if (!batch && first <= last) {
+			cout << "Command: " << cmdline << endl;
+		}
+		cout.flush();
+		oldPipe = signal(SIGPIPE, SIG_IGN);
+		for (i = first; i <= last; i++) {
+			if (i < last) {
+				pipe2(fds, O_CLOEXEC);
+				next = fds[0];
+				out = fds[1];
+			} else {
+				next = -1;
+				out = output;
 			}
+			args.clear();
+			for (j = 0; !stages[i].tokens[j].empty(); j++) {
+				args.push_back(strdup(stages[i].tokens[j].c_str()));
+			}
+			args.push_back(NULL);
 
-			if (tokens[2].find(*fakeFilePath) == 0) {
-				if (tokens[2].size() >= fakeFilePath->size() + 1) {
-					destFile = destFile.substr(fakeFilePath->size() + 1);
-					destInFake = true;
-				} else {
-					destFile = "";
+			stages[i].pid = fork();
+			if (stages[i].pid == 0) {
+				signal(SIGPIPE, SIG_DFL);
+				if (input != -1) {
+					dup2(input, 0);
 				}
-				destInFake = true;
+				if (out != -1) {
+					dup2(out, 1);
+				}
+				execvp(args[0], &args[0]);
+				cerr << args[0] << ": not a valid command" << endl;
+				_exit(127);
 			}
-		
-			if (cmd == "cp") {
-				ret = fileSystem->copyFile(sourceFile, destFile, 
-											sourceInFake, destInFake);
-			} else if (cmd == "mv") {
-				ret = fileSystem->moveFile(sourceFile, destFile, 
-											sourceInFake, destInFake);
+
+			for (j = 0; j < args.size(); j++) {
+				free(args[j]);
+			}
+			if (input != -1) {
+				close(input);
 			}
+			if (i < last) {
+				close(out);
+			}
+			input = next;
 		}
-	} else if (cmd == "rm") {
-		if (tokens[1].size() > fakeFilePath->size() + 1) {
-			ret = fileSystem->removeFile(tokens[1].substr(fakeFilePath->size() + 1));
+		if (output != -1) {
+			close(output);
 		}
-	} else if (cmd == "df") {
-		fileSystem->printInfo(6, NULL);
-		ret = 0;
-	} else if (cmd == "cat" && !tokens[1].empty()) {
-		if (tokens[1].size() > fakeFilePath->size() + 1) {
-			ret = fileSystem->printFile(tokens[1].substr(fakeFilePath->size() + 1));
+
+		if (feeding) {
+			fed = pthread_create(&feeder, NULL, feedWorker, &feed) == 0;
+			if (!fed) {
+				close(feed.out);
+				ret = -1;
+			}
 		}
-	} else {
-		cout << cmd << " command not supported by fake filesystem." << endl;
-		ret = -1;
+		if (sinkIn != -1 && append) {
+			written = sink->receiveFile(sinkHandle, sinkIn, INT_MAX);
+		} else if (sinkIn != -1) {
+			written = sink->importFile(sinkIn, sinkName);
+		}
+		if (sinkIn != -1) {
+			close(sinkIn);
+		}
+		if (fed) {
+			pthread_join(feeder, NULL);
+		}
+		for (i = first; i <= last; i++) {
+			waitpid(stages[i].pid, &status, 0);
+			if (i == last && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+				ret = -1;
+			}
+		}
+		signal(SIGPIPE, oldPipe);
+
+		if (feed.result != 0) {
+			cout << stages[0].tokens[0] << ": error with command" << endl;
+			ret = -1;
+		}
+		if (written == FS_ERR_NO_SPACE) {
+			cout << "ERROR: Not enough space in filesystem" << endl;
+			ret = FS_ERR_NO_SPACE;
+		} else if (written < 0) {
+			cout << outPath << ": error writing" << endl;
+			ret = -1;
+		}
+	}
+	if (sinkHandle >= 0) {
+		sink->closeFile(sinkHandle);
 	}
 
 	return ret;
 }
 
 /**
- * Converts a relative path to it's absolute path equivalent.
- * It parses the entire thing, removes all ".."'s and "."'s
- * @param relPat the path string to be converted
- * @param absPath pointer to the absolute path string; will be stored there
+ * Feeds the fake file system's side of a pipeline into it, on a thread of
+ * its own so the shell can take in what comes out of the other end at the
+ * same time. Closes the pipe when done, so the next command sees the end.
+ *
+ * @param arg pointer to the PipeFeed
+ * @return NULL
  */
-void Shell::getAbsoluteFromRelativePath(string relPath, string *absPath) {
-	int j;
-	string tempStr;
-	string subToks[256];
-	string newArg;
-	struct stat st_buf;
+void *Shell::feedWorker(void *arg) {
+	PipeFeed *feed = (PipeFeed*)arg;
+	int i;
+	int n = 0;
+	int sent = 1;
+	int handle;
 
-	tempStr = relPath;
-	if (relPath[0] != '/') {
-		newArg = *filePath;
+	while (n < feed->text.size() && sent > 0) {
+		sent = write(feed->out, feed->text.data() + n, feed->text.size() - n);
+		n += max(sent, 0);
+	}
+	for (i = 0; i < feed->names.size() && feed->result == 0; i++) {
+		handle = feed->fileSystem->openFile(feed->names[i], FS_READ);
+		if (handle < 0) {
+			feed->result = -1;
+		} else {
+			//stops short if the other end stops reading (head, say); that's fine
+			feed->fileSystem->sendFile(handle, feed->out,
+										feed->fileSystem->getFileSize(feed->names[i]));
+			feed->fileSystem->closeFile(handle);
+		}
+	}
+	close(feed->out);
+
+	return NULL;
+}
+
+/**
+ * Runs a fake command; calls the appropriate methods in the FileSys
+ * One runs supported commands: ls, touch, cp, mv, rm, df, cat, fsck, defrag,
+ * convert, trim, discard, snapshot, alloc, stats, trace
+ *
+ * @param tokens string array containing tokenized version of command
+ * @returns 0 if command runs fine; -1 if there's an error
+ */
+int Shell::runFakeCommand(string tokens[]) {
+	int ret = -1;
+	int i;
+	string cmd = tokens[0];
+	if (cmd == "ls") {
+		printDirectory();
+		ret = 0;
+	} else if (cmd == "touch") {
+		if (tokens[1].size() > fakeFilePath->size() + 1) {
+			ret = fileSystem->createFile(tokens[1].substr(fakeFilePath->size() + 1));
+		}
+	} else if (cmd == "cp" || cmd == "mv") {
+		ret = copyFiles(tokens, cmd == "mv");
+	} else if (cmd == "rm") {
+		if (tokens[1].size() > fakeFilePath->size() + 1) {
+			ret = fileSystem->removeFile(tokens[1].substr(fakeFilePath->size() + 1));
+		}
+	} else if (cmd == "df") {
+		printInfo(6, false);
+		ret = 0;
+	} else if (cmd == "cat" && !tokens[1].empty()) {
+		if (tokens[1].size() > fakeFilePath->size() + 1) {
+			ret = printFile(tokens[1].substr(fakeFilePath->size() + 1));
+		}
+	} else if (cmd == "fsck") {
+		ret = checkFileSystem(tokens);
+	} else if (cmd == "defrag") {
+		ret = defragmentFileSystem(tokens);
+	} else if (cmd == "convert") {
+		ret = convertFileSystem();
+	} else if (cmd == "trim") {
+		ret = trimFileSystem();
+	} else if (cmd == "discard") {
+		ret = setDiscard(tokens);
+	} else if (cmd == "snapshot") {
+		ret = manageSnapshots(tokens);
+	} else if (cmd == "alloc") {
+		ret = setAllocator(tokens);
+	} else if (cmd == "stats") {
+		ret = showStats(tokens);
+	} else if (cmd == "trace") {
+		ret = traceCalls(tokens);
+	} else {
+		cout << cmd << " command not supported by fake filesystem." << endl;
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/**
+ * The cp and mv commands: cp [-jTHREADS] source... dest
+ *
+ * Any number of sources can be given, and each can be a wildcard pattern
+ * (*, ? or [...]) for files on the real file system or in the fake one.
+ * With more than one source file dest has to be a directory. Files are
+ * copied by a pool of worker threads (one per CPU unless -j is given), and
+ * the FAT and directory are written every COPY_BATCH_SIZE files instead of
+ * after every file. A throughput summary is printed when there's more than
+ * one file.
+ *
+ * @param tokens string array containing tokenized version of command
+ * @param move true for mv, false for cp
+ * @returns 0 if every file was copied; -2 if out of space; -1 otherwise
+ */
+int Shell::copyFiles(string tokens[], bool move) {
+	int ret = 0;
+	int i;
+	int j;
+	int threads = 0;
+	bool multiple = false;
+	long long bytes = 0;
+	int failed = 0;
+	double seconds;
+	struct timeval start;
+	struct timeval end;
+	struct stat info;
+	vector<string> paths;
+	vector<string> matches;
+	vector<CopyJob> jobs;
+	CopyJob job;
+	CopyPool pool;
+	string name;
+	glob_t found;
+	pthread_t workers[COPY_MAX_THREADS];
+
+	for (i = 1; !tokens[i].empty(); i++) {
+		if (tokens[i][0] != '-') {
+			paths.push_back(tokens[i]);
+		} else if (tokens[i].substr(0, 2) == "-j") {
+			threads = atoi(tokens[i].substr(2).c_str());
+		}
+	}
+
+	if (paths.size() < 2) {
+		ret = -1;
+	} else {
+		job.destFs = getFakeName(paths.back(), &job.dest);
+		job.result = 0;
+		job.bytes = 0;
+		multiple = paths.size() > 2;
+
+		for (i = 0; i < paths.size() - 1; i++) {
+			job.sourceFs = getFakeName(paths[i], &name);
+			matches.clear();
+			if (name.find_first_of("*?[") == string::npos) {
+				matches.push_back(name);
+			} else if (job.sourceFs != NULL) {
+				multiple = true;
+				job.sourceFs->listFiles(name, &matches);
+			} else {
+				multiple = true;
+				if (glob(name.c_str(), 0, NULL, &found) == 0) {
+					for (j = 0; j < found.gl_pathc; j++) {
+						if (stat(found.gl_pathv[j], &info) == 0 
+							&& !S_ISDIR(info.st_mode)) {
+							matches.push_back(found.gl_pathv[j]);
+						}
+					}
+				}
+				globfree(&found);
+			}
+			for (j = 0; j < matches.size(); j++) {
+				job.source = matches[j];
+				jobs.push_back(job);
+			}
+		}
+
+		if (multiple && !job.dest.empty() && job.dest[job.dest.size()-1] != '/') {
+			cout << (move ? "mv" : "cp") << ": target '" << paths.back();
+			cout << "' is not a directory" << endl;
+			ret = -1;
+		} else if (jobs.empty()) {
+			ret = -1;
+		}
+	}
+
+	if (ret == 0) {
+		if (threads < 1) {
+			threads = sysconf(_SC_NPROCESSORS_ONLN);
+		}
+		threads = max(1, min(threads, min(COPY_MAX_THREADS, (int)jobs.size())));
+
+		for (i = 0; i < mounts.size(); i++) {
+			pool.volumes.push_back(mounts[i].fileSystem);
+		}
+		pool.jobs = &jobs;
+		pool.move = move;
+		pool.next = 0;
+		pool.done = 0;
+
+		gettimeofday(&start, NULL);
+		beginBatches();
+		//the shell's own thread is worker 0
+		for (i = 1; i < threads; i++) {
+			if (pthread_create(&workers[i], NULL, copyWorker, &pool) != 0) {
+				threads = i;
+			}
+		}
+		copyWorker(&pool);
+		for (i = 1; i < threads; i++) {
+			pthread_join(workers[i], NULL);
+		}
+		endBatches();
+		gettimeofday(&end, NULL);
+
+		for (i = 0; i < jobs.size(); i++) {
+			if (jobs[i].result < 0) {
+				failed++;
+				if (ret != FS_ERR_NO_SPACE) {
+					ret = (jobs[i].result == FS_ERR_NO_SPACE) ? FS_ERR_NO_SPACE : FS_ERR_FAILED;
+				}
+				if (multiple) {
+					cout << (move ? "mv" : "cp") << ": " << jobs[i].source;
+					cout << ": " << ((jobs[i].result == FS_ERR_NO_SPACE) ? "out of space" : "failed");
+					cout << endl;
+				}
+			} else {
+				bytes += jobs[i].bytes;
+			}
+		}
+
+		if (multiple) {
+			seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+			seconds = max(seconds, 1e-6);
+			cout << (move ? "mv" : "cp") << ": " << jobs.size() - failed;
+			cout << " of " << jobs.size() << " files, ";
+			cout << fixed << setprecision(2) << bytes / (1024.0 * 1024.0);
+			cout << " MB in " << seconds << " s (";
+			cout << (bytes / (1024.0 * 1024.0)) / seconds << " MB/s, ";
+			cout << setprecision(0) << (jobs.size() - failed) / seconds;
+			cout << " files/s) using " << threads << " thread(s)" << endl;
+			cout.unsetf(ios::fixed);
+			cout << setprecision(6);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * cp/mv worker thread. Keeps taking the next job until there are none
+ * left, and flushes the FAT/directory every COPY_BATCH_SIZE files.
+ *
+ * @param arg the CopyPool shared by all workers
+ * @return NULL
+ */
+void *Shell::copyWorker(void *arg) {
+	CopyPool *pool = (CopyPool*)arg;
+	CopyJob *job;
+	FileSys *fs;
+	int i;
+	int j;
+	struct stat info;
+
+	while ((i = __sync_fetch_and_add(&pool->next, 1)) < (int)pool->jobs->size()) {
+		job = &(*pool->jobs)[i];
+		if (job->sourceFs != NULL) {
+			job->bytes = max(0, job->sourceFs->getFileSize(job->source));
+		} else if (stat(job->source.c_str(), &info) == 0) {
+			job->bytes = info.st_size;
+		}
+
+		fs = (job->sourceFs != NULL) ? job->sourceFs : job->destFs;
+		if (job->sourceFs != NULL && job->destFs != NULL && job->sourceFs != job->destFs) {
+			//one fake file system to another, never touching the host
+			job->result = pool->move
+				? job->destFs->moveFileFrom(job->sourceFs, job->source, job->dest)
+				: job->destFs->copyFileFrom(job->sourceFs, job->source, job->dest);
+		} else if (pool->move) {
+			job->result = fs->moveFile(job->source, job->dest,
+										job->sourceFs != NULL, job->destFs != NULL);
+		} else {
+			job->result = fs->copyFile(job->source, job->dest,
+										job->sourceFs != NULL, job->destFs != NULL);
+		}
+
+		if (__sync_add_and_fetch(&pool->done, 1) % COPY_BATCH_SIZE == 0) {
+			for (j = 0; j < pool->volumes.size(); j++) {
+				pool->volumes[j]->flushBatch();
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Works out which fake file system an (absolute) path is inside, if any,
+ * and what it's called there.
+ *
+ * @param path the absolute path
+ * @param name pointer to store the name in; the name in the fake file
+ *        system ("" for its root), otherwise just the path
+ * @return FileSys* the file system the path is inside; NULL if none
+ */
+FileSys *Shell::getFakeName(string path, string *name) {
+	FileSys *ret = NULL;
+	int mount = findMount(path);
+
+	*name = path;
+	if (mount != -1) {
+		if (path.size() > mounts[mount].path.size() + 1) {
+			*name = path.substr(mounts[mount].path.size() + 1);
+		} else {
+			*name = "";
+		}
+		ret = mounts[mount].fileSystem;
+	}
+
+	return ret;
+}
+
+/**
+ * @param path an absolute path
+ * @return int the mount (in mounts) it's inside; -1 if none
+ */
+int Shell::findMount(string path) {
+	int ret = -1;
+	int i;
+	string prefix;
+
+	for (i = 0; i < mounts.size() && ret == -1; i++) {
+		prefix = mounts[i].path;
+		if (path.compare(0, prefix.size(), prefix) == 0
+			&& (path.size() == prefix.size() || path[prefix.size()] == '/')) {
+			ret = i;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Makes the file system an (absolute) path is inside, if any, the one
+ * commands run on.
+ *
+ * @param path the absolute path
+ * @return bool true if it's inside one
+ */
+bool Shell::selectMount(string path) {
+	int mount = findMount(path);
+
+	if (mount != -1) {
+		fileSystem = mounts[mount].fileSystem;
+		*fakeFilePath = mounts[mount].path;
+	}
+
+	return mount != -1;
+}
+
+/**
+ * Runs the file system checker: fsck [-r] [-jTHREADS]
+ *
+ * -r repairs whatever is found, otherwise the check is read-only. After
+ * repairing, the volume is checked again, since fixing one problem can
+ * leave (or uncover) another.
+ * -j sets how many threads walk the chains (defaults to one per CPU).
+ *
+ * @param tokens string array containing tokenized version of command
+ * @returns 0 if the file system is clean (or is clean once repaired); -1 if not
+ */
+int Shell::checkFileSystem(string tokens[]) {
+	int i;
+	int problems;
+	bool repair = false;
+	int threads = 0;
+	FsckReport report;
+	FsckReport after;
+	FileSysCheck checker(fileSystem);
+
+	for (i = 1; !tokens[i].empty(); i++) {
+		if (tokens[i] == "-r") {
+			repair = true;
+		} else if (tokens[i].substr(0, 2) == "-j") {
+			threads = atoi(tokens[i].substr(2).c_str());
+		}
+	}
+
+	problems = checker.check(repair, threads, &report);
+	printReport(&report);
+	if (repair && problems > 0) {
+		problems = checker.check(false, threads, &after);
+		if (problems > 0) {
+			cout << "fsck: " << problems << " problems left after repairing" << endl;
+		}
+	}
+
+	return (problems == 0) ? 0 : -1;
+}
+
+/**
+ * Runs the defragmenter: defrag [-n] [-v] [-mFILES]
+ *
+ * -n only reports fragmentation, nothing is moved.
+ * -v lists the fragmentation of every file.
+ * -m stops after moving that many files; running it again picks up
+ * where it left off. Ctrl+C also stops it after the current file.
+ *
+ * Read throughput of the whole volume is measured before and after.
+ *
+ * @param tokens string array containing tokenized version of command
+ * @returns 0 if defrag runs fine; -2 if there was no room to move anything
+ */
+int Shell::defragmentFileSystem(string tokens[]) {
+	int i;
+	int ret = 0;
+	bool reportOnly = false;
+	bool verbose = false;
+	int maxFiles = 0;
+	double before;
+	double after;
+	VolumeFragmentation volume;
+	vector<FileFragmentation> files;
+	DefragResult result;
+	Defragmenter defragmenter(fileSystem);
+	void (*oldHandler)(int);
+
+	for (i = 1; !tokens[i].empty(); i++) {
+		if (tokens[i] == "-n") {
+			reportOnly = true;
+		} else if (tokens[i] == "-v") {
+			verbose = true;
+		} else if (tokens[i].substr(0, 2) == "-m") {
+			maxFiles = atoi(tokens[i].substr(2).c_str());
+		}
+	}
+
+	defragmenter.measure(&volume, &files);
+	printFragmentation(&volume, verbose ? &files : NULL);
+	before = defragmenter.measureReadThroughput();
+	cout << "read throughput: " << before << " MB/s" << endl;
+
+	if (!reportOnly && volume.fragmentedFiles > 0) {
+		defragStop = 0;
+		oldHandler = signal(SIGINT, stopDefrag);
+		ret = defragmenter.defragment(maxFiles, &defragStop, &result);
+		signal(SIGINT, oldHandler);
+
+		cout << endl << "moved " << result.moved << ", skipped (no room) ";
+		cout << result.skipped << ", remaining " << result.remaining;
+		cout << (result.interrupted ? " (interrupted)" : "") << endl;
+
+		defragmenter.measure(&volume, &files);
+		printFragmentation(&volume, verbose ? &files : NULL);
+		after = defragmenter.measureReadThroughput();
+		cout << "read throughput: " << after << " MB/s (was ";
+		cout << before << " MB/s)" << endl;
+		ret = (ret < 0) ? ret : 0;
+	}
+
+	return ret;
+}
+
+/**
+ * Converts the file system from FAT chains to extent lists, in place.
+ *
+ * @returns 0 if converted (or already converted); -2 if out of space,
+ *          -1 if a file name is too long to keep
+ */
+int Shell::convertFileSystem() {
+	int ret;
+
+	if (fileSystem->isExtentVolume()) {
+		cout << "convert: already an extent volume" << endl;
+		ret = 0;
+	} else {
+		ret = fileSystem->convertToExtents();
+		if (ret >= 0) {
+			cout << "convert: " << ret << " files now stored as extents" << endl;
+			ret = 0;
+		} else if (ret == -3) {
+			cout << "convert: file names must be shorter than ";
+			cout << EXTENT_NAME_SIZE << " characters; rename them first" << endl;
+			ret = -1;
+		} else if (ret == -4) {
+			cout << "convert: delete the snapshots first" << endl;
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Punches every free cluster out of the image so the host gets the space
+ * back, and reports how much space the image takes up before and after.
+ *
+ * @returns 0 if trimmed; -1 if the host can't punch holes in the image
+ */
+int Shell::trimFileSystem() {
+	int ret;
+	long long before;
+	long long after;
+
+	ret = fileSystem->trimFileSys(&before, &after);
+	if (ret >= 0) {
+		cout << "trim: " << ret << " free runs punched; allocated on host ";
+		cout << before / 1024 << " KB -> " << after / 1024 << " KB" << endl;
+		ret = 0;
+	} else {
+		cout << "trim: the host file system can't punch holes" << endl;
+	}
+
+	return ret;
+}
+
+/**
+ * Shows or sets discard: discard [-on|-off]
+ *
+ * While discard is on, clusters are punched out of the image as they're
+ * freed. It's saved with the volume.
+ *
+ * @param tokens string array containing tokenized version of command
+ * @returns 0 if shown or set; -1 if the host can't punch holes in the image
+ */
+int Shell::setDiscard(string tokens[]) {
+	int i;
+	int ret = 0;
+
+	for (i = 1; !tokens[i].empty() && ret == 0; i++) {
+		if (tokens[i] == "-on" || tokens[i] == "-off") {
+			ret = fileSystem->setDiscard(tokens[i] == "-on");
+			if (ret != 0) {
+				cout << "discard: the host file system can't punch holes" << endl;
+			}
+		}
+	}
+	cout << "discard is " << (fileSystem->isDiscarding() ? "on" : "off") << endl;
+
+	return ret;
+}
+
+/**
+ * Shows or sets how free clusters are picked:
+ * alloc [-first|-next|-best|-near]
+ *
+ * The policy is saved with the volume; see Allocator for what each does.
+ *
+ * @param tokens string array containing tokenized version of command
+ * @returns 0 if shown or set; -1 if there's no such policy or a snapshot
+ *          is mounted
+ */
+int Shell::setAllocator(string tokens[]) {
+	int i;
+	int ret = 0;
+	int policy;
+
+	for (i = 1; !tokens[i].empty() && tokens[i][0] == '-' && ret == 0; i++) {
+		policy = Allocator::findPolicy(tokens[i].substr(1));
+		ret = fileSystem->setAllocator(policy);
+		if (policy == -1) {
+			cout << "alloc: policies are -first, -next, -best and -near" << endl;
+		} else if (ret != 0) {
+			cout << "alloc: a mounted snapshot can't be changed" << endl;
+		}
+	}
+	cout << "allocator is " << Allocator::getPolicyName(fileSystem->getAllocator()) << endl;
+
+	return ret;
+}
+
+/**
+ * Shows what the file system has spent its time on: stats [-json] [-reset]
+ *
+ * Every operation called since the file system was opened (or the counts
+ * were last reset), with its calls, system calls, bytes moved, clusters
+ * scanned and latency percentiles; see Profiler. -json shows the same as
+ * JSON, histograms included, and -reset zeroes the counts afterwards.
+ *
+ * @param tokens string array containing tokenized version of command
+ * @returns 0
+ */
+int Shell::showStats(string tokens[]) {
+	int i;
+	bool json = false;
+	bool reset = false;
+
+	for (i = 1; !tokens[i].empty(); i++) {
+		json = json || tokens[i] == "-json";
+		reset = reset || tokens[i] == "-reset";
+	}
+
+	if (Profiler::isEnabled() || json) {
+		cout << fileSystem->formatOpStats(json);
+	} else {
+		cout << "stats: built without operation counters (FS_NO_STATS)" << endl;
+	}
+	if (reset) {
+		fileSystem->resetOpStats();
+	}
+
+	return 0;
+}
+
+/**
+ * Records every call the shell makes to the file system, for replaying
+ * later with "os1shell -replay": trace [-sFILE] [-e]
+ *
+ * -s starts recording to FILE on the host (see Tracer), -e stops and
+ * writes out the rest. With no options it shows whether it's recording.
+ *
+ * @param tokens string array containing tokenized version of command
+ * @returns 0 if done; -1 if the trace couldn't be started or written
+ */
+int Shell::traceCalls(string tokens[]) {
+	int i;
+	int ret = 0;
+	long long records;
+	string option;
+	bool showing = true;
+
+	for (i = 1; !tokens[i].empty() && ret == 0; i++) {
+		option = tokens[i].substr(0, 2);
+		if (option == "-s" && tokens[i].size() > 2) {
+			ret = fileSystem->startTrace(tokens[i].substr(2));
+			if (ret == 0) {
+				tracePath = tokens[i].substr(2);
+				cout << "trace: recording to " << tracePath << endl;
+			} else if (fileSystem->isTracing()) {
+				cout << "trace: already recording to " << tracePath << endl;
+			} else {
+				cout << "trace: can't write " << tokens[i].substr(2) << endl;
+			}
+			showing = false;
+		} else if (option == "-e") {
+			records = fileSystem->stopTrace();
+			if (records >= 0) {
+				cout << "trace: " << records << " calls recorded to " << tracePath << endl;
+			} else if (tracePath.empty()) {
+				cout << "trace: not recording" << endl;
+			} else {
+				cout << "trace: couldn't write all of " << tracePath << endl;
+				ret = -1;
+			}
+			tracePath.clear();
+			showing = false;
+		}
+	}
+
+	if (showing) {
+		if (fileSystem->isTracing()) {
+			cout << "trace: recording to " << tracePath << endl;
+		} else {
+			cout << "trace: not recording" << endl;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Takes, deletes, rolls back to or lists snapshots:
+ * snapshot [-cNAME] [-dNAME] [-rNAME]
+ *
+ * -c takes a snapshot of the volume as it is now, -d deletes one and -r
+ * rolls the volume back to one (keeping the snapshot). With no options
+ * the snapshots are listed. A snapshot is mounted read-only by opening
+ * the shell on image@NAME.
+ *
+ * @param tokens string array containing tokenized version of command
+ * @returns 0 if done; -2 if out of space, -1 otherwise
+ */
+int Shell::manageSnapshots(string tokens[]) {
+	int i;
+	int ret = 0;
+	bool listing = true;
+	char created[32];
+	time_t when;
+	string option;
+	string name;
+	vector<SnapshotEntry> snapshots;
+
+	for (i = 1; !tokens[i].empty() && ret == 0; i++) {
+		option = tokens[i].substr(0, 2);
+		name = tokens[i].substr(2);
+		if (fileSystem->isReadOnly() && (option == "-c" || option == "-d" || option == "-r")) {
+			cout << "snapshot: a mounted snapshot can't be changed" << endl;
+			ret = -1;
+		} else if (option == "-c") {
+			ret = fileSystem->createSnapshot(name);
+			if (ret == 0) {
+				cout << "snapshot: took " << name << endl;
+			} else if (ret == FS_ERR_NO_SPACE) {
+				cout << "snapshot: not enough free clusters to save " << name << endl;
+			} else {
+				cout << "snapshot: can't take " << name << " (name taken, longer than ";
+				cout << SNAPSHOT_NAME_SIZE - 1 << " characters or already ";
+				cout << MAX_SNAPSHOTS << " snapshots)" << endl;
+			}
+		} else if (option == "-d" || option == "-r") {
+			ret = (option == "-d") ? fileSystem->deleteSnapshot(name)
+									: fileSystem->rollbackSnapshot(name);
+			if (ret == 0) {
+				cout << "snapshot: " << ((option == "-d") ? "deleted " : "rolled back to ");
+				cout << name << endl;
+			} else {
+				cout << "snapshot: no snapshot " << name << endl;
+			}
+		}
+		listing = listing && option != "-c" && option != "-d" && option != "-r";
+	}
+
+	if (listing) {
+		fileSystem->listSnapshots(&snapshots);
+		for (i = 0; i < snapshots.size(); i++) {
+			when = snapshots[i].created;
+			strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime(&when));
+			cout << left << setw(SNAPSHOT_NAME_SIZE) << snapshots[i].name;
+			cout << created << endl;
+		}
+		cout << snapshots.size() << " snapshots" << endl;
+	}
+
+	return ret;
+}
+
+/**
+ * Converts a relative path to it's absolute path equivalent.
+ * It parses the entire thing, removes all ".."'s and "."'s
+ * @param relPat the path string to be converted
+ * @param absPath pointer to the absolute path string; will be stored there
+ */
+void Shell::getAbsoluteFromRelativePath(string relPath, string *absPath) {
+	int j;
+	string tempStr;
+	vector<string> subToks;
+	string newArg;
+	struct stat st_buf;
+
+	tempStr = relPath;
+	if (relPath[0] != '/') {
+		newArg = *filePath;
 	} else {
 		newArg = "/";
 	}
-	getTokens(tempStr, "/", subToks);
+	getTokens(tempStr, "/", &subToks);
 	
 	j = 0;
 	while (!subToks[j].empty()) {
@@ -382,9 +1628,8 @@ void Shell::getAbsoluteFromRelativePath(string relPath, string *absPath) {
 		
 		j++;
 	}
-	if (newArg[newArg.size()-1] != '/' && newArg != *fakeFilePath) {
-		stat(newArg.c_str(), &st_buf);
-		if (S_ISDIR(st_buf.st_mode)) {
+	if (newArg[newArg.size()-1] != '/' && findMount(newArg) == -1) {
+		if (stat(newArg.c_str(), &st_buf) == 0 && S_ISDIR(st_buf.st_mode)) {
 			newArg += "/";
 		}
 	}
@@ -400,6 +1645,7 @@ int Shell::changeDirectory(string tokens[]) {
 	int j;
 	i = 1;
 	string absPath;
+	string name;
 	while (!tokens[i].empty() && absPath.empty()) {
 		if (tokens[i][0] != '-') {
 			getAbsoluteFromRelativePath(tokens[i], &absPath);
@@ -409,7 +1655,7 @@ int Shell::changeDirectory(string tokens[]) {
 	}
 
 	if (checkIfDirExists(*filePath) || 
-		(*filePath == *fakeFilePath && fakeFilePath->empty() == false)){
+		(getFakeName(*filePath, &name) != NULL && name.empty())){
 			*oldFilePath = *filePath;
 			chdir((*filePath).c_str());
 	} else {
@@ -451,38 +1697,276 @@ bool Shell::checkIfDirExists(string path) {
  * Tokenizes a string
  * @param orig the string to be tokenized
  * @param a string containing all the delimeter characters
- * @param tokens a string array in which all the tokens will be stored
+ * @param tokens pointer to a vector the tokens are added to, followed by
+ *        an empty one marking the end (so it reads like the old array)
  */
-void Shell::getTokens(string orig, string delims, string tokens[]) {
-	int i;
+void Shell::getTokens(string orig, string delims, vector<string> *tokens) {
 	int j;
 	int lastPos;
-	int c;
 	string origDup;
 	string token;
 
 	origDup = orig;
 	j = 0;
 	lastPos = 0;
-	i = 0;
 
 	while ( ( j = origDup.find_first_of(delims, lastPos) ) != -1 ) {
 		token = origDup.substr(lastPos, j-lastPos);
 		if (!token.empty()) {
-			tokens[i] = token;
-			i++;
+			tokens->push_back(token);
 		}
 		lastPos = j + 1;
 	}
 	token = origDup.substr(lastPos);
-	tokens[i] = token;
+	if (!token.empty()) {
+		tokens->push_back(token);
+	}
+	tokens->push_back("");
+}
+
+/**
+ * Prints the FAT, the structure of the file system and (if asked) the
+ * directory; what's shown when a file system is opened, and by "df"
+ *
+ * @param width int how many columns the FAT table should be; 6 is awesome
+ * @param directory true to print the directory as well
+ */
+void Shell::printInfo(int width, bool directory) {
+	printFAT(width);
+	printStructure();
+	if (directory) {
+		printDirectory();
+	}
+}
+
+/**
+ * Prints the File Allocation Table (FAT) to standard output (terminal).
+ * 
+ * The entries are printed in the format <cluster #>:<cluster value>
+ *
+ * If the cluster is free, its value is 0 and green
+ * If the cluster is a marker (end of chain, extent, snapshot or pack
+ * cluster; PACK_CLUSTER and up), its value is red
+ * If the cluster points to another cluster, its value is blue
+ * 
+ * @param width the number of FAT entries to print per line
+ */
+void Shell::printFAT(int width) {
+	int i;
+	string titleRow;
+	string rowDivide;
+	string title = "File Allocation Table";
+	vector<int> fat;
+
+	for (i = 0; i < width; i++) {
+		rowDivide += "-----------";
+	}
+	titleRow = rowDivide;
+	
+	fileSystem->getFAT(&fat);
+	cout << titleRow.replace(titleRow.length()/2-title.length()/2, 
+							title.length(), title);
+	for (i = 0; i < fat.size(); i++) {
+		if (i % width == 0) {
+			cout << endl;
+		}
+		cout << "\033[1;1m" << setw(4) << i << ":";
+		if (fat[i] == 0x0000) {
+			cout << "\033[0;32m";
+		} else if (fat[i] >= PACK_CLUSTER) {
+			cout << "\033[0;31m";
+		} else {
+			cout << "\033[0;34m";
+		}
+		cout << setw(5) << fat[i];
+		cout << "\033[0m" << "|";
+
+	}
+	cout << endl << endl;
+}
+
+/**
+ * The "df" command. Prints the structure of the file system.
+ */
+void Shell::printStructure() {
+	FileSysStats stats;
+
+	fileSystem->getStats(&stats);
+
+	cout << left << setw(15) << "Filesystem";
+	cout << " ";
+	cout << right << setw(10) << "Size";
+	cout << " ";
+	cout << right << setw(5) << (stats.clusterSize / 1024) << "K-clusters";
+	cout << " ";
+	cout << right << setw(8) << "Used" ;
+	cout << " ";
+	cout << right << setw(9) << "Available";
+	cout << " ";
+	cout << right << setw(3) << "Use%" ;
+	cout << endl;
+
+	cout << left << setw(15) << stats.name;
+	cout << " ";
+	cout << right << setw(10) << stats.size;
+	cout << " ";
+	cout << right << setw(15) << stats.clusters;
+	cout << " ";
+	cout << right << setw(8) << stats.usedClusters;
+	cout << " ";
+	cout << right << setw(9) << stats.availableClusters;
+	cout << " ";
+	cout << right << setw(3);
+	cout << (int)(((double)(stats.clusters - stats.availableClusters) / (double)stats.clusters) * 100);
+	cout << "%" ;
+	cout << endl;
+	cout << "Files stored as " << (stats.extents ? "extents" : "FAT chains");
+	cout << ", allocated " << Allocator::getPolicyName(stats.allocator) << " fit";
+	cout << endl;
+	cout << "FAT: " << stats.fatClusters << " clusters on disk, ";
+	cout << stats.fatMemory / 1024 << " KB in memory" << endl;
+	cout << "Waiting to be freed: " << stats.pendingClusters << " clusters of ";
+	cout << stats.pendingFiles << " deleted files" << endl;
+	cout << "Allocated on host: " << stats.hostAllocated / 1024 << " KB";
+	cout << (stats.discarding ? " (discard on)" : "") << endl;
+	if (stats.stripeMembers > 1) {
+		cout << "Striped over " << stats.stripeMembers << " files in ";
+		cout << stats.stripeUnit / 1024 << " KB units" << endl;
+	}
+	cout << "Held by snapshots: " << stats.heldClusters << " clusters of ";
+	cout << stats.snapshots << " snapshots";
+	cout << (stats.readOnly ? " (snapshot mounted read-only)" : "") << endl;
+	cout << "Small files: " << stats.inlineFiles << " kept in their entries, ";
+	cout << stats.packedFiles << " packed into " << stats.packClusters;
+	cout << " clusters" << endl;
+	cout << "Directory: " << stats.directoryFiles << " files in ";
+	cout << stats.directoryEntries << " entries, " << stats.directoryHoles;
+	cout << " empty or deleted before the last file" << endl << endl;
+}
+
+/**
+ * The "ls" command. Prints every file in the directory.
+ */
+void Shell::printDirectory() {
+	int i;
+	time_t time;
+	vector<FileInfo> entries;
+
+	fileSystem->listEntries(&entries);
+
+	cout << setw(5) << "" << left << setw(17) << "Filename";
+	cout << left << setw(11) << "Index";
+	cout << left << setw(10) << "Size";
+	cout << left << setw(10) << "Type";
+	cout << left << setw(25) << "Created";
+
+	cout << endl;
+	cout << setfill('-') << setw(75) << "";
+	cout << setfill(' ');
+
+	for (i = 0; i < entries.size(); i++) {
+		cout << endl;
+		cout << left << setw(5) << entries[i].entry << left << setw(17) << entries[i].name;
+		cout << right << setw(5) << entries[i].index;
+		cout << right << setw(10) << entries[i].size;
+		cout << right << setw(10) << entries[i].type;
+
+		time = entries[i].created;
+		cout << " ";
+		cout << right << setw(30) << ctime(&time);
+	}
+	cout << setfill('-') << setw(75) << "";
+	cout << setfill(' ') << endl;
+}
+
+/**
+ * The "cat" command. Prints the contents of a file to standard output
+ * (terminal).
+ *
+ * @param name string containing name of the file to be printed
+ * @return int -1 if error (file not found), otherwise 0
+ */
+int Shell::printFile(string name) {
+	int ret = -1;
+	int handle;
+	int length;
+	char *buffer;
+
+	handle = fileSystem->openFile(name, FS_READ);
+	if (handle >= 0) {
+		buffer = (char*)malloc(CAT_BUFFER_SIZE);
+		while ((length = fileSystem->readFile(handle, buffer, CAT_BUFFER_SIZE)) > 0) {
+			cout.write(buffer, length);
+		}
+		free(buffer);
+		fileSystem->closeFile(handle);
+		ret = (length == 0) ? 0 : -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Prints a check report to standard output (terminal)
+ *
+ * @param report pointer to the report to print
+ */
+void Shell::printReport(FsckReport *report) {
+	cout << "fsck: " << report->filesChecked << " files, ";
+	cout << report->clustersChecked << " clusters checked using ";
+	cout << report->threads << " thread(s)" << endl;
+	cout << left << setw(20) << "  bad entries" << report->badEntries << endl;
+	cout << left << setw(20) << "  cross-linked" << report->crossLinked << endl;
+	cout << left << setw(20) << "  cycles" << report->cycles << endl;
+	cout << left << setw(20) << "  bad links" << report->badLinks << endl;
+	cout << left << setw(20) << "  size mismatches" << report->sizeMismatches << endl;
+	cout << left << setw(20) << "  orphaned clusters" << report->orphaned << endl;
+	cout << left << setw(20) << "  repaired" << report->repaired << endl;
+	cout << right;
+}
+
+/**
+ * Prints per-file and volume fragmentation to standard output (terminal).
+ *
+ * @param volume pointer to the volume totals
+ * @param files pointer to the per-file results; can be NULL
+ */
+void Shell::printFragmentation(VolumeFragmentation *volume,
+								vector<FileFragmentation> *files) {
+	int i;
+
+	if (files != NULL) {
+		cout << setw(5) << "" << left << setw(17) << "Filename";
+		cout << right << setw(10) << "Clusters";
+		cout << right << setw(10) << "Extents" << endl;
+		for (i = 0; i < files->size(); i++) {
+			cout << left << setw(5) << (*files)[i].entry;
+			cout << left << setw(17) << (*files)[i].name;
+			cout << right << setw(10) << (*files)[i].clusters;
+			cout << right << setw(10) << (*files)[i].extents << endl;
+		}
+	}
+
+	cout << volume->files << " files, " << volume->fragmentedFiles;
+	cout << " fragmented; " << volume->extents << " extents in ";
+	cout << volume->clusters << " clusters" << endl;
+	cout << fixed << setprecision(2);
+	cout << volume->extentsPerFile << " extents/file, average run ";
+	cout << volume->averageRunLength << " clusters" << endl;
+	cout.unsetf(ios::fixed);
+	cout << setprecision(6);
 }
 
 /**
  * The deconstructor
  */
 Shell::~Shell() {
-	delete fileSystem;
+	int i;
+
+	for (i = 0; i < mounts.size(); i++) {
+		delete mounts[i].fileSystem;
+	}
+	delete fakeFilePath;
 	delete filePath;
 	delete oldFilePath;
 }
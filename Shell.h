@@ -11,29 +11,131 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string>
+#include <vector>
+#include <glob.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <limits.h>
+#include <signal.h>
 
 #include "FileSys.h"
+#include "FileSysCheck.h"
+#include "Defragmenter.h"
+#include "Allocator.h"
+
+#define COPY_MAX_THREADS 16 //most workers a single cp/mv will use
+#define COPY_BATCH_SIZE 64 //files copied between FAT/directory writes
+#define CAT_BUFFER_SIZE (64 * 1024) //bytes cat reads at a time
+
+/**
+ * A file system the shell has open, and where it's mounted
+ */
+struct Mount {
+	string path; //the mount prefix: "/" and a name, inside no other mount's
+	string image; //the image it was opened from, as given
+	FileSys *fileSystem;
+	dev_t device; //the image's, so it can't be opened twice at once
+	ino_t inode;
+};
+
+/**
+ * A single file for cp/mv to copy; one per source file
+ */
+struct CopyJob {
+	string source;
+	string dest;
+	FileSys *sourceFs; //the file system source is in; NULL if on the host
+	FileSys *destFs; //likewise dest
+	int result; //what copyFile()/moveFile() returned
+	long long bytes; //size of the source file
+};
+
+/**
+ * Shared state of the cp/mv worker pool
+ */
+struct CopyPool {
+	vector<FileSys*> volumes; //every one mounted; all flushed together
+	vector<CopyJob> *jobs;
+	bool move; //mv instead of cp
+	int next; //next job to hand out
+	int done; //jobs finished so far
+};
+
+/**
+ * One command of a pipeline (see Shell::runPipeline())
+ */
+struct PipeStage {
+	vector<string> tokens; //the command, then an empty token and a spare
+	bool fake; //runs on the fake file system; only the first command can
+	pid_t pid; //the host command's process; -1 if none was started
+};
+
+/**
+ * The fake file system's side of a pipeline, fed in by a thread of its own
+ */
+struct PipeFeed {
+	FileSys *fileSystem;
+	vector<string> names; //files to send, one after another
+	string text; //or what a fake command printed
+	int out; //where it all goes; closed when done
+	int result; //0 if every file was sent; -1 if one couldn't be opened
+};
 
 class Shell {
 	public:
-		Shell(char *name);
+		Shell(int count, char **names, bool batch);
 		~Shell();
 		void prompt();
+		int runBatch(istream *in);
 		bool checkIfExists(string path);
 		bool checkIfDirExists(string path);
 	private:
-		string *fakeFilePath;
+		vector<Mount> mounts; //every file system open, the first one given first
+		string *fakeFilePath; //where fileSystem is mounted; "" if none is
 		string *filePath;
 		string *oldFilePath;
-		FileSys *fileSystem;
+		FileSys *fileSystem; //the one the command being run is on (see resolvePaths())
+		string tracePath; //where calls are being recorded to; "" if not tracing
+		bool batch; //running a script: no prompts, echoes or chatter (see runBatch())
 
-		void getTokens(string orig, string delims, string tokens[]);
+		void getTokens(string orig, string delims, vector<string> *tokens);
 		int runCommand(string cmdline);
 		int changeDirectory(string tokens[]);
 		void getAbsoluteFromRelativePath(string relPath, string *absPath);
 		int createFileSystem(string name);
+		int mountFileSystem(string name, string path);
+		int mountCommand(string tokens[]);
+		int unmountCommand(string tokens[]);
+		int findMount(string path);
+		bool selectMount(string path);
+		void beginBatches();
+		void endBatches();
 		int runFakeCommand(string tokens[]);
 		int runRealCommand(string tokens[]);
+		int runPipeline(string cmdline);
+		static void *feedWorker(void *arg);
+		bool resolvePaths(vector<string> *tokens);
+		int checkFileSystem(string tokens[]);
+		int defragmentFileSystem(string tokens[]);
+		int convertFileSystem();
+		int trimFileSystem();
+		int setDiscard(string tokens[]);
+		int setAllocator(string tokens[]);
+		int showStats(string tokens[]);
+		int traceCalls(string tokens[]);
+		int manageSnapshots(string tokens[]);
+		int copyFiles(string tokens[], bool move);
+		FileSys *getFakeName(string path, string *name);
+		static void *copyWorker(void *arg);
 		bool isCommandSupported(string cmd);
+		bool isCommandBatched(string cmd);
+		void printInfo(int width, bool directory);
+		void printFAT(int width);
+		void printStructure();
+		void printDirectory();
+		int printFile(string name);
+		void printReport(FsckReport *report);
+		void printFragmentation(VolumeFragmentation *volume,
+								vector<FileFragmentation> *files);
 };
 #endif
@@ -0,0 +1,582 @@
+/**
+ * The tracer. Records every call made to a FileSys while it's tracing
+ * (see FileSys::startTrace()): what was called, with what names, handles,
+ * sizes and offsets, what it returned, when it started and how long it
+ * took. Records are fixed-size (see TraceRecord) with the names after
+ * them, and are buffered and written TRACE_BUFFER_SIZE bytes at a time,
+ * so tracing costs next to nothing beyond a copy per call.
+ *
+ * A trace can be replayed against another volume (a fresh one like the
+ * one traced, or one rolled back to a snapshot), call by call, either as
+ * fast as it'll go or with the calls started as far apart as they were
+ * when traced. Files copied in from the host are replayed from a scratch
+ * file of the same size, and files copied out go to a scratch file, so a
+ * trace replays anywhere without the host files it was taken with.
+ *
+ * @author: Eduardo Rodrigues - emr4378
+ */
+
+using namespace std;
+
+#include "Tracer.h"
+
+//calls the running thread is inside of; only the outermost is recorded
+static __thread int traceDepth = 0;
+
+/**
+ * Constructor. Nothing is recorded until start().
+ */
+Tracer::Tracer() {
+	fd = -1;
+	startNs = 0;
+	records = 0;
+	failed = false;
+	buffer = NULL;
+	used = 0;
+	pthread_mutex_init(&lock, NULL);
+}
+
+/**
+ * Destructor. Writes out whatever hasn't been yet.
+ */
+Tracer::~Tracer() {
+	stop();
+	pthread_mutex_destroy(&lock);
+}
+
+/**
+ * Starts a trace, overwriting whatever's at path.
+ *
+ * @param path the trace file
+ * @param header the volume being traced; magic, version and started are
+ *        filled in here
+ * @return int 0 if started; -1 if the trace file couldn't be written
+ */
+int Tracer::start(string path, TraceHeader *header) {
+	int ret = -1;
+	struct timeval now;
+
+	pthread_mutex_lock(&lock);
+	if (fd == -1) {
+		fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (fd != -1 && buffer == NULL) {
+		gettimeofday(&now, NULL);
+		header->magic = TRACE_MAGIC;
+		header->version = TRACE_VERSION;
+		header->started = now.tv_sec * 1000000LL + now.tv_usec;
+		if (writeFully(fd, header, sizeof(TraceHeader))) {
+			buffer = (char*)malloc(TRACE_BUFFER_SIZE);
+			used = 0;
+			records = 0;
+			failed = false;
+			startNs = Profiler::now();
+			ret = 0;
+		} else {
+			close(fd);
+			fd = -1;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+/**
+ * Ends the trace, writing out every record still held.
+ *
+ * @return int 0 if every record made it to the trace file; -1 if not (or
+ *         nothing was being traced)
+ */
+int Tracer::stop() {
+	int ret = -1;
+
+	pthread_mutex_lock(&lock);
+	if (fd != -1) {
+		if (flush() && !failed && fsync(fd) == 0) {
+			ret = 0;
+		}
+		close(fd);
+		fd = -1;
+		free(buffer);
+		buffer = NULL;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+/**
+ * Adds a call to the trace. Names longer than TRACE_NAME_SIZE are cut.
+ *
+ * @param record the call; at is when it started, on Profiler::now()'s
+ *        clock, and is made relative to the start of the trace here
+ * @param name the name (or pattern) it was called with; "" if none
+ * @param dest the destination it was called with; "" if none
+ */
+void Tracer::record(TraceRecord *record, string name, string dest) {
+	int size;
+
+	record->nameLength = min((int)name.size(), TRACE_NAME_SIZE);
+	record->destLength = min((int)dest.size(), TRACE_NAME_SIZE);
+	size = sizeof(TraceRecord) + record->nameLength + record->destLength;
+
+	pthread_mutex_lock(&lock);
+	if (fd != -1 && !failed) {
+		record->at -= startNs;
+		if (used + size > TRACE_BUFFER_SIZE) {
+			failed = !flush();
+		}
+		if (size > TRACE_BUFFER_SIZE) {
+			//only names near TRACE_NAME_SIZE; too big to hold
+			failed = failed || !writeFully(fd, record, sizeof(TraceRecord))
+				|| !writeFully(fd, name.data(), record->nameLength)
+				|| !writeFully(fd, dest.data(), record->destLength);
+		} else {
+			memcpy(buffer + used, record, sizeof(TraceRecord));
+			memcpy(buffer + used + sizeof(TraceRecord), name.data(), record->nameLength);
+			memcpy(buffer + used + sizeof(TraceRecord) + record->nameLength, dest.data(),
+					record->destLength);
+			used += size;
+		}
+		records++;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @return long long the number of calls recorded so far
+ */
+long long Tracer::getRecords() {
+	long long ret;
+
+	pthread_mutex_lock(&lock);
+	ret = records;
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+/**
+ * Writes out the records held so far.
+ *
+ * Should NEVER be called without holding lock.
+ *
+ * @return bool true if they were all written
+ */
+bool Tracer::flush() {
+	bool ret = writeFully(fd, buffer, used);
+
+	used = 0;
+
+	return ret;
+}
+
+/**
+ * Reads a trace's header, to find out what it was taken on.
+ *
+ * @param path the trace file
+ * @param header pointer to store the header in
+ * @return int 0 if read; -1 if it couldn't be read or isn't a trace
+ */
+int Tracer::readHeader(string path, TraceHeader *header) {
+	int ret = -1;
+	int in = open(path.c_str(), O_RDONLY);
+
+	if (in != -1) {
+		if (readFully(in, header, sizeof(TraceHeader)) && header->magic == TRACE_MAGIC
+			&& header->version == TRACE_VERSION) {
+			ret = 0;
+		}
+		close(in);
+	}
+
+	return ret;
+}
+
+/**
+ * Replays a trace, one call at a time in the order they finished when
+ * traced. Handles are matched up with the ones the replayed calls open,
+ * and a call whose result differs from what it was when traced is
+ * counted as diverged (but carries on regardless).
+ *
+ * @param fs the (opened) file system to replay against
+ * @param path the trace file
+ * @param timed true to start each call as long after the first as it was
+ *        when traced; false to make every call as soon as the last ends
+ * @param report pointer to store what happened in
+ * @return int the number of calls replayed; -1 if path isn't a trace, -3 if
+ *         it ends part way through a record
+ */
+int Tracer::replay(FileSys *fs, string path, bool timed, ReplayReport *report) {
+	int ret = 0;
+	int in;
+	int result;
+	long long ns;
+	long long first = -1;
+	long long last = 0;
+	long long started;
+	long long wait;
+	bool replayed;
+	TraceHeader header;
+	TraceRecord record;
+	ProfCounters none = {0, 0, 0};
+	Profiler traced;
+	Profiler replayedCalls;
+	vector<char> names;
+	vector<char> data;
+	map<int, int> handles;
+	string name;
+	string dest;
+	string scratch = path + ".scratch";
+	struct timespec pause;
+
+	report->records = 0;
+	report->skipped = 0;
+	report->diverged = 0;
+	report->divergedOps.assign(PROF_OPS, 0);
+
+	in = open(path.c_str(), O_RDONLY);
+	if (in == -1 || !readFully(in, &header, sizeof(TraceHeader))
+		|| header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+		ret = -1;
+	}
+
+	started = Profiler::now();
+	while (ret >= 0 && readFully(in, &record, sizeof(TraceRecord))) {
+		names.resize(record.nameLength + record.destLength + 1);
+		if (!readFully(in, &names[0], record.nameLength + record.destLength)) {
+			ret = -3;
+		} else {
+			name.assign(&names[0], record.nameLength);
+			dest.assign(&names[0] + record.nameLength, record.destLength);
+			if (first == -1) {
+				first = record.at;
+			}
+			last = max(last, record.at + record.ns);
+
+			wait = (record.at - first) - (Profiler::now() - started);
+			if (timed && wait > 0) {
+				pause.tv_sec = wait / 1000000000LL;
+				pause.tv_nsec = wait % 1000000000LL;
+				nanosleep(&pause, NULL);
+			}
+
+			replayed = replayCall(fs, &record, name, dest, &handles, scratch, &data,
+									&result, &ns);
+			if (replayed) {
+				traced.record(record.op, record.ns, &none);
+				replayedCalls.record(record.op, ns, &none);
+				if (result != record.result) {
+					report->diverged++;
+					report->divergedOps[record.op]++;
+				}
+				report->records++;
+				ret++;
+			} else {
+				report->skipped++;
+			}
+		}
+	}
+	report->replayedNs = Profiler::now() - started;
+	report->tracedNs = (first == -1) ? 0 : last - first;
+	traced.getStats(&report->traced);
+	replayedCalls.getStats(&report->replayed);
+
+	//anything the trace left open
+	for (map<int, int>::iterator i = handles.begin(); i != handles.end(); i++) {
+		fs->closeFile(i->second);
+	}
+	remove((scratch + ".in").c_str());
+	remove((scratch + ".out").c_str());
+	if (in != -1) {
+		close(in);
+	}
+
+	return ret;
+}
+
+/**
+ * Makes one traced call again. Files the call copied in from the host are
+ * copied in from a scratch file of the size they were instead, and files
+ * it copied out go to a scratch file.
+ *
+ * @param fs the file system to make the call on
+ * @param record the call, as traced
+ * @param name its name
+ * @param dest its destination
+ * @param handles handles as traced -> handles as replayed
+ * @param scratch path to make scratch files at (with .in and .out added)
+ * @param data buffer for reads and writes; grown as needed
+ * @param result pointer to store what the call returned in; an opened
+ *        handle is stored as the one it was when traced
+ * @param ns pointer to store how long the call took in, in nanoseconds
+ * @return bool true if the call was made; false if it can't be replayed
+ */
+bool Tracer::replayCall(FileSys *fs, TraceRecord *record, string name, string dest,
+						map<int, int> *handles, string scratch, vector<char> *data,
+						int *result, long long *ns) {
+	bool ret = true;
+	int handle = -1;
+	bool sourceIn = (record->flags & TRACE_SOURCE_IN) != 0;
+	bool destIn = (record->flags & TRACE_DEST_IN) != 0;
+	int length = max(record->length, 0);
+	long long start;
+	vector<string> names;
+	vector<FileInfo> entries;
+	vector<int> fat;
+	FileSysStats stats;
+	map<int, int>::iterator found = handles->find(record->handle);
+
+	if (record->op == OP_READ || record->op == OP_WRITE || record->op == OP_SEEK
+		|| record->op == OP_TRUNCATE || record->op == OP_CLOSE) {
+		if (found == handles->end()) {
+			ret = false;
+		} else {
+			handle = found->second;
+		}
+	}
+	if (ret && (record->op == OP_READ || record->op == OP_WRITE) && data->size() < length) {
+		data->resize(length);
+		for (int i = 0; i < length; i++) {
+			(*data)[i] = (char)(i * 31 + 7);
+		}
+	}
+	if (ret && (record->op == OP_COPY || record->op == OP_MOVE)) {
+		//the host side is a scratch file; names taken from it are the traced ones
+		if (!sourceIn && destIn) {
+			if (dest.empty() || dest[dest.size() - 1] == '/') {
+				dest.append(name.substr(name.find_last_of('/') + 1));
+			}
+			name = scratch + ".in";
+			ret = makeScratch(name, length, data);
+		} else if (sourceIn && !destIn) {
+			if (name.empty() || name[name.size() - 1] == '/') {
+				name.append(dest.substr(dest.find_last_of('/') + 1));
+			}
+			dest = scratch + ".out";
+		}
+	}
+
+	start = Profiler::now();
+	if (!ret) {
+		*result = 0;
+	} else if (record->op == OP_TOUCH) {
+		*result = fs->createFile(name);
+	} else if (record->op == OP_COPY) {
+		*result = fs->copyFile(name, dest, sourceIn, destIn);
+	} else if (record->op == OP_MOVE) {
+		*result = fs->moveFile(name, dest, sourceIn, destIn);
+	} else if (record->op == OP_REMOVE) {
+		*result = fs->removeFile(name);
+	} else if (record->op == OP_LIST && record->call == TRACE_LIST_FILES) {
+		*result = fs->listFiles(name, &names);
+	} else if (record->op == OP_LIST && record->call == TRACE_LIST_ENTRIES) {
+		*result = fs->listEntries(&entries);
+	} else if (record->op == OP_LIST) {
+		*result = fs->getFAT(&fat);
+	} else if (record->op == OP_LOOKUP) {
+		*result = fs->getFileSize(name);
+	} else if (record->op == OP_DF) {
+		*result = fs->getStats(&stats);
+	} else if (record->op == OP_OPEN) {
+		handle = fs->openFile(name, record->flags);
+		if (handle >= 0 && record->result >= 0) {
+			(*handles)[record->result] = handle;
+		}
+		*result = (handle >= 0 && record->result >= 0) ? record->result : handle;
+	} else if (record->op == OP_READ && record->call != TRACE_AT_OFFSET) {
+		//sendFile()'s host descriptor is long gone; reading as much does the same
+		*result = fs->readFile(handle, &(*data)[0], record->length);
+	} else if (record->op == OP_READ) {
+		*result = fs->readFileAt(handle, &(*data)[0], record->length, record->offset);
+	} else if (record->op == OP_WRITE && record->call != TRACE_AT_OFFSET) {
+		*result = fs->writeFile(handle, &(*data)[0], record->length);
+	} else if (record->op == OP_WRITE) {
+		*result = fs->writeFileAt(handle, &(*data)[0], record->length, record->offset);
+	} else if (record->op == OP_SEEK) {
+		*result = fs->seekFile(handle, record->offset, record->flags);
+	} else if (record->op == OP_TRUNCATE) {
+		*result = fs->truncateFile(handle, record->length);
+	} else if (record->op == OP_CLOSE) {
+		*result = fs->closeFile(handle);
+		handles->erase(found);
+	} else if (record->op == OP_BATCH) {
+		*result = 0;
+		if (record->call == TRACE_BATCH_BEGIN) {
+			fs->beginBatch();
+		} else if (record->call == TRACE_BATCH_FLUSH) {
+			fs->flushBatch();
+		} else {
+			fs->endBatch();
+		}
+	} else if (record->op == OP_CONVERT) {
+		*result = fs->convertToExtents();
+	} else if (record->op == OP_TRIM) {
+		*result = fs->trimFileSys(NULL, NULL);
+	} else if (record->op == OP_SNAPSHOT && record->call == TRACE_SNAPSHOT_CREATE) {
+		*result = fs->createSnapshot(name);
+	} else if (record->op == OP_SNAPSHOT && record->call == TRACE_SNAPSHOT_DELETE) {
+		*result = fs->deleteSnapshot(name);
+	} else if (record->op == OP_SNAPSHOT && record->call == TRACE_SNAPSHOT_ROLLBACK) {
+		*result = fs->rollbackSnapshot(name);
+	} else if (record->op == OP_SNAPSHOT) {
+		*result = fs->mountSnapshot(name);
+	} else {
+		ret = false;
+	}
+	*ns = Profiler::now() - start;
+
+	return ret;
+}
+
+/**
+ * Writes a scratch file for a replayed copy from the host to copy in.
+ *
+ * @param path where to write it
+ * @param length its size, in bytes
+ * @param data buffer to write it from; grown as needed
+ * @return bool true if it was written
+ */
+bool Tracer::makeScratch(string path, int length, vector<char> *data) {
+	bool ret = false;
+	int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int chunk = min(length, TRACE_BUFFER_SIZE);
+	int done = 0;
+
+	if (data->size() < chunk) {
+		data->resize(chunk);
+	}
+	if (out != -1) {
+		ret = true;
+		while (done < length && ret) {
+			ret = writeFully(out, &(*data)[0], min(chunk, length - done));
+			done += chunk;
+		}
+		close(out);
+	}
+
+	return ret;
+}
+
+/**
+ * @param fd the file to read from
+ * @param buf where to store what's read
+ * @param length the number of bytes to read
+ * @return bool true if all of them were read
+ */
+bool Tracer::readFully(int fd, void *buf, int length) {
+	int done = 0;
+	int n = 1;
+
+	while (done < length && n > 0) {
+		n = read(fd, (char*)buf + done, length - done);
+		if (n > 0) {
+			done += n;
+		} else if (n == -1 && errno == EINTR) {
+			n = 1;
+		}
+	}
+
+	return done == length;
+}
+
+/**
+ * @param fd the file to write to
+ * @param buf what to write
+ * @param length the number of bytes to write
+ * @return bool true if all of them were written
+ */
+bool Tracer::writeFully(int fd, const void *buf, int length) {
+	int done = 0;
+	int n = 1;
+
+	while (done < length && n > 0) {
+		n = write(fd, (const char*)buf + done, length - done);
+		if (n > 0) {
+			done += n;
+		} else if (n == -1 && errno == EINTR) {
+			n = 1;
+		}
+	}
+
+	return done == length;
+}
+
+/**
+ * Starts a call. It's recorded only if tracer is tracing and no other
+ * traced call on this thread is already under way.
+ *
+ * @param tracer the file system's tracer; NULL if it isn't tracing
+ * @param op the OP_* operation
+ * @param call which method, for operations several are counted as (TRACE_*)
+ */
+TraceCall::TraceCall(Tracer *tracer, int op, int call) {
+	this->tracer = (traceDepth == 0) ? tracer : NULL;
+	traceDepth++;
+	if (this->tracer != NULL) {
+		memset(&record, 0, sizeof(TraceRecord));
+		record.op = op;
+		record.call = call;
+		record.handle = -1;
+		record.offset = -1;
+		startNs = Profiler::now();
+	}
+}
+
+/**
+ * Ends the call; done() should have recorded it by now.
+ */
+TraceCall::~TraceCall() {
+	traceDepth--;
+}
+
+/**
+ * Sets what the call was made on, besides names.
+ *
+ * @param handle the handle; -1 if none
+ * @param length bytes asked for, or the size of what's copied
+ * @param offset where in the file; -1 for the handle's position
+ * @param flags TRACE_SOURCE_IN/TRACE_DEST_IN, openFile() flags or seekFile() whence
+ */
+void TraceCall::set(int handle, int length, int offset, int flags) {
+	record.handle = handle;
+	record.length = length;
+	record.offset = offset;
+	record.flags = flags;
+}
+
+/**
+ * Sets where a cp or mv is copying from and to. A source on the host is
+ * looked at now, before it's copied (or moved away), for its size.
+ *
+ * @param source the source, as passed to copyFile() or moveFile()
+ * @param sourceIn true if the source is in the file system
+ * @param destIn true if the destination is in the file system
+ */
+void TraceCall::copying(string source, bool sourceIn, bool destIn) {
+	struct stat info;
+
+	if (tracer != NULL) {
+		record.flags = (sourceIn ? TRACE_SOURCE_IN : 0) | (destIn ? TRACE_DEST_IN : 0);
+		if (!sourceIn && stat(source.c_str(), &info) == 0) {
+			record.length = info.st_size;
+		}
+	}
+}
+
+/**
+ * Records the call, if it's being recorded.
+ *
+ * @param result what the call is returning
+ * @param name the name (or pattern) it was called with; "" if none
+ * @param dest the destination it was called with; "" if none
+ */
+void TraceCall::done(int result, string name, string dest) {
+	if (tracer != NULL) {
+		record.result = result;
+		record.at = startNs;
+		record.ns = Profiler::now() - startNs;
+		tracer->record(&record, name, dest);
+	}
+}
@@ -0,0 +1,128 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "FileSys.h"
+
+#define TRACE_MAGIC 0x43525446 //"FTRC"; starts every trace
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_SIZE (64 * 1024) //bytes of records held before they're written
+#define TRACE_NAME_SIZE 0xFFFF //most bytes of a name kept in a record
+
+//TraceRecord.call, for operations several FileSys methods are counted as
+#define TRACE_LIST_FILES 0 //OP_LIST: listFiles()
+#define TRACE_LIST_ENTRIES 1 //OP_LIST: listEntries()
+#define TRACE_LIST_FAT 2 //OP_LIST: getFAT()
+#define TRACE_AT_POSITION 0 //OP_READ, OP_WRITE: readFile(), writeFile()
+#define TRACE_AT_OFFSET 1 //OP_READ, OP_WRITE: readFileAt(), writeFileAt()
+#define TRACE_FD 2 //OP_READ, OP_WRITE: sendFile(), receiveFile(); length is what was moved
+#define TRACE_BATCH_BEGIN 0 //OP_BATCH: beginBatch()
+#define TRACE_BATCH_FLUSH 1 //OP_BATCH: flushBatch()
+#define TRACE_BATCH_END 2 //OP_BATCH: endBatch()
+#define TRACE_SNAPSHOT_CREATE 0 //OP_SNAPSHOT: createSnapshot()
+#define TRACE_SNAPSHOT_DELETE 1 //OP_SNAPSHOT: deleteSnapshot()
+#define TRACE_SNAPSHOT_ROLLBACK 2 //OP_SNAPSHOT: rollbackSnapshot()
+#define TRACE_SNAPSHOT_MOUNT 3 //OP_SNAPSHOT: mountSnapshot()
+
+//TraceRecord.flags of OP_COPY and OP_MOVE; openFile() flags for OP_OPEN
+#define TRACE_SOURCE_IN 0x01 //the source is in the file system
+#define TRACE_DEST_IN 0x02 //the destination is in the file system
+
+/**
+ * Starts a trace file; one record (see TraceRecord) per call follows.
+ * Describes the volume the trace was taken on, so a fresh one like it
+ * can be made to replay it against.
+ */
+struct TraceHeader {
+	unsigned int magic; //TRACE_MAGIC
+	unsigned int version; //TRACE_VERSION
+	unsigned int size; //of the volume, in bytes
+	unsigned int clusterSize; //in bytes
+	unsigned int flags; //VOLUME_* flags the volume had
+	unsigned int allocator; //ALLOC_* policy the volume had
+	long long started; //when tracing started (unix epoch, in microseconds)
+};
+
+/**
+ * One call to the file system, in the order the calls finished. Followed
+ * by nameLength bytes of its name (or pattern) and then destLength bytes
+ * of its destination, neither terminated.
+ */
+struct TraceRecord {
+	unsigned char op; //OP_* (see Profiler.h)
+	unsigned char call; //TRACE_* call, for ops several methods are counted as
+	unsigned short flags; //TRACE_SOURCE_IN/TRACE_DEST_IN, openFile() flags or seekFile() whence
+	unsigned short nameLength;
+	unsigned short destLength;
+	int result; //what the call returned (0 for methods returning nothing)
+	int handle; //the handle, for calls on one
+	int length; //bytes asked for; for cp/mv, the size of the source
+	int offset; //where in the file; -1 for the handle's position
+	long long at; //when the call started, in nanoseconds since tracing started
+	long long ns; //how long it took
+};
+
+/**
+ * What replaying a trace did, as filled in by Tracer::replay()
+ */
+struct ReplayReport {
+	long long records; //calls replayed
+	long long skipped; //calls that couldn't be replayed (unknown op, or on a handle never opened)
+	long long diverged; //calls that returned something other than they did when traced
+	long long tracedNs; //from the first call starting to the last one ending, when traced
+	long long replayedNs; //the same, when replayed
+	vector<OpStats> traced; //every call's latency when traced, by OP_*
+	vector<OpStats> replayed; //and when replayed
+	vector<long long> divergedOps; //diverged, by OP_*
+};
+
+class Tracer {
+	public:
+		Tracer();
+		~Tracer();
+		int start(string path, TraceHeader *header);
+		int stop();
+		void record(TraceRecord *record, string name, string dest);
+		long long getRecords();
+		static int readHeader(string path, TraceHeader *header);
+		static int replay(FileSys *fs, string path, bool timed, ReplayReport *report);
+	private:
+		bool flush();
+		static bool replayCall(FileSys *fs, TraceRecord *record, string name, string dest,
+								map<int, int> *handles, string scratch, vector<char> *data,
+								int *result, long long *ns);
+		static bool makeScratch(string path, int length, vector<char> *data);
+		static bool readFully(int fd, void *buf, int length);
+		static bool writeFully(int fd, const void *buf, int length);
+
+		int fd; //the trace file; -1 if not tracing
+		long long startNs; //Profiler::now() when tracing started
+		long long records; //written so far
+		bool failed; //a write failed; nothing more is recorded
+		char *buffer; //records not yet written
+		int used; //bytes of buffer in use
+		pthread_mutex_t lock; //guards all of the above once started
+};
+
+/**
+ * One call being traced, from where it's declared to the end of the block
+ * it's in. Only the outermost call on a thread is recorded, so a moveFile()
+ * is one record and not a copyFile() and a removeFile() as well.
+ */
+class TraceCall {
+	public:
+		TraceCall(Tracer *tracer, int op, int call);
+		~TraceCall();
+		void set(int handle, int length, int offset, int flags);
+		void copying(string source, bool sourceIn, bool destIn);
+		void done(int result, string name, string dest);
+	private:
+		Tracer *tracer; //NULL if this call isn't being recorded
+		TraceRecord record;
+		long long startNs;
+};
+#endif
@@ -2,28 +2,568 @@
  * The main file class. Contains a main method (no way!)
  * Just gets everything going.
  *
+ * A file system's snapshot is mounted read-only with
+ *
+ * os1shell file-system-name@snapshot
+ *
+ * and several file systems are mounted at once, each at "/" and its name,
+ * by giving them all:
+ *
+ * os1shell file-system-name file-system-name...
+ *
+ * Also formats file systems without the shell's prompts:
+ *
+ * os1shell -mkfs [-sMB] [-cKB] [-bsparse|fallocate|zero]
+ *               [-afirst|next|best|near] [-uKB] [-mMEMBER...] file-system-name
+ *
+ * and ships them between hosts as deltas (see Replicator):
+ *
+ * os1shell -export-delta GENERATION file-system-name [delta-file]
+ * os1shell -apply-delta file-system-name [delta-file]
+ *
+ * and replays traces recorded with the shell's trace command (see Tracer):
+ *
+ * os1shell -replay [-timed] [-fresh] [-rSNAPSHOT] trace-file file-system-name
+ *
+ * and ages file systems, to measure them as they'd be after long use (see Ager):
+ *
+ * os1shell -age [-rSEED] [-fFILL] [-cCHURN] [-mCREATES,APPENDS,DELETES,COPIES]
+ *               [-zKB] [-xKB] [-wWRITERS] file-system-name
+ *
+ * and runs scripts of shell commands without the prompt (see Shell::runBatch()):
+ *
+ * os1shell -b file-system-name [script]
+ *
  * @author: Eduardo Rodrigues - emr4378
  */
 
 #include <iostream>
+#include <fstream>
 #include <stdio.h>
+#include <sys/time.h>
 using namespace std;
 
 #include "Shell.h"
+#include "Replicator.h"
+#include "Allocator.h"
+#include "Tracer.h"
+#include "Ager.h"
 
-int main( int argc, char ** argv) {
+/**
+ * Formats a file system from the command line, no questions asked.
+ * Overwrites whatever is already there.
+ *
+ * -s sets the size in MB (default 10), -c the cluster size in KB
+ * (default 8), and -b how the image is backed on the host: sparse
+ * (default; the image is only as big on disk as what's been written),
+ * fallocate (every block reserved up front, so the image never grows
+ * or fragments as files are written) or zero (every block written with
+ * zeros up front). -a picks the volume's allocator (see Allocator; first
+ * fit by default). Each -m adds a backing file to stripe the volume over,
+ * besides the image, dealing it out -u KB at a time (64 KB, or the
+ * cluster size if that's bigger, by default).
+ *
+ * @param argc number of arguments after -mkfs
+ * @param argv the arguments after -mkfs
+ * @return int 0 if the file system was created, 1 otherwise
+ */
+static int makeFileSystem(int argc, char **argv) {
+	int ret = 0;
+	int i;
+	int fileSize = 10;
+	int clusterSize = 8;
+	int backing = FS_BACKING_SPARSE;
+	int policy = ALLOC_FIRST_FIT;
+	int stripeUnit = 0;
+	int created;
+	string arg;
+	string name;
+	string backings[] = {"sparse", "fallocate", "zero"};
+	vector<string> members;
+	struct timeval start;
+	struct timeval end;
+	FileSys *fs;
+
+	for (i = 0; i < argc && ret == 0; i++) {
+		arg = argv[i];
+		if (arg.substr(0, 2) == "-s") {
+			fileSize = atoi(arg.substr(2).c_str());
+		} else if (arg.substr(0, 2) == "-c") {
+			clusterSize = atoi(arg.substr(2).c_str());
+		} else if (arg.substr(0, 2) == "-b") {
+			for (backing = 0; backing < 3 && backings[backing] != arg.substr(2); backing++);
+			if (backing == 3) {
+				cout << "mkfs: unknown backing " << arg.substr(2) << endl;
+				ret = 1;
+			}
+		} else if (arg.substr(0, 2) == "-a") {
+			policy = Allocator::findPolicy(arg.substr(2));
+			if (policy == -1) {
+				cout << "mkfs: unknown allocator " << arg.substr(2) << endl;
+				ret = 1;
+			}
+		} else if (arg.substr(0, 2) == "-u") {
+			stripeUnit = atoi(arg.substr(2).c_str());
+		} else if (arg.substr(0, 2) == "-m" && arg.size() > 2) {
+			members.push_back(arg.substr(2));
+		} else if (name == "" && arg[0] != '-') {
+			name = arg;
+		} else {
+			cout << "mkfs: unexpected " << arg << endl;
+			ret = 1;
+		}
+	}
+
+	if (ret == 0 && name == "") {
+		ret = 1;
+	}
+	if (ret == 0 && (fileSize > MAX_FILE_SIZE || fileSize < MIN_FILE_SIZE)) {
+		cout << "mkfs: size must be between " << MIN_FILE_SIZE;
+		cout << " and " << MAX_FILE_SIZE << " MB" << endl;
+		ret = 1;
+	}
+	if (ret == 0 && (clusterSize > MAX_CLUSTER_SIZE || clusterSize < MIN_CLUSTER_SIZE)) {
+		cout << "mkfs: cluster size must be between " << MIN_CLUSTER_SIZE;
+		cout << " and " << MAX_CLUSTER_SIZE << " KB" << endl;
+		ret = 1;
+	}
+	if (ret == 0 && fileSize * 1024 / clusterSize >= MAX_CLUSTERS) {
+		cout << "mkfs: a " << fileSize << " MB file system needs clusters of at least ";
+		cout << fileSize * 1024 / MAX_CLUSTERS + 1 << " KB" << endl;
+		ret = 1;
+	}
+	if (stripeUnit == 0) {
+		stripeUnit = max(64, clusterSize);
+	}
+	if (ret == 0 && members.size() >= MAX_STRIPE_MEMBERS) {
+		cout << "mkfs: at most " << MAX_STRIPE_MEMBERS - 1 << " members besides the image" << endl;
+		ret = 1;
+	}
+	if (ret == 0 && !members.empty() && (stripeUnit % clusterSize != 0
+		|| stripeUnit > fileSize * 1024)) {
+		cout << "mkfs: the stripe unit must be a multiple of the cluster size (";
+		cout << clusterSize << " KB) no bigger than the volume" << endl;
+		ret = 1;
+	}
+
+	if (ret == 0) {
+		fs = new FileSys();
+		gettimeofday(&start, NULL);
+		created = fs->createFileSys(name, fileSize, clusterSize, backing, &members, stripeUnit);
+		if (created == 0) {
+			fs->setAllocator(policy);
+		}
+		gettimeofday(&end, NULL);
+		delete fs;
+
+		if (created == 0) {
+			cout << name << ": " << fileSize << " MB, " << clusterSize;
+			cout << " KB clusters, " << backings[backing] << " backing, ";
+			cout << Allocator::getPolicyName(policy) << " fit allocator, ";
+			if (!members.empty()) {
+				cout << "striped over " << members.size() + 1 << " files in ";
+				cout << stripeUnit << " KB units, ";
+			}
+			cout << "formatted in ";
+			cout << (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+			cout << " ms" << endl;
+		} else {
+			cout << "mkfs: couldn't create " << name;
+			cout << ((created == FS_ERR_NO_SPACE) ? ": no space left on the host" : "") << endl;
+			ret = 1;
+		}
+	} else if (name == "") {
+		cout << "usage: os1shell -mkfs [-sMB] [-cKB] [-bsparse|fallocate|zero] ";
+		cout << "[-afirst|next|best|near] [-uKB] [-mMEMBER...] file-system-name\n";
+	}
+
+	return ret;
+}
+
+/**
+ * Writes a delta of everything changed in a file system since the given
+ * generation, to the delta file or (without one) standard output. What
+ * happened goes to standard error, so it stays out of the delta.
+ *
+ * @param argc number of arguments after -export-delta
+ * @param argv the arguments after -export-delta
+ * @return int 0 if the delta was written, 1 otherwise
+ */
+static int exportDelta(int argc, char **argv) {
+	int ret = 1;
+	int out = 1;
+	int clusters;
+	DeltaHeader delta;
+	FileSys *fs;
+	Replicator *replicator;
+
+	if (argc < 2 || argc > 3) {
+		cerr << "usage: os1shell -export-delta GENERATION file-system-name ";
+		cerr << "[delta-file]\n";
+	} else if (argc == 3
+		&& (out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		cerr << "export-delta: couldn't create " << argv[2] << endl;
+	} else {
+		fs = new FileSys();
+		if (fs->openFileSys(argv[1]) == 0) {
+			replicator = new Replicator(fs);
+			clusters = replicator->exportDelta(atoi(argv[0]), out, &delta);
+			if (clusters >= 0) {
+				cerr << "export-delta: generation " << delta.from << " -> ";
+				cerr << delta.to << ", " << clusters << " clusters (";
+				cerr << (long long)clusters * delta.clusterSize / 1024 << " KB)" << endl;
+				ret = 0;
+			} else if (clusters == -3) {
+				cerr << "export-delta: " << argv[1] << " is only at generation ";
+				cerr << fs->getGeneration() - 1 << endl;
+			} else if (clusters == -4) {
+				cerr << "export-delta: " << argv[1] << " is striped; only plain ";
+				cerr << "images can be replicated" << endl;
+			} else {
+				cerr << "export-delta: couldn't write the delta" << endl;
+			}
+			delete replicator;
+		} else {
+			cerr << "export-delta: " << argv[1] << " isn't a file system" << endl;
+		}
+		delete fs;
+		if (out != 1) {
+			close(out);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Applies a delta, from the delta file or (without one) standard input,
+ * to a file system that isn't mounted.
+ *
+ * @param argc number of arguments after -apply-delta
+ * @param argv the arguments after -apply-delta
+ * @return int 0 if the delta was applied, 1 otherwise
+ */
+static int applyDelta(int argc, char **argv) {
+	int ret = 1;
+	int in = 0;
+	int clusters;
+	DeltaHeader delta;
+
+	if (argc < 1 || argc > 2) {
+		cerr << "usage: os1shell -apply-delta file-system-name [delta-file]\n";
+	} else if (argc == 2 && (in = open(argv[1], O_RDONLY)) == -1) {
+		cerr << "apply-delta: couldn't open " << argv[1] << endl;
+	} else {
+		clusters = Replicator::applyDelta(argv[0], in, &delta);
+		if (clusters >= 0) {
+			cerr << "apply-delta: " << argv[0] << " now at generation ";
+			cerr << delta.to << ", " << clusters << " clusters written" << endl;
+			ret = 0;
+		} else if (clusters == -3) {
+			cerr << "apply-delta: delta is from generation " << delta.from;
+			cerr << "; apply the ones before it first" << endl;
+		} else {
+			cerr << "apply-delta: couldn't apply the delta" << endl;
+		}
+		if (in != 0) {
+			close(in);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Replays a trace against a file system and shows how long every kind of
+ * call took, as traced and as replayed.
+ *
+ * -fresh formats the file system first, the same size, cluster size,
+ * layout and allocator as the one traced; otherwise it must exist, and
+ * -r rolls it back to a snapshot first, so a trace can be replayed from
+ * the same starting point over and over. -timed starts every call as
+ * long after the first as it was when traced, instead of as soon as the
+ * last one is done.
+ *
+ * @param argc number of arguments after -replay
+ * @param argv the arguments after -replay
+ * @return int 0 if the trace was replayed, 1 otherwise
+ */
+static int replayTrace(int argc, char **argv) {
+	int ret = 0;
+	int i;
+	int replayed;
+	bool timed = false;
+	bool fresh = false;
+	string arg;
+	string snapshot;
+	string trace;
+	string name;
+	TraceHeader header;
+	ReplayReport report;
+	OpStats *traced;
+	OpStats *stats;
+	FileSys *fs = new FileSys();
+
+	for (i = 0; i < argc && ret == 0; i++) {
+		arg = argv[i];
+		if (arg == "-timed") {
+			timed = true;
+		} else if (arg == "-fresh") {
+			fresh = true;
+		} else if (arg.substr(0, 2) == "-r" && arg.size() > 2) {
+			snapshot = arg.substr(2);
+		} else if (trace == "" && arg[0] != '-') {
+			trace = arg;
+		} else if (name == "" && arg[0] != '-') {
+			name = arg;
+		} else {
+			cout << "replay: unexpected " << arg << endl;
+			ret = 1;
+		}
+	}
+
+	if (ret == 0 && name == "") {
+		cout << "usage: os1shell -replay [-timed] [-fresh] [-rSNAPSHOT] ";
+		cout << "trace-file file-system-name\n";
+		ret = 1;
+	} else if (ret == 0 && Tracer::readHeader(trace, &header) != 0) {
+		cout << "replay: " << trace << " isn't a trace" << endl;
+		ret = 1;
+	} else if (ret == 0 && fresh) {
+		if (fs->createFileSys(name, header.size / (1024 * 1024), header.clusterSize / 1024) != 0
+			|| ((header.flags & VOLUME_EXTENTS) && fs->convertToExtents() < 0)) {
+			cout << "replay: couldn't create " << name << endl;
+			ret = 1;
+		} else {
+			fs->setAllocator(header.allocator);
+		}
+	} else if (ret == 0 && fs->openFileSys(name) != 0) {
+		cout << "replay: " << name << " isn't a file system" << endl;
+		ret = 1;
+	} else if (ret == 0 && snapshot != "" && fs->rollbackSnapshot(snapshot) != 0) {
+		cout << "replay: no snapshot " << snapshot << endl;
+		ret = 1;
+	}
+
+	if (ret == 0) {
+		fs->resetOpStats();
+		replayed = Tracer::replay(fs, trace, timed, &report);
+		if (replayed < 0) {
+			cout << "replay: " << trace << " is cut short; replayed what was there" << endl;
+		}
+		cout << fixed << setprecision(2);
+		cout << "replay: " << report.records << " calls (" << report.skipped;
+		cout << " skipped, " << report.diverged << " returned something else) in ";
+		cout << report.replayedNs / 1e6 << " ms; " << report.tracedNs / 1e6;
+		cout << " ms when traced" << endl;
+
+		cout << left << setw(12) << "op" << right << setw(10) << "calls";
+		cout << setw(12) << "traced us" << setw(10) << "p99 us";
+		cout << setw(12) << "replay us" << setw(10) << "p50 us" << setw(10) << "p99 us";
+		cout << setw(10) << "p999 us" << setw(10) << "max us" << setw(10) << "diverged";
+		cout << endl;
+		for (i = 0; i < PROF_OPS; i++) {
+			traced = &report.traced[i];
+			stats = &report.replayed[i];
+			if (stats->calls > 0) {
+				cout << left << setw(12) << Profiler::getOpName(i) << right;
+				cout << setw(10) << stats->calls;
+				cout << setw(12) << traced->totalNs / 1e3 / traced->calls;
+				cout << setw(10) << Profiler::percentile(traced, 0.99);
+				cout << setw(12) << stats->totalNs / 1e3 / stats->calls;
+				cout << setw(10) << Profiler::percentile(stats, 0.5);
+				cout << setw(10) << Profiler::percentile(stats, 0.99);
+				cout << setw(10) << Profiler::percentile(stats, 0.999);
+				cout << setw(10) << stats->maxNs / 1e3;
+				cout << setw(10) << report.divergedOps[i] << endl;
+			}
+		}
+	}
+	delete fs;
+
+	return ret;
+}
+
+/**
+ * Ages a file system (see Ager) and shows what it did and what it left:
+ * fragmentation, how full of holes the directory is, and how fast the
+ * volume writes, looks files up and reads back.
+ *
+ * -r sets the seed, -f how full to keep the volume (percent of its size
+ * in file data), -c how much to write once it's full (percent of its
+ * size), -m the weights of creates, appends, deletes and copies while
+ * churning, -z the median file size and -x the biggest (in KB), and -w
+ * how many files are written at once. Anything not given is as
+ * Ager::defaults() has it.
+ *
+ * @param argc number of arguments after -age
+ * @param argv the arguments after -age
+ * @return int 0 if the file system was aged, 1 otherwise
+ */
+static int ageFileSystem(int argc, char **argv) {
+	int ret = 0;
+	int i;
+	string arg;
+	string name;
+	AgingConfig config;
+	AgingReport report;
+	VolumeFragmentation *frag = &report.fragmentation;
+	FileSys *fs;
+
+	Ager::defaults(&config);
+	for (i = 0; i < argc && ret == 0; i++) {
+		arg = argv[i];
+		if (arg.substr(0, 2) == "-r") {
+			config.seed = strtoul(arg.substr(2).c_str(), NULL, 10);
+		} else if (arg.substr(0, 2) == "-f") {
+			config.fill = atoi(arg.substr(2).c_str());
+		} else if (arg.substr(0, 2) == "-c") {
+			config.churn = atoi(arg.substr(2).c_str());
+		} else if (arg.substr(0, 2) == "-m") {
+			if (sscanf(arg.substr(2).c_str(), "%d,%d,%d,%d", &config.creates,
+					&config.appends, &config.deletes, &config.copies) != 4) {
+				cout << "age: -m takes four weights, CREATES,APPENDS,DELETES,COPIES" << endl;
+				ret = 1;
+			}
+		} else if (arg.substr(0, 2) == "-z") {
+			config.medianSize = atoi(arg.substr(2).c_str()) * 1024;
+		} else if (arg.substr(0, 2) == "-x") {
+			config.maxSize = atoi(arg.substr(2).c_str()) * 1024;
+		} else if (arg.substr(0, 2) == "-w") {
+			config.writers = atoi(arg.substr(2).c_str());
+		} else if (name == "" && arg[0] != '-') {
+			name = arg;
+		} else {
+			cout << "age: unexpected " << arg << endl;
+			ret = 1;
+		}
+	}
+
+	fs = new FileSys();
+	if (ret == 0 && name == "") {
+		cout << "usage: os1shell -age [-rSEED] [-fFILL] [-cCHURN] ";
+		cout << "[-mCREATES,APPENDS,DELETES,COPIES] [-zKB] [-xKB] [-wWRITERS] ";
+		cout << "file-system-name\n";
+		ret = 1;
+	} else if (ret == 0 && fs->openFileSys(name) != 0) {
+		cout << "age: " << name << " isn't a file system" << endl;
+		ret = 1;
+	} else if (ret == 0 && Ager(fs).age(&config, &report) != 0) {
+		cout << "age: couldn't age " << name << " (fill must be 1 to 95%, the sizes ";
+		cout << "and writers (1 to " << AGE_MAX_WRITERS << ") positive and the median ";
+		cout << "no bigger than the biggest, and some weight non-zero)" << endl;
+		ret = 1;
+	}
+
+	if (ret == 0) {
+		cout << fixed << setprecision(1);
+		cout << name << ": seed " << config.seed << ", " << config.fill << "% full, ";
+		cout << config.churn << "% churn, mix " << config.creates << "/";
+		cout << config.appends << "/" << config.deletes << "/" << config.copies;
+		cout << ", files around " << config.medianSize / 1024.0 << " KB (up to ";
+		cout << config.maxSize / 1024 << " KB), " << config.writers << " at once" << endl;
+		cout << "done:        " << report.creates << " creates, " << report.appends;
+		cout << " appends, " << report.deletes << " deletes, " << report.copies;
+		cout << " copies, " << report.full << " out of space, in " << report.seconds;
+		cout << " s" << endl;
+		cout << "written:     " << report.written / (1024.0 * 1024.0) << " MB at ";
+		cout << ((report.writeSeconds > 0)
+					? report.written / (1024.0 * 1024.0) / report.writeSeconds : 0);
+		cout << " MB/s" << endl;
+		cout << "left:        " << report.files << " files, " << report.usedPercent;
+		cout << "% of clusters used" << endl;
+		cout << "fragmented:  " << frag->fragmentedFiles << " files (";
+		cout << 100.0 * frag->fragmentedFiles / max(frag->files, 1) << "%), ";
+		cout << setprecision(2) << frag->extentsPerFile << " extents/file, ";
+		cout << frag->averageRunLength << " clusters/extent" << endl;
+		cout << "directory:   " << report.directoryEntries << " entries, ";
+		cout << report.directoryHoles << " empty or deleted before the last file (";
+		cout << setprecision(1);
+		cout << 100.0 * report.directoryHoles / max(report.directoryHoles + report.files, 1);
+		cout << "%)" << endl;
+		cout << "lookup:      " << setprecision(2) << report.lookupMicros << " us" << endl;
+		cout << "read:        " << setprecision(1) << report.readMBps << " MB/s" << endl;
+	}
+	delete fs;
+
+	return ret;
+}
+
+/**
+ * Runs a script of shell commands against a file system, from a file or
+ * from stdin: no prompts, no echoes, and metadata written once at the end.
+ * The file system has to exist already (see -mkfs).
+ *
+ * @param argc number of arguments after -b
+ * @param argv the arguments after -b
+ * @return int 0 if every command ran fine, 1 otherwise
+ */
+static int runScript(int argc, char **argv) {
+	int ret = 0;
+	ifstream script;
 	Shell *shell;
+
+	if (argc < 1 || argc > 2) {
+		cerr << "usage: os1shell -b file-system-name [script]" << endl;
+		ret = 1;
+	} else if (argc == 2) {
+		//before the shell moves into the file system
+		script.open(argv[1]);
+		if (!script.is_open()) {
+			cerr << "batch: couldn't open " << argv[1] << endl;
+			ret = 1;
+		}
+	}
+
+	if (ret == 0) {
+		shell = new Shell(1, argv, true);
+		if (shell->runBatch(argc == 2 ? (istream*)&script : &cin) != 0) {
+			ret = 1;
+		}
+		delete shell;
+	}
+
+	return ret;
+}
+
+int main( int argc, char ** argv) {
+	Shell *shell = NULL;
+	int ret = 0;
+
 	if (argc == 1) {
 		//no filesystem given
-		shell = new Shell(NULL);
+		shell = new Shell(0, NULL, false);
 		shell->prompt();
-	} else if (argc == 2) {
-		//filesystem given
-		shell = new Shell(argv[1]);
+	} else if (string(argv[1]) == "-mkfs") {
+		ret = makeFileSystem(argc - 2, argv + 2);
+	} else if (string(argv[1]) == "-export-delta") {
+		ret = exportDelta(argc - 2, argv + 2);
+	} else if (string(argv[1]) == "-apply-delta") {
+		ret = applyDelta(argc - 2, argv + 2);
+	} else if (string(argv[1]) == "-replay") {
+		ret = replayTrace(argc - 2, argv + 2);
+	} else if (string(argv[1]) == "-age") {
+		ret = ageFileSystem(argc - 2, argv + 2);
+	} else if (string(argv[1]) == "-b") {
+		ret = runScript(argc - 2, argv + 2);
+	} else if (argv[1][0] != '-') {
+		//file systems given; each is mounted
+		shell = new Shell(argc - 1, argv + 1, false);
 		shell->prompt();
 	} else {
-		cout << "usage: os1shell [file-system-name]\n";
+		cout << "usage: os1shell [file-system-name[@snapshot]...]\n";
+		cout << "       os1shell -mkfs [-sMB] [-cKB] [-bsparse|fallocate|zero] ";
+		cout << "[-afirst|next|best|near] [-uKB] [-mMEMBER...] file-system-name\n";
+		cout << "       os1shell -export-delta GENERATION file-system-name ";
+		cout << "[delta-file]\n";
+		cout << "       os1shell -apply-delta file-system-name [delta-file]\n";
+		cout << "       os1shell -replay [-timed] [-fresh] [-rSNAPSHOT] ";
+		cout << "trace-file file-system-name\n";
+		cout << "       os1shell -age [-rSEED] [-fFILL] [-cCHURN] ";
+		cout << "[-mCREATES,APPENDS,DELETES,COPIES] [-zKB] [-xKB] [-wWRITERS] ";
+		cout << "file-system-name\n";
+		cout << "       os1shell -b file-system-name [script]\n";
 	}
 	delete shell;
-	return 0;
+	return ret;
 }